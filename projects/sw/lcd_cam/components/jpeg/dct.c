@@ -1,4 +1,6 @@
+#include <string.h>
 #include "dct.h"
+#include "simd.h"
 
 
 /******************************************************************************
@@ -95,4 +97,399 @@ void dct(int16_t pixels[8][8], int16_t data[8][8])
 		data[2][i] = (C2*d0734 + C6*d1625) >> 16;
 		data[6][i] = (C6*d0734 - C2*d1625) >> 16;
 	}
-}
\ No newline at end of file
+}
+
+// zig-zag position of every natural-order coefficient
+static const unsigned char dct_zigzag[64] =
+{
+	 0,  1,  5,  6, 14, 15, 27, 28,
+	 2,  4,  7, 13, 16, 26, 29, 42,
+	 3,  8, 12, 17, 25, 30, 41, 43,
+	 9, 11, 18, 24, 31, 40, 44, 53,
+	10, 19, 23, 32, 39, 45, 52, 54,
+	20, 22, 33, 38, 46, 51, 55, 60,
+	21, 34, 37, 47, 50, 56, 59, 61,
+	35, 36, 48, 49, 57, 58, 62, 63
+};
+
+// AAN output scale factors, aan[k] = cos(k*PI/16)*sqrt(2) (aan[0] = 1), *(1 << 14)
+static const uint16_t dct_aanscale[8] =
+{
+	16384, 22725, 21407, 19266, 16384, 12873, 8867, 4520
+};
+
+#define AAN_BITS 12
+#define AAN_MUL(v, c) (((v) * (c) + (1 << (AAN_BITS-1))) >> AAN_BITS)
+
+/******************************************************************************
+**  dct_fdtbl
+**  --------------------------------------------------------------------------
+**  Builds the quantizer table used by dct_quantize().
+**  The AAN DCT leaves every coefficient scaled by 8*aan[row]*aan[col]; this
+**  factor is folded into the quantization step, so each entry is
+**  (1 << DCT_FDTBL_SCALE) / (qtable * 8*aan[row]*aan[col]).
+**  
+**  ARGUMENTS:
+**      qtable  - 8x8 quantization table, natural order;
+**      fdtbl   - quantizer table, natural order;
+**
+**  RETURN: -
+******************************************************************************/
+void dct_fdtbl(const unsigned char qtable[64], int32_t fdtbl[64])
+{
+	unsigned r, c;
+
+	for (r = 0; r < 8; r++)
+		for (c = 0; c < 8; c++)
+		{
+			// divisor scaled by 2^28 (two 2^14 AAN factors)
+			const uint64_t d = (uint64_t)qtable[r*8 + c] * 8 * dct_aanscale[r] * dct_aanscale[c];
+
+			fdtbl[r*8 + c] = (int32_t)(((1ULL << (28 + DCT_FDTBL_SCALE)) + d/2) / d);
+		}
+}
+
+// round(v * q / 2^DCT_FDTBL_SCALE)
+static inline int16_t dct_quant(const int32_t v, const int32_t q)
+{
+	return (int16_t)((v * q + (1 << (DCT_FDTBL_SCALE-1))) >> DCT_FDTBL_SCALE);
+}
+
+#define C0_382683433 1567 // Ci scaled by 1 << AAN_BITS
+#define C0_541196100 2217
+#define C0_707106781 2896
+#define C1_306562965 5352
+
+// AAN row pass, output still scaled by aan[col]
+static inline void dct_aan_rows(int16_t pixels[8][8], int32_t rows[8][8])
+{
+	unsigned i;
+
+	for (i = 0; i < 8; i++)
+	{
+		int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+		int32_t tmp10, tmp11, tmp12, tmp13;
+		int32_t z1, z2, z3, z4, z5, z11, z13;
+
+		tmp0 = pixels[i][0] + pixels[i][7];
+		tmp7 = pixels[i][0] - pixels[i][7];
+		tmp1 = pixels[i][1] + pixels[i][6];
+		tmp6 = pixels[i][1] - pixels[i][6];
+		tmp2 = pixels[i][2] + pixels[i][5];
+		tmp5 = pixels[i][2] - pixels[i][5];
+		tmp3 = pixels[i][3] + pixels[i][4];
+		tmp4 = pixels[i][3] - pixels[i][4];
+
+		// even part
+		tmp10 = tmp0 + tmp3;
+		tmp13 = tmp0 - tmp3;
+		tmp11 = tmp1 + tmp2;
+		tmp12 = tmp1 - tmp2;
+
+		rows[i][0] = tmp10 + tmp11;
+		rows[i][4] = tmp10 - tmp11;
+
+		z1 = AAN_MUL(tmp12 + tmp13, C0_707106781);
+		rows[i][2] = tmp13 + z1;
+		rows[i][6] = tmp13 - z1;
+
+		// odd part
+		tmp10 = tmp4 + tmp5;
+		tmp11 = tmp5 + tmp6;
+		tmp12 = tmp6 + tmp7;
+
+		z5 = AAN_MUL(tmp10 - tmp12, C0_382683433);
+		z2 = AAN_MUL(tmp10, C0_541196100) + z5;
+		z4 = AAN_MUL(tmp12, C1_306562965) + z5;
+		z3 = AAN_MUL(tmp11, C0_707106781);
+
+		z11 = tmp7 + z3;
+		z13 = tmp7 - z3;
+
+		rows[i][5] = z13 + z2;
+		rows[i][3] = z13 - z2;
+		rows[i][1] = z11 + z4;
+		rows[i][7] = z11 - z4;
+	}
+}
+
+// AAN pass over column i, col[k] is the (scaled) coefficient of row k
+static inline void dct_aan_column(int32_t rows[8][8], unsigned i, int32_t col[8])
+{
+	int32_t tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	int32_t tmp10, tmp11, tmp12, tmp13;
+	int32_t z1, z2, z3, z4, z5, z11, z13;
+
+	tmp0 = rows[0][i] + rows[7][i];
+	tmp7 = rows[0][i] - rows[7][i];
+	tmp1 = rows[1][i] + rows[6][i];
+	tmp6 = rows[1][i] - rows[6][i];
+	tmp2 = rows[2][i] + rows[5][i];
+	tmp5 = rows[2][i] - rows[5][i];
+	tmp3 = rows[3][i] + rows[4][i];
+	tmp4 = rows[3][i] - rows[4][i];
+
+	// even part
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	col[0] = tmp10 + tmp11;
+	col[4] = tmp10 - tmp11;
+
+	z1 = AAN_MUL(tmp12 + tmp13, C0_707106781);
+	col[2] = tmp13 + z1;
+	col[6] = tmp13 - z1;
+
+	// odd part
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	z5 = AAN_MUL(tmp10 - tmp12, C0_382683433);
+	z2 = AAN_MUL(tmp10, C0_541196100) + z5;
+	z4 = AAN_MUL(tmp12, C1_306562965) + z5;
+	z3 = AAN_MUL(tmp11, C0_707106781);
+
+	z11 = tmp7 + z3;
+	z13 = tmp7 - z3;
+
+	col[5] = z13 + z2;
+	col[3] = z13 - z2;
+	col[1] = z11 + z4;
+	col[7] = z11 - z4;
+}
+
+/******************************************************************************
+**  dct_quantize
+**  --------------------------------------------------------------------------
+**  Fast DCT (Arai, Agui, Nakajima) fused with quantization.
+**  5 multiplications per 1-D transform; the output scaling of the AAN
+**  algorithm is left in place and removed by the quantizer table, so each
+**  coefficient costs one more multiplication. Quantized coefficients are
+**  written in zig-zag order, ready for the entropy coder.
+**  
+**  ARGUMENTS:
+**      pixels  - 8x8 pixel array (level shifted, -128..127);
+**      fdtbl   - quantizer table from dct_fdtbl();
+**      data    - 64 quantized coefficients, zig-zag order;
+**
+**  RETURN: -
+******************************************************************************/
+void dct_quantize(int16_t pixels[8][8], const int32_t fdtbl[64], int16_t data[64])
+{
+	int32_t  rows[8][8];
+	int32_t  col[8];
+	unsigned i, k;
+
+#if JPEG_SIMD
+	if (jpeg_simd.dct_quantize != NULL) {
+		int16_t natural[64];
+
+		jpeg_simd.dct_quantize(pixels, fdtbl, natural);
+		for (i = 0; i < 64; i++)
+			data[dct_zigzag[i]] = natural[i];
+		return;
+	}
+#endif
+
+	dct_aan_rows(pixels, rows);
+
+	/* transform columns and quantize */
+	for (i = 0; i < 8; i++)
+	{
+		dct_aan_column(rows, i, col);
+		for (k = 0; k < 8; k++)
+			data[dct_zigzag[k*8 + i]] = dct_quant(col[k], fdtbl[k*8 + i]);
+	}
+}
+
+/******************************************************************************
+**  dct_aan
+**  --------------------------------------------------------------------------
+**  The transform of dct_quantize() without the quantization, for quantizing
+**  one block several times (dct_requantize()) at the cost of one transform.
+**  
+**  ARGUMENTS:
+**      pixels  - 8x8 pixel array (level shifted, -128..127);
+**      coef    - 64 AAN-scaled coefficients, natural order;
+**
+**  RETURN: -
+******************************************************************************/
+void dct_aan(int16_t pixels[8][8], int32_t coef[64])
+{
+	int32_t  rows[8][8];
+	int32_t  col[8];
+	unsigned i, k;
+
+#if JPEG_SIMD
+	if (jpeg_simd.dct_aan != NULL) {
+		jpeg_simd.dct_aan(pixels, coef);
+		return;
+	}
+#endif
+
+	dct_aan_rows(pixels, rows);
+
+	for (i = 0; i < 8; i++)
+	{
+		dct_aan_column(rows, i, col);
+		for (k = 0; k < 8; k++)
+			coef[k*8 + i] = col[k];
+	}
+}
+
+/******************************************************************************
+**  dct_requantize
+**  --------------------------------------------------------------------------
+**  Quantizes the output of dct_aan(), same result as dct_quantize() on the
+**  same pixels.
+**  
+**  ARGUMENTS:
+**      coef    - 64 coefficients from dct_aan();
+**      fdtbl   - quantizer table from dct_fdtbl();
+**      data    - 64 quantized coefficients, zig-zag order;
+**
+**  RETURN: -
+******************************************************************************/
+void dct_requantize(const int32_t coef[64], const int32_t fdtbl[64], int16_t data[64])
+{
+	unsigned i;
+
+#if JPEG_SIMD
+	if (jpeg_simd.quantize != NULL) {
+		int16_t natural[64];
+
+		jpeg_simd.quantize(coef, fdtbl, natural);
+		for (i = 0; i < 64; i++)
+			data[dct_zigzag[i]] = natural[i];
+		return;
+	}
+#endif
+
+	for (i = 0; i < 64; i++)
+		data[dct_zigzag[i]] = dct_quant(coef[i], fdtbl[i]);
+}
+
+/******************************************************************************
+**  dct_quantize_rd
+**  --------------------------------------------------------------------------
+**  Rate-distortion quantization of the output of dct_aan(): the levels that
+**  minimize D + lambda * R over the AC coefficients, instead of rounding
+**  each one. D is the squared error of the dequantized coefficients (equal
+**  to that of the pixels), R the bits of the Huffman codes, magnitudes,
+**  zero runs and EOB as coded with the code lengths aclen. An AC level can
+**  stay as rounded, drop by one towards 0, or become 0 (joining a zero run),
+**  searched as a trellis over the position of the last non-zero level
+**  (mostly a few 100 steps a block). The DC coefficient is rounded as in
+**  dct_requantize(). Integer only, for the ESP32-S2 without an FPU: the
+**  unrounded levels have DCT_RD_BITS fraction bits, the costs 64 bits.
+**  
+**  ARGUMENTS:
+**      coef    - 64 coefficients from dct_aan();
+**      fdtbl   - quantizer table from dct_fdtbl();
+**      qtable  - the quantization table fdtbl is built from, natural order;
+**      aclen   - AC code length by (run << 4) | size, 0: symbol not coded;
+**      lambda  - squared error worth one bit, in levels scaled by
+**                2^DCT_RD_BITS (so 2^(2*DCT_RD_BITS) times the error);
+**      data    - 64 quantized coefficients, zig-zag order;
+**
+**  RETURN: -
+******************************************************************************/
+void dct_quantize_rd(const int32_t coef[64], const int32_t fdtbl[64], const unsigned char qtable[64],
+                     const unsigned char aclen[256], uint32_t lambda, int16_t data[64])
+{
+	int32_t        x[64];     // unrounded levels, zig-zag order
+	int32_t        w[64];     // squared quantizer steps, weights of the level errors
+	int64_t        zero[64];  // error of coding levels 1..k as 0
+	int64_t        cost[64];  // best D + lambda * R of levels 1..k with level k non-zero
+	int16_t        level[64];
+	unsigned char  from[64];  // position of the non-zero level before k
+	unsigned char  nz[64];    // positions that can end a run: 0 and the non-zero levels
+	unsigned       i, k, n, c, last;
+	int64_t        best;
+
+	for (i = 0; i < 64; i++) {
+		const unsigned z = dct_zigzag[i];
+
+		x[z] = (coef[i] * fdtbl[i] + (1 << (DCT_FDTBL_SCALE - DCT_RD_BITS - 1))) >>
+		       (DCT_FDTBL_SCALE - DCT_RD_BITS);
+		w[z] = qtable[i] * qtable[i];
+		data[z] = dct_quant(coef[i], fdtbl[i]);
+	}
+	zero[0] = 0;
+	for (k = 1; k < 64; k++)
+		zero[k] = zero[k - 1] + (int64_t)x[k] * x[k] * w[k];
+
+	cost[0] = 0;
+	nz[0] = 0;
+	for (n = 1, k = 1; k < 64; k++) {
+		const int16_t r = data[k];
+
+		if (!r)
+			continue;
+		cost[k] = -1;
+		// the rounded level, and the one closer to 0 unless that is 0
+		for (c = 0; c < 2; c++) {
+			const int16_t l = c == 0 ? r : r > 0 ? r - 1 : r + 1;
+			const int32_t e = x[k] - l * (1 << DCT_RD_BITS);
+			const int64_t d = (int64_t)e * e * w[k];
+			unsigned size, a, j;
+
+			if (!l)
+				break;
+			for (size = 0, a = l < 0 ? -l : l; a; a >>= 1)
+				size++;
+			for (j = 0; j < n; j++) {
+				const unsigned run = k - nz[j] - 1;
+				const unsigned len = aclen[(run & 15) << 4 | size];
+				int64_t jc;
+
+				if (!len || (run >= 16 && !aclen[0xF0]))
+					continue;
+				jc = cost[nz[j]] + zero[k - 1] - zero[nz[j]] + d +
+				     (int64_t)lambda * ((run >> 4) * aclen[0xF0] + len + size);
+				if (cost[k] < 0 || jc < cost[k]) {
+					cost[k] = jc;
+					from[k] = nz[j];
+					level[k] = l;
+				}
+			}
+		}
+		if (cost[k] >= 0)
+			nz[n++] = k;
+	}
+
+	// all levels behind the last non-zero one go into the EOB
+	for (last = 0, best = -1, i = 0; i < n; i++) {
+		const unsigned j = nz[i];
+		const int64_t jc = cost[j] + zero[63] - zero[j] + (j < 63 ? (int64_t)lambda * aclen[0x00] : 0);
+
+		if (best < 0 || jc < best) {
+			best = jc;
+			last = j;
+		}
+	}
+	memset(&data[1], 0, 63 * sizeof(data[0]));
+	for (k = last; k > 0; k = from[k])
+		data[k] = level[k];
+}
+
+/******************************************************************************
+**  dct_quantize_flat
+**  --------------------------------------------------------------------------
+**  dct_quantize() of a uniform block: all AC coefficients of the transform
+**  are exactly 0 and the DC one is 64 times the pixel value, so only the DC
+**  is quantized. Same result as the full transform.
+**  
+**  ARGUMENTS:
+**      pixel   - value of all 64 pixels (level shifted, -128..127);
+**      fdtbl   - quantizer table from dct_fdtbl();
+**
+**  RETURN: the quantized DC coefficient, the AC ones are 0
+******************************************************************************/
+int16_t dct_quantize_flat(int16_t pixel, const int32_t fdtbl[64])
+{
+	return dct_quant(64 * pixel, fdtbl[0]);
+}
@@ -0,0 +1,56 @@
+// Encode time of a 640x480 frame through jpeg_encode(), the entry point
+// every version of the component has, so the same benchmark also builds
+// against an older tree (JPEG_COMPONENT_DIR) for before/after numbers.
+// The hash shows whether two builds write the same bytes.
+//   bench_encode [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define W 640
+#define H 480
+#define OUT_SIZE (1 << 20)
+
+static void bench(const char *name, jpeg_encode_mode_t mode, uint8_t *img, uint8_t *out, int rounds)
+{
+    double best = 1e9;
+    size_t size = 0;
+
+    for (int r = 0; r < rounds; r++) {
+        double t = host_test_now();
+        for (int i = 0; i < 20; i++) {
+            size = jpeg_encode(mode, img, W, H, out, OUT_SIZE);
+        }
+        t = (host_test_now() - t) / 20;
+        if (t < best) {
+            best = t;
+        }
+    }
+    printf("%-14s %7.3f ms %7zu bytes hash %08x\n", name, best * 1e3, size, (unsigned)host_test_hash(out, size));
+}
+
+int main(int argc, char **argv)
+{
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    uint8_t *rgb = (uint8_t *)malloc(W * H * 3);
+    uint8_t *out = (uint8_t *)malloc(OUT_SIZE);
+    if (rgb == NULL || out == NULL) {
+        return 1;
+    }
+    host_test_frame(rgb, W, H, 1);
+    uint8_t *rgb565 = host_test_rgb565(rgb, W, H);
+    uint8_t *yuyv = host_test_yuyv(rgb, W, H);
+
+    printf("%dx%d, best of %d x 20 encodes\n", W, H, rounds);
+    bench("camera RGB565", ENCODE_RGB16_MODE, rgb565, out, rounds);
+    bench("camera YUYV", ENCODE_YUV_MODE, yuyv, out, rounds);
+    bench("camera RGB24", ENCODE_RGB24_MODE, rgb, out, rounds);
+    host_test_noise(rgb565, W * H * 2, 2);
+    bench("noise RGB565", ENCODE_RGB16_MODE, rgb565, out, rounds);
+    free(rgb565);
+    free(yuyv);
+    free(rgb);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,69 @@
+// Sequential, stripe-parallel and pipelined encodes of RGB565 frames of
+// several widths, ms per frame. Numbers reflect the host's cores: with one
+// CPU the stripes and the pipeline only show their hand-off overhead.
+//   bench_pipeline [rounds]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define H 480
+#define OUT_SIZE (1 << 20)
+
+static double bench(jpeg_encode_ctx_t *ctx, uint8_t *img, int w, uint8_t *out, size_t *size, int rounds)
+{
+    double best = 1e9;
+
+    for (int r = 0; r < rounds; r++) {
+        double t = host_test_now();
+        for (int i = 0; i < 20; i++) {
+            *size = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, H, out, OUT_SIZE);
+        }
+        t = (host_test_now() - t) / 20;
+        if (t < best) {
+            best = t;
+        }
+    }
+    return best * 1e3;
+}
+
+int main(int argc, char **argv)
+{
+    static const int widths[] = {640, 160, 48};
+    int rounds = argc > 1 ? atoi(argv[1]) : 5;
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    uint8_t *out[3] = {malloc(OUT_SIZE), malloc(OUT_SIZE), malloc(OUT_SIZE)};
+    if (ctx == NULL || out[0] == NULL || out[1] == NULL || out[2] == NULL) {
+        return 1;
+    }
+
+    printf("RGB565, ms per frame  sequential  stripes x2  pipeline  same output\n");
+    for (size_t i = 0; i < sizeof(widths) / sizeof(widths[0]); i++) {
+        int w = widths[i];
+        uint8_t *rgb = (uint8_t *)malloc((size_t)w * H * 3);
+        if (rgb == NULL) {
+            return 1;
+        }
+        host_test_frame(rgb, w, H, 1);
+        uint8_t *img = host_test_rgb565(rgb, w, H);
+        size_t size[3] = {0, 0, 0};
+        double seq = bench(ctx, img, w, out[0], &size[0], rounds);
+        jpeg_encode_ctx_set_stripes(ctx, 2);
+        double stripes = bench(ctx, img, w, out[1], &size[1], rounds);
+        jpeg_encode_ctx_set_stripes(ctx, 1);
+        jpeg_encode_ctx_set_pipeline(ctx, true);
+        double pipe = bench(ctx, img, w, out[2], &size[2], rounds);
+        jpeg_encode_ctx_set_pipeline(ctx, false);
+        bool same = size[0] == size[1] && size[0] == size[2] &&
+                    !memcmp(out[0], out[1], size[0]) && !memcmp(out[0], out[2], size[0]);
+        printf("  %4dx%d %20.2f %11.2f %9.2f  %s\n", w, H, seq, stripes, pipe, same ? "yes" : "NO");
+        free(img);
+        free(rgb);
+    }
+    jpeg_encode_ctx_delete(ctx);
+    for (int i = 0; i < 3; i++) {
+        free(out[i]);
+    }
+    return 0;
+}
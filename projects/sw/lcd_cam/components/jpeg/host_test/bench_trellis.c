@@ -0,0 +1,257 @@
+// Rate-distortion of the trellis quantizer: YUYV frames encoded 4:2:2 at
+// qualities 30..95 with and without jpeg_encode_ctx_set_trellis(), with the
+// standard and the optimized Huffman tables. The distortion is that of the
+// decoded samples against the encoder input (Y, and Y/Cb/Cr together),
+// taken from the quantized coefficients through a floating point inverse
+// DCT, so the RGB565 output of jpeg_decode() does not hide it. The BD-rate
+// is the mean size difference at equal PSNR over the PSNR range both curves
+// cover (log size interpolated linearly in PSNR); negative is smaller.
+//   bench_trellis [<RGB24 file> <w> <h>]
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jpeg.h"
+#include "tjpgd.h"
+#include "host_test.h"
+
+#define W 640
+#define H 480
+#define OUT_SIZE (1 << 21)
+#define POOL_SIZE (16 * 1024)
+#define QUALITIES 14            //30, 35 .. 95
+
+static const unsigned char zigzag_natural[64] = {
+    0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63,
+};
+
+typedef struct {
+    const uint8_t *jpeg;
+    size_t size, pos;
+    const uint8_t *yuyv;        //Encoder input
+    int w;
+    BYTE qtable[3][64];
+    double sse[2];              //Y, Cb + Cr
+} bench_decode_t;
+
+typedef struct {
+    size_t size;
+    double psnr_y, psnr;        //Y, all samples
+    double ms;
+} bench_point_t;
+
+static UINT bench_in(JDEC *decoder, BYTE *buf, UINT len)
+{
+    bench_decode_t *d = (bench_decode_t *)decoder->device;
+
+    if (len > d->size - d->pos) {
+        len = d->size - d->pos;
+    }
+    if (buf != NULL) {
+        memcpy(buf, &d->jpeg[d->pos], len);
+    }
+    d->pos += len;
+    return len;
+}
+
+//Squared error of one decoded block: coefficients in zig-zag order, input
+//samples at in, step bytes apart in a row, stride between rows
+static double bench_block(const SHORT *coef, const BYTE *qtable, const uint8_t *in, int step, int stride)
+{
+    static double basis[8][8];
+    double dq[64], tmp[64], sse = 0;
+
+    if (basis[0][0] == 0) {
+        for (int u = 0; u < 8; u++) {
+            for (int x = 0; x < 8; x++) {
+                basis[u][x] = (u ? 0.5 : 0.5 * M_SQRT1_2) * cos((2 * x + 1) * u * M_PI / 16);
+            }
+        }
+    }
+    for (int k = 0; k < 64; k++) {
+        int n = zigzag_natural[k];
+        dq[n] = coef[k] * qtable[n];
+    }
+    for (int v = 0; v < 8; v++) {
+        for (int x = 0; x < 8; x++) {
+            double s = 0;
+            for (int u = 0; u < 8; u++) {
+                s += basis[u][x] * dq[v * 8 + u];
+            }
+            tmp[v * 8 + x] = s;
+        }
+    }
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            double s = 128;
+            for (int v = 0; v < 8; v++) {
+                s += basis[v][y] * tmp[v * 8 + x];
+            }
+            long p = lround(s);
+            p = p < 0 ? 0 : p > 255 ? 255 : p;
+            double e = (double)p - in[y * stride + x * step];
+            sse += e * e;
+        }
+    }
+    return sse;
+}
+
+//One 4:2:2 MCU: two Y blocks, Cb, Cr
+static UINT bench_out(JDEC *decoder, SHORT *blocks, JRECT *rect)
+{
+    bench_decode_t *d = (bench_decode_t *)decoder->device;
+    int stride = 2 * d->w;
+    const uint8_t *in = &d->yuyv[rect->top * stride + 2 * rect->left];
+
+    d->sse[0] += bench_block(&blocks[0], d->qtable[0], in, 2, stride);
+    d->sse[0] += bench_block(&blocks[64], d->qtable[0], in + 16, 2, stride);
+    d->sse[1] += bench_block(&blocks[128], d->qtable[1], in + 1, 4, stride);
+    d->sse[1] += bench_block(&blocks[192], d->qtable[2], in + 3, 4, stride);
+    return 1;
+}
+
+static bench_point_t bench_encode(jpeg_encode_ctx_t *ctx, uint8_t *yuyv, int w, int h, uint8_t *out)
+{
+    bench_point_t p = {0};
+    static char pool[POOL_SIZE];
+    bench_decode_t d = {.yuyv = yuyv, .w = w};
+    JDEC decoder;
+
+    double t = host_test_now();
+    p.size = jpeg_encode_ctx(ctx, ENCODE_YUV_MODE, yuyv, w, h, out, OUT_SIZE);
+    p.ms = (host_test_now() - t) * 1e3;
+    d.jpeg = out;
+    d.size = p.size;
+    if (p.size == 0 || jd_prepare(&decoder, bench_in, pool, sizeof(pool), &d) != JDR_OK || decoder.msx != 2 || decoder.msy != 1) {
+        fprintf(stderr, "cannot read back the encode\n");
+        exit(1);
+    }
+    for (int c = 0; c < 3; c++) {
+        jd_qtable(&decoder, c, d.qtable[c]);
+    }
+    jd_decomp_coef(&decoder, bench_out);
+    //Only whole MCUs are encoded
+    double samples = (double)(w & -16) * (h & -8);
+    p.psnr_y = 10 * log10(255.0 * 255.0 * samples / d.sse[0]);
+    p.psnr = 10 * log10(255.0 * 255.0 * 2 * samples / (d.sse[0] + d.sse[1]));
+    return p;
+}
+
+//Mean log size difference of b against a at equal PSNR, in percent
+static double bench_bdrate(const bench_point_t *a, const bench_point_t *b, bool y)
+{
+    double lo = -1e9, hi = 1e9, sum = 0;
+    const bench_point_t *c[2] = {a, b};
+    const int steps = 100;
+
+    for (int i = 0; i < 2; i++) {
+        double first = y ? c[i][0].psnr_y : c[i][0].psnr, last = y ? c[i][QUALITIES - 1].psnr_y : c[i][QUALITIES - 1].psnr;
+        lo = first > lo ? first : lo;
+        hi = last < hi ? last : hi;
+    }
+    for (int s = 0; s <= steps; s++) {
+        double psnr = lo + (hi - lo) * s / steps, r[2];
+        for (int i = 0; i < 2; i++) {
+            int k = 0;
+            while (k < QUALITIES - 2 && (y ? c[i][k + 1].psnr_y : c[i][k + 1].psnr) < psnr) {
+                k++;
+            }
+            double d0 = y ? c[i][k].psnr_y : c[i][k].psnr, d1 = y ? c[i][k + 1].psnr_y : c[i][k + 1].psnr;
+            double f = (psnr - d0) / (d1 - d0);
+            r[i] = log((double)c[i][k].size) + f * (log((double)c[i][k + 1].size) - log((double)c[i][k].size));
+        }
+        sum += r[1] - r[0];
+    }
+    return (exp(sum / (steps + 1)) - 1) * 100;
+}
+
+static void bench_image(const char *name, uint8_t *yuyv, int w, int h, uint8_t *out)
+{
+    static const int strengths[] = {50, JPEG_TRELLIS_DEFAULT, 200};
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    bench_point_t base[QUALITIES], curve[QUALITIES];
+
+    for (int opt = 0; opt < 2; opt++) {
+        jpeg_encode_ctx_set_optimize(ctx, opt);
+        jpeg_encode_ctx_set_trellis(ctx, 0);
+        for (int i = 0; i < QUALITIES; i++) {
+            jpeg_encode_ctx_set_quality(ctx, 30 + 5 * i);
+            base[i] = bench_encode(ctx, yuyv, w, h, out);
+        }
+        printf("%s, %s tables: q75 %zu bytes, Y %.2f dB, YCbCr %.2f dB, %.1f ms\n", name, opt ? "optimized" : "standard",
+               base[9].size, base[9].psnr_y, base[9].psnr, base[9].ms);
+        for (size_t s = 0; s < sizeof(strengths) / sizeof(strengths[0]); s++) {
+            jpeg_encode_ctx_set_trellis(ctx, strengths[s]);
+            for (int i = 0; i < QUALITIES; i++) {
+                jpeg_encode_ctx_set_quality(ctx, 30 + 5 * i);
+                curve[i] = bench_encode(ctx, yuyv, w, h, out);
+            }
+            printf("  trellis %3d: BD-rate Y %+5.1f%%, YCbCr %+5.1f%%; q75 %zu bytes, Y %.2f dB, %.1f ms\n", strengths[s],
+                   bench_bdrate(base, curve, true), bench_bdrate(base, curve, false), curve[9].size, curve[9].psnr_y, curve[9].ms);
+        }
+    }
+    jpeg_encode_ctx_delete(ctx);
+}
+
+//Box blur of the RGB24 frame, 3x3
+static void bench_smooth(uint8_t *rgb, int w, int h)
+{
+    uint8_t *src = malloc((size_t)w * h * 3);
+
+    memcpy(src, rgb, (size_t)w * h * 3);
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            for (int c = 0; c < 3; c++) {
+                int sum = 0, n = 0;
+                for (int dy = -1; dy <= 1; dy++) {
+                    for (int dx = -1; dx <= 1; dx++) {
+                        if (y + dy >= 0 && y + dy < h && x + dx >= 0 && x + dx < w) {
+                            sum += src[((y + dy) * w + x + dx) * 3 + c];
+                            n++;
+                        }
+                    }
+                }
+                rgb[(y * w + x) * 3 + c] = (sum + n / 2) / n;
+            }
+        }
+    }
+    free(src);
+}
+
+int main(int argc, char **argv)
+{
+    uint8_t *out = malloc(OUT_SIZE);
+    int w = W, h = H;
+    uint8_t *rgb;
+
+    if (argc == 4) {
+        w = atoi(argv[2]);
+        h = atoi(argv[3]);
+        rgb = malloc((size_t)w * h * 3);
+        FILE *f = fopen(argv[1], "rb");
+        if (f == NULL || fread(rgb, 3, (size_t)w * h, f) != (size_t)w * h) {
+            fprintf(stderr, "cannot read %dx%d RGB24 from %s\n", w, h, argv[1]);
+            return 1;
+        }
+        fclose(f);
+        uint8_t *yuyv = host_test_yuyv(rgb, w, h);
+        bench_image(argv[1], yuyv, w, h, out);
+        free(yuyv);
+    } else {
+        rgb = malloc(W * H * 3);
+        host_test_frame(rgb, W, H, 1);
+        uint8_t *yuyv = host_test_yuyv(rgb, W, H);
+        bench_image("camera", yuyv, W, H, out);
+        free(yuyv);
+        bench_smooth(rgb, W, H);
+        yuyv = host_test_yuyv(rgb, W, H);
+        bench_image("smoothed", yuyv, W, H, out);
+        free(yuyv);
+    }
+    free(rgb);
+    free(out);
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include "host_test.h"
+
+int host_test_failures = 0;
+
+int host_test_result(const char *name)
+{
+    if (host_test_failures) {
+        printf("%s: %d checks failed\n", name, host_test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
+
+static uint32_t host_test_random(uint32_t *state)
+{
+    *state = *state * 1664525u + 1013904223u;
+    return *state >> 8;
+}
+
+static uint8_t host_test_clamp(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : (uint8_t)v;
+}
+
+static void host_test_fill(uint8_t *rgb, int w, int h, int x0, int y0, int x1, int y1, const uint8_t color[3])
+{
+    for (int y = y0 < 0 ? 0 : y0; y <= y1 && y < h; y++) {
+        for (int x = x0 < 0 ? 0 : x0; x <= x1 && x < w; x++) {
+            rgb[3 * (y * w + x) + 0] = color[0];
+            rgb[3 * (y * w + x) + 1] = color[1];
+            rgb[3 * (y * w + x) + 2] = color[2];
+        }
+    }
+}
+
+void host_test_frame(uint8_t *rgb, int w, int h, uint32_t seed)
+{
+    uint32_t state = seed;
+    uint8_t *tmp = (uint8_t *)malloc((size_t)w * h * 3);
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            rgb[3 * (y * w + x) + 0] = host_test_clamp((int)(128 + 100 * sin(x / 37.0) * cos(y / 53.0)));
+            rgb[3 * (y * w + x) + 1] = (uint8_t)(x * 255 / w);
+            rgb[3 * (y * w + x) + 2] = host_test_clamp((int)(128 + 120 * sin((x + y) / 23.0)));
+        }
+    }
+    //Filled boxes and light outlines, the edges of the frame
+    for (int i = 0; i < w * h / 7680 + 1; i++) {
+        int x = host_test_random(&state) % w, y = host_test_random(&state) % h;
+        int bw = 10 + host_test_random(&state) % 110, bh = 10 + host_test_random(&state) % 80;
+        uint8_t color[3] = {(uint8_t)host_test_random(&state), (uint8_t)host_test_random(&state), (uint8_t)host_test_random(&state)};
+        const uint8_t white[3] = {255, 255, 255};
+        host_test_fill(rgb, w, h, x, y, x + bw, y + bh, color);
+        host_test_fill(rgb, w, h, x - 30, y - 20, x + bw / 2, y - 20, white);
+        host_test_fill(rgb, w, h, x - 30, y - 20, x - 30, y + bh / 2, white);
+    }
+    //Soften like a lens, then sensor noise
+    if (tmp != NULL) {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                for (int c = 0; c < 3; c++) {
+                    int sum = 0, n = 0;
+                    for (int dy = -1; dy <= 1; dy++) {
+                        for (int dx = -1; dx <= 1; dx++) {
+                            if (y + dy >= 0 && y + dy < h && x + dx >= 0 && x + dx < w) {
+                                sum += rgb[3 * ((y + dy) * w + x + dx) + c] * (dx || dy ? 1 : 4);
+                                n += dx || dy ? 1 : 4;
+                            }
+                        }
+                    }
+                    tmp[3 * (y * w + x) + c] = (uint8_t)((sum + n / 2) / n);
+                }
+            }
+        }
+        for (size_t i = 0; i < (size_t)w * h; i++) {
+            int noise = (int)(host_test_random(&state) % 13) - 6;
+            for (int c = 0; c < 3; c++) {
+                rgb[3 * i + c] = host_test_clamp(tmp[3 * i + c] + noise);
+            }
+        }
+        free(tmp);
+    }
+    //Flat areas, as on screen content
+    const uint8_t blue[3] = {30, 60, 200}, white[3] = {250, 250, 250};
+    host_test_fill(rgb, w, h, 0, 0, w * 5 / 16, h / 4, blue);
+    host_test_fill(rgb, w, h, w * 11 / 16, h * 3 / 4, w - 1, h - 1, white);
+}
+
+void host_test_noise(uint8_t *buf, size_t size, uint32_t seed)
+{
+    uint32_t state = seed;
+
+    for (size_t i = 0; i < size; i++) {
+        buf[i] = (uint8_t)host_test_random(&state);
+    }
+}
+
+uint8_t *host_test_rgb565(const uint8_t *rgb, int w, int h)
+{
+    uint8_t *out = (uint8_t *)malloc((size_t)w * h * 2);
+
+    for (size_t i = 0; out != NULL && i < (size_t)w * h; i++) {
+        unsigned v = (rgb[3 * i] >> 3) << 11 | (rgb[3 * i + 1] >> 2) << 5 | rgb[3 * i + 2] >> 3;
+        out[2 * i] = (uint8_t)(v >> 8);
+        out[2 * i + 1] = (uint8_t)v;
+    }
+    return out;
+}
+
+static void host_test_ycbcr(const uint8_t *p, int *y, int *cb, int *cr)
+{
+    *y = (int)lround(0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2]);
+    *cb = (int)lround(128 - 0.168736 * p[0] - 0.331264 * p[1] + 0.5 * p[2]);
+    *cr = (int)lround(128 + 0.5 * p[0] - 0.418688 * p[1] - 0.081312 * p[2]);
+}
+
+uint8_t *host_test_yuyv(const uint8_t *rgb, int w, int h)
+{
+    uint8_t *out = (uint8_t *)malloc((size_t)w * h * 2);
+
+    for (size_t i = 0; out != NULL && i + 1 < (size_t)w * h; i += 2) {
+        int y0, cb0, cr0, y1, cb1, cr1;
+        host_test_ycbcr(&rgb[3 * i], &y0, &cb0, &cr0);
+        host_test_ycbcr(&rgb[3 * i + 3], &y1, &cb1, &cr1);
+        out[2 * i + 0] = host_test_clamp(y0);
+        out[2 * i + 1] = host_test_clamp((cb0 + cb1 + 1) / 2);
+        out[2 * i + 2] = host_test_clamp(y1);
+        out[2 * i + 3] = host_test_clamp((cr0 + cr1 + 1) / 2);
+    }
+    return out;
+}
+
+uint8_t *host_test_gray(const uint8_t *rgb, int w, int h)
+{
+    uint8_t *out = (uint8_t *)malloc((size_t)w * h);
+
+    for (size_t i = 0; out != NULL && i < (size_t)w * h; i++) {
+        int y, cb, cr;
+        host_test_ycbcr(&rgb[3 * i], &y, &cb, &cr);
+        out[i] = host_test_clamp(y);
+    }
+    return out;
+}
+
+double host_test_now(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+uint32_t host_test_hash(const uint8_t *buf, size_t size)
+{
+    uint32_t hash = 2166136261u;
+
+    for (size_t i = 0; i < size; i++) {
+        hash = (hash ^ buf[i]) * 16777619u;
+    }
+    return hash;
+}
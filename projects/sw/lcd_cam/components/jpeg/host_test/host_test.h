@@ -0,0 +1,39 @@
+// Helpers shared by the host tests and benchmarks of the jpeg component:
+// deterministic test frames, a check macro and a clock.
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+// Failed CHECK()s so far; main() returns host_test_result()
+extern int host_test_failures;
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            host_test_failures++; \
+        } \
+    } while (0)
+
+// Prints the outcome, returns the exit code of the test
+int host_test_result(const char *name);
+
+// Camera-like w x h RGB24 frame: gradients, edges, mild noise and two flat
+// areas, the same for a seed on every host
+void host_test_frame(uint8_t *rgb, int w, int h, uint32_t seed);
+
+// Uniform noise
+void host_test_noise(uint8_t *buf, size_t size, uint32_t seed);
+
+// Conversions of an RGB24 frame to the encoder input formats, malloc()ed:
+// big-endian RGB565, YUYV (BT.601 full range, chroma of each pixel pair
+// averaged) and 8-bit luma
+uint8_t *host_test_rgb565(const uint8_t *rgb, int w, int h);
+uint8_t *host_test_yuyv(const uint8_t *rgb, int w, int h);
+uint8_t *host_test_gray(const uint8_t *rgb, int w, int h);
+
+// Monotonic time in seconds
+double host_test_now(void);
+
+// FNV-1a of buf
+uint32_t host_test_hash(const uint8_t *buf, size_t size);
@@ -0,0 +1,16 @@
+// Host shim of the FreeRTOS types and constants the jpeg component uses
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+typedef int BaseType_t;
+typedef unsigned int UBaseType_t;
+typedef uint32_t TickType_t;
+
+#define pdTRUE              1
+#define pdFALSE             0
+#define pdPASS              pdTRUE
+#define portMAX_DELAY       ((TickType_t)0xffffffffUL)
+#define portNUM_PROCESSORS  2
+#define tskNO_AFFINITY      0x7fffffff
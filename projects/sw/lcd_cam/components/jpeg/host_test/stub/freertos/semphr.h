@@ -0,0 +1,51 @@
+// Host shim of FreeRTOS binary semaphores on a mutex and condition variable.
+// Takes wait without a timeout, the jpeg component only uses portMAX_DELAY.
+#pragma once
+#include <pthread.h>
+#include "freertos/FreeRTOS.h"
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool given;
+} host_semaphore_t;
+
+typedef host_semaphore_t *SemaphoreHandle_t;
+
+static inline SemaphoreHandle_t xSemaphoreCreateBinary(void)
+{
+    host_semaphore_t *sem = (host_semaphore_t *)calloc(1, sizeof(host_semaphore_t));
+    if (sem != NULL) {
+        pthread_mutex_init(&sem->mutex, NULL);
+        pthread_cond_init(&sem->cond, NULL);
+    }
+    return sem;
+}
+
+static inline BaseType_t xSemaphoreTake(SemaphoreHandle_t sem, TickType_t ticks)
+{
+    (void)ticks;
+    pthread_mutex_lock(&sem->mutex);
+    while (!sem->given) {
+        pthread_cond_wait(&sem->cond, &sem->mutex);
+    }
+    sem->given = false;
+    pthread_mutex_unlock(&sem->mutex);
+    return pdTRUE;
+}
+
+static inline BaseType_t xSemaphoreGive(SemaphoreHandle_t sem)
+{
+    pthread_mutex_lock(&sem->mutex);
+    sem->given = true;
+    pthread_cond_signal(&sem->cond);
+    pthread_mutex_unlock(&sem->mutex);
+    return pdTRUE;
+}
+
+static inline void vSemaphoreDelete(SemaphoreHandle_t sem)
+{
+    pthread_mutex_destroy(&sem->mutex);
+    pthread_cond_destroy(&sem->cond);
+    free(sem);
+}
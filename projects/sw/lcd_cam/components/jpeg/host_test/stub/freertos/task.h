@@ -0,0 +1,85 @@
+// Host shim of FreeRTOS tasks on POSIX threads. Priorities and core
+// affinity are ignored, the host scheduler places the threads.
+#pragma once
+#include <pthread.h>
+#include <sched.h>
+#include "freertos/FreeRTOS.h"
+
+typedef pthread_t *TaskHandle_t;
+typedef void (*TaskFunction_t)(void *);
+
+typedef struct {
+    TaskFunction_t func;
+    void *arg;
+    pthread_t *thread;
+} host_task_start_t;
+
+//The handle lives as long as the task, as on FreeRTOS; vTaskDelete() leaves
+//through pthread_exit(), which runs the cleanup handler
+static void *host_task_entry(void *arg)
+{
+    host_task_start_t start = *(host_task_start_t *)arg;
+    free(arg);
+    pthread_detach(pthread_self());
+    pthread_cleanup_push(free, start.thread);
+    start.func(start.arg);
+    pthread_cleanup_pop(1);
+    return NULL;
+}
+
+static inline BaseType_t xTaskCreatePinnedToCore(TaskFunction_t func, const char *name, uint32_t stack_depth, void *arg,
+                                                 UBaseType_t priority, TaskHandle_t *handle, BaseType_t core)
+{
+    (void)name;
+    (void)stack_depth;
+    (void)priority;
+    (void)core;
+    pthread_t *thread = (pthread_t *)malloc(sizeof(pthread_t));
+    host_task_start_t *start = (host_task_start_t *)malloc(sizeof(host_task_start_t));
+    if (thread == NULL || start == NULL) {
+        free(thread);
+        free(start);
+        return pdFALSE;
+    }
+    start->func = func;
+    start->arg = arg;
+    start->thread = thread;
+    if (pthread_create(thread, NULL, host_task_entry, start) != 0) {
+        free(thread);
+        free(start);
+        return pdFALSE;
+    }
+    if (handle != NULL) {
+        *handle = thread;
+    }
+    return pdPASS;
+}
+
+static inline BaseType_t xTaskCreate(TaskFunction_t func, const char *name, uint32_t stack_depth, void *arg,
+                                     UBaseType_t priority, TaskHandle_t *handle)
+{
+    return xTaskCreatePinnedToCore(func, name, stack_depth, arg, priority, handle, tskNO_AFFINITY);
+}
+
+//Only a task deleting itself, as the jpeg workers do
+static inline void vTaskDelete(TaskHandle_t task)
+{
+    (void)task;
+    pthread_exit(NULL);
+}
+
+static inline UBaseType_t uxTaskPriorityGet(TaskHandle_t task)
+{
+    (void)task;
+    return 5;
+}
+
+static inline BaseType_t xPortGetCoreID(void)
+{
+    return 0;
+}
+
+static inline void taskYIELD(void)
+{
+    sched_yield();
+}
@@ -0,0 +1,110 @@
+// jpeg_encode_ctx_begin() / _push_rows() / _end(): a frame pushed in bands of
+// 1, 5, 9, 13 and 17 rows (never lined up with the MCU rows), of whole MCU
+// rows and all at once gives the bytes of the one-shot encode, into a buffer
+// and into a callback; a frame that is not complete gives 0.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} test_sink_t;
+
+static bool test_cb(void *arg, const uint8_t *data, size_t len)
+{
+    test_sink_t *s = (test_sink_t *)arg;
+
+    memcpy(&s->data[s->size], data, len);
+    s->size += len;
+    return true;
+}
+
+//Pushes the h rows of img in bands of n, the last one shorter
+static void test_push(jpeg_encode_ctx_t *ctx, uint8_t *img, int bpp, int w, int h, int n)
+{
+    for (int y = 0; y < h; y += n) {
+        CHECK(jpeg_encode_ctx_push_rows(ctx, &img[y * w * bpp], y + n > h ? h - y : n) == ESP_OK);
+    }
+}
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int bpp, int w, int h)
+{
+    static const int band[] = {1, 5, 9, 13, 17, 8, 16, TEST_H};
+    uint8_t *jpeg = malloc(TEST_MAX), *banded = malloc(TEST_MAX);
+    test_sink_t sink = {.data = banded};
+
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    for (size_t i = 0; i < sizeof(band) / sizeof(band[0]); i++) {
+        memset(banded, 0, size);
+        CHECK(jpeg_encode_ctx_begin(ctx, mode, w, h, banded, TEST_MAX) == ESP_OK);
+        test_push(ctx, img, bpp, w, h, band[i]);
+        CHECK(jpeg_encode_ctx_end(ctx) == size);
+        CHECK(!memcmp(banded, jpeg, size));
+    }
+    memset(banded, 0, size);
+    CHECK(jpeg_encode_ctx_begin_cb(ctx, mode, w, h, test_cb, &sink) == ESP_OK);
+    test_push(ctx, img, bpp, w, h, 7);
+    CHECK(jpeg_encode_ctx_end(ctx) == size);
+    CHECK(sink.size == size && !memcmp(banded, jpeg, size));
+
+    //Rows past h are ignored; a frame short of a row of its last MCU row, or
+    //not fitting, gives 0
+    CHECK(jpeg_encode_ctx_begin(ctx, mode, w, h, banded, TEST_MAX) == ESP_OK);
+    test_push(ctx, img, bpp, w, h - 3, 11);
+    CHECK(jpeg_encode_ctx_push_rows(ctx, &img[(h - 3) * w * bpp], 3) == ESP_OK);
+    CHECK(jpeg_encode_ctx_push_rows(ctx, img, 5) == ESP_OK);
+    CHECK(jpeg_encode_ctx_end(ctx) == size && !memcmp(banded, jpeg, size));
+    CHECK(jpeg_encode_ctx_begin(ctx, mode, w, h, banded, TEST_MAX) == ESP_OK);
+    test_push(ctx, img, bpp, w, h / 16 * 16 - 1, 9);
+    CHECK(jpeg_encode_ctx_end(ctx) == 0);
+    CHECK(jpeg_encode_ctx_begin(ctx, mode, w, h, banded, size - 1) == ESP_OK);
+    test_push(ctx, img, bpp, w, h, 9);
+    CHECK(jpeg_encode_ctx_end(ctx) == 0);
+    CHECK(jpeg_encode_ctx_push_rows(ctx, img, 1) == ESP_ERR_INVALID_STATE);
+    printf("mode %d, %dx%d: %zu bytes, same in every band size\n", mode, w, h, size);
+    free(jpeg);
+    free(banded);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 13);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, 2, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, 2, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, 3, TEST_W, TEST_H);
+        //Partial MCUs at the right and bottom
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, 2, 200, 101);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, 1, TEST_W, TEST_H);
+    test_mode(ctx, ENCODE_YUV_GRAY_MODE, yuyv, 2, TEST_W, TEST_H);
+    //With stripes and the pipeline set, band input stays sequential
+    jpeg_encode_ctx_set_stripes(ctx, 3);
+    test_mode(ctx, ENCODE_YUV_MODE, yuyv, 2, TEST_W, TEST_H);
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    jpeg_encode_ctx_set_pipeline(ctx, true);
+    test_mode(ctx, ENCODE_RGB16_MODE, rgb565, 2, TEST_W, TEST_H);
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_band");
+}
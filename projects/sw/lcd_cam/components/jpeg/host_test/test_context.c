@@ -0,0 +1,97 @@
+// jpeg_encode_ctx_t: encoders on two threads at once, each with its own
+// frame, mode, quality and subsampling, write the same bytes as the same
+// encodes one after the other; settings stay with their context, and
+// jpeg_encode() matches a fresh context.
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+#define TEST_ROUNDS 25
+
+typedef struct {
+    jpeg_encode_ctx_t *ctx;
+    jpeg_encode_mode_t mode;
+    uint8_t *img;
+    uint8_t *jpeg;
+    size_t size;                //Of the sequential encode
+    int mismatches;
+} test_thread_t;
+
+static void *test_thread(void *arg)
+{
+    test_thread_t *t = (test_thread_t *)arg;
+    uint8_t *jpeg = malloc(TEST_MAX);
+
+    for (int i = 0; i < TEST_ROUNDS; i++) {
+        size_t size = jpeg_encode_ctx(t->ctx, t->mode, t->img, TEST_W, TEST_H, jpeg, TEST_MAX);
+        if (size != t->size || memcmp(jpeg, t->jpeg, size)) {
+            t->mismatches++;
+        }
+    }
+    free(jpeg);
+    return NULL;
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3), *other = malloc(TEST_W * TEST_H * 3);
+    uint8_t *jpeg = malloc(TEST_MAX);
+    test_thread_t t[2] = {{0}};
+    pthread_t thread[2];
+
+    host_test_frame(rgb, TEST_W, TEST_H, 1);
+    host_test_frame(other, TEST_W, TEST_H, 2);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(other, TEST_W, TEST_H);
+
+    t[0].mode = ENCODE_RGB16_MODE;
+    t[0].img = rgb565;
+    t[1].mode = ENCODE_YUV_MODE;
+    t[1].img = yuyv;
+    for (int i = 0; i < 2; i++) {
+        t[i].ctx = jpeg_encode_ctx_create();
+        CHECK(t[i].ctx != NULL);
+        t[i].jpeg = malloc(TEST_MAX);
+    }
+    jpeg_encode_ctx_set_quality(t[0].ctx, 85);
+    jpeg_encode_ctx_set_quality(t[1].ctx, 40);
+    jpeg_encode_ctx_set_subsampling(t[1].ctx, JPEG_SUBSAMPLING_420);
+
+    //jpeg_encode() is a context with the defaults, untouched by the others
+    size_t size = jpeg_encode(ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, jpeg, TEST_MAX);
+    jpeg_encode_ctx_t *fresh = jpeg_encode_ctx_create();
+    t[0].size = jpeg_encode_ctx(fresh, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, t[0].jpeg, TEST_MAX);
+    CHECK(size > 0 && size == t[0].size && !memcmp(jpeg, t[0].jpeg, size));
+    jpeg_encode_ctx_delete(fresh);
+
+    for (int i = 0; i < 2; i++) {
+        t[i].size = jpeg_encode_ctx(t[i].ctx, t[i].mode, t[i].img, TEST_W, TEST_H, t[i].jpeg, TEST_MAX);
+        CHECK(t[i].size > 0);
+    }
+    CHECK(t[0].size != size);
+    for (int i = 0; i < 2; i++) {
+        CHECK(pthread_create(&thread[i], NULL, test_thread, &t[i]) == 0);
+    }
+    for (int i = 0; i < 2; i++) {
+        pthread_join(thread[i], NULL);
+        printf("thread %d: %d x %zu bytes, %d mismatches\n", i, TEST_ROUNDS, t[i].size, t[i].mismatches);
+        CHECK(t[i].mismatches == 0);
+    }
+    CHECK(jpeg_encode(ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, jpeg, TEST_MAX) == size);
+
+    for (int i = 0; i < 2; i++) {
+        jpeg_encode_ctx_delete(t[i].ctx);
+        free(t[i].jpeg);
+    }
+    free(rgb);
+    free(other);
+    free(rgb565);
+    free(yuyv);
+    free(jpeg);
+    return host_test_result("test_context");
+}
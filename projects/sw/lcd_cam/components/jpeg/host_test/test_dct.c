@@ -0,0 +1,88 @@
+// dct_quantize() against a floating point DCT divided by the quantizer and
+// rounded: with quantizers of 16 and more off by at most one level in 2% of
+// the coefficients, with all 1 (quality 100) by at most 3, the rounding of
+// the integer AAN transform. The two-step dct_aan() + dct_requantize() and
+// dct_quantize_flat() give its levels exactly.
+#include <stdlib.h>
+#include <math.h>
+#include "dct.h"
+#include "host_test.h"
+
+#define TEST_BLOCKS 4000
+
+//Natural order index of each zig-zag position
+static const unsigned char test_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+//Coefficient u (row), v (column) of the JPEG FDCT
+static double test_fdct(int16_t pixels[8][8], int u, int v)
+{
+    double sum = 0;
+
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 8; x++) {
+            sum += pixels[y][x] * cos((2 * x + 1) * v * M_PI / 16) * cos((2 * y + 1) * u * M_PI / 16);
+        }
+    }
+    return sum * (u ? 1 : M_SQRT1_2) * (v ? 1 : M_SQRT1_2) / 4;
+}
+
+int main(void)
+{
+    //Largest difference and percentage of coefficients off for each table
+    static const int limit[4][2] = {{3, 20}, {1, 2}, {1, 2}, {1, 2}};
+    unsigned char qtable[4][64];
+    int32_t fdtbl[64], coef[64];
+    int16_t pixels[8][8], data[64], requant[64];
+    uint8_t noise[64];
+
+    for (int i = 0; i < 64; i++) {
+        qtable[0][i] = 1;
+        qtable[1][i] = 16;
+        qtable[2][i] = 2 + (i / 8 + i % 8) * 8;
+        qtable[3][i] = 255;
+    }
+    for (int t = 0; t < 4; t++) {
+        long off = 0, total = 0;
+        int worst = 0;
+        dct_fdtbl(qtable[t], fdtbl);
+        for (int b = 0; b < TEST_BLOCKS; b++) {
+            //Noise, noise of a smaller range, and the extremes
+            host_test_noise(noise, sizeof(noise), t * TEST_BLOCKS + b);
+            for (int i = 0; i < 64; i++) {
+                int p = b % 3 == 0 ? noise[i] - 128 : b % 3 == 1 ? noise[i] / 8 + 40 : (noise[i] & 1) ? 127 : -128;
+                pixels[i / 8][i % 8] = p;
+            }
+            dct_quantize(pixels, fdtbl, data);
+            dct_aan(pixels, coef);
+            dct_requantize(coef, fdtbl, requant);
+            for (int k = 0; k < 64; k++) {
+                int n = test_natural[k];
+                int ref = (int)lround(test_fdct(pixels, n / 8, n % 8) / qtable[t][n]);
+                int d = abs(data[k] - ref);
+                worst = d > worst ? d : worst;
+                off += d != 0;
+                CHECK(requant[k] == data[k]);
+            }
+            total += 64;
+        }
+        printf("table %d: %.3f%% off, largest difference %d\n", t, 100.0 * off / total, worst);
+        CHECK(worst <= limit[t][0] && off * 100 < total * limit[t][1]);
+        //Flat blocks
+        for (int p = -128; p < 128; p++) {
+            for (int i = 0; i < 64; i++) {
+                pixels[i / 8][i % 8] = p;
+            }
+            dct_quantize(pixels, fdtbl, data);
+            CHECK(dct_quantize_flat(p, fdtbl) == data[0]);
+            for (int k = 1; k < 64; k++) {
+                CHECK(data[k] == 0);
+            }
+        }
+    }
+    return host_test_result("test_dct");
+}
@@ -0,0 +1,80 @@
+// The entropy coder: streams from noise at quality 100 (the longest codes
+// and the most 0xFF bytes to stuff) down to quality 1 are read back by the
+// tjpgd Huffman decoder and coded again to the same bytes, and a buffer
+// exactly as large as the JPEG takes it while one byte less fails without
+// writing past its end.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+#define TEST_GUARD 64
+
+static void test_stream(jpeg_encode_ctx_t *ctx, const char *name, jpeg_encode_mode_t mode, uint8_t *img, int quality)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *again = malloc(TEST_MAX);
+
+    jpeg_encode_ctx_set_quality(ctx, quality);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, jpeg, TEST_MAX);
+    CHECK(size > 0 && jpeg[size - 2] == 0xFF && jpeg[size - 1] == 0xD9);
+
+    //Every 0xFF in the scan is stuffed or a restart marker
+    size_t sos = 2, stuffed = 0;
+    while (sos < size && jpeg[sos + 1] != 0xDA) {
+        sos += 2 + (jpeg[sos + 2] << 8 | jpeg[sos + 3]);
+    }
+    for (size_t i = sos + 2 + (jpeg[sos + 2] << 8 | jpeg[sos + 3]); i < size - 2; i++) {
+        if (jpeg[i] == 0xFF) {
+            CHECK(jpeg[i + 1] == 0x00 || (jpeg[i + 1] >= 0xD0 && jpeg[i + 1] <= 0xD7));
+            stuffed += jpeg[i + 1] == 0x00;
+        }
+    }
+
+    size_t n = jpeg_encode_ctx_transform(ctx, jpeg, size, JPEG_TRANSFORM_NONE, again, TEST_MAX);
+    printf("%s, quality %d: %zu bytes, %zu stuffed, decoded and coded again %zu\n", name, quality, size, stuffed, n);
+    CHECK(n == size && !memcmp(again, jpeg, size));
+
+    //The exact size fits, one byte less does not, nothing behind either
+    memset(again, 0xA5, size + TEST_GUARD);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, again, size) == size);
+    CHECK(!memcmp(again, jpeg, size));
+    memset(again, 0xA5, size + TEST_GUARD);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, again, size - 1) == 0);
+    for (size_t i = size - 1; i < size + TEST_GUARD; i++) {
+        CHECK(again[i] == 0xA5);
+    }
+    free(jpeg);
+    free(again);
+}
+
+int main(void)
+{
+    static const int quality[] = {JPEG_QUALITY_MAX, 90, 50, 1, JPEG_QUALITY_DEFAULT};
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 4);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *noise = malloc(TEST_W * TEST_H * 2);
+    host_test_noise(noise, TEST_W * TEST_H * 2, 4);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        for (size_t i = 0; i < sizeof(quality) / sizeof(quality[0]); i++) {
+            test_stream(ctx, "noise", ENCODE_RGB16_MODE, noise, quality[i]);
+            test_stream(ctx, "camera", ENCODE_YUV_MODE, yuyv, quality[i]);
+            test_stream(ctx, "camera", ENCODE_RGB16_MODE, rgb565, quality[i]);
+        }
+    }
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(noise);
+    return host_test_result("test_entropy");
+}
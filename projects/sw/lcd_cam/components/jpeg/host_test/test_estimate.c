@@ -0,0 +1,71 @@
+// jpeg_encode_ctx_estimate() with every MCU row sampled against the real
+// size, from every 4th row within 1/8 of it, and jpeg_encode_ctx_budget()
+// filling but never overflowing its buffer, leaving its quality set.
+#include <stdlib.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 640
+#define TEST_H 480
+#define TEST_MAX (1 << 20)
+
+static void test_estimate(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, uint8_t *out)
+{
+    static const int quality[] = {10, 50, 75, 95, JPEG_QUALITY_MAX, JPEG_QUALITY_DEFAULT};
+
+    for (size_t i = 0; i < sizeof(quality) / sizeof(quality[0]); i++) {
+        jpeg_encode_ctx_set_quality(ctx, quality[i]);
+        size_t size = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, out, TEST_MAX);
+        size_t exact = jpeg_encode_ctx_estimate(ctx, mode, img, TEST_W, TEST_H, 1);
+        size_t est = jpeg_encode_ctx_estimate(ctx, mode, img, TEST_W, TEST_H, 4);
+        printf("mode %d, quality %d: %zu bytes, step 1 %zu, step 4 %zu\n", mode, quality[i], size, exact, est);
+        CHECK(size > 0 && exact == size);
+        CHECK(est > size * 7 / 8 && est < size * 9 / 8);
+    }
+}
+
+static void test_budget(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, uint8_t *out)
+{
+    static const size_t budget[] = {12000, 24000, 48000, 96000, 192000};
+
+    //Budgets above the size at quality 100 get quality 100
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_MAX);
+    size_t best = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, out, TEST_MAX);
+    jpeg_encode_ctx_set_quality(ctx, 75);
+    for (size_t i = 0; i < sizeof(budget) / sizeof(budget[0]); i++) {
+        size_t size = jpeg_encode_ctx_budget(ctx, mode, img, TEST_W, TEST_H, out, budget[i]);
+        printf("mode %d, budget %zu: %zu bytes\n", mode, budget[i], size);
+        CHECK(best < budget[i] ? size == best : size > budget[i] * 3 / 4 && size <= budget[i]);
+        //The quality it chose stays set
+        CHECK(jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, out, TEST_MAX) == size);
+    }
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    uint8_t *out = malloc(TEST_MAX);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 5);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_estimate(ctx, ENCODE_RGB16_MODE, rgb565, out);
+        test_estimate(ctx, ENCODE_YUV_MODE, yuyv, out);
+        test_budget(ctx, ENCODE_RGB16_MODE, rgb565, out);
+    }
+    test_estimate(ctx, ENCODE_GRAY_MODE, gray, out);
+    test_budget(ctx, ENCODE_GRAY_MODE, gray, out);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    free(out);
+    return host_test_result("test_estimate");
+}
@@ -0,0 +1,179 @@
+// The flat block and early end of block paths: a screen-like frame of flat
+// blocks, blocks flat but for their first, second or last pixel, and noise
+// blocks decodes to flat colours where the source is flat and keeps the odd
+// pixel where it is not; its DC-only blocks code to the same bytes as the
+// full AC loop of the transcoder, through the multi-quality chain, the
+// optimized tables (block_cb) and the thumbnail as well, in every mode.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//Kinds of the 8x8 blocks of the test frame, by block index
+enum {
+    TEST_FLAT = 0,
+    TEST_FIRST,                 //Flat but for pixel (0, 0)
+    TEST_SECOND,                //Flat but for pixel (1, 0)
+    TEST_LAST,                  //Flat but for pixel (7, 7)
+    TEST_NOISE,
+    TEST_FLAT_DARK,             //Flat black, a DC of the most negative level
+    TEST_KINDS
+};
+
+static int test_kind(int x, int y)
+{
+    return (x / 8 + 4 * (y / 8)) % TEST_KINDS;
+}
+
+//RGB24 test frame: noise blocks, the others of one colour per 16x16 area
+//(black for TEST_FLAT_DARK) with the odd pixels brighter by 80
+static void test_frame(uint8_t *rgb)
+{
+    uint8_t *noise = malloc(TEST_W * TEST_H * 3);
+
+    host_test_noise(noise, TEST_W * TEST_H * 3, 20);
+    for (int y = 0; y < TEST_H; y++) {
+        for (int x = 0; x < TEST_W; x++) {
+            uint8_t *p = &rgb[3 * (y * TEST_W + x)];
+            const uint8_t *area = &noise[3 * ((y & -16) * TEST_W + (x & -16))];
+            int kind = test_kind(x, y);
+            for (int i = 0; i < 3; i++) {
+                p[i] = kind == TEST_NOISE ? noise[3 * (y * TEST_W + x) + i] : kind == TEST_FLAT_DARK ? 0 : 40 + area[i] % 120;
+            }
+            if ((kind == TEST_FIRST && x % 8 == 0 && y % 8 == 0) || (kind == TEST_SECOND && x % 8 == 1 && y % 8 == 0) ||
+                (kind == TEST_LAST && x % 8 == 7 && y % 8 == 7)) {
+                for (int i = 0; i < 3; i++) {
+                    p[i] += 80;
+                }
+            }
+        }
+    }
+    free(noise);
+}
+
+//Green (6 bits) of a decoded big-endian RGB565 pixel
+static int test_green(const uint8_t *pixels, int x, int y)
+{
+    return (pixels[2 * (y * TEST_W + x)] << 8 | pixels[2 * (y * TEST_W + x) + 1]) >> 5 & 0x3F;
+}
+
+//At q100, flat blocks decode flat, the odd pixel stands out from the pixel
+//next to it by most of its 80 (20 in 6 bits)
+static void test_decoded(const uint8_t *jpeg, const uint8_t *rgb)
+{
+    int w, h, flat = 0, odd = 0;
+    uint8_t *pixels = jpeg_decode((uint8_t *)jpeg, &w, &h);
+
+    CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+    if (pixels == NULL) {
+        return;
+    }
+    for (int y = 0; y < TEST_H; y += 8) {
+        for (int x = 0; x < TEST_W; x += 8) {
+            int kind = test_kind(x, y);
+            if (kind == TEST_FLAT || kind == TEST_FLAT_DARK) {
+                int g = test_green(pixels, x, y), spread = 0;
+                for (int i = 0; i < 64; i++) {
+                    int d = abs(test_green(pixels, x + i % 8, y + i / 8) - g);
+                    spread = d > spread ? d : spread;
+                }
+                //Chroma of a 4:2:0 area may come from a neighbouring block
+                CHECK(spread <= 1);
+                CHECK(abs(g - (rgb[3 * (y * TEST_W + x) + 1] >> 2)) <= 2);
+                flat++;
+            } else if (kind == TEST_FIRST) {
+                CHECK(test_green(pixels, x, y) - test_green(pixels, x + 1, y) > 12);
+                odd++;
+            } else if (kind == TEST_SECOND) {
+                CHECK(test_green(pixels, x + 1, y) - test_green(pixels, x + 2, y) > 12);
+                odd++;
+            } else if (kind == TEST_LAST) {
+                CHECK(test_green(pixels, x + 7, y + 7) - test_green(pixels, x + 6, y + 7) > 12);
+                odd++;
+            }
+        }
+    }
+    printf("%d flat blocks decode flat, %d odd pixels kept\n", flat, odd);
+    free(pixels);
+}
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, const uint8_t *rgb)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *out = malloc(TEST_MAX), *other = malloc(TEST_MAX);
+    bool gray = mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE;
+
+    jpeg_encode_ctx_set_quality(ctx, 100);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    printf("mode %d: %zu bytes, ", mode, size);
+    if (!gray) {
+        test_decoded(jpeg, rgb);
+    } else {
+        printf("\n");
+    }
+
+    for (int q = 0; q < 2; q++) {
+        jpeg_encode_ctx_set_quality(ctx, q ? 30 : 100);
+        size = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, jpeg, TEST_MAX);
+        //The full AC loop of the transcoder codes the same blocks alike
+        if (!gray) {
+            CHECK(jpeg_encode_ctx_transform(ctx, jpeg, size, JPEG_TRANSFORM_NONE, out, TEST_MAX) == size);
+            CHECK(!memcmp(out, jpeg, size));
+        }
+        //A chained output writes the same as alone
+        jpeg_encode_output_t multi[2] = {
+            {.quality = 50, .jpeg = other, .max_size = TEST_MAX},
+            {.quality = q ? 30 : 100, .jpeg = out, .max_size = TEST_MAX},
+        };
+        CHECK(jpeg_encode_ctx_multi(ctx, mode, img, TEST_W, TEST_H, multi, 2) == ESP_OK);
+        CHECK(multi[1].size == size && !memcmp(out, jpeg, size));
+        //Optimized tables (blocks through block_cb) code the same coefficients
+        jpeg_encode_ctx_set_optimize(ctx, true);
+        size_t n = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, other, TEST_MAX);
+        jpeg_encode_ctx_set_optimize(ctx, false);
+        CHECK(n > 0 && n < size);
+        if (!gray) {
+            CHECK(jpeg_encode_ctx_transform(ctx, other, n, JPEG_TRANSFORM_NONE, out, TEST_MAX) == size);
+            CHECK(!memcmp(out, jpeg, size));
+        }
+        //The thumbnail does not change the output
+        jpeg_encode_ctx_set_thumbnail(ctx, true);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, out, TEST_MAX) == size && !memcmp(out, jpeg, size));
+        jpeg_encode_ctx_set_thumbnail(ctx, false);
+    }
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_DEFAULT);
+    free(jpeg);
+    free(out);
+    free(other);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    test_frame(rgb);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, rgb);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, rgb);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, rgb);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, rgb);
+    test_mode(ctx, ENCODE_YUV_GRAY_MODE, yuyv, rgb);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_flat");
+}
@@ -0,0 +1,103 @@
+// ENCODE_GRAY_MODE and ENCODE_YUV_GRAY_MODE: one-component headers (SOF,
+// one DQT table, the two luminance Huffman tables, SOS), the Y of a YUYV frame
+// coded like the same plane given as 8-bit gray, 8x8 MCUs in any
+// subsampling, and fewer bytes than the colour frame.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//Checks the segments of a grayscale JPEG of w x h, returns the SOS offset
+static size_t test_headers(const uint8_t *jpeg, size_t size, int w, int h)
+{
+    size_t i = 2;
+    int dht = 0;
+
+    CHECK(jpeg[0] == 0xFF && jpeg[1] == 0xD8);
+    while (i + 4 < size && jpeg[i] == 0xFF && jpeg[i + 1] != 0xDA) {
+        const uint8_t *s = &jpeg[i + 4];
+        int len = jpeg[i + 2] << 8 | jpeg[i + 3];
+        switch (jpeg[i + 1]) {
+        case 0xDB:
+            CHECK(len == 2 + 65 && s[0] == 0);
+            break;
+        case 0xC0:
+            CHECK(len == 2 + 6 + 3 && s[5] == 1);
+            CHECK((s[1] << 8 | s[2]) == h && (s[3] << 8 | s[4]) == w);
+            CHECK(s[6] == 1 && s[7] == 0x11 && s[8] == 0);
+            break;
+        case 0xC4:
+            //Tables of one segment: class and destination, 16 counts, values
+            for (int k = 0; k < len - 2; dht++) {
+                int n = 0;
+                for (int b = 1; b <= 16; b++) {
+                    n += s[k + b];
+                }
+                CHECK(s[k] == (dht ? 0x10 : 0x00));
+                k += 17 + n;
+            }
+            break;
+        }
+        i += 2 + len;
+    }
+    CHECK(dht == 2);
+    CHECK(i + 4 < size && jpeg[i + 1] == 0xDA && jpeg[i + 4] == 1 && jpeg[i + 5] == 1 && jpeg[i + 6] == 0x00);
+    CHECK(jpeg[size - 2] == 0xFF && jpeg[size - 1] == 0xD9);
+    return i;
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    uint8_t *jpeg = malloc(TEST_MAX), *from_yuyv = malloc(TEST_MAX), *colour = malloc(TEST_MAX);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 7);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = malloc(TEST_W * TEST_H);
+    for (int i = 0; i < TEST_W * TEST_H; i++) {
+        gray[i] = yuyv[2 * i];
+    }
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        for (int q = 0; q <= JPEG_QUALITY_MAX; q += 25) {
+            jpeg_encode_ctx_set_quality(ctx, q);
+            size_t size = jpeg_encode_ctx(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H, jpeg, TEST_MAX);
+            size_t n = jpeg_encode_ctx(ctx, ENCODE_YUV_GRAY_MODE, yuyv, TEST_W, TEST_H, from_yuyv, TEST_MAX);
+            size_t c = jpeg_encode_ctx(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H, colour, TEST_MAX);
+            printf("subsampling %d, quality %d: gray %zu bytes, colour %zu\n", s, q, size, c);
+            test_headers(jpeg, size, TEST_W, TEST_H);
+            CHECK(n == size && !memcmp(jpeg, from_yuyv, size));
+            CHECK(size < c);
+        }
+        //Whole 8x8 MCUs, whatever the subsampling
+        size_t size = jpeg_encode_ctx(ctx, ENCODE_GRAY_MODE, gray, 44, 21, jpeg, TEST_MAX);
+        CHECK(size > 0);
+        test_headers(jpeg, size, 40, 16);
+        size = jpeg_encode_ctx(ctx, ENCODE_YUV_GRAY_MODE, yuyv, 8, 8, jpeg, TEST_MAX);
+        CHECK(size > 0);
+        test_headers(jpeg, size, 8, 8);
+    }
+
+    //A flat frame: every block only has its DC, the DC differences are 0
+    memset(gray, 100, TEST_W * TEST_H);
+    jpeg_encode_ctx_set_quality(ctx, 50);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H, jpeg, TEST_MAX);
+    size_t sos = test_headers(jpeg, size, TEST_W, TEST_H);
+    printf("flat: %zu bytes, %zu of them headers\n", size, sos);
+    CHECK(size - sos < TEST_W * TEST_H / 64);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(yuyv);
+    free(gray);
+    free(jpeg);
+    free(from_yuyv);
+    free(colour);
+    return host_test_result("test_gray");
+}
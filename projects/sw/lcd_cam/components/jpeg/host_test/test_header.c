@@ -0,0 +1,113 @@
+// The header template of huffman_start(): one context going through changes
+// of quality, subsampling, size, component count, optimized tables, the
+// index segment and transcodes in between writes the bytes of a fresh
+// context with the same settings for every frame, also after a frame whose
+// headers did not fit.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    int quality;
+    jpeg_subsampling_t subsampling;
+    jpeg_encode_mode_t mode;
+    int w, h;
+    bool optimize;
+    bool index;                 //With the APP9 segment
+} test_settings_t;
+
+static const test_settings_t test_steps[] = {
+    {JPEG_QUALITY_DEFAULT, JPEG_SUBSAMPLING_422, ENCODE_RGB16_MODE, TEST_W, TEST_H, false, false},
+    {JPEG_QUALITY_DEFAULT, JPEG_SUBSAMPLING_422, ENCODE_RGB16_MODE, TEST_W, TEST_H, false, false},
+    {80, JPEG_SUBSAMPLING_422, ENCODE_RGB16_MODE, TEST_W, TEST_H, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_RGB16_MODE, TEST_W, TEST_H, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_RGB16_MODE, 160, TEST_H, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_RGB16_MODE, 160, 96, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_GRAY_MODE, 160, 96, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 160, 96, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 160, 96, true, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 160, 96, false, false},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 160, 96, false, true},
+    {80, JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 160, 96, false, false},
+    {80, JPEG_SUBSAMPLING_422, ENCODE_YUV_GRAY_MODE, TEST_W, TEST_H, true, true},
+    {30, JPEG_SUBSAMPLING_422, ENCODE_RGB16_MODE, TEST_W, TEST_H, false, false},
+};
+
+static void test_apply(jpeg_encode_ctx_t *ctx, const test_settings_t *s, uint32_t *offsets)
+{
+    jpeg_encode_ctx_set_quality(ctx, s->quality);
+    jpeg_encode_ctx_set_subsampling(ctx, s->subsampling);
+    jpeg_encode_ctx_set_optimize(ctx, s->optimize);
+    jpeg_encode_ctx_set_index(ctx, s->index ? offsets : NULL, TEST_H / 8 + 1, true);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    uint8_t *jpeg = malloc(TEST_MAX), *ref = malloc(TEST_MAX), *other = malloc(TEST_MAX);
+    uint32_t offsets[TEST_H / 8 + 1], ref_offsets[TEST_H / 8 + 1];
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    int n = sizeof(test_steps) / sizeof(test_steps[0]);
+
+    host_test_frame(rgb, TEST_W, TEST_H, 16);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+
+    //A JPEG of other settings for the transcodes between the steps
+    size_t other_size = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, other, TEST_MAX);
+
+    for (int round = 0; round < 2; round++) {
+        for (int i = 0; i < n; i++) {
+            const test_settings_t *s = &test_steps[i];
+            uint8_t *img = s->mode == ENCODE_RGB16_MODE ? rgb565 : yuyv;
+            jpeg_encode_ctx_t *fresh = jpeg_encode_ctx_create();
+
+            test_apply(fresh, s, ref_offsets);
+            size_t size = jpeg_encode_ctx(fresh, s->mode, img, s->w, s->h, ref, TEST_MAX);
+            jpeg_encode_ctx_delete(fresh);
+            CHECK(size > 0);
+
+            test_apply(ctx, s, offsets);
+            //Headers that do not fit, then the whole frame
+            if (i % 5 == 4) {
+                CHECK(jpeg_encode_ctx(ctx, s->mode, img, s->w, s->h, jpeg, 100) == 0);
+            }
+            CHECK(jpeg_encode_ctx(ctx, s->mode, img, s->w, s->h, jpeg, TEST_MAX) == size);
+            CHECK(!memcmp(jpeg, ref, size));
+            //The second round transcodes in between: the other JPEG, then
+            //this frame, whose headers must be those of a fresh context even
+            //where the two only differ in their tables
+            if (round == 1) {
+                int quality = s->quality;
+                jpeg_encode_ctx_set_index(ctx, NULL, 0, false);
+                jpeg_encode_ctx_set_optimize(ctx, false);
+                CHECK(jpeg_encode_ctx_transform(ctx, other, other_size, i & 1 ? JPEG_TRANSFORM_ROT_90 : JPEG_TRANSFORM_FLIP_V, jpeg, TEST_MAX) > 0);
+                if (s->mode != ENCODE_YUV_GRAY_MODE && !s->index) {
+                    fresh = jpeg_encode_ctx_create();
+                    size_t t = jpeg_encode_ctx_transform(fresh, ref, size, JPEG_TRANSFORM_FLIP_H, other + other_size, TEST_MAX - other_size);
+                    jpeg_encode_ctx_delete(fresh);
+                    CHECK(t > 0 && jpeg_encode_ctx_transform(ctx, ref, size, JPEG_TRANSFORM_FLIP_H, jpeg, TEST_MAX) == t);
+                    CHECK(!memcmp(jpeg, other + other_size, t));
+                }
+                jpeg_encode_ctx_set_quality(ctx, 10);
+                CHECK(jpeg_encode_ctx_requantize(ctx, other, other_size, 64, jpeg, TEST_MAX) > 0);
+                jpeg_encode_ctx_set_quality(ctx, quality);
+            }
+        }
+    }
+    printf("%d frames, each the same as from a fresh context\n", 2 * n);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(jpeg);
+    free(ref);
+    free(other);
+    return host_test_result("test_header");
+}
@@ -0,0 +1,214 @@
+// jpeg_encode_ctx_set_index(): offsets[0] is the end of the headers, every
+// other offset follows a restart marker, numbered in order, and the last is
+// the EOI; the scan has no other restart markers. The headers and the scan
+// from any row on (markers renumbered) decode to the bottom of the frame.
+// The APP9 segment holds the same offsets, the image is otherwise the same
+// as without the index; an index too small for the rows records no segment,
+// callback output has none, and the offsets follow the image into
+// jpeg_encode_ctx_thumbnail_exif().
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+#define TEST_ROWS (TEST_H / 8 + 1)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+} test_sink_t;
+
+static bool test_cb(void *arg, const uint8_t *data, size_t len)
+{
+    test_sink_t *s = (test_sink_t *)arg;
+
+    memcpy(&s->data[s->size], data, len);
+    s->size += len;
+    return true;
+}
+
+//Position of the first marker segment of type marker, 0 if there is none
+static size_t test_segment(const uint8_t *jpeg, size_t size, uint8_t marker)
+{
+    for (size_t i = 2; i + 4 <= size && jpeg[i] == 0xFF; i += 2 + (jpeg[i + 2] << 8 | jpeg[i + 3])) {
+        if (jpeg[i + 1] == marker) {
+            return i;
+        }
+        if (jpeg[i + 1] == 0xDA) {
+            break;
+        }
+    }
+    return 0;
+}
+
+//The offsets against the markers of jpeg[size] with rows MCU rows
+static void test_offsets(const uint8_t *jpeg, size_t size, const uint32_t *offsets, int rows)
+{
+    size_t sos = test_segment(jpeg, size, 0xDA);
+    int markers = 0;
+
+    CHECK(sos > 0 && offsets[0] == sos + 2 + (jpeg[sos + 2] << 8 | jpeg[sos + 3]));
+    for (int i = 1; i <= rows; i++) {
+        CHECK(offsets[i] > offsets[i - 1] && offsets[i] <= size - 2);
+        CHECK(jpeg[offsets[i] - 2] == 0xFF && jpeg[offsets[i] - 1] == (0xD0 | ((i - 1) & 7)));
+    }
+    CHECK(offsets[rows] == size - 2 && jpeg[size - 2] == 0xFF && jpeg[size - 1] == 0xD9);
+    for (size_t i = offsets[0]; i + 1 < size; i++) {
+        markers += jpeg[i] == 0xFF && (jpeg[i + 1] & 0xF8) == 0xD0;
+    }
+    CHECK(markers == rows);
+}
+
+//The headers and the scan from row on, as a JPEG of the rows left; decodes
+//to the bottom rows of the whole frame pixels
+static void test_partial(const uint8_t *jpeg, size_t size, const uint32_t *offsets, int rows, int row, const uint8_t *pixels, int w, int h)
+{
+    //jpeg_decode() reads ahead of the image
+    uint8_t *part = malloc(TEST_MAX);
+    size_t sof = test_segment(jpeg, size, 0xC0);
+    int mcu_h = h / rows, pw, ph;
+
+    memcpy(part, jpeg, offsets[0]);
+    part[sof + 5] = (h - row * mcu_h) >> 8;
+    part[sof + 6] = (h - row * mcu_h) & 0xFF;
+    size_t n = offsets[0];
+    for (int i = row; i < rows; i++) {
+        size_t len = offsets[i + 1] - offsets[i];
+        memcpy(&part[n], &jpeg[offsets[i]], len);
+        n += len;
+        part[n - 1] = 0xD0 | ((i - row) & 7);
+    }
+    part[n++] = 0xFF;
+    part[n++] = 0xD9;
+
+    uint8_t *bottom = jpeg_decode(part, &pw, &ph);
+    CHECK(bottom != NULL && pw == w && ph == h - row * mcu_h);
+    CHECK(bottom != NULL && !memcmp(bottom, &pixels[2 * w * row * mcu_h], 2 * pw * ph));
+    free(bottom);
+    free(part);
+}
+
+static void test_frame(jpeg_encode_ctx_t *ctx, uint8_t *img, int w, int h)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *plain = malloc(TEST_MAX), *app = malloc(TEST_MAX);
+    uint32_t offsets[TEST_ROWS], app_offsets[TEST_ROWS];
+    int rows, dw, dh;
+
+    jpeg_encode_ctx_set_index(ctx, NULL, 0, false);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, plain, TEST_MAX);
+    CHECK(size > 0 && jpeg_encode_ctx_index(ctx) == 0);
+    uint8_t *pixels = jpeg_decode(plain, &dw, &dh);
+    CHECK(pixels != NULL);
+
+    //Without the segment: the same image, offsets into it
+    CHECK(jpeg_encode_ctx_set_index(ctx, offsets, TEST_ROWS, false) == ESP_OK);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, plain, size));
+    rows = jpeg_encode_ctx_index(ctx) - 1;
+    CHECK(rows == dh / 8 || rows == dh / 16);
+    test_offsets(jpeg, size, offsets, rows);
+    for (int row = 0; pixels != NULL && row < rows; row += row < 3 ? 1 : 5) {
+        test_partial(jpeg, size, offsets, rows, row, pixels, dw, dh);
+    }
+
+    //With the segment behind the JFIF header: the rest is the same image
+    CHECK(jpeg_encode_ctx_set_index(ctx, app_offsets, TEST_ROWS, true) == ESP_OK);
+    size_t n = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, app, TEST_MAX);
+    size_t seg = test_segment(app, n, 0xE9), len = seg ? (app[seg + 2] << 8 | app[seg + 3]) + 2 : 0;
+    CHECK(seg == test_segment(plain, size, 0xE0) + 18 && n == size + len);
+    CHECK(!memcmp(app, plain, seg) && !memcmp(&app[seg + len], &plain[seg], size - seg));
+    CHECK(len == 2 + 2 + 7 + 2 + 4 * (size_t)(rows + 1) && !memcmp(&app[seg + 4], "RSTIDX", 7));
+    CHECK((app[seg + 11] << 8 | app[seg + 12]) == rows + 1);
+    for (int i = 0; i <= rows; i++) {
+        const uint8_t *p = &app[seg + 13 + 4 * i];
+        CHECK(app_offsets[i] == offsets[i] + len);
+        CHECK((uint32_t)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) == app_offsets[i]);
+    }
+    test_offsets(app, n, app_offsets, rows);
+
+    //Exactly the size fits, a byte less does not
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, n) == n && !memcmp(jpeg, app, n));
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, n - 1) == 0);
+
+    //Too small for all rows: the offsets it has room for, no segment
+    memset(offsets, 0xA5, sizeof(offsets));
+    CHECK(jpeg_encode_ctx_set_index(ctx, offsets, rows, true) == ESP_OK);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, plain, size));
+    CHECK(jpeg_encode_ctx_index(ctx) == rows + 1 && offsets[rows] == 0xA5A5A5A5);
+    CHECK(offsets[rows - 1] == app_offsets[rows - 1] - len);
+
+    //Callback output: no segment, the same offsets
+    test_sink_t sink = {.data = jpeg};
+    CHECK(jpeg_encode_ctx_set_index(ctx, offsets, TEST_ROWS, true) == ESP_OK);
+    CHECK(jpeg_encode_ctx_cb(ctx, ENCODE_RGB16_MODE, img, w, h, test_cb, &sink) == size);
+    CHECK(sink.size == size && !memcmp(jpeg, plain, size));
+    test_offsets(jpeg, size, offsets, rows);
+
+    //Band input and the pipeline record the same
+    CHECK(jpeg_encode_ctx_begin(ctx, ENCODE_RGB16_MODE, w, h, jpeg, TEST_MAX) == ESP_OK);
+    for (int y = 0; y < h; y += 7) {
+        jpeg_encode_ctx_push_rows(ctx, &img[y * w * 2], y + 7 > h ? h - y : 7);
+    }
+    CHECK(jpeg_encode_ctx_end(ctx) == n && !memcmp(jpeg, app, n) && !memcmp(offsets, app_offsets, 4 * (rows + 1)));
+    jpeg_encode_ctx_set_pipeline(ctx, true);
+    memset(offsets, 0, sizeof(offsets));
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == n && !memcmp(jpeg, app, n));
+    CHECK(!memcmp(offsets, app_offsets, 4 * (rows + 1)));
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    //Stripes are not used while the index is on
+    jpeg_encode_ctx_set_stripes(ctx, 3);
+    memset(offsets, 0, sizeof(offsets));
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == n && !memcmp(jpeg, app, n));
+    CHECK(!memcmp(offsets, app_offsets, 4 * (rows + 1)));
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+
+    //The EXIF thumbnail moves the offsets and the segment with the image
+    jpeg_encode_ctx_set_thumbnail(ctx, true);
+    n = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX);
+    size_t exif = jpeg_encode_ctx_thumbnail_exif(ctx, jpeg, n, TEST_MAX);
+    jpeg_encode_ctx_set_thumbnail(ctx, false);
+    CHECK(exif > n);
+    test_offsets(jpeg, exif, offsets, rows);
+    seg = test_segment(jpeg, exif, 0xE9);
+    for (int i = 0; seg && i <= rows; i++) {
+        const uint8_t *p = &jpeg[seg + 13 + 4 * i];
+        CHECK(offsets[i] == app_offsets[i] + exif - n);
+        CHECK((uint32_t)(p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) == offsets[i]);
+    }
+    CHECK(seg > 0);
+
+    printf("%dx%d: %d rows, %zu bytes, APP9 %zu bytes\n", w, h, rows, size, len);
+    jpeg_encode_ctx_set_index(ctx, NULL, 0, false);
+    free(pixels);
+    free(jpeg);
+    free(plain);
+    free(app);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    uint32_t offsets[TEST_ROWS];
+
+    host_test_frame(rgb, TEST_W, TEST_H, 23);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_frame(ctx, rgb565, TEST_W, TEST_H);
+        //Partial MCUs at the right and bottom
+        test_frame(ctx, rgb565, 200, 101);
+    }
+
+    //Bad arguments, off again
+    CHECK(jpeg_encode_ctx_set_index(ctx, offsets, 0, false) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_set_index(ctx, NULL, 0, false) == ESP_OK && jpeg_encode_ctx_index(ctx) == 0);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    return host_test_result("test_index");
+}
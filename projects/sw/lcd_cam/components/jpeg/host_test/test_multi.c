@@ -0,0 +1,176 @@
+// jpeg_encode_ctx_multi(): every output, into a buffer or a callback, is the
+// same as a single encode at its quality, for 1 to JPEG_ENCODE_OUTPUTS_MAX
+// outputs, every input mode, both subsamplings and the trellis; an output
+// that does not fit or whose callback aborts gives 0 without stopping the
+// others, and the quality of the context is left as it was.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+static const int test_qualities[] = {90, JPEG_QUALITY_DEFAULT, 100, 20};
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int calls;
+    int abort_at;               //Call that returns false, 0: none
+} test_sink_t;
+
+static bool test_cb(void *arg, const uint8_t *data, size_t len)
+{
+    test_sink_t *s = (test_sink_t *)arg;
+
+    s->calls++;
+    memcpy(&s->data[s->size], data, len);
+    s->size += len;
+    return s->calls != s->abort_at;
+}
+
+//The single encodes at the qualities of the outputs, on a context of the
+//same subsampling and trellis
+static void test_single(jpeg_encode_ctx_t *single, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t **ref, size_t *size)
+{
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        jpeg_encode_ctx_set_quality(single, test_qualities[i]);
+        size[i] = jpeg_encode_ctx(single, mode, img, w, h, ref[i], TEST_MAX);
+        CHECK(size[i] > 0);
+    }
+    jpeg_encode_ctx_set_quality(single, JPEG_QUALITY_DEFAULT);
+}
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_ctx_t *single, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *ref[JPEG_ENCODE_OUTPUTS_MAX], *jpeg[JPEG_ENCODE_OUTPUTS_MAX];
+    size_t size[JPEG_ENCODE_OUTPUTS_MAX];
+    test_sink_t sink[JPEG_ENCODE_OUTPUTS_MAX];
+    jpeg_encode_output_t out[JPEG_ENCODE_OUTPUTS_MAX];
+
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        ref[i] = malloc(TEST_MAX);
+        jpeg[i] = malloc(TEST_MAX);
+    }
+    test_single(single, mode, img, w, h, ref, size);
+
+    for (int n = 1; n <= JPEG_ENCODE_OUTPUTS_MAX; n++) {
+        //Into buffers, exactly the size of the output or larger
+        for (int i = 0; i < n; i++) {
+            memset(jpeg[i], 0, size[i]);
+            out[i] = (jpeg_encode_output_t){.quality = test_qualities[i], .jpeg = jpeg[i], .max_size = i & 1 ? size[i] : TEST_MAX};
+        }
+        CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, out, n) == ESP_OK);
+        for (int i = 0; i < n; i++) {
+            CHECK(out[i].size == size[i] && !memcmp(jpeg[i], ref[i], size[i]));
+        }
+
+        //Into callbacks and a buffer mixed
+        for (int i = 0; i < n; i++) {
+            sink[i] = (test_sink_t){.data = jpeg[i]};
+            memset(jpeg[i], 0, size[i]);
+            out[i] = (jpeg_encode_output_t){.quality = test_qualities[i], .jpeg = jpeg[i], .max_size = TEST_MAX};
+            if (i != 1) {
+                out[i].cb = test_cb;
+                out[i].arg = &sink[i];
+            }
+        }
+        CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, out, n) == ESP_OK);
+        for (int i = 0; i < n; i++) {
+            CHECK(out[i].size == size[i] && !memcmp(jpeg[i], ref[i], size[i]));
+            CHECK(i == 1 || sink[i].size == size[i]);
+        }
+
+        //Each output in turn fails, a byte too small or aborted in its
+        //second chunk; the others are still written whole
+        for (int f = 0; f < n; f++) {
+            for (int i = 0; i < n; i++) {
+                sink[i] = (test_sink_t){.data = jpeg[i], .abort_at = i == f ? 2 : 0};
+                out[i] = (jpeg_encode_output_t){.quality = test_qualities[i], .jpeg = jpeg[i], .max_size = i == f ? size[i] - 1 : TEST_MAX};
+                if (f & 1) {
+                    out[i].cb = test_cb;
+                    out[i].arg = &sink[i];
+                }
+            }
+            CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, out, n) == ESP_OK);
+            for (int i = 0; i < n; i++) {
+                if (i == f) {
+                    CHECK(out[i].size == 0);
+                } else {
+                    CHECK(out[i].size == size[i] && !memcmp(jpeg[i], ref[i], size[i]));
+                }
+            }
+        }
+    }
+
+    //All outputs failing ends the frame early, and the next is whole again
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        out[i] = (jpeg_encode_output_t){.quality = test_qualities[i], .jpeg = jpeg[i], .max_size = 1000};
+    }
+    CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, out, JPEG_ENCODE_OUTPUTS_MAX) == ESP_OK);
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        CHECK(out[i].size == 0);
+        out[i].max_size = TEST_MAX;
+    }
+    CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, out, JPEG_ENCODE_OUTPUTS_MAX) == ESP_OK);
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        CHECK(out[i].size == size[i] && !memcmp(jpeg[i], ref[i], size[i]));
+    }
+
+    //The context encodes at its own quality again
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, jpeg[0], TEST_MAX) == size[1]);
+    CHECK(!memcmp(jpeg[0], ref[1], size[1]));
+    printf("mode %d, %dx%d: %zu %zu %zu %zu bytes, each the same as alone\n", mode, w, h, size[0], size[1], size[2], size[3]);
+
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX; i++) {
+        free(ref[i]);
+        free(jpeg[i]);
+    }
+}
+
+static void test_modes(jpeg_encode_ctx_t *ctx, jpeg_encode_ctx_t *single, uint8_t *rgb, uint8_t *rgb565, uint8_t *yuyv, uint8_t *gray)
+{
+    test_mode(ctx, single, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+    test_mode(ctx, single, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+    test_mode(ctx, single, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+    test_mode(ctx, single, ENCODE_YUV_GRAY_MODE, yuyv, TEST_W, TEST_H);
+    test_mode(ctx, single, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+    //Partial MCUs at the right and bottom
+    test_mode(ctx, single, ENCODE_RGB16_MODE, rgb565, 200, 101);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3), jpeg[64];
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create(), *single = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 17);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    test_modes(ctx, single, rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_420);
+    jpeg_encode_ctx_set_subsampling(single, JPEG_SUBSAMPLING_420);
+    test_modes(ctx, single, rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_trellis(ctx, JPEG_TRELLIS_DEFAULT);
+    jpeg_encode_ctx_set_trellis(single, JPEG_TRELLIS_DEFAULT);
+    test_mode(ctx, single, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+
+    //No outputs, too many, a quality out of range
+    jpeg_encode_output_t out[JPEG_ENCODE_OUTPUTS_MAX + 1] = {{.jpeg = jpeg, .max_size = sizeof(jpeg)}};
+    CHECK(jpeg_encode_ctx_multi(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, out, 0) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_multi(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, out, JPEG_ENCODE_OUTPUTS_MAX + 1) == ESP_ERR_INVALID_ARG);
+    out[0].quality = JPEG_QUALITY_MAX + 1;
+    CHECK(jpeg_encode_ctx_multi(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, out, 1) == ESP_ERR_INVALID_ARG);
+
+    jpeg_encode_ctx_delete(ctx);
+    jpeg_encode_ctx_delete(single);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_multi");
+}
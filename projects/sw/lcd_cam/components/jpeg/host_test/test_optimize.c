@@ -0,0 +1,66 @@
+// jpeg_encode_ctx_set_optimize(): optimized tables code the same quantized
+// coefficients as the standard ones, in fewer bytes, for every input mode
+// and subsampling, and grayscale images (no chrominance symbols at all) keep
+// the Annex K chrominance tables instead of building empty ones.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//Optimized against standard tables on the same input; the transcoder codes
+//the optimized stream with the standard tables again, which must give the
+//bytes of the standard encode
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *plain = malloc(TEST_MAX), *opt = malloc(TEST_MAX), *back = malloc(TEST_MAX);
+    bool gray = mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE;
+
+    jpeg_encode_ctx_set_optimize(ctx, false);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, plain, TEST_MAX);
+    jpeg_encode_ctx_set_optimize(ctx, true);
+    size_t n = jpeg_encode_ctx(ctx, mode, img, w, h, opt, TEST_MAX);
+    jpeg_encode_ctx_set_optimize(ctx, false);
+    printf("mode %d, %dx%d: %zu bytes, optimized %zu\n", mode, w, h, size, n);
+    CHECK(size > 0 && n > 0 && n < size);
+    CHECK(n >= 2 && opt[n - 2] == 0xFF && opt[n - 1] == 0xD9);
+    if (!gray) {
+        size_t m = jpeg_encode_ctx_transform(ctx, opt, n, JPEG_TRANSFORM_NONE, back, TEST_MAX);
+        CHECK(m == size && !memcmp(back, plain, size));
+    }
+    free(plain);
+    free(opt);
+    free(back);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 3);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_GRAY_MODE, yuyv, TEST_W, TEST_H);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+    //One block: a single symbol in each luminance table
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, 8, 8);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_optimize");
+}
@@ -0,0 +1,98 @@
+// jpeg_encode_ctx_set_pipeline(): the two-stage encode writes the bytes of
+// the sequential one into a buffer and into a callback, for every mode and
+// both subsamplings; an overflowing buffer or an aborting callback ends it
+// with 0 and the next encode on the context is whole again.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int calls;
+    int abort_at;               //Call that returns false, 0: none
+} test_sink_t;
+
+static bool test_cb(void *arg, const uint8_t *data, size_t len)
+{
+    test_sink_t *s = (test_sink_t *)arg;
+
+    if (s->size + len <= TEST_MAX) {
+        memcpy(&s->data[s->size], data, len);
+    }
+    s->size += len;
+    return ++s->calls != s->abort_at;
+}
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *piped = malloc(TEST_MAX);
+    test_sink_t sink = {.data = piped};
+
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    CHECK(jpeg_encode_ctx_set_pipeline(ctx, true) == ESP_OK);
+    //Several frames through the same ring
+    for (int i = 0; i < 3; i++) {
+        memset(piped, 0, size);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, piped, TEST_MAX) == size);
+        CHECK(!memcmp(piped, jpeg, size));
+    }
+    memset(piped, 0, size);
+    CHECK(jpeg_encode_ctx_cb(ctx, mode, img, w, h, test_cb, &sink) == size);
+    CHECK(sink.size == size && !memcmp(piped, jpeg, size));
+
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, piped, size - 1) == 0);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, piped, size) == size);
+    sink = (test_sink_t){.data = piped, .abort_at = 1};
+    CHECK(jpeg_encode_ctx_cb(ctx, mode, img, w, h, test_cb, &sink) == 0);
+    CHECK(sink.calls == 1);
+    memset(piped, 0, size);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, piped, TEST_MAX) == size);
+    CHECK(!memcmp(piped, jpeg, size));
+    printf("mode %d, %dx%d: %zu bytes, same through the pipeline\n", mode, w, h, size);
+    free(jpeg);
+    free(piped);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 12);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+        //One MCU, and a single MCU row
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, 16, 16);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, 16);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_MAX);
+    test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+
+    //Switched off and on again
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_pipeline");
+}
@@ -0,0 +1,182 @@
+// jpeg_encode_ctx_planar() and the packed UYVY / YVYU modes: each gives the
+// bytes of the YUYV encode of the same samples (for I420 / NV12, YUYV with
+// every chroma row twice), in 4:2:2 and 4:2:0, with partial MCUs, for planes
+// pointing into a larger frame against the same YUYV rectangle, with
+// optimized tables and with stripes set; bad planes give 0.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    uint8_t *y, *cb, *cr;       //I4xx planes
+    uint8_t *cbcr;              //NV1x plane
+    uint8_t *yuyv;              //The same samples packed
+} test_planes_t;
+
+//Planes of the TEST_W x TEST_H YUYV frame src, the chroma of every second row
+//only if half; yuyv then gets each chroma row twice
+static void test_split(test_planes_t *p, const uint8_t *src, bool half)
+{
+    int rows = half ? TEST_H / 2 : TEST_H;
+
+    p->y = malloc(TEST_W * TEST_H);
+    p->cb = malloc(TEST_W / 2 * rows);
+    p->cr = malloc(TEST_W / 2 * rows);
+    p->cbcr = malloc(TEST_W * rows);
+    p->yuyv = malloc(TEST_W * TEST_H * 2);
+    for (int y = 0; y < TEST_H; y++) {
+        int cy = half ? y & -2 : y;
+        for (int x = 0; x < TEST_W; x += 2) {
+            const uint8_t *s = &src[2 * (y * TEST_W + x)], *c = &src[2 * (cy * TEST_W + x)];
+            uint8_t *d = &p->yuyv[2 * (y * TEST_W + x)];
+            int i = (half ? y / 2 : y) * TEST_W / 2 + x / 2;
+            p->y[y * TEST_W + x] = d[0] = s[0];
+            p->y[y * TEST_W + x + 1] = d[2] = s[2];
+            p->cb[i] = p->cbcr[2 * i] = d[1] = c[1];
+            p->cr[i] = p->cbcr[2 * i + 1] = d[3] = c[3];
+        }
+    }
+}
+
+static void test_free(test_planes_t *p)
+{
+    free(p->y);
+    free(p->cb);
+    free(p->cr);
+    free(p->cbcr);
+    free(p->yuyv);
+}
+
+//The image of format at x, y (even) of the planes
+static jpeg_planar_image_t test_image(const test_planes_t *p, jpeg_planar_format_t format, int x, int y)
+{
+    bool half = format == JPEG_PLANAR_I420 || format == JPEG_PLANAR_NV12;
+    int cy = half ? y / 2 : y;
+
+    if (format == JPEG_PLANAR_NV12 || format == JPEG_PLANAR_NV16) {
+        return (jpeg_planar_image_t){
+            .format = format,
+            .plane = {&p->y[y * TEST_W + x], &p->cbcr[cy * TEST_W + x]},
+            .stride = {TEST_W, TEST_W},
+        };
+    }
+    return (jpeg_planar_image_t){
+        .format = format,
+        .plane = {&p->y[y * TEST_W + x], &p->cb[cy * TEST_W / 2 + x / 2], &p->cr[cy * TEST_W / 2 + x / 2]},
+        .stride = {TEST_W, TEST_W / 2, TEST_W / 2},
+    };
+}
+
+static void test_format(jpeg_encode_ctx_t *ctx, const test_planes_t *p, jpeg_planar_format_t format)
+{
+    static const struct {
+        int x, y, w, h;
+    } rects[] = {
+        {0, 0, TEST_W, TEST_H},
+        {0, 0, 200, 101},       //Partial MCUs
+        {64, 34, 176, 144},
+        {TEST_W - 48, TEST_H - 32, 48, 32},
+    };
+    uint8_t *jpeg = malloc(TEST_MAX), *ref = malloc(TEST_MAX);
+
+    for (size_t i = 0; i < sizeof(rects) / sizeof(rects[0]); i++) {
+        jpeg_planar_image_t img = test_image(p, format, rects[i].x, rects[i].y);
+        size_t size = jpeg_encode_ctx_rect(ctx, ENCODE_YUV_MODE, p->yuyv, TEST_W * 2, rects[i].x, rects[i].y, rects[i].w, rects[i].h, ref, TEST_MAX);
+        CHECK(size > 0);
+        CHECK(jpeg_encode_ctx_planar(ctx, &img, rects[i].w, rects[i].h, jpeg, TEST_MAX) == size);
+        CHECK(!memcmp(jpeg, ref, size));
+        CHECK(jpeg_encode_ctx_planar(ctx, &img, rects[i].w, rects[i].h, jpeg, size - 1) == 0);
+    }
+    free(jpeg);
+    free(ref);
+}
+
+static void test_formats(jpeg_encode_ctx_t *ctx, const char *name, const test_planes_t *full, const test_planes_t *half)
+{
+    test_format(ctx, half, JPEG_PLANAR_I420);
+    test_format(ctx, full, JPEG_PLANAR_I422);
+    test_format(ctx, half, JPEG_PLANAR_NV12);
+    test_format(ctx, full, JPEG_PLANAR_NV16);
+    printf("%s: every planar format the same as YUYV\n", name);
+}
+
+//UYVY and YVYU: the bytes of YUYV moved, the same JPEG
+static void test_packed(jpeg_encode_ctx_t *ctx, const uint8_t *yuyv)
+{
+    uint8_t *uyvy = malloc(TEST_W * TEST_H * 2), *yvyu = malloc(TEST_W * TEST_H * 2);
+    uint8_t *jpeg = malloc(TEST_MAX), *ref = malloc(TEST_MAX);
+
+    for (int i = 0; i < TEST_W * TEST_H * 2; i += 4) {
+        const uint8_t *s = &yuyv[i];
+        uint8_t u[4] = {s[1], s[0], s[3], s[2]}, v[4] = {s[0], s[3], s[2], s[1]};
+        memcpy(&uyvy[i], u, 4);
+        memcpy(&yvyu[i], v, 4);
+    }
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        size_t size = jpeg_encode_ctx(ctx, ENCODE_YUV_MODE, (uint8_t *)yuyv, TEST_W, TEST_H, ref, TEST_MAX);
+        CHECK(size > 0);
+        CHECK(jpeg_encode_ctx(ctx, ENCODE_UYVY_MODE, uyvy, TEST_W, TEST_H, jpeg, TEST_MAX) == size && !memcmp(jpeg, ref, size));
+        CHECK(jpeg_encode_ctx(ctx, ENCODE_YVYU_MODE, yvyu, TEST_W, TEST_H, jpeg, TEST_MAX) == size && !memcmp(jpeg, ref, size));
+        printf("subsampling %d: UYVY and YVYU the same as YUYV\n", s);
+    }
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_422);
+    free(uyvy);
+    free(yvyu);
+    free(jpeg);
+    free(ref);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3), *jpeg = malloc(TEST_MAX);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    test_planes_t full, half;
+
+    host_test_frame(rgb, TEST_W, TEST_H, 22);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    test_split(&full, yuyv, false);
+    test_split(&half, yuyv, true);
+
+    test_formats(ctx, "4:2:2", &full, &half);
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_420);
+    test_formats(ctx, "4:2:0", &full, &half);
+    jpeg_encode_ctx_set_optimize(ctx, true);
+    test_formats(ctx, "optimized", &full, &half);
+    jpeg_encode_ctx_set_optimize(ctx, false);
+    jpeg_encode_ctx_set_stripes(ctx, 3);
+    test_formats(ctx, "3 stripes", &full, &half);
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    test_packed(ctx, yuyv);
+
+    //Bad format, missing plane, strides shorter than a row, less than an MCU
+    jpeg_planar_image_t img = test_image(&full, JPEG_PLANAR_I422, 0, 0);
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) > 0);
+    img.format = (jpeg_planar_format_t)(JPEG_PLANAR_NV16 + 1);
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) == 0);
+    img = test_image(&full, JPEG_PLANAR_I422, 0, 0);
+    img.plane[2] = NULL;
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) == 0);
+    img = test_image(&full, JPEG_PLANAR_I422, 0, 0);
+    img.stride[1] = 15;
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) == 0);
+    img = test_image(&full, JPEG_PLANAR_NV16, 0, 0);
+    img.stride[1] = 31;
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) == 0);
+    img.stride[1] = 32;
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 32, 16, jpeg, TEST_MAX) > 0);
+    CHECK(jpeg_encode_ctx_planar(ctx, &img, 8, 16, jpeg, TEST_MAX) == 0);
+
+    jpeg_encode_ctx_delete(ctx);
+    test_free(&full);
+    test_free(&half);
+    free(rgb);
+    free(yuyv);
+    free(jpeg);
+    return host_test_result("test_planar");
+}
@@ -0,0 +1,137 @@
+// jpeg_encode_ctx_set_quality(): the DQT segments carry the IJG scaling of
+// the Annex K tables, the pictures get better and larger with the quality,
+// and switching between levels (also on two contexts taking turns) gives the
+// bytes of a context that only ever had that level.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//Annex K tables K.1 and K.2, natural order
+static const unsigned char test_k1[64] = {
+    16, 11, 10, 16,  24,  40,  51,  61,
+    12, 12, 14, 19,  26,  58,  60,  55,
+    14, 13, 16, 24,  40,  57,  69,  56,
+    14, 17, 22, 29,  51,  87,  80,  62,
+    18, 22, 37, 56,  68, 109, 103,  77,
+    24, 35, 55, 64,  81, 104, 113,  92,
+    49, 64, 78, 87, 103, 121, 120, 101,
+    72, 92, 95, 98, 112, 100, 103,  99
+};
+static const unsigned char test_k2[64] = {
+    17, 18, 24, 47, 99, 99, 99, 99,
+    18, 21, 26, 66, 99, 99, 99, 99,
+    24, 26, 56, 99, 99, 99, 99, 99,
+    47, 66, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99,
+    99, 99, 99, 99, 99, 99, 99, 99
+};
+
+static const unsigned char test_zigzag[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+//The DQT tables of jpeg against Annex K scaled to quality
+static void test_dqt(const uint8_t *jpeg, size_t size, int quality)
+{
+    int scale = quality < 50 ? 5000 / quality : 200 - 2 * quality;
+    size_t i = 2;
+
+    while (i + 4 < size && jpeg[i + 1] != 0xDB) {
+        i += 2 + (jpeg[i + 2] << 8 | jpeg[i + 3]);
+    }
+    CHECK(i + 4 + 2 * 65 < size && (jpeg[i + 2] << 8 | jpeg[i + 3]) == 2 + 2 * 65);
+    for (int t = 0; t < 2 && i + 4 + 2 * 65 < size; t++) {
+        const uint8_t *dqt = &jpeg[i + 4 + 65 * t];
+        CHECK(dqt[0] == t);
+        for (int k = 0; k < 64; k++) {
+            int q = ((t ? test_k2 : test_k1)[test_zigzag[k]] * scale + 50) / 100;
+            q = q < 1 ? 1 : q > 255 ? 255 : q;
+            CHECK(dqt[1 + k] == q);
+        }
+    }
+}
+
+//Sum of squared differences of the decoded frame against rgb565
+static double test_sse(const uint8_t *jpeg, const uint8_t *rgb565)
+{
+    int w, h;
+    double sse = 0;
+    uint8_t *pixels = jpeg_decode((uint8_t *)jpeg, &w, &h);
+
+    CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+    for (int i = 0; pixels && i < TEST_W * TEST_H; i++) {
+        int a = pixels[2 * i] << 8 | pixels[2 * i + 1], b = rgb565[2 * i] << 8 | rgb565[2 * i + 1];
+        int d[3] = {(a >> 11) - (b >> 11), ((a >> 5) & 0x3F) / 2 - ((b >> 5) & 0x3F) / 2, (a & 0x1F) - (b & 0x1F)};
+        sse += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    }
+    free(pixels);
+    return sse;
+}
+
+int main(void)
+{
+    static const int quality[] = {1, 10, 25, 50, 75, 90, 100};
+    const int levels = sizeof(quality) / sizeof(quality[0]);
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    uint8_t *jpeg[7], *again = malloc(TEST_MAX);
+    size_t size[7];
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create(), *other = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 6);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+
+    CHECK(jpeg_encode_ctx_set_quality(ctx, -1) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_MAX + 1) == ESP_ERR_INVALID_ARG);
+
+    //One fresh context per level
+    for (int i = 0; i < levels; i++) {
+        jpeg_encode_ctx_t *fresh = jpeg_encode_ctx_create();
+        jpeg[i] = malloc(TEST_MAX);
+        CHECK(jpeg_encode_ctx_set_quality(fresh, quality[i]) == ESP_OK);
+        size[i] = jpeg_encode_ctx(fresh, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, jpeg[i], TEST_MAX);
+        jpeg_encode_ctx_delete(fresh);
+        test_dqt(jpeg[i], size[i], quality[i]);
+        double sse = test_sse(jpeg[i], rgb565);
+        printf("quality %d: %zu bytes, squared error %.0f\n", quality[i], size[i], sse);
+        if (i > 0) {
+            CHECK(size[i] > size[i - 1] && sse < test_sse(jpeg[i - 1], rgb565));
+        }
+    }
+
+    //Switching back and forth, on one context and on two taking turns
+    for (int r = 0; r < 3 * levels; r++) {
+        int i = r * 3 % levels, j = (r * 5 + 1) % levels;
+        jpeg_encode_ctx_set_quality(ctx, quality[i]);
+        jpeg_encode_ctx_set_quality(other, quality[j]);
+        CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, again, TEST_MAX) == size[i]);
+        CHECK(!memcmp(again, jpeg[i], size[i]));
+        CHECK(jpeg_encode_ctx(other, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, again, TEST_MAX) == size[j]);
+        CHECK(!memcmp(again, jpeg[j], size[j]));
+    }
+
+    //The built-in tables are those of jpeg_encode()
+    size_t n = jpeg_encode(ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, jpeg[0], TEST_MAX);
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_DEFAULT);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, again, TEST_MAX) == n);
+    CHECK(!memcmp(again, jpeg[0], n));
+
+    for (int i = 0; i < levels; i++) {
+        free(jpeg[i]);
+    }
+    jpeg_encode_ctx_delete(ctx);
+    jpeg_encode_ctx_delete(other);
+    free(rgb);
+    free(rgb565);
+    free(again);
+    return host_test_result("test_quality");
+}
@@ -0,0 +1,105 @@
+// jpeg_encode_ctx_rect(): a window of a larger frame, at its corners, at odd
+// rows and with partial MCUs, gives the bytes of jpeg_encode_ctx() on a copy
+// of that window, for every input mode and through the optimized, striped,
+// pipelined and replenishing paths; bad rectangles give 0.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+static const struct {
+    int x, y, w, h;
+} test_rects[] = {
+    {0, 0, TEST_W, TEST_H},
+    {0, 0, 160, 120},
+    {64, 33, 176, 144},
+    {2, 7, 100, 50},
+    {TEST_W - 48, TEST_H - 40, 48, 40},     //Bottom right corner
+    {TEST_W - 38, TEST_H - 19, 38, 19},     //Partial MCUs up to the corner
+    {150, 100, 16, 16},
+};
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, const uint8_t *frame, int bpp)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *window = malloc(TEST_MAX);
+    //Rows padded to a longer stride, nothing behind the last pixel
+    int stride = TEST_W * bpp + 24;
+    uint8_t *padded = malloc((size_t)stride * (TEST_H - 1) + TEST_W * bpp);
+
+    for (int r = 0; r < TEST_H; r++) {
+        memcpy(&padded[r * stride], &frame[r * TEST_W * bpp], TEST_W * bpp);
+    }
+    for (size_t i = 0; i < sizeof(test_rects) / sizeof(test_rects[0]); i++) {
+        int x = test_rects[i].x, y = test_rects[i].y, w = test_rects[i].w, h = test_rects[i].h;
+        uint8_t *crop = malloc((size_t)w * h * bpp);
+        for (int r = 0; r < h; r++) {
+            memcpy(&crop[r * w * bpp], &frame[((y + r) * TEST_W + x) * bpp], w * bpp);
+        }
+        size_t size = jpeg_encode_ctx(ctx, mode, crop, w, h, jpeg, TEST_MAX);
+        CHECK(size > 0);
+        CHECK(jpeg_encode_ctx_rect(ctx, mode, padded, stride, x, y, w, h, window, TEST_MAX) == size);
+        CHECK(!memcmp(window, jpeg, size));
+        CHECK(jpeg_encode_ctx_rect(ctx, mode, (uint8_t *)frame, TEST_W * bpp, x, y, w, h, window, TEST_MAX) == size);
+        CHECK(!memcmp(window, jpeg, size));
+        free(crop);
+    }
+    free(jpeg);
+    free(window);
+    free(padded);
+}
+
+static void test_modes(jpeg_encode_ctx_t *ctx, const char *name, uint8_t *rgb, uint8_t *rgb565, uint8_t *yuyv, uint8_t *gray)
+{
+    test_mode(ctx, ENCODE_RGB24_MODE, rgb, 3);
+    test_mode(ctx, ENCODE_RGB16_MODE, rgb565, 2);
+    test_mode(ctx, ENCODE_YUV_MODE, yuyv, 2);
+    test_mode(ctx, ENCODE_UYVY_MODE, yuyv, 2);
+    test_mode(ctx, ENCODE_YVYU_MODE, yuyv, 2);
+    test_mode(ctx, ENCODE_YUV_GRAY_MODE, yuyv, 2);
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, 1);
+    printf("%s: every window the same as its copy\n", name);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3), jpeg[64];
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 14);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    test_modes(ctx, "4:2:2", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_420);
+    test_modes(ctx, "4:2:0", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_optimize(ctx, true);
+    test_modes(ctx, "optimized", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_optimize(ctx, false);
+    jpeg_encode_ctx_set_stripes(ctx, 3);
+    test_modes(ctx, "3 stripes", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    jpeg_encode_ctx_set_pipeline(ctx, true);
+    test_modes(ctx, "pipeline", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    jpeg_encode_ctx_set_replenish(ctx, true);
+    test_modes(ctx, "replenish", rgb, rgb565, yuyv, gray);
+    jpeg_encode_ctx_set_replenish(ctx, false);
+
+    //Odd x of pixel pairs, negative origin, stride shorter than a row
+    CHECK(jpeg_encode_ctx_rect(ctx, ENCODE_YUV_MODE, yuyv, TEST_W * 2, 1, 0, 32, 16, jpeg, sizeof(jpeg)) == 0);
+    CHECK(jpeg_encode_ctx_rect(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W * 2, -2, 0, 32, 16, jpeg, sizeof(jpeg)) == 0);
+    CHECK(jpeg_encode_ctx_rect(ctx, ENCODE_RGB16_MODE, rgb565, 62, 0, 0, 32, 16, jpeg, sizeof(jpeg)) == 0);
+    CHECK(jpeg_encode_ctx_rect(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W * 2, 0, 0, 0, 16, jpeg, sizeof(jpeg)) == 0);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_rect");
+}
@@ -0,0 +1,123 @@
+// jpeg_encode_ctx_set_replenish(): a sequence of frames from a mostly static
+// scene (a moving square, a frame that does not change, one that changes
+// everywhere), with the quality, subsampling, trellis, mode and size changed
+// between frames, gives the bytes of a context without replenishment for
+// every frame; so does the frame after one that did not fit.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    jpeg_encode_ctx_t *ctx;     //Replenishing
+    jpeg_encode_ctx_t *plain;
+    uint8_t *jpeg;
+    uint8_t *ref;
+    int frames;
+} test_pair_t;
+
+static void test_frame(test_pair_t *t, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    size_t size = jpeg_encode_ctx(t->plain, mode, img, w, h, t->ref, TEST_MAX);
+    CHECK(size > 0);
+    CHECK(jpeg_encode_ctx(t->ctx, mode, img, w, h, t->jpeg, TEST_MAX) == size);
+    CHECK(!memcmp(t->jpeg, t->ref, size));
+    t->frames++;
+}
+
+//A 40x40 square at x, y on the RGB24 frame rgb of the static scene
+static void test_square(uint8_t *frame, const uint8_t *rgb, int x, int y)
+{
+    memcpy(frame, rgb, TEST_W * TEST_H * 3);
+    for (int r = y; r < y + 40; r++) {
+        memset(&frame[(r * TEST_W + x) * 3], 0xE0, 40 * 3);
+    }
+}
+
+static void test_both(test_pair_t *t, void (*set)(jpeg_encode_ctx_t *, int), int value)
+{
+    set(t->ctx, value);
+    set(t->plain, value);
+}
+
+static void test_quality(jpeg_encode_ctx_t *ctx, int value)
+{
+    jpeg_encode_ctx_set_quality(ctx, value);
+}
+
+static void test_subsampling(jpeg_encode_ctx_t *ctx, int value)
+{
+    jpeg_encode_ctx_set_subsampling(ctx, (jpeg_subsampling_t)value);
+}
+
+static void test_trellis(jpeg_encode_ctx_t *ctx, int value)
+{
+    jpeg_encode_ctx_set_trellis(ctx, value);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3), *frame = malloc(TEST_W * TEST_H * 3);
+    test_pair_t t = {
+        .ctx = jpeg_encode_ctx_create(),
+        .plain = jpeg_encode_ctx_create(),
+        .jpeg = malloc(TEST_MAX),
+        .ref = malloc(TEST_MAX),
+    };
+
+    host_test_frame(rgb, TEST_W, TEST_H, 15);
+    CHECK(jpeg_encode_ctx_set_replenish(t.ctx, true) == ESP_OK);
+
+    for (int s = 0; s < 2; s++) {
+        test_both(&t, test_subsampling, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        for (int i = 0; i < 12; i++) {
+            //The square moves, stops for two frames, and the quality changes
+            //between the 6th and the 7th
+            test_square(frame, rgb, 10 + 23 * (i < 8 ? i : 8), 10 + 15 * (i < 8 ? i : 8));
+            if (i == 6) {
+                test_both(&t, test_quality, 60);
+            }
+            uint8_t *rgb565 = host_test_rgb565(frame, TEST_W, TEST_H);
+            uint8_t *yuyv = host_test_yuyv(frame, TEST_W, TEST_H);
+            test_frame(&t, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+            //The same frame in another mode, then back
+            if (i % 4 == 3) {
+                test_frame(&t, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+                test_frame(&t, ENCODE_YUV_GRAY_MODE, yuyv, TEST_W, TEST_H);
+            }
+            //Another size of the same frame
+            if (i == 9) {
+                test_frame(&t, ENCODE_RGB16_MODE, rgb565, TEST_W - 32, TEST_H - 48);
+            }
+            //A frame that does not fit, then the same again
+            if (i == 10) {
+                CHECK(jpeg_encode_ctx(t.ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H, t.jpeg, 2000) == 0);
+                test_frame(&t, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+            }
+            free(rgb565);
+            free(yuyv);
+        }
+        test_both(&t, test_quality, JPEG_QUALITY_DEFAULT);
+    }
+
+    //Noise everywhere, twice, then with the trellis on
+    host_test_noise(frame, TEST_W * TEST_H * 2, 15);
+    test_frame(&t, ENCODE_RGB16_MODE, frame, TEST_W, TEST_H);
+    test_frame(&t, ENCODE_RGB16_MODE, frame, TEST_W, TEST_H);
+    test_both(&t, test_trellis, JPEG_TRELLIS_DEFAULT);
+    test_frame(&t, ENCODE_RGB16_MODE, frame, TEST_W, TEST_H);
+    test_frame(&t, ENCODE_RGB16_MODE, frame, TEST_W, TEST_H);
+    printf("%d frames, each the same as without replenishment\n", t.frames);
+
+    jpeg_encode_ctx_delete(t.ctx);
+    jpeg_encode_ctx_delete(t.plain);
+    free(t.jpeg);
+    free(t.ref);
+    free(rgb);
+    free(frame);
+    return host_test_result("test_replenish");
+}
@@ -0,0 +1,170 @@
+// jpeg_encode_ctx_requantize(): a q90 frame shrunk to a coarser quality gets
+// the quantizers of that quality and decodes about as well as a direct encode
+// at it; a finer quality keeps the quantizers of the source and gives its
+// bytes back; coefs limits every block to its first coefficients (1: flat
+// blocks); optimized tables decode to the same pixels; a full buffer, a
+// broken source and a bad coefs give 0.
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//The two quantization tables of the DQT segments of jpeg (in zig-zag order)
+static void test_dqt(const uint8_t *jpeg, size_t size, uint8_t q[2][64])
+{
+    memset(q, 0, 2 * 64);
+    for (size_t i = 2; i + 4 <= size && jpeg[i] == 0xFF && jpeg[i + 1] != 0xDA; ) {
+        size_t len = jpeg[i + 2] << 8 | jpeg[i + 3];
+        if (jpeg[i + 1] == 0xDB) {
+            for (size_t t = i + 4; t + 65 <= i + 2 + len; t += 65) {
+                CHECK((jpeg[t] & 0xF0) == 0 && (jpeg[t] & 0x0F) < 2);
+                memcpy(q[jpeg[t] & 1], &jpeg[t + 1], 64);
+            }
+        }
+        i += 2 + len;
+    }
+}
+
+//PSNR of the decoded RGB565 frame against rgb reduced to RGB565 precision
+static double test_psnr(const uint8_t *pixels, const uint8_t *rgb)
+{
+    double sse = 0;
+
+    for (int i = 0; i < TEST_W * TEST_H; i++) {
+        const uint8_t *s = &rgb[3 * i];
+        int v = pixels[2 * i] << 8 | pixels[2 * i + 1];
+        int d[3] = {(v >> 11 << 3) - (s[0] & 0xF8), ((v >> 5 & 0x3F) << 2) - (s[1] & 0xFC), ((v & 0x1F) << 3) - (s[2] & 0xF8)};
+        sse += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+    }
+    return 10 * log10(255.0 * 255.0 * 3 * TEST_W * TEST_H / (sse > 0 ? sse : 1));
+}
+
+static double test_decode_psnr(const uint8_t *jpeg, const uint8_t *rgb)
+{
+    int w, h;
+    uint8_t *pixels = jpeg_decode((uint8_t *)jpeg, &w, &h);
+
+    CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+    if (pixels == NULL) {
+        return 0;
+    }
+    double psnr = test_psnr(pixels, rgb);
+    free(pixels);
+    return psnr;
+}
+
+//Every 8x8 block of the decoded frame is a single colour
+static bool test_flat_blocks(const uint8_t *jpeg)
+{
+    int w, h;
+    uint8_t *pixels = jpeg_decode((uint8_t *)jpeg, &w, &h);
+    bool flat = pixels != NULL;
+
+    for (int y = 0; flat && y < h; y++) {
+        for (int x = 0; flat && x < w; x++) {
+            const uint8_t *p = &pixels[2 * (y * w + x)], *b = &pixels[2 * ((y & -8) * w + (x & -8))];
+            flat = p[0] == b[0] && p[1] == b[1];
+        }
+    }
+    free(pixels);
+    return flat;
+}
+
+static void test_subsampling(jpeg_encode_ctx_t *ctx, jpeg_subsampling_t subsampling, const uint8_t *rgb)
+{
+    uint8_t *src = malloc(TEST_MAX), *out = malloc(TEST_MAX), *direct = malloc(TEST_MAX), *opt = malloc(TEST_MAX);
+    uint8_t q_src[2][64], q_direct[2][64], q_out[2][64];
+
+    jpeg_encode_ctx_set_subsampling(ctx, subsampling);
+    jpeg_encode_ctx_set_quality(ctx, 90);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, (uint8_t *)rgb, TEST_W, TEST_H, src, TEST_MAX);
+    CHECK(size > 0);
+    test_dqt(src, size, q_src);
+
+    //Coarser: the quantizers of the target quality, never finer than the
+    //source, and about the quality of a direct encode
+    static const int coarser[] = {75, 50, 20};
+    for (int i = 0; i < 3; i++) {
+        jpeg_encode_ctx_set_quality(ctx, coarser[i]);
+        size_t d = jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, (uint8_t *)rgb, TEST_W, TEST_H, direct, TEST_MAX);
+        size_t n = jpeg_encode_ctx_requantize(ctx, src, size, 64, out, TEST_MAX);
+        CHECK(d > 0 && n > 0 && n < size);
+        test_dqt(direct, d, q_direct);
+        test_dqt(out, n, q_out);
+        for (int t = 0; t < 2; t++) {
+            for (int k = 0; k < 64; k++) {
+                CHECK(q_out[t][k] == (q_direct[t][k] > q_src[t][k] ? q_direct[t][k] : q_src[t][k]));
+            }
+        }
+        double psnr = test_decode_psnr(out, rgb), psnr_direct = test_decode_psnr(direct, rgb);
+        printf("subsampling %d, q90 -> q%d: %zu -> %zu bytes, PSNR %.2f dB (direct %zu bytes, %.2f dB)\n",
+               subsampling, coarser[i], size, n, psnr, d, psnr_direct);
+        CHECK(psnr > psnr_direct - 1.0 && n < d + d / 8);
+
+        //Exactly the size fits, a byte less does not
+        CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 64, direct, n) == n && !memcmp(direct, out, n));
+        CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 64, direct, n - 1) == 0);
+
+        //Optimized tables: the same coefficients in fewer bytes
+        jpeg_encode_ctx_set_optimize(ctx, true);
+        size_t o = jpeg_encode_ctx_requantize(ctx, src, size, 64, opt, TEST_MAX);
+        jpeg_encode_ctx_set_optimize(ctx, false);
+        int w, h, ow, oh;
+        uint8_t *pixels = jpeg_decode(out, &w, &h), *opt_pixels = jpeg_decode(opt, &ow, &oh);
+        CHECK(o > 0 && o < n);
+        CHECK(pixels != NULL && opt_pixels != NULL && ow == w && oh == h && !memcmp(pixels, opt_pixels, 2 * w * h));
+        free(pixels);
+        free(opt_pixels);
+    }
+
+    //Finer: the source quantizers, so the source bytes again
+    jpeg_encode_ctx_set_quality(ctx, 100);
+    CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 64, out, TEST_MAX) == size && !memcmp(out, src, size));
+
+    //Fewer coefficients, fewer bytes; only DC leaves flat blocks
+    static const int coefs[] = {64, 28, 10, 3, 1};
+    size_t last = size + 1;
+    for (int i = 0; i < 5; i++) {
+        size_t n = jpeg_encode_ctx_requantize(ctx, src, size, coefs[i], out, TEST_MAX);
+        printf("subsampling %d, %d coefficients: %zu bytes\n", subsampling, coefs[i], n);
+        CHECK(n > 0 && n < last);
+        test_dqt(out, n, q_out);
+        CHECK(!memcmp(q_out, q_src, sizeof(q_src)));
+        CHECK(test_flat_blocks(out) == (coefs[i] == 1));
+        last = n;
+    }
+    CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 0, out, TEST_MAX) == 0);
+    CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 65, out, TEST_MAX) == 0);
+
+    //A truncated source, one that is not a JPEG
+    CHECK(jpeg_encode_ctx_requantize(ctx, src, 100, 64, out, TEST_MAX) == 0);
+    CHECK(jpeg_encode_ctx_requantize(ctx, (const uint8_t *)rgb, size, 64, out, TEST_MAX) == 0);
+
+    //The context encodes as before
+    jpeg_encode_ctx_set_quality(ctx, 90);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, (uint8_t *)rgb, TEST_W, TEST_H, out, TEST_MAX) == size && !memcmp(out, src, size));
+
+    free(src);
+    free(out);
+    free(direct);
+    free(opt);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 19);
+    test_subsampling(ctx, JPEG_SUBSAMPLING_422, rgb);
+    test_subsampling(ctx, JPEG_SUBSAMPLING_420, rgb);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    return host_test_result("test_requantize");
+}
@@ -0,0 +1,90 @@
+// The RGB565 conversion tables: an RGB565 frame gives the bytes of the RGB24
+// frame of its fields widened to 8 bits (r << 3, g << 2, b << 3), which goes
+// through RGB2Y/Cb/Cr() and subsample() / subsample420(); for every one of
+// the 65536 colours and every pairing of neighbours in a noise frame, in
+// 4:2:2 and 4:2:0, with partial MCUs and through a rectangle.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//RGB24 of the big-endian RGB565 pixels of img
+static uint8_t *test_widen(const uint8_t *img, int w, int h)
+{
+    uint8_t *rgb = malloc((size_t)w * h * 3);
+
+    for (int i = 0; i < w * h; i++) {
+        int v = img[2 * i] << 8 | img[2 * i + 1];
+        rgb[3 * i] = (v >> 11) << 3;
+        rgb[3 * i + 1] = ((v >> 5) & 0x3F) << 2;
+        rgb[3 * i + 2] = (v & 0x1F) << 3;
+    }
+    return rgb;
+}
+
+static void test_frame(jpeg_encode_ctx_t *ctx, const char *name, uint8_t *img, int w, int h)
+{
+    uint8_t *rgb = test_widen(img, w, h);
+    uint8_t *jpeg = malloc(TEST_MAX), *ref = malloc(TEST_MAX);
+
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, rgb, w, h, ref, TEST_MAX);
+    CHECK(size > 0);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, ref, size));
+    printf("%s, %dx%d: %zu bytes, the same as RGB24\n", name, w, h, size);
+
+    //A window at an odd row and column
+    if (w >= 64 && h >= 48) {
+        size = jpeg_encode_ctx_rect(ctx, ENCODE_RGB24_MODE, rgb, w * 3, 3, 5, w - 35, h - 21, ref, TEST_MAX);
+        CHECK(size > 0);
+        CHECK(jpeg_encode_ctx_rect(ctx, ENCODE_RGB16_MODE, img, w * 2, 3, 5, w - 35, h - 21, jpeg, TEST_MAX) == size);
+        CHECK(!memcmp(jpeg, ref, size));
+    }
+    free(rgb);
+    free(jpeg);
+    free(ref);
+}
+
+int main(void)
+{
+    uint8_t *all = malloc(256 * 256 * 2), *noise = malloc(TEST_W * TEST_H * 2);
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    //Every colour once, in rows of 256 (neighbours differ in the low fields)
+    //and again with the bytes swapped (neighbours differ in the high fields)
+    uint8_t *swapped = malloc(256 * 256 * 2);
+    for (int i = 0; i < 256 * 256; i++) {
+        all[2 * i] = i >> 8;
+        all[2 * i + 1] = i & 0xFF;
+        swapped[2 * i] = i & 0xFF;
+        swapped[2 * i + 1] = i >> 8;
+    }
+    host_test_noise(noise, TEST_W * TEST_H * 2, 21);
+    host_test_frame(rgb, TEST_W, TEST_H, 21);
+    uint8_t *camera = host_test_rgb565(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        for (int q = 0; q < 2; q++) {
+            jpeg_encode_ctx_set_quality(ctx, q ? 100 : JPEG_QUALITY_DEFAULT);
+            test_frame(ctx, "all colours", all, 256, 256);
+            test_frame(ctx, "all colours swapped", swapped, 256, 256);
+            test_frame(ctx, "noise", noise, TEST_W, TEST_H);
+            test_frame(ctx, "camera", camera, TEST_W, TEST_H);
+            //Partial MCUs at the right and bottom
+            test_frame(ctx, "noise", noise, 200, 101);
+        }
+    }
+
+    jpeg_encode_ctx_delete(ctx);
+    free(all);
+    free(swapped);
+    free(noise);
+    free(rgb);
+    free(camera);
+    return host_test_result("test_rgb565");
+}
@@ -0,0 +1,150 @@
+// The vector kernels of every instruction set the CPU has against the
+// scalar code they replace, kernel by kernel and through whole encodes:
+// all must be bit-exact.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "dct.h"
+#include "simd.h"
+#include "host_test.h"
+
+#if JPEG_SIMD
+static uint32_t test_rand(uint32_t *seed)
+{
+    *seed = *seed * 1103515245 + 12345;
+    return *seed >> 8;
+}
+
+//dct_quantize(), dct_aan() and dct_requantize() on extreme, checkered and
+//random blocks with the finest, the coarsest and random tables
+static void test_dct(const jpeg_simd_kernels_t *set)
+{
+    static const int16_t level[] = {-128, 127, 0, -1};
+    unsigned char qtable[64];
+    int32_t fdtbl[64];
+    int16_t pixels[8][8];
+    int32_t coef[2][64];
+    int16_t data[2][64], requant[2][64];
+    uint32_t seed = 1;
+
+    for (int t = 0; t < 2048; t++) {
+        for (int i = 0; i < 64; i++) {
+            if (t < 4) {
+                pixels[i >> 3][i & 7] = level[t];
+            } else if (t < 16) {
+                pixels[i >> 3][i & 7] = ((i ^ (i >> 3) ^ t) & 1) ? 127 : -128;
+            } else {
+                pixels[i >> 3][i & 7] = (int16_t)(test_rand(&seed) % 256) - 128;
+            }
+            qtable[i] = t % 3 == 0 ? 1 : t % 3 == 1 ? 255 : 1 + test_rand(&seed) % 255;
+        }
+        dct_fdtbl(qtable, fdtbl);
+        for (int k = 0; k < 2; k++) {
+            int16_t copy[8][8];
+            jpeg_simd_select(k ? set : NULL);
+            memcpy(copy, pixels, sizeof(copy));
+            dct_quantize(copy, fdtbl, data[k]);
+            memcpy(copy, pixels, sizeof(copy));
+            dct_aan(copy, coef[k]);
+            dct_requantize(coef[0], fdtbl, requant[k]);
+        }
+        CHECK(!memcmp(data[0], data[1], sizeof(data[0])));
+        CHECK(!memcmp(coef[0], coef[1], sizeof(coef[0])));
+        CHECK(!memcmp(requant[0], requant[1], sizeof(requant[0])));
+    }
+}
+
+//rgb24_ycbcr() against rgb_ycbcr() on black, white and random MCUs
+static void test_color(const jpeg_simd_kernels_t *set)
+{
+    RGB rgb[16][16];
+    uint8_t line[16 * 48];
+    int16_t y[2][4][8][8], cb[2][8][8], cr[2][8][8];
+    uint32_t seed = 2;
+
+    for (int t = 0; t < 256; t++) {
+        bool s420 = t & 1;
+        for (size_t i = 0; i < sizeof(line); i++) {
+            line[i] = t < 4 ? (t & 2 ? 255 : 0) : (uint8_t)test_rand(&seed);
+        }
+        for (int i = 0; i < 256; i++) {
+            rgb[i >> 4][i & 15].Red = line[3 * i + 0];
+            rgb[i >> 4][i & 15].Green = line[3 * i + 1];
+            rgb[i >> 4][i & 15].Blue = line[3 * i + 2];
+        }
+        memset(y, 0, sizeof(y));
+        rgb_ycbcr(rgb, s420, y[0], cb[0], cr[0]);
+        set->rgb24_ycbcr(line, 48, s420, y[1], cb[1], cr[1]);
+        CHECK(!memcmp(y[0], y[1], sizeof(y[0])));
+        CHECK(!memcmp(cb[0], cb[1], sizeof(cb[0])));
+        CHECK(!memcmp(cr[0], cr[1], sizeof(cr[0])));
+    }
+}
+
+//Whole frames in every mode that reaches a kernel, both subsamplings
+static void test_encode(const jpeg_simd_kernels_t *set, const uint8_t *rgb, int w, int h)
+{
+    static const jpeg_encode_mode_t modes[] = {ENCODE_RGB24_MODE, ENCODE_RGB16_MODE, ENCODE_YUV_MODE, ENCODE_GRAY_MODE};
+    const size_t max = 1 << 20;
+    uint8_t *img[4] = {(uint8_t *)rgb, host_test_rgb565(rgb, w, h), host_test_yuyv(rgb, w, h), host_test_gray(rgb, w, h)};
+    uint8_t *out[2] = {malloc(max), malloc(max)};
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    for (int m = 0; m < 4; m++) {
+        for (int s = 0; s < 2; s++) {
+            size_t size[2];
+            jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+            for (int k = 0; k < 2; k++) {
+                jpeg_simd_select(k ? set : NULL);
+                size[k] = jpeg_encode_ctx(ctx, modes[m], img[m], w, h, out[k], max);
+            }
+            CHECK(size[0] > 0 && size[0] == size[1] && !memcmp(out[0], out[1], size[0]));
+        }
+    }
+    jpeg_encode_ctx_delete(ctx);
+    for (int m = 1; m < 4; m++) {
+        free(img[m]);
+    }
+    free(out[0]);
+    free(out[1]);
+}
+
+int main(void)
+{
+    const int w = 320, h = 240;
+    uint8_t *rgb = (uint8_t *)malloc(w * h * 3);
+    uint8_t *out = (uint8_t *)malloc(1 << 20);
+    const jpeg_simd_kernels_t *best = NULL;
+
+    host_test_frame(rgb, w, h, 1);
+    for (const jpeg_simd_kernels_t *const *set = jpeg_simd_sets; *set != NULL; set++) {
+        if (jpeg_simd_supported(*set) && best == NULL) {
+            best = *set;
+        }
+    }
+    //Nothing chosen before the first encode, then the best set of the CPU
+    CHECK(jpeg_simd.dct_quantize == NULL);
+    jpeg_encode(ENCODE_RGB24_MODE, rgb, w, h, out, 1 << 20);
+    CHECK(best == NULL ? jpeg_simd.dct_quantize == NULL : !strcmp(jpeg_simd.name, best->name));
+
+    for (const jpeg_simd_kernels_t *const *set = jpeg_simd_sets; *set != NULL; set++) {
+        if (!jpeg_simd_supported(*set)) {
+            printf("%s: not supported by this CPU, skipped\n", (*set)->name);
+            continue;
+        }
+        printf("%s\n", (*set)->name);
+        test_dct(*set);
+        test_color(*set);
+        test_encode(*set, rgb, w, h);
+    }
+    free(rgb);
+    free(out);
+    return host_test_result("test_simd");
+}
+#else
+int main(void)
+{
+    printf("test_simd: no vector kernels in this build\n");
+    return 0;
+}
+#endif // JPEG_SIMD
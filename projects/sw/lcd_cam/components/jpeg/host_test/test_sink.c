@@ -0,0 +1,95 @@
+// jpeg_encode_ctx_cb(): the chunks handed to the callback, JPEG_BUFFSIZE
+// bytes each but the last, make up the bytes of the buffer encode; a
+// callback returning false ends the encode with 0 and is not called again.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+typedef struct {
+    uint8_t *data;
+    size_t size;
+    int calls;
+    int abort_at;               //Call that returns false, 0: none
+    bool short_chunk;           //A chunk shorter than JPEG_BUFFSIZE was seen
+    bool bad_chunk;             //A chunk after a short one, or an empty or long one
+} test_sink_t;
+
+static bool test_cb(void *arg, const uint8_t *data, size_t len)
+{
+    test_sink_t *s = (test_sink_t *)arg;
+
+    s->calls++;
+    if (s->short_chunk || len == 0 || len > JPEG_BUFFSIZE) {
+        s->bad_chunk = true;
+    }
+    s->short_chunk = len < JPEG_BUFFSIZE;
+    if (s->size + len <= TEST_MAX) {
+        memcpy(&s->data[s->size], data, len);
+    }
+    s->size += len;
+    return s->calls != s->abort_at;
+}
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *jpeg = malloc(TEST_MAX);
+    test_sink_t sink = {.data = malloc(TEST_MAX)};
+
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX);
+    size_t n = jpeg_encode_ctx_cb(ctx, mode, img, w, h, test_cb, &sink);
+    printf("mode %d, %dx%d: %zu bytes in %d chunks\n", mode, w, h, n, sink.calls);
+    CHECK(size > 0 && n == size && sink.size == size && !memcmp(sink.data, jpeg, size));
+    CHECK(!sink.bad_chunk && sink.calls == (int)((size + JPEG_BUFFSIZE - 1) / JPEG_BUFFSIZE));
+
+    //Aborted in the first, a middle and the last chunk
+    int calls = sink.calls;
+    int abort_at[3] = {1, calls / 2 + 1, calls};
+    for (int i = 0; i < 3; i++) {
+        sink = (test_sink_t){.data = sink.data, .abort_at = abort_at[i]};
+        CHECK(jpeg_encode_ctx_cb(ctx, mode, img, w, h, test_cb, &sink) == 0);
+        CHECK(sink.calls == abort_at[i] && !memcmp(sink.data, jpeg, sink.size));
+    }
+
+    //The context still writes the same afterwards
+    sink = (test_sink_t){.data = sink.data};
+    CHECK(jpeg_encode_ctx_cb(ctx, mode, img, w, h, test_cb, &sink) == size);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, sink.data, TEST_MAX) == size && !memcmp(sink.data, jpeg, size));
+    free(sink.data);
+    free(jpeg);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 8);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+    //Fewer bytes than one chunk
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, 8, 8);
+    jpeg_encode_ctx_set_optimize(ctx, true);
+    jpeg_encode_ctx_set_quality(ctx, 90);
+    test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_sink");
+}
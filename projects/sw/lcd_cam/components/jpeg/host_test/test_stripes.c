@@ -0,0 +1,74 @@
+// jpeg_encode_ctx_set_stripes(): 2 to JPEG_ENCODE_STRIPES_MAX stripes write
+// the bytes of the sequential encode for every mode, both subsamplings and
+// frames with fewer MCU rows than stripes, also into a buffer of exactly the
+// JPEG size (a stripe overflowing its share falls back to one stripe).
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *striped = malloc(TEST_MAX);
+
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    for (int n = 2; n <= JPEG_ENCODE_STRIPES_MAX; n++) {
+        CHECK(jpeg_encode_ctx_set_stripes(ctx, n) == ESP_OK);
+        memset(striped, 0, size);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, striped, TEST_MAX) == size);
+        CHECK(!memcmp(striped, jpeg, size));
+        memset(striped, 0, size);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, striped, size) == size);
+        CHECK(!memcmp(striped, jpeg, size));
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, striped, size - 1) == 0);
+    }
+    printf("mode %d, %dx%d: %zu bytes, same with 2..%d stripes\n", mode, w, h, size, JPEG_ENCODE_STRIPES_MAX);
+    free(jpeg);
+    free(striped);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 10);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    CHECK(jpeg_encode_ctx_set_stripes(ctx, 0) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_set_stripes(ctx, JPEG_ENCODE_STRIPES_MAX + 1) == ESP_ERR_INVALID_ARG);
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+        //Fewer MCU rows than stripes, and rows not divisible by them
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, 16);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, 7 * 16 + 5);
+    }
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+    jpeg_encode_ctx_set_quality(ctx, 30);
+    test_mode(ctx, ENCODE_YUV_GRAY_MODE, yuyv, TEST_W, TEST_H);
+
+    //Not together with the pipeline
+    CHECK(jpeg_encode_ctx_set_pipeline(ctx, true) == ESP_ERR_INVALID_STATE);
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    CHECK(jpeg_encode_ctx_set_pipeline(ctx, true) == ESP_OK);
+    CHECK(jpeg_encode_ctx_set_stripes(ctx, 2) == ESP_ERR_INVALID_STATE);
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_stripes");
+}
@@ -0,0 +1,133 @@
+// jpeg_encode_ctx_set_subsampling(): 4:2:0 encodes of every colour input
+// decode to the source within the loss of chroma subsampling and are
+// smaller than 4:2:2; the frame size in the SOF is the whole MCUs; frames
+// smaller than one MCU are rejected by every entry point.
+#include <stdlib.h>
+#include <math.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//PSNR of the decoded RGB565 frame against the w x h top left of rgb
+//(TEST_W wide, RGB24) reduced to RGB565 precision the same way
+static double test_psnr(const uint8_t *pixels, int w, int h, const uint8_t *rgb)
+{
+    double sse = 0;
+
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const uint8_t *s = &rgb[3 * (y * TEST_W + x)];
+            int v = pixels[2 * (y * w + x)] << 8 | pixels[2 * (y * w + x) + 1];
+            int d[3] = {(v >> 11 << 3) - (s[0] & 0xF8), ((v >> 5 & 0x3F) << 2) - (s[1] & 0xFC), ((v & 0x1F) << 3) - (s[2] & 0xF8)};
+            sse += d[0] * d[0] + d[1] * d[1] + d[2] * d[2];
+        }
+    }
+    return 10 * log10(255.0 * 255.0 * 3 * w * h / (sse > 0 ? sse : 1));
+}
+
+//Encode, decode and compare; returns the JPEG size
+static size_t test_encode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, const uint8_t *rgb)
+{
+    uint8_t *jpeg = malloc(TEST_MAX);
+    int dw, dh;
+
+    size_t size = jpeg_encode_ctx_rect(ctx, mode, img, TEST_W * (mode == ENCODE_RGB24_MODE ? 3 : 2), 0, 0, w, h, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    uint8_t *pixels = size ? jpeg_decode(jpeg, &dw, &dh) : NULL;
+    CHECK(pixels != NULL);
+    if (pixels != NULL) {
+        double psnr = test_psnr(pixels, dw, dh, rgb);
+        printf("mode %d, %dx%d: %zu bytes, decoded %dx%d, PSNR %.1f dB\n", mode, w, h, size, dw, dh, psnr);
+        CHECK(psnr > 28);
+        free(pixels);
+    }
+    free(jpeg);
+    return size;
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    uint8_t *jpeg = malloc(TEST_MAX);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    int dw, dh;
+
+    host_test_frame(rgb, TEST_W, TEST_H, 11);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+    uint8_t *input[3] = {yuyv, rgb565, rgb};
+
+    CHECK(jpeg_encode_ctx_set_subsampling(ctx, (jpeg_subsampling_t)7) == ESP_ERR_INVALID_ARG);
+    jpeg_encode_ctx_set_quality(ctx, 90);
+    for (int mode = ENCODE_YUV_MODE; mode <= ENCODE_RGB24_MODE; mode++) {
+        jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_422);
+        size_t s422 = test_encode(ctx, mode, input[mode], TEST_W, TEST_H, rgb);
+        jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_420);
+        size_t s420 = test_encode(ctx, mode, input[mode], TEST_W, TEST_H, rgb);
+        CHECK(s420 < s422);
+    }
+
+    //Partial MCUs are dropped: the SOF has the whole ones
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_420);
+    size_t size = jpeg_encode_ctx_rect(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W * 2, 0, 0, 40, 31, jpeg, TEST_MAX);
+    uint8_t *pixels = size ? jpeg_decode(jpeg, &dw, &dh) : NULL;
+    CHECK(pixels != NULL && dw == 32 && dh == 16);
+    free(pixels);
+    test_encode(ctx, ENCODE_RGB16_MODE, rgb565, 16, 16, rgb);
+
+    //Less than one MCU: 16x16 in 4:2:0, 16x8 in 4:2:2, 8x8 in grayscale
+    static const struct {
+        jpeg_subsampling_t subsampling;
+        jpeg_encode_mode_t mode;
+        int w, h;
+    } small[] = {
+        {JPEG_SUBSAMPLING_420, ENCODE_RGB16_MODE, 16, 8},
+        {JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 17, 9},
+        {JPEG_SUBSAMPLING_420, ENCODE_YUV_MODE, 15, 16},
+        {JPEG_SUBSAMPLING_422, ENCODE_RGB16_MODE, 8, 8},
+        {JPEG_SUBSAMPLING_422, ENCODE_RGB24_MODE, 16, 7},
+        {JPEG_SUBSAMPLING_420, ENCODE_GRAY_MODE, 7, 8},
+    };
+    for (size_t i = 0; i < sizeof(small) / sizeof(small[0]); i++) {
+        jpeg_encode_mode_t mode = small[i].mode;
+        int w = small[i].w, h = small[i].h;
+        uint8_t *img = mode == ENCODE_GRAY_MODE ? gray : mode == ENCODE_RGB24_MODE ? rgb : mode == ENCODE_RGB16_MODE ? rgb565 : yuyv;
+        jpeg_encode_output_t out = {.quality = 50, .jpeg = jpeg, .max_size = TEST_MAX};
+        jpeg_planar_image_t planar = {
+            .format = JPEG_PLANAR_I420,
+            .plane = {gray, gray, gray},
+            .stride = {TEST_W, TEST_W, TEST_W},
+        };
+
+        jpeg_encode_ctx_set_subsampling(ctx, small[i].subsampling);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX) == 0);
+        CHECK(jpeg_encode_ctx_rect(ctx, mode, img, TEST_W * 3, 2, 2, w, h, jpeg, TEST_MAX) == 0);
+        CHECK(jpeg_encode_ctx_estimate(ctx, mode, img, w, h, 1) == 0);
+        CHECK(jpeg_encode_ctx_budget(ctx, mode, img, w, h, jpeg, TEST_MAX) == 0);
+        CHECK(jpeg_encode_ctx_multi(ctx, mode, img, w, h, &out, 1) == ESP_ERR_INVALID_SIZE);
+        CHECK(jpeg_encode_ctx_begin(ctx, mode, w, h, jpeg, TEST_MAX) == ESP_ERR_INVALID_ARG);
+        CHECK(jpeg_encode_ctx_push_rows(ctx, img, h) == ESP_ERR_INVALID_STATE);
+        if (mode != ENCODE_GRAY_MODE) {
+            CHECK(jpeg_encode_ctx_planar(ctx, &planar, w, h, jpeg, TEST_MAX) == 0);
+        }
+        jpeg_encode_ctx_set_optimize(ctx, true);
+        CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX) == 0);
+        jpeg_encode_ctx_set_optimize(ctx, false);
+    }
+    //The smallest frames that are encoded
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_422);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_GRAY_MODE, gray, 8, 8, jpeg, TEST_MAX) > 0);
+    test_encode(ctx, ENCODE_RGB16_MODE, rgb565, 16, 8, rgb);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    free(jpeg);
+    return host_test_result("test_subsampling");
+}
@@ -0,0 +1,189 @@
+// jpeg_encode_ctx_set_thumbnail(): the 1/8 scale thumbnail of 4:2:2, 4:2:0
+// and grayscale encodes against the block averages of the decoded frame, its
+// JPEG against the thumbnail, and the EXIF embedding leaving the image as it
+// was. Also: an estimate keeps the thumbnail of the last encode.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 640
+#define TEST_H 480
+#define TEST_MAX (1 << 20)
+
+//R, G and B of a big-endian RGB565 pixel scaled to 0..255
+static void test_rgb(const uint8_t *p, int rgb[3])
+{
+    int v = p[0] << 8 | p[1];
+
+    rgb[0] = (v >> 11) * 255 / 31;
+    rgb[1] = ((v >> 5) & 0x3F) * 255 / 63;
+    rgb[2] = (v & 0x1F) * 255 / 31;
+}
+
+//Largest difference of a channel between thumb and the decoded frame
+//(RGB565) scaled down the way the encoder does: luminance averaged over each
+//8x8 block, chrominance over the chroma block, ch_h (8 or 16) rows high
+static int test_blocks(const uint8_t *thumb, int tw, int th, const uint8_t *frame, int ch_h)
+{
+    int worst = 0;
+
+    for (int by = 0; by < th; by++) {
+        for (int bx = 0; bx < tw; bx++) {
+            double y = 0, cb = 0, cr = 0;
+            int t[3];
+            for (int i = 0; i < 16 * ch_h; i++) {
+                int x = bx / 2 * 16 + i % 16, r = by / (ch_h / 8) * ch_h + i / 16;
+                int p[3];
+                test_rgb(&frame[2 * (r * TEST_W + x)], p);
+                cb += -0.168736 * p[0] - 0.331264 * p[1] + 0.5 * p[2];
+                cr += 0.5 * p[0] - 0.418688 * p[1] - 0.081312 * p[2];
+                if (x / 8 == bx && r / 8 == by) {
+                    y += 0.299 * p[0] + 0.587 * p[1] + 0.114 * p[2];
+                }
+            }
+            y /= 64;
+            cb /= 16 * ch_h;
+            cr /= 16 * ch_h;
+            double expect[3] = {y + 1.402 * cr, y - 0.344136 * cb - 0.714136 * cr, y + 1.772 * cb};
+            test_rgb(&thumb[2 * (by * tw + bx)], t);
+            for (int k = 0; k < 3; k++) {
+                double e = expect[k] < 0 ? 0 : expect[k] > 255 ? 255 : expect[k];
+                int d = abs((int)(e + 0.5) - t[k]);
+                worst = d > worst ? d : worst;
+            }
+        }
+    }
+    return worst;
+}
+
+//The same for a grayscale frame, whose thumbnail has R = G = B: green
+static int test_blocks_gray(const uint8_t *thumb, int tw, int th, const uint8_t *frame)
+{
+    int worst = 0;
+
+    for (int by = 0; by < th; by++) {
+        for (int bx = 0; bx < tw; bx++) {
+            int sum = 0, t[3];
+            for (int i = 0; i < 64; i++) {
+                sum += frame[(by * 8 + i / 8) * TEST_W + bx * 8 + i % 8];
+            }
+            test_rgb(&thumb[2 * (by * tw + bx)], t);
+            int d = abs((sum + 32) / 64 - t[1]);
+            worst = d > worst ? d : worst;
+        }
+    }
+    return worst;
+}
+
+static void test_thumbnail(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int ch_h)
+{
+    uint8_t *jpeg = malloc(TEST_MAX), *small = malloc(TEST_MAX);
+    uint8_t *thumb = malloc(TEST_W * TEST_H / 32), *again = malloc(TEST_W * TEST_H / 32);
+    int tw, th, w, h;
+
+    size_t size = jpeg_encode_ctx(ctx, mode, img, TEST_W, TEST_H, jpeg, TEST_MAX);
+    CHECK(size > 0);
+    CHECK(jpeg_encode_ctx_thumbnail(ctx, thumb, 16, &tw, &th) == ESP_ERR_INVALID_SIZE);
+    CHECK(jpeg_encode_ctx_thumbnail(ctx, thumb, TEST_W * TEST_H / 32, &tw, &th) == ESP_OK);
+    CHECK(tw == TEST_W / 8 && th == TEST_H / 8);
+
+    //Each thumbnail pixel is the average of its blocks, up to the rounding of
+    //the DC coefficients and of RGB565
+    int worst;
+    if (mode == ENCODE_GRAY_MODE) {
+        worst = test_blocks_gray(thumb, tw, th, img);
+    } else {
+        uint8_t *pixels = jpeg_decode(jpeg, &w, &h);
+        CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+        worst = pixels ? test_blocks(thumb, tw, th, pixels, ch_h) : 255;
+        free(pixels);
+    }
+    printf("mode %d: thumbnail %dx%d, largest difference %d\n", mode, tw, th, worst);
+    CHECK(worst <= 12);
+
+    //An estimate does not replace it
+    jpeg_encode_ctx_estimate(ctx, mode, img, TEST_W, TEST_H, 4);
+    CHECK(jpeg_encode_ctx_thumbnail(ctx, again, TEST_W * TEST_H / 32, &tw, &th) == ESP_OK);
+    CHECK(!memcmp(again, thumb, tw * th * 2));
+
+    //Its JPEG (at quality 100, close to lossless) has the thumbnail's whole
+    //MCUs
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_MAX);
+    size_t n = jpeg_encode_ctx_thumbnail_jpeg(ctx, small, TEST_MAX);
+    CHECK(n > 0);
+    if (mode != ENCODE_GRAY_MODE) {
+        uint8_t *pixels = jpeg_decode(small, &w, &h);
+        CHECK(pixels != NULL && w == tw / 16 * 16 && h == th / 8 * 8);
+        int d = 0;
+        for (int y = 0; pixels && y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                int a[3], b[3];
+                test_rgb(&pixels[2 * (y * w + x)], a);
+                test_rgb(&thumb[2 * (y * tw + x)], b);
+                for (int k = 0; k < 3; k++) {
+                    d += abs(a[k] - b[k]);
+                }
+            }
+        }
+        printf("mode %d: thumbnail JPEG %zu bytes, mean difference %.2f\n", mode, n, (double)d / (3 * w * h));
+        CHECK(d < 2 * 3 * w * h);
+        free(pixels);
+    }
+
+    //EXIF: an APP1 segment with that JPEG behind the JFIF header, the rest of
+    //the image unchanged; if it does not fit nothing changes
+    uint8_t *orig = malloc(size);
+    memcpy(orig, jpeg, size);
+    CHECK(jpeg_encode_ctx_thumbnail_exif(ctx, jpeg, size, size + n - 1) == 0);
+    CHECK(!memcmp(jpeg, orig, size));
+    size_t m = jpeg_encode_ctx_thumbnail_exif(ctx, jpeg, size, TEST_MAX);
+    CHECK(m > size + n);
+    CHECK(jpeg[20] == 0xFF && jpeg[21] == 0xE1 && !memcmp(&jpeg[24], "Exif\0\0", 6));
+    size_t exif = (jpeg[22] << 8 | jpeg[23]) + 2 - n;
+    CHECK(m == size + exif + n);
+    CHECK(!memcmp(jpeg, orig, 20) && !memcmp(&jpeg[20 + exif], small, n));
+    CHECK(!memcmp(&jpeg[20 + exif + n], &orig[20], size - 20));
+    free(orig);
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_DEFAULT);
+    if (mode != ENCODE_GRAY_MODE) {
+        uint8_t *pixels = jpeg_decode(jpeg, &w, &h);
+        CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+        free(pixels);
+    }
+
+    free(jpeg);
+    free(small);
+    free(thumb);
+    free(again);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+    uint8_t thumb[64];
+    int tw, th;
+
+    host_test_frame(rgb, TEST_W, TEST_H, 9);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    CHECK(jpeg_encode_ctx_thumbnail(ctx, thumb, sizeof(thumb), &tw, &th) == ESP_ERR_INVALID_STATE);
+    jpeg_encode_ctx_set_thumbnail(ctx, true);
+    CHECK(jpeg_encode_ctx_thumbnail(ctx, thumb, sizeof(thumb), &tw, &th) == ESP_ERR_INVALID_STATE);
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_thumbnail(ctx, ENCODE_RGB16_MODE, rgb565, s ? 16 : 8);
+        test_thumbnail(ctx, ENCODE_YUV_MODE, yuyv, s ? 16 : 8);
+    }
+    test_thumbnail(ctx, ENCODE_GRAY_MODE, gray, 8);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_thumbnail");
+}
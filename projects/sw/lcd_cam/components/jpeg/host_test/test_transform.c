@@ -0,0 +1,126 @@
+// jpeg_encode_ctx_transform(): all 8 transforms of 4:2:2 and 4:2:0 frames
+// against the decoded source with its pixels moved the same way, each
+// transform undone by its inverse to the same bytes, and a stream with a
+// broken Huffman table rejected by the decoder.
+#include <stdlib.h>
+#include <string.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 176
+#define TEST_H 144
+#define TEST_MAX (1 << 20)
+
+static const jpeg_transform_t inverse[8] = {
+    JPEG_TRANSFORM_NONE, JPEG_TRANSFORM_FLIP_H, JPEG_TRANSFORM_FLIP_V, JPEG_TRANSFORM_ROT_180,
+    JPEG_TRANSFORM_TRANSPOSE, JPEG_TRANSFORM_ROT_270, JPEG_TRANSFORM_ROT_90, JPEG_TRANSFORM_TRANSVERSE,
+};
+
+//Largest difference of the R, G and B fields (in RGB565 steps) between
+//pixel a and pixel b of two decoded frames
+static int test_diff(const uint8_t *a, const uint8_t *b)
+{
+    int va = a[0] << 8 | a[1], vb = b[0] << 8 | b[1];
+    int dr = abs((va >> 11) - (vb >> 11));
+    int dg = abs(((va >> 5) & 0x3F) - ((vb >> 5) & 0x3F));
+    int db = abs((va & 0x1F) - (vb & 0x1F));
+    int d = dr > dg ? dr : dg;
+
+    return d > db ? d : db;
+}
+
+static void test_subsampling(jpeg_encode_ctx_t *ctx, jpeg_subsampling_t subsampling, const uint8_t *rgb)
+{
+    uint8_t *src = malloc(TEST_MAX), *out = malloc(TEST_MAX), *back = malloc(TEST_MAX);
+    int w, h, tw, th;
+
+    jpeg_encode_ctx_set_subsampling(ctx, subsampling);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, (uint8_t *)rgb, TEST_W, TEST_H, src, TEST_MAX);
+    CHECK(size > 0);
+    uint8_t *pixels = jpeg_decode(src, &w, &h);
+    CHECK(pixels != NULL && w == TEST_W && h == TEST_H);
+
+    for (int t = 0; t < 8 && pixels != NULL; t++) {
+        size_t n = jpeg_encode_ctx_transform(ctx, src, size, (jpeg_transform_t)t, out, TEST_MAX);
+        CHECK(n > 0);
+        uint8_t *turned = jpeg_decode(out, &tw, &th);
+        CHECK(turned != NULL);
+        if (turned == NULL) {
+            continue;
+        }
+        CHECK(tw == (t & 4 ? h : w) && th == (t & 4 ? w : h));
+        //Bit 2 transposes, then bit 0 mirrors left-right and bit 1 top-bottom;
+        //only the rounding of the inverse DCT may differ
+        int worst = 0;
+        for (int y = 0; y < th; y++) {
+            for (int x = 0; x < tw; x++) {
+                int xx = t & 1 ? tw - 1 - x : x;
+                int yy = t & 2 ? th - 1 - y : y;
+                int sx = t & 4 ? yy : xx, sy = t & 4 ? xx : yy;
+                int d = test_diff(&turned[2 * (y * tw + x)], &pixels[2 * (sy * w + sx)]);
+                worst = d > worst ? d : worst;
+            }
+        }
+        printf("subsampling %d, transform %d: %zu bytes, largest difference %d\n", subsampling, t, n, worst);
+        CHECK(worst <= 1);
+        free(turned);
+
+        //The inverse gives back the source, the same tables code the same bytes
+        size_t m = jpeg_encode_ctx_transform(ctx, out, n, inverse[t], back, TEST_MAX);
+        CHECK(m == size && !memcmp(back, src, size));
+    }
+    free(pixels);
+    free(src);
+    free(out);
+    free(back);
+}
+
+//A DHT whose code lengths overflow the code space (3 codes of 1 bit) must be
+//rejected before the Huffman tables are built
+static void test_malformed(jpeg_encode_ctx_t *ctx, const uint8_t *rgb)
+{
+    uint8_t *src = malloc(TEST_MAX), *out = malloc(TEST_MAX);
+    int w, h;
+    bool patched = false;
+
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_422);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB24_MODE, (uint8_t *)rgb, TEST_W, TEST_H, src, TEST_MAX);
+    for (size_t i = 0; i + 21 < size && !patched; i++) {
+        if (src[i] != 0xFF || src[i + 1] != 0xC4) {
+            continue;
+        }
+        //Move 3 codes to the 1-bit length, the symbol count stays the same
+        uint8_t *bits = &src[i + 5];
+        for (int l = 1; l < 16; l++) {
+            if (bits[l] >= 3) {
+                bits[l] -= 3;
+                bits[0] += 3;
+                patched = true;
+                break;
+            }
+        }
+    }
+    CHECK(patched);
+    uint8_t *pixels = jpeg_decode(src, &w, &h);
+    CHECK(pixels == NULL);
+    free(pixels);
+    CHECK(jpeg_encode_ctx_transform(ctx, src, size, JPEG_TRANSFORM_ROT_90, out, TEST_MAX) == 0);
+    CHECK(jpeg_encode_ctx_requantize(ctx, src, size, 64, out, TEST_MAX) == 0);
+    free(src);
+    free(out);
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 7);
+    jpeg_encode_ctx_set_quality(ctx, 90);
+    test_subsampling(ctx, JPEG_SUBSAMPLING_422, rgb);
+    test_subsampling(ctx, JPEG_SUBSAMPLING_420, rgb);
+    test_malformed(ctx, rgb);
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    return host_test_result("test_transform");
+}
@@ -0,0 +1,153 @@
+// jpeg_encode_ctx_set_trellis(): smaller than rounding for every input mode
+// and subsampling, smaller still for a larger strength, strength 0 the plain
+// bytes; stripes, the pipeline and band input give the sequential bytes.
+// With optimized tables the levels are picked with their code lengths: the
+// stream codes only symbols the tables have, so it decodes to the pixels of
+// its transcode to the standard tables, also for noise at quality 100; when
+// the tables have no EOB, the levels are those of the Annex K lengths.
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "jpeg.h"
+#include "host_test.h"
+
+#define TEST_W 320
+#define TEST_H 240
+#define TEST_MAX (1 << 20)
+
+//Trellis against rounding, and larger strengths against smaller ones
+static void test_mode(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    static const int strengths[] = {50, JPEG_TRELLIS_DEFAULT, 200, JPEG_TRELLIS_MAX};
+    uint8_t *plain = malloc(TEST_MAX), *jpeg = malloc(TEST_MAX);
+    size_t last;
+
+    jpeg_encode_ctx_set_trellis(ctx, 0);
+    size_t size = last = jpeg_encode_ctx(ctx, mode, img, w, h, plain, TEST_MAX);
+    CHECK(size > 0);
+    printf("mode %d, %dx%d: %zu bytes, trellis", mode, w, h, size);
+    for (size_t i = 0; i < sizeof(strengths) / sizeof(strengths[0]); i++) {
+        CHECK(jpeg_encode_ctx_set_trellis(ctx, strengths[i]) == ESP_OK);
+        size_t n = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX);
+        CHECK(n > 0 && n < last);
+        CHECK(n >= 2 && jpeg[n - 2] == 0xFF && jpeg[n - 1] == 0xD9);
+        printf(" %zu", n);
+        last = n;
+    }
+    printf("\n");
+    jpeg_encode_ctx_set_trellis(ctx, 0);
+    CHECK(jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, plain, size));
+    free(plain);
+    free(jpeg);
+}
+
+//Stripes, pipeline and band input against the sequential trellis encode
+static void test_paths(jpeg_encode_ctx_t *ctx, uint8_t *img, int w, int h)
+{
+    uint8_t *ref = malloc(TEST_MAX), *jpeg = malloc(TEST_MAX);
+
+    jpeg_encode_ctx_set_trellis(ctx, JPEG_TRELLIS_DEFAULT);
+    size_t size = jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, ref, TEST_MAX);
+    CHECK(size > 0);
+    jpeg_encode_ctx_set_stripes(ctx, 3);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, ref, size));
+    jpeg_encode_ctx_set_stripes(ctx, 1);
+    jpeg_encode_ctx_set_pipeline(ctx, true);
+    CHECK(jpeg_encode_ctx(ctx, ENCODE_RGB16_MODE, img, w, h, jpeg, TEST_MAX) == size && !memcmp(jpeg, ref, size));
+    jpeg_encode_ctx_set_pipeline(ctx, false);
+    CHECK(jpeg_encode_ctx_begin(ctx, ENCODE_RGB16_MODE, w, h, jpeg, TEST_MAX) == ESP_OK);
+    for (int y = 0; y < h; y += 7) {
+        jpeg_encode_ctx_push_rows(ctx, &img[y * w * 2], y + 7 > h ? h - y : 7);
+    }
+    CHECK(jpeg_encode_ctx_end(ctx) == size && !memcmp(jpeg, ref, size));
+    printf("%dx%d: stripes, pipeline and band input the same %zu bytes\n", w, h, size);
+    jpeg_encode_ctx_set_trellis(ctx, 0);
+    free(ref);
+    free(jpeg);
+}
+
+//Optimized tables with the trellis: smaller than the trellis alone, and the
+//same pixels as the transcode of the stream to the standard tables; true if
+//that transcode is the trellis encode with the standard tables (the same
+//levels picked)
+static bool test_optimized(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    uint8_t *std = malloc(TEST_MAX), *opt = malloc(TEST_MAX), *back = malloc(TEST_MAX);
+    int ow, oh, bw, bh;
+
+    jpeg_encode_ctx_set_trellis(ctx, JPEG_TRELLIS_DEFAULT);
+    size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, std, TEST_MAX);
+    jpeg_encode_ctx_set_optimize(ctx, true);
+    size_t n = jpeg_encode_ctx(ctx, mode, img, w, h, opt, TEST_MAX);
+    jpeg_encode_ctx_set_optimize(ctx, false);
+    jpeg_encode_ctx_set_trellis(ctx, 0);
+    printf("mode %d, %dx%d: trellis %zu bytes, optimized %zu\n", mode, w, h, size, n);
+    CHECK(size > 0 && n > 0 && n < size);
+    size_t m = jpeg_encode_ctx_transform(ctx, opt, n, JPEG_TRANSFORM_NONE, back, TEST_MAX);
+    CHECK(m > n);
+    bool same = m == size && !memcmp(back, std, size);
+
+    uint8_t *pixels = jpeg_decode(opt, &ow, &oh), *ref = jpeg_decode(back, &bw, &bh);
+    CHECK(pixels != NULL && ref != NULL && ow == bw && oh == bh);
+    CHECK(pixels != NULL && ref != NULL && !memcmp(pixels, ref, 2 * ow * oh));
+    free(pixels);
+    free(ref);
+    free(std);
+    free(opt);
+    free(back);
+    return same;
+}
+
+int main(void)
+{
+    uint8_t *rgb = malloc(TEST_W * TEST_H * 3);
+    jpeg_encode_ctx_t *ctx = jpeg_encode_ctx_create();
+
+    host_test_frame(rgb, TEST_W, TEST_H, 24);
+    uint8_t *rgb565 = host_test_rgb565(rgb, TEST_W, TEST_H);
+    uint8_t *yuyv = host_test_yuyv(rgb, TEST_W, TEST_H);
+    uint8_t *gray = host_test_gray(rgb, TEST_W, TEST_H);
+
+    for (int s = 0; s < 2; s++) {
+        jpeg_encode_ctx_set_subsampling(ctx, s ? JPEG_SUBSAMPLING_420 : JPEG_SUBSAMPLING_422);
+        test_mode(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_RGB16_MODE, rgb565, TEST_W, TEST_H);
+        test_mode(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H);
+        test_paths(ctx, rgb565, TEST_W, TEST_H);
+        //Partial MCUs at the right and bottom
+        test_paths(ctx, rgb565, 200, 101);
+        CHECK(!test_optimized(ctx, ENCODE_YUV_MODE, yuyv, TEST_W, TEST_H));
+    }
+    jpeg_encode_ctx_set_subsampling(ctx, JPEG_SUBSAMPLING_422);
+    test_mode(ctx, ENCODE_GRAY_MODE, gray, TEST_W, TEST_H);
+
+    //Noise at quality 100: the last coefficient of most blocks is non-zero
+    host_test_noise(rgb, TEST_W * TEST_H * 3, 24);
+    jpeg_encode_ctx_set_quality(ctx, 100);
+    CHECK(!test_optimized(ctx, ENCODE_RGB24_MODE, rgb, TEST_W, TEST_H));
+    //Gray blocks of two basis functions: a strong (7, 6) and a weak (7, 7)
+    //coefficient, worth its bits against the Annex K EOB but not against
+    //the optimized tables, which have no luminance EOB: the levels of the
+    //Annex K code lengths
+    for (int y = 0; y < 8; y++) {
+        for (int x = 0; x < 16; x++) {
+            double cy = cos((2 * y + 1) * 7 * M_PI / 16), c6 = cos((2 * (x & 7) + 1) * 6 * M_PI / 16);
+            double c7 = cos((2 * (x & 7) + 1) * 7 * M_PI / 16);
+            memset(&rgb[3 * (y * 16 + x)], (int)lround(128 + (200 * c6 + 1.3 * c7) * cy / 4), 3);
+        }
+    }
+    CHECK(test_optimized(ctx, ENCODE_RGB24_MODE, rgb, 16, 8));
+    jpeg_encode_ctx_set_quality(ctx, JPEG_QUALITY_DEFAULT);
+
+    //Out of range, off again
+    CHECK(jpeg_encode_ctx_set_trellis(ctx, -1) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_set_trellis(ctx, JPEG_TRELLIS_MAX + 1) == ESP_ERR_INVALID_ARG);
+    CHECK(jpeg_encode_ctx_set_trellis(ctx, 0) == ESP_OK);
+
+    jpeg_encode_ctx_delete(ctx);
+    free(rgb);
+    free(rgb565);
+    free(yuyv);
+    free(gray);
+    return host_test_result("test_trellis");
+}
@@ -4,5 +4,29 @@
 // integer DCTs
 void dct(int16_t pixel[8][8], int16_t data[8][8]);
 
+// quantizer tables of dct_quantize() are scaled by 1 << DCT_FDTBL_SCALE
+#define DCT_FDTBL_SCALE 16
+
+// AAN DCT fused with quantization, output in zig-zag order
+void dct_quantize(int16_t pixels[8][8], const int32_t fdtbl[64], int16_t data[64]);
+
+// the same in two steps, to quantize one transform with several tables:
+// AAN-scaled coefficients in natural order, and their quantization
+void dct_aan(int16_t pixels[8][8], int32_t coef[64]);
+void dct_requantize(const int32_t coef[64], const int32_t fdtbl[64], int16_t data[64]);
+
+// rate-distortion quantization of dct_aan() coefficients: levels that cost
+// fewer bits (Huffman code lengths aclen) where that is worth their error,
+// lambda in squared levels of DCT_RD_BITS fraction bits
+#define DCT_RD_BITS 4
+void dct_quantize_rd(const int32_t coef[64], const int32_t fdtbl[64], const unsigned char qtable[64],
+                     const unsigned char aclen[256], uint32_t lambda, int16_t data[64]);
+
+// DC of dct_quantize() on a block of 64 equal pixels, whose AC are all 0
+int16_t dct_quantize_flat(int16_t pixel, const int32_t fdtbl[64]);
+
+// build the dct_quantize() quantizer table of a natural order qtable
+void dct_fdtbl(const unsigned char qtable[64], int32_t fdtbl[64]);
+
 
 #endif//__DCT_H__
\ No newline at end of file
@@ -1,17 +1,251 @@
-#pragma once
-#include <stdint.h>
-#include "esp_err.h"
-#include "tjpgd.h"
-#include "jpegenc.h"
-
-#define JPEG_WORK_BUF_SIZE 3100
-
-typedef enum {
-    ENCODE_YUV_MODE = 0,
-    ENCODE_RGB16_MODE,
-    ENCODE_RGB24_MODE
-} jpeg_encode_mode_t;
-
-uint8_t *jpeg_decode(uint8_t *jpeg, int *w, int* h);
-
+#pragma once
+#include <stdint.h>
+#include <stdbool.h>
+#include "esp_err.h"
+#include "tjpgd.h"
+#include "jpegenc.h"
+
+#define JPEG_WORK_BUF_SIZE 3100
+
+// Most stripes a frame can be split into, see jpeg_encode_ctx_set_stripes()
+#define JPEG_ENCODE_STRIPES_MAX 4
+
+typedef enum {
+    ENCODE_YUV_MODE = 0,
+    ENCODE_RGB16_MODE,
+    ENCODE_RGB24_MODE,
+    ENCODE_GRAY_MODE,       // 8-bit grayscale in, 1-component JPEG out
+    ENCODE_YUV_GRAY_MODE,   // YUYV in, only Y is encoded
+    ENCODE_UYVY_MODE,       // 4:2:2 packed as Cb Y Cr Y
+    ENCODE_YVYU_MODE        // 4:2:2 packed as Y Cr Y Cb
+} jpeg_encode_mode_t;
+
+uint8_t *jpeg_decode(uint8_t *jpeg, int *w, int* h);
+
+// Encoder context: holds all encoder state, so that several encodes can run
+// at once (e.g. one per core). Allocate once and reuse it for every frame.
+typedef struct jpeg_encode_ctx_s jpeg_encode_ctx_t;
+
+jpeg_encode_ctx_t *jpeg_encode_ctx_create(void);
+
+void jpeg_encode_ctx_delete(jpeg_encode_ctx_t *ctx);
+
+// Quality of the following encodes on this context: 1..100 (IJG scaling of
+// the Annex K tables) or JPEG_QUALITY_DEFAULT for the built-in tables.
+// Tables are built once per level, switching between frames is free.
+esp_err_t jpeg_encode_ctx_set_quality(jpeg_encode_ctx_t *ctx, int quality);
+
+// Chroma subsampling of the following encodes on this context, 4:2:2 by
+// default. 4:2:0 needs 6 instead of 8 blocks per 16x16 pixels.
+esp_err_t jpeg_encode_ctx_set_subsampling(jpeg_encode_ctx_t *ctx, jpeg_subsampling_t subsampling);
+
+// Split the following buffer encodes (jpeg_encode_ctx()) on this context into
+// 1..JPEG_ENCODE_STRIPES_MAX stripes of MCU rows. The calling task encodes the
+// first stripe, one worker task per other stripe (pinned round-robin to the
+// other cores) the rest, the output is the same as with 1 (the default).
+// Each worker needs its own encoder state in internal RAM. Not together with
+// the pipeline (ESP_ERR_INVALID_STATE).
+esp_err_t jpeg_encode_ctx_set_stripes(jpeg_encode_ctx_t *ctx, int stripes);
+
+// Pipeline the following encodes on this context: the calling task does colour
+// conversion, DCT and quantization, a worker task on the next core Huffman
+// coding and output (the callback of jpeg_encode_ctx_cb() runs there). The
+// two are coupled by a lock-free ring of quantized blocks, so this balances
+// for any image width. The output is the same as without. Not together with
+// stripes (ESP_ERR_INVALID_STATE).
+esp_err_t jpeg_encode_ctx_set_pipeline(jpeg_encode_ctx_t *ctx, bool enable);
+
+// Two-pass encodes with Huffman tables optimized for each image instead of
+// the standard ones: a first pass (colour conversion, DCT and quantization,
+// no output) counts the symbols, the second one writes and uses tables built
+// from them. Typically 3-8% smaller for about 1.8 times the encode time.
+// Sequential, takes precedence over replenishment, stripes and pipeline;
+// band input (jpeg_encode_ctx_begin()) keeps the standard tables.
+esp_err_t jpeg_encode_ctx_set_optimize(jpeg_encode_ctx_t *ctx, bool enable);
+
+// Rate-distortion (trellis) quantization for the following encodes on this
+// context, for archiving where size matters more than time: instead of
+// rounding every coefficient, each block gets the levels with the least
+// squared error plus lambda times the bits they code to (the code lengths of
+// the tables in use, so optimized tables get their own levels), zeroing or
+// lowering coefficients that are not worth their bits. strength scales
+// lambda, JPEG_TRELLIS_DEFAULT is tuned for PSNR: at the same PSNR 10-12%
+// smaller on a camera test frame, 4-9% on a smoothed one (host_test/
+// bench_trellis), for 2-3 times the encode time. 0 turns it off.
+// Integer arithmetic only (no FPU on the ESP32-S2). Works with every
+// encode mode; the transcoders keep the source levels.
+#define JPEG_TRELLIS_DEFAULT (100)
+#define JPEG_TRELLIS_MAX     (400)
+esp_err_t jpeg_encode_ctx_set_trellis(jpeg_encode_ctx_t *ctx, int strength);
+
+// Conditional replenishment for MJPEG from a mostly static camera: keep a
+// hash of every MCU row's pixels and its encoded bytes, and copy rows that did
+// not change since the previous buffer encode on this context instead of
+// encoding them again. The output is the same as without. Costs one hash
+// pass over the frame and a copy of the entropy-coded data (PSRAM if
+// available). Used instead of stripes or pipeline when enabled.
+esp_err_t jpeg_encode_ctx_set_replenish(jpeg_encode_ctx_t *ctx, bool enable);
+
+// Encode straight into jpeg[max_size], no intermediate copy. Returns the JPEG
+// size, or 0 if it does not fit: the encode stops at the row that overflows.
+// Partial MCUs at the right and bottom are dropped; every encode call rejects
+// frames smaller than one MCU (16x8, 4:2:0 16x16, grayscale 8x8).
+size_t jpeg_encode_ctx(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size);
+
+// Encode the w x h rectangle at (x, y) of a larger frame in place, e.g. a crop
+// or digital-zoom window, without copying it out first. stride is the byte
+// distance between two rows of img, x must be even for the YUYV modes. Same
+// result and return value as jpeg_encode_ctx() on the cropped image.
+size_t jpeg_encode_ctx_rect(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int stride, int x, int y, int w, int h, uint8_t *jpeg, size_t max_size);
+
+// Encode into cb, called with consecutive JPEG_BUFFSIZE chunks (the last one
+// shorter) from inside this call, e.g. to feed a socket or a file. Returns
+// the JPEG size, or 0 if cb returned false, which also ends the encode.
+size_t jpeg_encode_ctx_cb(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, jpeg_sink_cb_t cb, void *arg);
+
+// Predict the size of jpeg_encode_ctx() with the current settings without any
+// output: headers plus every step-th MCU row are encoded into a byte counter
+// and scaled up to the whole image. step 1 gives the exact size, 4 takes about
+// a quarter of an encode and is typically within a few percent.
+size_t jpeg_encode_ctx_estimate(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, int step);
+
+// Rate control: encode into jpeg[max_size] at the highest quality estimated
+// to fill at most 15/16 of max_size, from up to 5 sampled estimates starting
+// at the current quality. Retries once a step lower if it does not fit. The
+// chosen quality stays set on ctx and is where the next frame starts from.
+// Returns the size, or 0 if even that did not fit.
+size_t jpeg_encode_ctx_budget(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size);
+
+// Most outputs of jpeg_encode_ctx_multi()
+#define JPEG_ENCODE_OUTPUTS_MAX 4
+
+// One output of jpeg_encode_ctx_multi()
+typedef struct {
+    int quality;               //As for jpeg_encode_ctx_set_quality()
+    uint8_t *jpeg;             //Output buffer of max_size bytes, if cb is NULL
+    size_t max_size;
+    jpeg_sink_cb_t cb;         //Else called as for jpeg_encode_ctx_cb()
+    void *arg;
+    size_t size;               //Set to the JPEG size, or 0 if it did not fit / cb aborted
+} jpeg_encode_output_t;
+
+// Encode one frame at n (1..JPEG_ENCODE_OUTPUTS_MAX) qualities at once, e.g. a
+// live stream and an archive copy: colour conversion and DCT run once per
+// block, only quantization and Huffman coding once per output. Every output
+// is the same as a jpeg_encode_ctx() / _cb() at its quality, and one that
+// fails does not stop the others. Outputs past the first need an encoder
+// state each in internal RAM, kept on the context. Sequential, with the
+// subsampling of the context; its quality is left as it was.
+esp_err_t jpeg_encode_ctx_multi(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, jpeg_encode_output_t *out, int n);
+
+// Record a 1/8 scale thumbnail during the following encodes on this context:
+// one pixel per 8x8 block, the block average taken from the quantized DC
+// coefficient (exact to Q/8 levels of its quantizer Q), so no decode and
+// scale pass. Frames are w/8 x h/8 for the whole MCUs that are encoded, the
+// planes (2 bytes per pixel) are kept on the context. Takes precedence over
+// stripes and replenishment; multi-quality encodes record the first output.
+esp_err_t jpeg_encode_ctx_set_thumbnail(jpeg_encode_ctx_t *ctx, bool enable);
+
+// Thumbnail of the last complete encode as RGB565 (big-endian, as for
+// ENCODE_RGB16_MODE) into rgb[size]; sets its size in w, h.
+// ESP_ERR_INVALID_STATE if there is none, ESP_ERR_INVALID_SIZE if too small.
+esp_err_t jpeg_encode_ctx_thumbnail(jpeg_encode_ctx_t *ctx, uint8_t *rgb, size_t size, int *w, int *h);
+
+// The same thumbnail encoded as a JPEG at the current quality into
+// jpeg[max_size], 4:2:2 and whole MCUs like any frame. Returns its size, or 0.
+size_t jpeg_encode_ctx_thumbnail_jpeg(jpeg_encode_ctx_t *ctx, uint8_t *jpeg, size_t max_size);
+
+// Embed that JPEG thumbnail as an EXIF APP1 segment behind the JFIF header of
+// jpeg[size], the image it belongs to, in place (no second buffer): the
+// image needs max_size - size spare bytes for it. Returns the new size, or 0
+// with jpeg unchanged if the thumbnail is missing or does not fit.
+size_t jpeg_encode_ctx_thumbnail_exif(jpeg_encode_ctx_t *ctx, uint8_t *jpeg, size_t size, size_t max_size);
+
+// Record where every MCU row starts in the JPEG of the following encodes on
+// this context, for partial decodes from a row on: offsets[i] is the byte
+// offset of row i behind its restart marker (row 0: behind the headers),
+// offsets[rows] that of EOI, taken as the stream is written, no scan. With
+// app the same offsets go into an APP9 segment behind the JFIF header as
+// well: "RSTIDX\0", a 16-bit entry count and 32-bit big-endian offsets from
+// the start of the file (buffer output only, and only if max covers all
+// rows). Stripes are not used while enabled; jpeg_encode_ctx_thumbnail_exif()
+// moves the offsets with the image. offsets NULL turns it off.
+esp_err_t jpeg_encode_ctx_set_index(jpeg_encode_ctx_t *ctx, uint32_t *offsets, int max, bool app);
+
+// Entries the last encode recorded (rows + 1), more than max if offsets was
+// too small for all of them, 0 if not enabled.
+int jpeg_encode_ctx_index(const jpeg_encode_ctx_t *ctx);
+
+// Lossless transforms of jpeg_encode_ctx_transform(): bit 2 transposes,
+// then bit 0 mirrors left-right and bit 1 top-bottom
+typedef enum {
+    JPEG_TRANSFORM_NONE = 0,
+    JPEG_TRANSFORM_FLIP_H = 1,
+    JPEG_TRANSFORM_FLIP_V = 2,
+    JPEG_TRANSFORM_ROT_180 = 3,
+    JPEG_TRANSFORM_TRANSPOSE = 4,   // Mirror at the top-left to bottom-right diagonal
+    JPEG_TRANSFORM_ROT_90 = 5,      // Clockwise
+    JPEG_TRANSFORM_ROT_270 = 6,
+    JPEG_TRANSFORM_TRANSVERSE = 7,  // Mirror at the other diagonal
+} jpeg_transform_t;
+
+// Rotate or mirror the baseline Y/Cb/Cr JPEG src[size] (4:4:4, 4:2:2 or 4:2:0,
+// as tjpgd reads it) into jpeg[max_size] without decoding the pixels: only
+// the Huffman coding is undone, the quantized coefficients are moved between
+// and inside blocks, and coded again with the same quantizers, so the image
+// does not lose any quality. 4:2:2 turned by 90 degrees is 4:4:0. Partial
+// MCUs at the right and bottom edge are dropped (this encoder does not
+// write any). The coefficients of the whole image are held at once (PSRAM if
+// available, 128 bytes per block). Uses the optimized Huffman tables when
+// set on ctx. Returns the size, or 0 if src cannot be read or jpeg is full.
+size_t jpeg_encode_ctx_transform(jpeg_encode_ctx_t *ctx, const uint8_t *src, size_t size, jpeg_transform_t transform, uint8_t *jpeg, size_t max_size);
+
+// Shrink the baseline Y/Cb/Cr JPEG src[size], e.g. a frame of a sensor in JPEG
+// mode, into jpeg[max_size] without decoding the pixels: its quantized
+// coefficients are quantized again with the tables of the current quality
+// (never finer than those of src), only the first coefs (1..64) of each block
+// in zig-zag order are kept, and the result is Huffman coded again. Streams
+// MCU by MCU, no image-sized buffer. Same sampling and dropped partial MCUs as
+// jpeg_encode_ctx_transform(); with optimized Huffman tables src is decoded
+// twice. Returns the size, or 0 if src cannot be read or jpeg is full.
+size_t jpeg_encode_ctx_requantize(jpeg_encode_ctx_t *ctx, const uint8_t *src, size_t size, int coefs, uint8_t *jpeg, size_t max_size);
+
+// Planar and semi-planar input of jpeg_encode_ctx_planar()
+typedef enum {
+    JPEG_PLANAR_I420 = 0,   // Y, Cb and Cr planes, chroma w/2 x h/2
+    JPEG_PLANAR_I422,       // Y, Cb and Cr planes, chroma w/2 x h
+    JPEG_PLANAR_NV12,       // Y plane and w/2 x h/2 Cb,Cr pairs in plane[1]
+    JPEG_PLANAR_NV16,       // Y plane and w/2 x h Cb,Cr pairs in plane[1]
+} jpeg_planar_format_t;
+
+typedef struct {
+    jpeg_planar_format_t format;
+    const uint8_t *plane[3];   //Y, Cb, Cr (semi-planar: Y, CbCr, unused)
+    int stride[3];             //Bytes from one row of each plane to the next
+} jpeg_planar_image_t;
+
+// Encode a w x h planar or semi-planar frame into jpeg[max_size], the blocks
+// are gathered from the planes as they are (no repacking to YUYV). Each
+// plane has its own stride, so pointing them into a larger frame encodes a
+// crop. The output has the subsampling of the context: 4:2:0 chroma rows are
+// repeated for 4:2:2, 4:2:2 ones averaged for 4:2:0. Sequential on the
+// calling task (optimized tables if set), returns the size or 0.
+size_t jpeg_encode_ctx_planar(jpeg_encode_ctx_t *ctx, const jpeg_planar_image_t *img, int w, int h, uint8_t *jpeg, size_t max_size);
+
+// Band input: encode a frame while it arrives, e.g. from camera DMA, instead
+// of waiting for it in a full-frame buffer. jpeg_encode_ctx_begin() writes
+// the headers into jpeg[max_size] (_cb: into cb), then every
+// jpeg_encode_ctx_push_rows() takes the next n pixel rows (w pixels each,
+// contiguous) and encodes all MCU rows it completes. Bands of a multiple of
+// the MCU height (8, or 16 for 4:2:0) are encoded in place, others are
+// gathered in a one-MCU-row buffer. Rows past h are ignored.
+// jpeg_encode_ctx_end() returns the JPEG size, or 0 if the output failed or
+// not all rows of the whole MCU rows were pushed. Always sequential on the
+// calling task.
+esp_err_t jpeg_encode_ctx_begin(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, int w, int h, uint8_t *jpeg, size_t max_size);
+esp_err_t jpeg_encode_ctx_begin_cb(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, int w, int h, jpeg_sink_cb_t cb, void *arg);
+esp_err_t jpeg_encode_ctx_push_rows(jpeg_encode_ctx_t *ctx, uint8_t *rows, int n);
+size_t jpeg_encode_ctx_end(jpeg_encode_ctx_t *ctx);
+
+// Same as jpeg_encode_ctx() on a shared default context, not re-entrant
 size_t jpeg_encode(jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size);
\ No newline at end of file
@@ -2,36 +2,52 @@
 #define __JPEG_H__
 
 #include "stdint.h"
+#include "stdbool.h"
+#include "stddef.h"
 
 #define ENABLE_RGB (1)
 
 //---------------- J P E G ---------------
 
-// Application should provide this function for JPEG stream flushing
-extern void write_jpeg(uint8_t* buff, unsigned size);
-extern uint32_t jpeg_addr_ptr(void);
-
 typedef struct huffman_s
 {
-	const unsigned char  (*haclen)[12];
-	const unsigned short (*hacbit)[12];
-	const unsigned char  *hdclen;
-	const unsigned short *hdcbit;
-	const unsigned char  *qtable;
+	const uint32_t       *hdccode; // (code << 8) | length, by magnitude
+	const uint32_t       *haccode; // (code << 8) | length, by (run << 4) | magnitude
+	const int32_t        *fdtbl;   // quantizer table of dct_quantize()
+	const unsigned char  *qtable;  // DQT table fdtbl is built from
+	uint32_t             lambda;   // dct_quantize_rd() error per bit, 0: levels rounded
 	short                dc;
 }
 huffman_t;
 
-extern huffman_t huffman_ctx[3];
+typedef struct bitbuffer_s
+{
+	uint64_t buf;
+	unsigned n;
+}
+bitbuffer_t;
 
-#define	HUFFMAN_CTX_Y	&huffman_ctx[0]
-#define	HUFFMAN_CTX_Cb	&huffman_ctx[1]
-#define	HUFFMAN_CTX_Cr	&huffman_ctx[2]
+// built-in ("Paint") quantization tables
+#define JPEG_QUALITY_DEFAULT (0)
+// highest IJG quality level
+#define JPEG_QUALITY_MAX     (100)
 
-void huffman_start(short height, short width);
-void huffman_resetdc(void);
-void huffman_stop(void);
-void huffman_encode(huffman_t *const ctx, const short data[64]);
+// quantization tables of one quality level
+typedef struct jpeg_qtables_s
+{
+	unsigned char qtable[2][64]; // DQT tables, natural order, luminance/chrominance
+	int32_t       fdtbl[2][64];  // matching dct_quantize() quantizers
+}
+jpeg_qtables_t;
+
+// chroma subsampling of the encoded image
+typedef enum {
+	JPEG_SUBSAMPLING_422 = 0,   // H=2,V=1: 16x8 MCU, 2 Y + Cb + Cr blocks
+	JPEG_SUBSAMPLING_420,       // H=2,V=2: 16x16 MCU, 4 Y + Cb + Cr blocks
+	// headers only, for coefficients from a transcoder:
+	JPEG_SUBSAMPLING_444,       // H=1,V=1: 8x8 MCU, Y + Cb + Cr blocks
+	JPEG_SUBSAMPLING_440,       // H=1,V=2: 8x16 MCU, 2 Y + Cb + Cr blocks (4:2:2 turned)
+} jpeg_subsampling_t;
 
 #ifdef ENABLE_RGB
 // color mapping
@@ -41,22 +57,253 @@ typedef struct {
 	color Green;
 	color Blue;
 } RGB;
+#endif // ENABLE_RGB
+
+// size of the code-stream chunks handed to a sink callback
+#define JPEG_BUFFSIZE (1024)
+
+// sink callback: gets the code-stream in order, JPEG_BUFFSIZE bytes at a
+// time (the last chunk is shorter); return false to abort the encode
+typedef bool (*jpeg_sink_cb_t)(void *arg, const uint8_t *data, size_t len);
+
+// where the code-stream goes, see huffman_sink_buffer()/huffman_sink_callback()
+typedef struct jpeg_sink_s
+{
+	uint8_t        *buf;     // caller buffer, or enc->jpgbuff in callback mode
+	size_t          size;    // capacity of buf
+	size_t          pos;     // bytes written into buf
+	size_t          total;   // bytes already handed out / discarded before buf
+	jpeg_sink_cb_t  cb;      // NULL: buf is the whole output buffer
+	void           *arg;     // passed to cb
+	bool            full;    // caller buffer used up, further bytes are discarded
+	bool            failed;  // overflow, or aborted by the callback
+	uint8_t        *out;     // caller buffer, still at hand once buf is the scratch
+}
+jpeg_sink_t;
+
+// Huffman tables as written to DHT (BITS and HUFFVAL of Annex C), in the
+// order luminance DC, luminance AC, chrominance DC, chrominance AC
+typedef struct huffman_dht_s
+{
+	const unsigned char *nrcodes[4];
+	const unsigned char *values[4];
+}
+huffman_dht_t;
+
+// room for SOI and all headers up to SOS
+#define JPEG_HEADER_SIZE (640)
+
+// headers as written by the last huffman_start(), with what they depend on
+typedef struct jpeg_header_s
+{
+	const jpeg_qtables_t *qtables;
+	int16_t       width;
+	int16_t       height;
+	jpeg_subsampling_t subsampling;
+	bool          grayscale;
+	unsigned      app;                    // end of SOI and APP0, where an index segment goes
+	unsigned      len;                    // 0: nothing cached
+	uint8_t       data[JPEG_HEADER_SIZE];
+}
+jpeg_header_t;
+
+// receives the quantized blocks (zig-zag order) instead of the entropy coder,
+// in code-stream order: comp is 0 (Y), 1 (Cb) or 2 (Cr) - the index into
+// huffman[] - or JPEG_BLOCK_RST + n for the restart marker n, data is NULL then
+typedef void (*jpeg_block_cb_t)(void *arg, unsigned comp, const int16_t *data);
+#define JPEG_BLOCK_RST (8)
+
+// 1/8 scale image made of the block averages (DC coefficients) of the last
+// encode, see huffman_setup(); one sample per 8x8 block, chrominance
+// planes are width / 2 samples wide and height (4:2:0: height / 2) high
+typedef struct jpeg_thumb_s
+{
+	uint8_t      *y;                      // luminance, width x height, malloc()ed
+	uint8_t      *cb;
+	uint8_t      *cr;
+	size_t        size;                   // capacity of y, cb and cr get size / 2
+	unsigned      width;                  // luminance blocks per row
+	unsigned      height;                 // block rows
+	unsigned      n[3];                   // blocks recorded so far, Y/Cb/Cr
+}
+jpeg_thumb_t;
+
+// chroma of planar and semi-planar input, see encode_line_planar()
+typedef struct jpeg_planes_s
+{
+	const uint8_t *cb;                    // first Cb sample of the image
+	const uint8_t *cr;                    // first Cr sample of the image
+	unsigned      cb_stride;              // bytes from one Cb row to the next
+	unsigned      cr_stride;
+	unsigned      step;                   // bytes from one sample to the next: 1 planar, 2 semi-planar
+	bool          half;                   // half as many chroma rows as image rows (4:2:0)
+}
+jpeg_planes_t;
+
+// byte offsets of the MCU rows in the code-stream of the last encode: entry
+// 0 is the first byte behind the headers, entry i the first byte behind the
+// restart marker of row i - 1, the last one (rows + 1 entries) that of EOI.
+// Recorded by huffman_start() and write_RSI(), see huffman_index_row()
+typedef struct jpeg_index_s
+{
+	uint32_t     *offset;                 // caller array, max entries
+	unsigned      max;
+	unsigned      count;                  // entries of the last encode, may exceed max
+	bool          app;                    // also carry them in a JPEG_INDEX_MARKER segment
+	size_t        at;                     // start of its offsets in the output, 0: none
+}
+jpeg_index_t;
+
+// APP9: length, JPEG_INDEX_ID, 16-bit number of entries, 32-bit big-endian
+// offsets from the start of the file
+#define JPEG_INDEX_MARKER (0xFFE9)
+#define JPEG_INDEX_ID     "RSTIDX"
+#define JPEG_INDEX_SIZE(entries) (2 + 2 + sizeof(JPEG_INDEX_ID) + 2 + 4 * (entries))
+
+// encoder context: everything one encode needs, so that several encoders
+// (one per task / core) can run at the same time without locking;
+// must start out zeroed, tables and headers are built on first use
+typedef struct jpeg_enc_s
+{
+	huffman_t     huffman[3];             // Y, Cb, Cr
+	uint32_t      hdccode[2][12];         // packed DC codes, luminance/chrominance
+	uint32_t      haccode[2][256];        // packed AC codes, luminance/chrominance
+	const jpeg_qtables_t *qtables;        // set by huffman_quality()
+	const huffman_dht_t *dht;             // set by huffman_optimize(), NULL: Annex K tables
+	const huffman_dht_t *hbuilt;          // tables hdccode/haccode are built from
+	struct huffman_opt_s *opt;            // huffman_gather() statistics and optimized tables
+	bitbuffer_t   bitbuf;
+	int16_t       img_width;
+	int16_t       img_high;
+	unsigned      stride;                 // bytes per pixel row of the line buffers, 0: img_width pixels
+	jpeg_sink_t   sink;                   // code-stream output
+	unsigned char jpgbuff[JPEG_BUFFSIZE]; // callback chunk / overflow scratch
+	jpeg_subsampling_t subsampling;       // set before huffman_start()
+	bool          grayscale;              // Y only (1 component), set before huffman_start()
+#ifdef ENABLE_RGB
+	RGB           RGB16x16[16][16];       // up to four 8x8 red/green/blue blocks
+#endif // ENABLE_RGB
+	int16_t       Y8x8[4][8][8];          // luminance
+	int16_t       Cb8x8[8][8];            // chrominance
+	int16_t       Cr8x8[8][8];            // chrominance
+	jpeg_header_t header;                 // header template, see huffman_start()
+	jpeg_block_cb_t block_cb;             // NULL: entropy-code blocks right away
+	void         *block_arg;              // passed to block_cb
+	jpeg_thumb_t *thumb;                  // NULL: no thumbnail recorded
+	jpeg_planes_t planes;                 // chroma of encode_line_planar(), cb NULL:
+	                                      // packed input
+	jpeg_index_t *index;                  // NULL: no row offsets recorded
+	unsigned      trellis;                // rate-distortion quantization strength
+	                                      // (percent), 0: off, see huffman_setup()
+	unsigned char haclen[2][256];         // AC code lengths dct_quantize_rd() costs bits with
+	struct jpeg_enc_s *next;              // more encoders (own qtables and sink, same
+	                                      // subsampling) fed from the same DCT, see
+	                                      // encode_block(); NULL: just this one
+}
+jpeg_enc_t;
+
+#define	HUFFMAN_CTX_Y(enc)	(&(enc)->huffman[0])
+#define	HUFFMAN_CTX_Cb(enc)	(&(enc)->huffman[1])
+#define	HUFFMAN_CTX_Cr(enc)	(&(enc)->huffman[2])
+
+// pixel rows of one MCU row (line), 8 for 4:2:2 and 16 for 4:2:0
+#define	JPEG_MCU_HEIGHT(enc)	(((enc)->subsampling == JPEG_SUBSAMPLING_420 || \
+                              	  (enc)->subsampling == JPEG_SUBSAMPLING_440) && !(enc)->grayscale ? 16 : 8)
+// pixel columns of one MCU, 16 for 4:2:2 and 4:2:0
+#define	JPEG_MCU_WIDTH(enc)	(((enc)->subsampling == JPEG_SUBSAMPLING_444 || \
+                              	  (enc)->subsampling == JPEG_SUBSAMPLING_440) || (enc)->grayscale ? 8 : 16)
+
+// output selection, call before huffman_start():
+//  buffer mode writes straight into buf, once it is full the encode fails
+//  (huffman_sink_failed()) and the rest of the stream is dropped;
+//  callback mode stages JPEG_BUFFSIZE bytes in enc->jpgbuff per call of cb
+void   huffman_sink_buffer(jpeg_enc_t *enc, uint8_t *buf, size_t size);
+void   huffman_sink_callback(jpeg_enc_t *enc, jpeg_sink_cb_t cb, void *arg);
+// no output, only huffman_sink_length() counts, for size estimates
+void   huffman_sink_count(jpeg_enc_t *enc);
+// fail the sink from outside, e.g. when the output stage gave up
+void   huffman_sink_abort(jpeg_enc_t *enc);
+// bytes of code-stream produced so far (including any that did not fit)
+size_t huffman_sink_length(const jpeg_enc_t *enc);
+// true once the output overflowed or the callback asked to stop, the line
+// encoders can be skipped from then on
+bool   huffman_sink_failed(const jpeg_enc_t *enc);
+
+int  huffman_quality(jpeg_enc_t *enc, int quality);
+
+// two-pass optimized Huffman tables: after huffman_gather_start(), a first
+// pass over the image with block_cb = huffman_gather, block_arg = enc counts
+// the symbols; huffman_optimize() turns the counts into the tables the
+// following huffman_start() writes and codes with, until huffman_standard()
+// goes back to the Annex K tables. enc->opt is malloc()ed, free it with enc.
+int  huffman_gather_start(jpeg_enc_t *enc);
+void huffman_gather(void *enc, unsigned comp, const int16_t *data);
+void huffman_optimize(jpeg_enc_t *enc);
+void huffman_standard(jpeg_enc_t *enc);
+void huffman_setup(jpeg_enc_t *enc, short height, short width);
+void huffman_start(jpeg_enc_t *enc, short height, short width);
+void huffman_resetdc(jpeg_enc_t *enc);
+void huffman_stop(jpeg_enc_t *enc);
+void huffman_encode(jpeg_enc_t *enc, huffman_t *const ctx, const short data[64]);
+// record the sink position as the start of the next MCU row in enc->index,
+// for rows copied into the sink with write_bytes()
+void huffman_index_row(jpeg_enc_t *enc);
+// fill the index segment of jpeg, the output of the last encode, from index
+void huffman_index_write(const jpeg_index_t *index, uint8_t *jpeg);
+
+#ifdef ENABLE_RGB
+// lines are JPEG_MCU_HEIGHT(enc) pixel rows high, enc->stride bytes apart
 
 // encode RGB 24 line [size: 15,360 bytes]
-void encode_line_rgb24(uint8_t *    _line_buffer,
-                       unsigned int _line_number);
+void encode_line_rgb24(jpeg_enc_t *  enc,
+                       uint8_t *     _line_buffer,
+                       unsigned int  _line_number);
 
 // encode RGB 16 line [size: 10,240 bytes]
-void encode_line_rgb16(uint8_t *    _line_buffer,
-                       unsigned int _line_number);
+void encode_line_rgb16(jpeg_enc_t *  enc,
+                       uint8_t *     _line_buffer,
+                       unsigned int  _line_number);
+
+// level shifted Y blocks and subsampled Cb / Cr of a 16x8 (4:2:2) or 16x16
+// (4:2:0) RGB MCU, as encode_line_rgb24() converts them
+void rgb_ycbcr(RGB rgb[16][16], bool s420, int16_t y[4][8][8], int16_t cb[8][8], int16_t cr[8][8]);
 #endif // ENABLE_RGB
 
 // encode YUV line [size: 10,240 bytes]
-void encode_line_yuv(uint8_t *    _line_buffer,
-                     unsigned int _line_number);
+void encode_line_yuv(jpeg_enc_t *  enc,
+                     uint8_t *     _line_buffer,
+                     unsigned int  _line_number);
+
+// encode UYVY (Cb Y Cr Y) line [size: 10,240 bytes]
+void encode_line_uyvy(jpeg_enc_t *  enc,
+                      uint8_t *     _line_buffer,
+                      unsigned int  _line_number);
+
+// encode YVYU (Y Cr Y Cb) line [size: 10,240 bytes]
+void encode_line_yvyu(jpeg_enc_t *  enc,
+                      uint8_t *     _line_buffer,
+                      unsigned int  _line_number);
+
+// encode planar / semi-planar line: Y rows [size: 5,120 bytes], chroma from enc->planes
+void encode_line_planar(jpeg_enc_t *  enc,
+                        uint8_t *     _line_buffer,
+                        unsigned int  _line_number);
+
+// encode grayscale line [size: 5,120 bytes]
+void encode_line_gray(jpeg_enc_t *  enc,
+                      uint8_t *     _line_buffer,
+                      unsigned int  _line_number);
+
+// encode only the Y of a YUV line [size: 10,240 bytes]
+void encode_line_yuv_gray(jpeg_enc_t *  enc,
+                          uint8_t *     _line_buffer,
+                          unsigned int  _line_number);
+
+// copy finished code-stream into the output, only between MCU rows
+void write_bytes(jpeg_enc_t *enc, const uint8_t *data, size_t len);
 
 // write re-start interval termination character
 //  _rsi    :   3-bit restart interval character [0..7]
-void write_RSI(unsigned int _rsi);
+void write_RSI(jpeg_enc_t *enc, unsigned int _rsi);
 
 #endif//__JPEG_H__
\ No newline at end of file
@@ -0,0 +1,49 @@
+#ifndef __SIMD_H__
+#define __SIMD_H__
+#include "stdint.h"
+#include "stdbool.h"
+
+// Vector kernels for host builds (Linux gateways re-encoding device
+// streams): x86 SSE2 / AVX2 and AArch64 NEON, written once with the GCC /
+// Clang vector extensions. None on the ESP32 targets, which keep the
+// scalar code only.
+#if defined(__has_builtin)
+#if (defined(__x86_64__) || defined(__i386__) || defined(__aarch64__)) && \
+    __has_builtin(__builtin_shufflevector) && __has_builtin(__builtin_convertvector)
+#define JPEG_SIMD 1
+#endif
+#endif
+#ifndef JPEG_SIMD
+#define JPEG_SIMD 0
+#endif
+
+#if JPEG_SIMD
+// kernels of one instruction set; NULL: scalar code
+typedef struct jpeg_simd_kernels_s
+{
+	const char *name;  // instruction set, "scalar" if none
+	// dct_quantize() output in natural instead of zig-zag order
+	void (*dct_quantize)(int16_t pixels[8][8], const int32_t fdtbl[64], int16_t data[64]);
+	// dct_aan()
+	void (*dct_aan)(int16_t pixels[8][8], int32_t coef[64]);
+	// dct_requantize(), natural order
+	void (*quantize)(const int32_t coef[64], const int32_t fdtbl[64], int16_t data[64]);
+	// 16 pixel wide RGB24 MCU, 8 (4:2:2) or 16 (4:2:0) rows of stride bytes,
+	// to its level shifted Y blocks and subsampled Cb / Cr, see rgb_ycbcr()
+	void (*rgb24_ycbcr)(const uint8_t *px, unsigned stride, bool s420,
+	                    int16_t y[4][8][8], int16_t cb[8][8], int16_t cr[8][8]);
+}
+jpeg_simd_kernels_t;
+
+// kernels in use, empty (scalar) until the first encode calls jpeg_simd_init()
+extern jpeg_simd_kernels_t jpeg_simd;
+
+// the sets of this build, best first, NULL-terminated; the CPU may lack some
+extern const jpeg_simd_kernels_t *const jpeg_simd_sets[];
+
+bool jpeg_simd_supported(const jpeg_simd_kernels_t *set);
+void jpeg_simd_init(void);
+void jpeg_simd_select(const jpeg_simd_kernels_t *set);
+#endif // JPEG_SIMD
+
+#endif//__SIMD_H__
@@ -1,124 +1,1820 @@
-#include <stdio.h>
-#include <string.h>
-#include "freertos/FreeRTOS.h"
-#include "freertos/task.h"
-#include "esp_log.h"
-#include "jpeg.h"
-
-const char *TAG="jpeg";
-
-typedef struct {	
-    uint8_t *in;   //Pointer to jpeg data
-    int in_pos;    //Current position in jpeg data
-    uint8_t *out;
-    int out_pos;
-} jpeg_decode_obj_t;
-
-//Input function for jpeg decoder. Just returns bytes from the inData field of the JpegDev structure.
-static UINT jpeg_decode_in_callback(JDEC *decoder, BYTE *buf, UINT len) 
-{
-    //Read bytes from input file
-    jpeg_decode_obj_t *jpeg_decode_obj = (jpeg_decode_obj_t *)decoder->device;
-
-    if (buf != NULL) {
-        memcpy(buf, &jpeg_decode_obj->in[jpeg_decode_obj->in_pos], len);
-    }
-    jpeg_decode_obj->in_pos += len;
-    return len;
-}
-
-//Output function. Re-encodes the RGB888 data from the decoder as big-endian RGB565 and
-//stores it in the outData array of the JpegDev structure.
-static UINT jpeg_decode_out_callback(JDEC *decoder, void *bitmap, JRECT *rect) 
-{
-    jpeg_decode_obj_t *jpeg_decode_obj = (jpeg_decode_obj_t *)decoder->device;
-    uint8_t *in = (uint8_t*)bitmap;
-
-    for (int y = rect->top; y <= rect->bottom; y++) {
-        for (int x = rect->left; x <= rect->right; x++) {
-            //The LCD wants the 16-bit value in big-endian, so swap bytes
-            jpeg_decode_obj->out[2 * (y * decoder->width + x)] = in[1];
-            jpeg_decode_obj->out[2 * (y * decoder->width + x) + 1] = in[0];
-            jpeg_decode_obj->out_pos += 2;
-            in += 2;
-        }
-    }
-    return 1;
-}
-
-uint8_t *jpeg_decode(uint8_t *jpeg, int *w, int* h)
-{
-    jpeg_decode_obj_t jpeg_decode_obj = {0};
-    JDEC decoder = {0};
-    int ret = -1;
-
-    jpeg_decode_obj.in = jpeg;
-    jpeg_decode_obj.in_pos = 0;
-    jpeg_decode_obj.out_pos = 0;
-    char *work_buf = (char *)heap_caps_calloc(JPEG_WORK_BUF_SIZE, sizeof(uint8_t), MALLOC_CAP_SPIRAM);
-    //Prepare and decode the jpeg.
-    ret = jd_prepare(&decoder, jpeg_decode_in_callback, work_buf, JPEG_WORK_BUF_SIZE, (void*)&jpeg_decode_obj);
-    if (ret != JDR_OK) {
-        ESP_LOGE(TAG, "Image decoder: jd_prepare failed (%d)", ret);
-        free(work_buf);
-        return NULL;
-    }
-    *w = decoder.width;
-    *h = decoder.height;
-    jpeg_decode_obj.out = (uint8_t *)heap_caps_calloc(decoder.width * decoder.height, sizeof(uint16_t), MALLOC_CAP_SPIRAM);
-    ret = jd_decomp(&decoder, jpeg_decode_out_callback, 0);
-    if (ret != JDR_OK) {
-        ESP_LOGE(TAG, "Image decoder: jd_decode failed (%d)", ret);
-        free(jpeg_decode_obj.out);
-        free(work_buf);
-        return NULL;
-    }
-
-    free(work_buf);
-    return jpeg_decode_obj.out;
-}
-
-typedef struct {	
-    uint8_t *in;   //Pointer to img data
-    int in_pos;    //Current position in img data
-    uint8_t *out;  //Pointer to jpeg data
-    int out_pos;    //Current position in jpeg data
-    size_t max_size;
-} jpeg_encode_obj_t;
-
-jpeg_encode_obj_t jpeg_encode_obj = {0};
-
-void write_jpeg(uint8_t* buff, unsigned size)
-{
-    if (jpeg_encode_obj.out_pos + size <= jpeg_encode_obj.max_size) {
-        memcpy(&jpeg_encode_obj.out[jpeg_encode_obj.out_pos], buff, size);
-        jpeg_encode_obj.out_pos += size;
-    } else {
-        jpeg_encode_obj.out = NULL;
-    }
-}
-
-size_t jpeg_encode(jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
-{
-    jpeg_encode_obj.out = jpeg;
-    jpeg_encode_obj.out_pos = 0;
-    jpeg_encode_obj.max_size = max_size;
-    huffman_start(h & -8, w & -8);
-    huffman_resetdc();
-    int line = h / 8; 
-    int line_size = w * 8 * sizeof(uint16_t);
-    for (int x = 0; x < line; x++) {
-        switch (mode) {
-            default: 
-            case ENCODE_YUV_MODE: encode_line_yuv(&img[line_size * x], x); break;
-            case ENCODE_RGB16_MODE: encode_line_rgb16(&img[line_size * x], x); break;
-            case ENCODE_RGB24_MODE: encode_line_rgb24(&img[line_size * x], x); break;
-        }
-    }
-    huffman_stop();
-
-    if (jpeg_encode_obj.out == NULL) {
-        return 0;
-    }
-    return jpeg_encode_obj.out_pos;
-}
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "freertos/semphr.h"
+#include "esp_log.h"
+#include "esp_heap_caps.h"
+#include "jpeg.h"
+
+const char *TAG="jpeg";
+
+typedef struct {	
+    uint8_t *in;   //Pointer to jpeg data
+    int in_pos;    //Current position in jpeg data
+    int in_size;   //Size of jpeg data, 0 if not known
+    uint8_t *out;
+    int out_pos;
+} jpeg_decode_obj_t;
+
+//Input function for jpeg decoder. Just returns bytes from the inData field of the JpegDev structure.
+static UINT jpeg_decode_in_callback(JDEC *decoder, BYTE *buf, UINT len) 
+{
+    //Read bytes from input file
+    jpeg_decode_obj_t *jpeg_decode_obj = (jpeg_decode_obj_t *)decoder->device;
+
+    //Never read past the end of data of known size
+    if (jpeg_decode_obj->in_size && len > (UINT)(jpeg_decode_obj->in_size - jpeg_decode_obj->in_pos)) {
+        len = (UINT)(jpeg_decode_obj->in_size - jpeg_decode_obj->in_pos);
+    }
+    if (buf != NULL) {
+        memcpy(buf, &jpeg_decode_obj->in[jpeg_decode_obj->in_pos], len);
+    }
+    jpeg_decode_obj->in_pos += len;
+    return len;
+}
+
+//Output function. Re-encodes the RGB888 data from the decoder as big-endian RGB565 and
+//stores it in the outData array of the JpegDev structure.
+static UINT jpeg_decode_out_callback(JDEC *decoder, void *bitmap, JRECT *rect) 
+{
+    jpeg_decode_obj_t *jpeg_decode_obj = (jpeg_decode_obj_t *)decoder->device;
+    uint8_t *in = (uint8_t*)bitmap;
+
+    for (int y = rect->top; y <= rect->bottom; y++) {
+        for (int x = rect->left; x <= rect->right; x++) {
+            //The LCD wants the 16-bit value in big-endian, so swap bytes
+            jpeg_decode_obj->out[2 * (y * decoder->width + x)] = in[1];
+            jpeg_decode_obj->out[2 * (y * decoder->width + x) + 1] = in[0];
+            jpeg_decode_obj->out_pos += 2;
+            in += 2;
+        }
+    }
+    return 1;
+}
+
+uint8_t *jpeg_decode(uint8_t *jpeg, int *w, int* h)
+{
+    jpeg_decode_obj_t jpeg_decode_obj = {0};
+    JDEC decoder = {0};
+    int ret = -1;
+
+    jpeg_decode_obj.in = jpeg;
+    jpeg_decode_obj.in_pos = 0;
+    jpeg_decode_obj.out_pos = 0;
+    char *work_buf = (char *)heap_caps_calloc(JPEG_WORK_BUF_SIZE, sizeof(uint8_t), MALLOC_CAP_SPIRAM);
+    //Prepare and decode the jpeg.
+    ret = jd_prepare(&decoder, jpeg_decode_in_callback, work_buf, JPEG_WORK_BUF_SIZE, (void*)&jpeg_decode_obj);
+    if (ret != JDR_OK) {
+        ESP_LOGE(TAG, "Image decoder: jd_prepare failed (%d)", ret);
+        free(work_buf);
+        return NULL;
+    }
+    *w = decoder.width;
+    *h = decoder.height;
+    jpeg_decode_obj.out = (uint8_t *)heap_caps_calloc(decoder.width * decoder.height, sizeof(uint16_t), MALLOC_CAP_SPIRAM);
+    ret = jd_decomp(&decoder, jpeg_decode_out_callback, 0);
+    if (ret != JDR_OK) {
+        ESP_LOGE(TAG, "Image decoder: jd_decode failed (%d)", ret);
+        free(jpeg_decode_obj.out);
+        free(work_buf);
+        return NULL;
+    }
+
+    free(work_buf);
+    return jpeg_decode_obj.out;
+}
+
+typedef struct jpeg_encode_worker_s jpeg_encode_worker_t;
+
+//Quantized blocks in flight between the transform and the entropy stage
+typedef struct {
+    int16_t data[64];              //Zig-zag order
+    unsigned comp;                 //As passed to jpeg_block_cb_t, or JPEG_PIPELINE_END
+} jpeg_pipeline_block_t;
+
+#define JPEG_PIPELINE_END (0xFF)
+#define JPEG_PIPELINE_BLOCKS (64)      //Ring size, power of two
+
+typedef struct {
+    jpeg_pipeline_block_t block[JPEG_PIPELINE_BLOCKS];
+    unsigned head;                 //Blocks pushed, written by the transform stage only
+    unsigned tail;                 //Blocks popped, written by the entropy stage only
+    bool stop;                     //Set by the entropy stage once its sink failed
+    SemaphoreHandle_t filled;      //Given when a push finds the ring empty, the entropy stage waits on it
+    SemaphoreHandle_t freed;       //Given when a pop finds the ring full, the transform stage waits on it
+} jpeg_pipeline_ring_t;
+
+struct jpeg_encode_worker_s {
+    jpeg_enc_t enc;                //Encoder state of this worker
+    TaskHandle_t task;
+    SemaphoreHandle_t start;       //Given by the caller when a job is set
+    SemaphoreHandle_t done;        //Given by the task when the job is finished
+    bool quit;
+    void (*run)(jpeg_encode_worker_t *worker);  //Job to do
+    //Stripe job: encode lines [first, last) into out[max_size]
+    jpeg_encode_mode_t mode;
+    uint8_t *img;
+    int line_size;
+    int first;
+    int last;
+    uint8_t *out;
+    size_t max_size;
+    //Pipeline job: entropy-code the blocks of ring
+    jpeg_pipeline_ring_t *ring;
+};
+
+//MCU rows of the previous frame, see jpeg_encode_ctx_set_replenish()
+typedef struct {
+    bool valid;                //Rows below belong to a frame encoded like the next one
+    jpeg_encode_mode_t mode;
+    int w;
+    int h;
+    const jpeg_qtables_t *qtables;
+    jpeg_subsampling_t subsampling;
+    unsigned trellis;
+    int lines;
+    uint32_t *hash;            //Pixel hash per MCU row
+    uint32_t *offset;          //Start of each MCU row in data, lines + 1 entries
+    uint8_t *data;             //Entropy-coded rows with their restart markers
+    size_t size;               //Capacity of data
+} jpeg_replenish_t;
+
+struct jpeg_encode_ctx_s {
+    jpeg_enc_t enc;            //Encoder state, private to this context
+    int quality;               //As set by jpeg_encode_ctx_set_quality()
+    bool optimize;             //Two-pass encodes with optimized Huffman tables
+    int stripes;               //Number of stripes a frame is split into, 1 for sequential
+    jpeg_encode_worker_t *stripe[JPEG_ENCODE_STRIPES_MAX - 1];  //Workers for stripes 1..stripes-1
+    jpeg_encode_worker_t *pipeline;  //Entropy stage worker, NULL if not pipelined
+    //Band input, see jpeg_encode_ctx_begin()
+    bool streaming;
+    jpeg_encode_mode_t mode;
+    int line;                  //Next MCU row to encode
+    int lines;                 //MCU rows of the image
+    int row_size;              //Bytes per pixel row
+    uint8_t *carry;            //Rows of an incomplete MCU row, one MCU row large
+    int carry_rows;
+    jpeg_replenish_t *replenish;  //Row cache, NULL if not enabled
+    jpeg_enc_t *output[JPEG_ENCODE_OUTPUTS_MAX - 1];  //Encoders of outputs 1.., see jpeg_encode_ctx_multi()
+    jpeg_index_t index;        //Row offsets, enc.index points here when enabled
+};
+
+static jpeg_encode_ctx_t *jpeg_encode_default = NULL;
+
+static void jpeg_encode_worker_stop(jpeg_encode_worker_t *worker);
+
+jpeg_encode_ctx_t *jpeg_encode_ctx_create(void)
+{
+    // Scratch blocks are touched for every pixel, keep them in internal RAM
+    jpeg_encode_ctx_t *ctx = (jpeg_encode_ctx_t *)heap_caps_calloc(1, sizeof(jpeg_encode_ctx_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (ctx == NULL) {
+        ESP_LOGE(TAG, "Image encoder: no memory for context");
+        return NULL;
+    }
+    ctx->stripes = 1;
+    return ctx;
+}
+
+void jpeg_encode_ctx_delete(jpeg_encode_ctx_t *ctx)
+{
+    if (ctx == NULL) {
+        return;
+    }
+    for (int i = 0; i < ctx->stripes - 1; i++) {
+        jpeg_encode_worker_stop(ctx->stripe[i]);
+    }
+    if (ctx->pipeline) {
+        jpeg_encode_worker_stop(ctx->pipeline);
+    }
+    free(ctx->carry);
+    jpeg_encode_ctx_set_replenish(ctx, false);
+    for (int i = 0; i < JPEG_ENCODE_OUTPUTS_MAX - 1; i++) {
+        free(ctx->output[i]);
+    }
+    jpeg_encode_ctx_set_thumbnail(ctx, false);
+    free(ctx->enc.opt);
+    free(ctx);
+}
+
+static int jpeg_encode_bytes_per_pixel(jpeg_encode_mode_t mode)
+{
+    switch (mode) {
+        case ENCODE_GRAY_MODE: return 1;
+        case ENCODE_RGB24_MODE: return 3;
+        default: return 2;
+    }
+}
+
+//Only whole MCUs are encoded, a frame without one would get a SOF of height
+//or width 0; sets the component count of mode on enc
+static bool jpeg_encode_check_size(jpeg_enc_t *enc, jpeg_encode_mode_t mode, int w, int h)
+{
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    if (w < JPEG_MCU_WIDTH(enc) || h < JPEG_MCU_HEIGHT(enc)) {
+        ESP_LOGE(TAG, "Image encoder: %dx%d is smaller than one %dx%d MCU", w, h, JPEG_MCU_WIDTH(enc), JPEG_MCU_HEIGHT(enc));
+        return false;
+    }
+    return true;
+}
+
+esp_err_t jpeg_encode_ctx_set_quality(jpeg_encode_ctx_t *ctx, int quality)
+{
+    if (quality < JPEG_QUALITY_DEFAULT || quality > JPEG_QUALITY_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (huffman_quality(&ctx->enc, quality) != 0) {
+        ESP_LOGE(TAG, "Image encoder: no memory for quality %d tables", quality);
+        return ESP_ERR_NO_MEM;
+    }
+    ctx->quality = quality;
+    return ESP_OK;
+}
+
+esp_err_t jpeg_encode_ctx_set_subsampling(jpeg_encode_ctx_t *ctx, jpeg_subsampling_t subsampling)
+{
+    if (subsampling != JPEG_SUBSAMPLING_422 && subsampling != JPEG_SUBSAMPLING_420) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ctx->enc.subsampling = subsampling;
+    return ESP_OK;
+}
+
+//Encode MCU row x from buf
+static void jpeg_encode_line(jpeg_enc_t *enc, jpeg_encode_mode_t mode, uint8_t *buf, int x)
+{
+    //jpeg_encode_ctx_planar(): Y rows in buf, the chroma planes on the encoder
+    if (enc->planes.cb != NULL) {
+        encode_line_planar(enc, buf, x);
+        return;
+    }
+    switch (mode) {
+        default: 
+        case ENCODE_YUV_MODE: encode_line_yuv(enc, buf, x); break;
+        case ENCODE_RGB16_MODE: encode_line_rgb16(enc, buf, x); break;
+        case ENCODE_RGB24_MODE: encode_line_rgb24(enc, buf, x); break;
+        case ENCODE_GRAY_MODE: encode_line_gray(enc, buf, x); break;
+        case ENCODE_YUV_GRAY_MODE: encode_line_yuv_gray(enc, buf, x); break;
+        case ENCODE_UYVY_MODE: encode_line_uyvy(enc, buf, x); break;
+        case ENCODE_YVYU_MODE: encode_line_yvyu(enc, buf, x); break;
+    }
+}
+
+//Encode lines [first, last) of img, stops at the first line after the sink failed
+static void jpeg_encode_lines(jpeg_enc_t *enc, jpeg_encode_mode_t mode, uint8_t *img, int line_size, int first, int last)
+{
+    for (int x = first; x < last && !huffman_sink_failed(enc); x++) {
+        jpeg_encode_line(enc, mode, &img[line_size * x], x);
+    }
+}
+
+//Write EOI, returns the JPEG size or 0 if the sink failed
+static size_t jpeg_encode_finish(jpeg_enc_t *enc)
+{
+    if (huffman_sink_failed(enc)) {
+        return 0;
+    }
+    huffman_stop(enc);
+
+    if (huffman_sink_failed(enc)) {
+        return 0;
+    }
+    return huffman_sink_length(enc);
+}
+
+//Encode into whatever sink is set on ctx->enc
+static size_t jpeg_encode_run(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    huffman_start(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    huffman_resetdc(enc);
+    jpeg_encode_lines(enc, mode, img, enc->stride * mcu_h, 0, h / mcu_h);
+    return jpeg_encode_finish(enc);
+}
+
+//Worker task, lives as long as the stripe or pipeline setting of its context
+static void jpeg_encode_worker_task(void *arg)
+{
+    jpeg_encode_worker_t *worker = (jpeg_encode_worker_t *)arg;
+
+    while (xSemaphoreTake(worker->start, portMAX_DELAY) == pdTRUE && !worker->quit) {
+        worker->run(worker);
+        xSemaphoreGive(worker->done);
+    }
+    xSemaphoreGive(worker->done);
+    vTaskDelete(NULL);
+}
+
+static void jpeg_encode_worker_stop(jpeg_encode_worker_t *worker)
+{
+    worker->quit = true;
+    xSemaphoreGive(worker->start);
+    xSemaphoreTake(worker->done, portMAX_DELAY);
+    vSemaphoreDelete(worker->start);
+    vSemaphoreDelete(worker->done);
+    if (worker->ring) {
+        if (worker->ring->filled) {
+            vSemaphoreDelete(worker->ring->filled);
+        }
+        if (worker->ring->freed) {
+            vSemaphoreDelete(worker->ring->freed);
+        }
+        free(worker->ring);
+    }
+    free(worker);
+}
+
+static jpeg_encode_worker_t *jpeg_encode_worker_create(int core)
+{
+    jpeg_encode_worker_t *worker = (jpeg_encode_worker_t *)heap_caps_calloc(1, sizeof(jpeg_encode_worker_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (worker == NULL) {
+        return NULL;
+    }
+    worker->start = xSemaphoreCreateBinary();
+    worker->done = xSemaphoreCreateBinary();
+    if (worker->start == NULL || worker->done == NULL) {
+        goto fail;
+    }
+    if (xTaskCreatePinnedToCore(jpeg_encode_worker_task, "jpeg_worker", 3072, worker, uxTaskPriorityGet(NULL), &worker->task, core) != pdPASS) {
+        goto fail;
+    }
+    return worker;
+
+fail:
+    if (worker->start) {
+        vSemaphoreDelete(worker->start);
+    }
+    if (worker->done) {
+        vSemaphoreDelete(worker->done);
+    }
+    free(worker);
+    return NULL;
+}
+
+//Worker side of a stripe
+static void jpeg_encode_stripe_run(jpeg_encode_worker_t *worker)
+{
+    huffman_sink_buffer(&worker->enc, worker->out, worker->max_size);
+    jpeg_encode_lines(&worker->enc, worker->mode, worker->img, worker->line_size, worker->first, worker->last);
+}
+
+esp_err_t jpeg_encode_ctx_set_stripes(jpeg_encode_ctx_t *ctx, int stripes)
+{
+    if (stripes < 1 || stripes > JPEG_ENCODE_STRIPES_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    if (stripes > 1 && ctx->pipeline) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    while (ctx->stripes > stripes) {
+        jpeg_encode_worker_stop(ctx->stripe[--ctx->stripes - 1]);
+    }
+    while (ctx->stripes < stripes) {
+        // Stripe 0 runs on the calling task, spread the others over the remaining cores
+        int core = (xPortGetCoreID() + ctx->stripes) % portNUM_PROCESSORS;
+        jpeg_encode_worker_t *worker = jpeg_encode_worker_create(core);
+        if (worker == NULL) {
+            ESP_LOGE(TAG, "Image encoder: no memory for stripe %d", ctx->stripes);
+            return ESP_ERR_NO_MEM;
+        }
+        worker->run = jpeg_encode_stripe_run;
+        ctx->stripe[ctx->stripes++ - 1] = worker;
+    }
+    return ESP_OK;
+}
+
+//Every MCU row ends with a restart marker numbered by its line and starts
+//with reset DC predictors, so rows encoded by different contexts can be
+//put back to back. The output buffer is split between the stripes in
+//proportion to their lines and each stripe is encoded into its part, the
+//parts are then moved together: no extra buffers and only one copy.
+static size_t jpeg_encode_run_stripes(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    int line = h / mcu_h;
+    int line_size = enc->stride * mcu_h;
+    int stripes = ctx->stripes < line ? ctx->stripes : line;
+
+    huffman_sink_buffer(enc, jpeg, max_size);
+    huffman_start(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    size_t head = huffman_sink_length(enc);
+    if (huffman_sink_failed(enc) || stripes < 2 || head + 2 > max_size) {
+        huffman_sink_buffer(enc, jpeg, max_size);
+        return jpeg_encode_run(ctx, mode, img, w, h);
+    }
+    // Space between the headers and EOI
+    size_t body = max_size - head - 2;
+
+    for (int i = 1; i < stripes; i++) {
+        jpeg_encode_worker_t *stripe = ctx->stripe[i - 1];
+        size_t from = body * ((size_t)line * i / stripes) / line;
+        size_t to = body * ((size_t)line * (i + 1) / stripes) / line;
+        stripe->enc.qtables = enc->qtables;
+        stripe->enc.subsampling = enc->subsampling;
+        stripe->enc.grayscale = enc->grayscale;
+        stripe->enc.trellis = enc->trellis;
+        stripe->enc.stride = enc->stride;
+        huffman_setup(&stripe->enc, enc->img_high, enc->img_width);
+        stripe->mode = mode;
+        stripe->img = img;
+        stripe->line_size = line_size;
+        stripe->first = line * i / stripes;
+        stripe->last = line * (i + 1) / stripes;
+        stripe->out = jpeg + head + from;
+        stripe->max_size = to - from;
+        xSemaphoreGive(stripe->start);
+    }
+    huffman_sink_buffer(enc, jpeg + head, body * (line / stripes) / line);
+    huffman_resetdc(enc);
+    jpeg_encode_lines(enc, mode, img, line_size, 0, line / stripes);
+
+    bool failed = huffman_sink_failed(enc);
+    size_t pos = head + huffman_sink_length(enc);
+    for (int i = 1; i < stripes; i++) {
+        jpeg_encode_worker_t *stripe = ctx->stripe[i - 1];
+        xSemaphoreTake(stripe->done, portMAX_DELAY);
+        if (failed || huffman_sink_failed(&stripe->enc)) {
+            failed = true;
+            continue;
+        }
+        size_t len = huffman_sink_length(&stripe->enc);
+        memmove(&jpeg[pos], stripe->out, len);
+        pos += len;
+    }
+    if (failed) {
+        // A stripe did not fit its share, the whole image may still fit
+        huffman_sink_buffer(enc, jpeg, max_size);
+        return jpeg_encode_run(ctx, mode, img, w, h);
+    }
+
+    huffman_sink_buffer(enc, jpeg + pos, max_size - pos);
+    huffman_stop(enc);
+    return pos + huffman_sink_length(enc);
+}
+
+//Both stages block on a binary semaphore instead of polling the ring, so
+//neither depends on the priority or core of the other. Each side only gives
+//when its pop or push ends a full or empty ring; the head/tail store and the
+//load that follows it are sequentially consistent, so a stage that found the
+//ring full or empty is always woken, and a stale give only costs a re-check.
+
+//Transform stage: block_cb of the context encoder, queues the blocks for the
+//entropy stage and waits while the ring is full
+static void jpeg_pipeline_push(void *arg, unsigned comp, const int16_t *data)
+{
+    jpeg_encode_ctx_t *ctx = (jpeg_encode_ctx_t *)arg;
+    jpeg_pipeline_ring_t *ring = ctx->pipeline->ring;
+    unsigned head = ring->head;
+
+    while (head - __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == JPEG_PIPELINE_BLOCKS) {
+        xSemaphoreTake(ring->freed, portMAX_DELAY);
+    }
+    jpeg_pipeline_block_t *block = &ring->block[head % JPEG_PIPELINE_BLOCKS];
+    if (data != NULL) {
+        memcpy(block->data, data, sizeof(block->data));
+    }
+    block->comp = comp;
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST) == head) {
+        xSemaphoreGive(ring->filled);
+    }
+
+    if (__atomic_load_n(&ring->stop, __ATOMIC_RELAXED)) {
+        // Output failed, let jpeg_encode_lines() stop after this line
+        huffman_sink_abort(&ctx->enc);
+    }
+}
+
+//Entropy stage: Huffman-codes the queued blocks into the worker sink until
+//JPEG_PIPELINE_END, keeps draining the ring after the sink failed
+static void jpeg_pipeline_run(jpeg_encode_worker_t *worker)
+{
+    jpeg_enc_t *enc = &worker->enc;
+    jpeg_pipeline_ring_t *ring = worker->ring;
+    unsigned tail = ring->tail;
+
+    for (;;) {
+        while (tail == __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST)) {
+            xSemaphoreTake(ring->filled, portMAX_DELAY);
+        }
+        jpeg_pipeline_block_t *block = &ring->block[tail % JPEG_PIPELINE_BLOCKS];
+        unsigned comp = block->comp;
+        if (comp == JPEG_PIPELINE_END) {
+            break;
+        }
+        if (comp >= JPEG_BLOCK_RST) {
+            if (!huffman_sink_failed(enc)) {
+                write_RSI(enc, comp - JPEG_BLOCK_RST);
+            }
+            if (huffman_sink_failed(enc)) {
+                __atomic_store_n(&ring->stop, true, __ATOMIC_RELAXED);
+            }
+        } else if (!huffman_sink_failed(enc)) {
+            huffman_encode(enc, &enc->huffman[comp], block->data);
+        }
+        __atomic_store_n(&ring->tail, ++tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) - (tail - 1) == JPEG_PIPELINE_BLOCKS) {
+            xSemaphoreGive(ring->freed);
+        }
+    }
+    if (!huffman_sink_failed(enc)) {
+        huffman_stop(enc);
+    }
+}
+
+esp_err_t jpeg_encode_ctx_set_pipeline(jpeg_encode_ctx_t *ctx, bool enable)
+{
+    if (!enable) {
+        if (ctx->pipeline) {
+            jpeg_encode_worker_stop(ctx->pipeline);
+            ctx->pipeline = NULL;
+        }
+        return ESP_OK;
+    }
+    if (ctx->stripes > 1) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    if (ctx->pipeline) {
+        return ESP_OK;
+    }
+    jpeg_encode_worker_t *worker = jpeg_encode_worker_create((xPortGetCoreID() + 1) % portNUM_PROCESSORS);
+    if (worker == NULL) {
+        ESP_LOGE(TAG, "Image encoder: no memory for pipeline");
+        return ESP_ERR_NO_MEM;
+    }
+    worker->ring = (jpeg_pipeline_ring_t *)heap_caps_calloc(1, sizeof(jpeg_pipeline_ring_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+    if (worker->ring != NULL) {
+        worker->ring->filled = xSemaphoreCreateBinary();
+        worker->ring->freed = xSemaphoreCreateBinary();
+    }
+    if (worker->ring == NULL || worker->ring->filled == NULL || worker->ring->freed == NULL) {
+        ESP_LOGE(TAG, "Image encoder: no memory for pipeline");
+        jpeg_encode_worker_stop(worker);
+        return ESP_ERR_NO_MEM;
+    }
+    worker->run = jpeg_pipeline_run;
+    ctx->pipeline = worker;
+    return ESP_OK;
+}
+
+//The calling task converts, transforms and quantizes, the pipeline worker
+//writes headers, blocks and markers into its sink: the same code-stream as
+//jpeg_encode_run(), in the same order
+static size_t jpeg_encode_run_pipeline(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+    jpeg_encode_worker_t *worker = ctx->pipeline;
+    jpeg_pipeline_ring_t *ring = worker->ring;
+
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    // Blocks go to the ring, the sink of enc only carries the abort flag
+    huffman_sink_buffer(enc, NULL, 0);
+    huffman_setup(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+
+    worker->enc.qtables = enc->qtables;
+    worker->enc.subsampling = enc->subsampling;
+    worker->enc.grayscale = enc->grayscale;
+    worker->enc.index = enc->index;
+    huffman_start(&worker->enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    ring->head = 0;
+    ring->tail = 0;
+    ring->stop = false;
+    xSemaphoreGive(worker->start);
+
+    enc->block_cb = jpeg_pipeline_push;
+    enc->block_arg = ctx;
+    jpeg_encode_lines(enc, mode, img, enc->stride * mcu_h, 0, h / mcu_h);
+    jpeg_pipeline_push(ctx, JPEG_PIPELINE_END, NULL);
+    enc->block_cb = NULL;
+    xSemaphoreTake(worker->done, portMAX_DELAY);
+
+    if (huffman_sink_failed(&worker->enc)) {
+        return 0;
+    }
+    return huffman_sink_length(&worker->enc);
+}
+
+esp_err_t jpeg_encode_ctx_set_optimize(jpeg_encode_ctx_t *ctx, bool enable)
+{
+    ctx->optimize = enable;
+    if (!enable) {
+        free(ctx->enc.opt);
+        ctx->enc.opt = NULL;
+    }
+    return ESP_OK;
+}
+
+esp_err_t jpeg_encode_ctx_set_trellis(jpeg_encode_ctx_t *ctx, int strength)
+{
+    if (strength < 0 || strength > JPEG_TRELLIS_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ctx->enc.trellis = strength;
+    return ESP_OK;
+}
+
+//First pass collects the Huffman symbol statistics of the image without
+//output, then jpeg_encode_run() encodes with tables built from them
+static size_t jpeg_encode_run_optimized(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    huffman_setup(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    if (huffman_gather_start(enc) != 0) {
+        ESP_LOGE(TAG, "Image encoder: no memory for Huffman statistics");
+        return jpeg_encode_run(ctx, mode, img, w, h);
+    }
+    enc->block_cb = huffman_gather;
+    enc->block_arg = enc;
+    jpeg_encode_lines(enc, mode, img, enc->stride * mcu_h, 0, h / mcu_h);
+    enc->block_cb = NULL;
+    huffman_optimize(enc);
+    size_t size = jpeg_encode_run(ctx, mode, img, w, h);
+    // The tables only fit this image
+    huffman_standard(enc);
+    return size;
+}
+
+esp_err_t jpeg_encode_ctx_set_replenish(jpeg_encode_ctx_t *ctx, bool enable)
+{
+    jpeg_replenish_t *cache = ctx->replenish;
+
+    if (!enable) {
+        if (cache) {
+            free(cache->hash);
+            free(cache->offset);
+            free(cache->data);
+            free(cache);
+            ctx->replenish = NULL;
+        }
+        return ESP_OK;
+    }
+    if (cache == NULL) {
+        ctx->replenish = (jpeg_replenish_t *)heap_caps_calloc(1, sizeof(jpeg_replenish_t), MALLOC_CAP_8BIT);
+        if (ctx->replenish == NULL) {
+            return ESP_ERR_NO_MEM;
+        }
+    }
+    return ESP_OK;
+}
+
+//Hash of the pixels of one MCU row: rows of len bytes, stride apart
+static uint32_t jpeg_replenish_hash(const uint8_t *buf, int len, int stride, int rows)
+{
+    uint32_t h = 0x811C9DC5;
+
+    for (int r = 0; r < rows; r++, buf += stride) {
+        int i = 0;
+        for (; i + 4 <= len; i += 4) {
+            uint32_t v;
+            memcpy(&v, &buf[i], sizeof(v));
+            h = (h ^ v) * 0x9E3779B1;
+            h ^= h >> 15;
+        }
+        for (; i < len; i++) {
+            h = (h ^ buf[i]) * 0x9E3779B1;
+        }
+    }
+    return h;
+}
+
+//Like jpeg_encode_run() into the buffer jpeg[max_size], but an MCU row whose
+//pixels hash like in the previous frame is copied from the cache instead of
+//being encoded. Each row starts with reset DC predictors and ends with the
+//restart marker of its line, its bytes only depend on its pixels.
+static size_t jpeg_encode_run_replenish(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+    jpeg_replenish_t *cache = ctx->replenish;
+
+    huffman_sink_buffer(enc, jpeg, max_size);
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    int lines = h / mcu_h;
+    huffman_start(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    huffman_resetdc(enc);
+
+    if (!cache->valid || cache->mode != mode || cache->w != w || cache->h != h ||
+        cache->qtables != enc->qtables || cache->subsampling != enc->subsampling ||
+        cache->trellis != enc->trellis) {
+        cache->valid = false;
+        if (cache->lines != lines) {
+            free(cache->hash);
+            free(cache->offset);
+            cache->hash = (uint32_t *)heap_caps_malloc(lines * sizeof(uint32_t), MALLOC_CAP_8BIT);
+            cache->offset = (uint32_t *)heap_caps_malloc((lines + 1) * sizeof(uint32_t), MALLOC_CAP_8BIT);
+            cache->lines = (cache->hash && cache->offset) ? lines : 0;
+            if (cache->lines == 0) {
+                ESP_LOGE(TAG, "Image encoder: no memory for row cache");
+                huffman_sink_buffer(enc, jpeg, max_size);
+                return jpeg_encode_run(ctx, mode, img, w, h);
+            }
+        }
+        cache->mode = mode;
+        cache->w = w;
+        cache->h = h;
+        cache->qtables = enc->qtables;
+        cache->subsampling = enc->subsampling;
+        cache->trellis = enc->trellis;
+    }
+
+    size_t head = huffman_sink_length(enc);
+    int len = w * jpeg_encode_bytes_per_pixel(mode);
+    for (int x = 0; x < lines && !huffman_sink_failed(enc); x++) {
+        uint8_t *line = &img[enc->stride * mcu_h * x];
+        uint32_t hash = jpeg_replenish_hash(line, len, enc->stride, mcu_h);
+        uint32_t start = huffman_sink_length(enc) - head;
+        if (cache->valid && cache->hash[x] == hash) {
+            write_bytes(enc, &cache->data[cache->offset[x]], cache->offset[x + 1] - cache->offset[x]);
+            if (enc->index) {
+                huffman_index_row(enc);
+            }
+        } else {
+            jpeg_encode_line(enc, mode, line, x);
+        }
+        // Old offset[x] is not needed any more, rows are visited in order
+        cache->hash[x] = hash;
+        cache->offset[x] = start;
+    }
+    cache->valid = false;
+    if (huffman_sink_failed(enc)) {
+        return 0;
+    }
+    size_t body = huffman_sink_length(enc) - head;
+    cache->offset[lines] = body;
+
+    // Keep this frame's rows for the next one, straight from the output
+    if (cache->size < body) {
+        free(cache->data);
+        cache->size = 0;
+        cache->data = (uint8_t *)heap_caps_malloc(body, MALLOC_CAP_SPIRAM);
+        if (cache->data == NULL) {
+            cache->data = (uint8_t *)heap_caps_malloc(body, MALLOC_CAP_8BIT);
+        }
+        if (cache->data != NULL) {
+            cache->size = body;
+        }
+    }
+    if (cache->data != NULL) {
+        memcpy(cache->data, &jpeg[head], body);
+        cache->valid = true;
+    }
+    return jpeg_encode_finish(enc);
+}
+
+size_t jpeg_encode_ctx_rect(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int stride, int x, int y, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    int bpp = jpeg_encode_bytes_per_pixel(mode);
+
+    // YUYV (UYVY, YVYU) pixels come in pairs sharing one Cb/Cr
+    bool packed_yuv = mode == ENCODE_YUV_MODE || mode == ENCODE_YUV_GRAY_MODE ||
+                      mode == ENCODE_UYVY_MODE || mode == ENCODE_YVYU_MODE;
+    if (x < 0 || y < 0 || w <= 0 || h <= 0 || stride < w * bpp || (packed_yuv && (x & 1))) {
+        ESP_LOGE(TAG, "Image encoder: invalid source rectangle");
+        return 0;
+    }
+    if (!jpeg_encode_check_size(&ctx->enc, mode, w, h)) {
+        return 0;
+    }
+    img += (size_t)stride * y + bpp * x;
+    ctx->enc.stride = stride;
+    if (ctx->optimize) {
+        huffman_sink_buffer(&ctx->enc, jpeg, max_size);
+        return jpeg_encode_run_optimized(ctx, mode, img, w, h);
+    }
+    if (ctx->replenish && ctx->enc.thumb == NULL) {
+        return jpeg_encode_run_replenish(ctx, mode, img, w, h, jpeg, max_size);
+    }
+    if (ctx->pipeline) {
+        huffman_sink_buffer(&ctx->pipeline->enc, jpeg, max_size);
+        return jpeg_encode_run_pipeline(ctx, mode, img, w, h);
+    }
+    if (ctx->stripes > 1 && ctx->enc.thumb == NULL && ctx->enc.index == NULL) {
+        return jpeg_encode_run_stripes(ctx, mode, img, w, h, jpeg, max_size);
+    }
+    huffman_sink_buffer(&ctx->enc, jpeg, max_size);
+    return jpeg_encode_run(ctx, mode, img, w, h);
+}
+
+size_t jpeg_encode_ctx(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    return jpeg_encode_ctx_rect(ctx, mode, img, w * jpeg_encode_bytes_per_pixel(mode), 0, 0, w, h, jpeg, max_size);
+}
+
+size_t jpeg_encode_ctx_planar(jpeg_encode_ctx_t *ctx, const jpeg_planar_image_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+    bool semi = img->format == JPEG_PLANAR_NV12 || img->format == JPEG_PLANAR_NV16;
+    int chroma_w = semi ? w / 2 * 2 : w / 2;
+
+    if ((unsigned)img->format > JPEG_PLANAR_NV16 || w <= 0 || h <= 0 ||
+        img->plane[0] == NULL || img->plane[1] == NULL || (!semi && img->plane[2] == NULL) ||
+        img->stride[0] < w || img->stride[1] < chroma_w || (!semi && img->stride[2] < chroma_w)) {
+        ESP_LOGE(TAG, "Image encoder: invalid planar image");
+        return 0;
+    }
+    if (!jpeg_encode_check_size(enc, ENCODE_YUV_MODE, w, h)) {
+        return 0;
+    }
+    enc->stride = img->stride[0];
+    enc->planes.cb = img->plane[1];
+    enc->planes.cr = semi ? img->plane[1] + 1 : img->plane[2];
+    enc->planes.cb_stride = img->stride[1];
+    enc->planes.cr_stride = semi ? img->stride[1] : img->stride[2];
+    enc->planes.step = semi ? 2 : 1;
+    enc->planes.half = img->format == JPEG_PLANAR_I420 || img->format == JPEG_PLANAR_NV12;
+    huffman_sink_buffer(enc, jpeg, max_size);
+    //Any colour mode, the rows go to encode_line_planar() while planes.cb is set
+    size_t size;
+    if (ctx->optimize) {
+        size = jpeg_encode_run_optimized(ctx, ENCODE_YUV_MODE, (uint8_t *)img->plane[0], w, h);
+    } else {
+        size = jpeg_encode_run(ctx, ENCODE_YUV_MODE, (uint8_t *)img->plane[0], w, h);
+    }
+    enc->planes.cb = NULL;
+    return size;
+}
+
+size_t jpeg_encode_ctx_cb(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, jpeg_sink_cb_t cb, void *arg)
+{
+    if (!jpeg_encode_check_size(&ctx->enc, mode, w, h)) {
+        return 0;
+    }
+    ctx->enc.stride = w * jpeg_encode_bytes_per_pixel(mode);
+    if (ctx->optimize) {
+        huffman_sink_callback(&ctx->enc, cb, arg);
+        return jpeg_encode_run_optimized(ctx, mode, img, w, h);
+    }
+    if (ctx->pipeline) {
+        huffman_sink_callback(&ctx->pipeline->enc, cb, arg);
+        return jpeg_encode_run_pipeline(ctx, mode, img, w, h);
+    }
+    huffman_sink_callback(&ctx->enc, cb, arg);
+    return jpeg_encode_run(ctx, mode, img, w, h);
+}
+
+size_t jpeg_encode_ctx_estimate(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, int step)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    if (!jpeg_encode_check_size(enc, mode, w, h)) {
+        return 0;
+    }
+    huffman_sink_count(enc);
+    enc->stride = w * jpeg_encode_bytes_per_pixel(mode);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    int lines = h / mcu_h;
+    //The row offsets and thumbnail of the last encode stay, only the index
+    //segment is counted
+    jpeg_index_t *index = enc->index;
+    jpeg_thumb_t *thumb = enc->thumb;
+    enc->index = NULL;
+    enc->thumb = NULL;
+    huffman_start(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    enc->index = index;
+    size_t head = huffman_sink_length(enc);
+    size_t seg = 0;
+    if (index && index->app && lines + 1 <= (int)index->max && JPEG_INDEX_SIZE(lines + 1) - 2 <= 0xFFFF) {
+        seg = JPEG_INDEX_SIZE(lines + 1);
+    }
+    if (step < 1) {
+        step = 1;
+    } else if (step > lines) {
+        step = lines;
+    }
+    // Sample the middle row of every group of step rows
+    int sampled = 0;
+    for (int x = step / 2; x < lines; x += step) {
+        jpeg_encode_line(enc, mode, &img[enc->stride * mcu_h * x], x);
+        sampled++;
+    }
+    enc->thumb = thumb;
+    uint64_t rows = huffman_sink_length(enc) - head;
+    return head + seg + rows * lines / sampled + 2;   // + EOI
+}
+
+//Rate control: log(size) is close to linear in the log of the IJG table scale
+//factor, so a secant search on that scale over sampled estimates, kept
+//inside the qualities known to be too small and too large, converges in two
+//to four estimates of a quarter encode each. All in fixed point.
+#define JPEG_BUDGET_STEP       4      //Estimate from every 4th MCU row
+#define JPEG_BUDGET_ESTIMATES  5      //Most estimates per frame
+
+//log2(x) in 16.16 fixed point, x > 0: the integer part from the leading
+//bit, the fraction interpolated between log2(1 + i/16) (error below 2^-10)
+static int32_t jpeg_budget_log2(uint32_t x)
+{
+    static const uint32_t frac[17] = {
+        0, 5732, 11136, 16248, 21098, 25711, 30109, 34312, 38336,
+        42196, 45904, 49472, 52911, 56229, 59434, 62534, 65536
+    };
+    int e = 31 - __builtin_clz(x);
+    //Mantissa below the leading bit as a 20-bit fraction
+    uint32_t m = (e >= 20 ? x >> (e - 20) : x << (20 - e)) & 0xFFFFF;
+    uint32_t i = m >> 16;
+
+    return (e << 16) + frac[i] + (int32_t)(((frac[i + 1] - frac[i]) * (m & 0xFFFF)) >> 16);
+}
+
+//log2 of the IJG table scale factor of a quality, 16.16
+static int32_t jpeg_budget_scale(int quality)
+{
+    int scale = quality < 50 ? 5000 / quality : 200 - quality * 2;
+    return jpeg_budget_log2(scale > 0 ? scale : 1);
+}
+
+//Lowest quality whose scale factor is not above 2^log_scale
+static int jpeg_budget_quality(int32_t log_scale)
+{
+    int q = 1;
+    while (q < JPEG_QUALITY_MAX && jpeg_budget_scale(q) > log_scale) {
+        q++;
+    }
+    return q;
+}
+
+//Quality where the line through (log scale, log size) of qa, sa and qb, sb
+//reaches the log size aim
+static int jpeg_budget_secant(int qa, size_t sa, int qb, size_t sb, int32_t aim)
+{
+    int32_t xa = jpeg_budget_scale(qa), xb = jpeg_budget_scale(qb);
+    int32_t la = jpeg_budget_log2(sa), lb = jpeg_budget_log2(sb);
+
+    if (la == lb) {
+        return qb;
+    }
+    int64_t x = xb + (int64_t)(xb - xa) * (aim - lb) / (lb - la);
+    return jpeg_budget_quality(x < 0 ? 0 : x > 16 << 16 ? 16 << 16 : (int32_t)x);
+}
+
+static size_t jpeg_budget_estimate(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, int quality)
+{
+    if (jpeg_encode_ctx_set_quality(ctx, quality) != ESP_OK) {
+        return 0;
+    }
+    return jpeg_encode_ctx_estimate(ctx, mode, img, w, h, JPEG_BUDGET_STEP);
+}
+
+size_t jpeg_encode_ctx_budget(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    // Aim a bit below max_size, the estimates are not exact; anything down to
+    // 7/8 of that is close enough, the search aims at the middle
+    size_t target = max_size - max_size / 16;
+    int32_t aim = jpeg_budget_log2(target - target / 32);
+    // The built-in tables are the IJG quality 75 tables
+    int qb = ctx->quality == JPEG_QUALITY_DEFAULT ? 75 : ctx->quality;
+    size_t sb = jpeg_budget_estimate(ctx, mode, img, w, h, qb);
+    int qa = 0;
+    size_t sa = 0;
+    // Highest quality estimated to fit and lowest one estimated not to, 0: none
+    int q_lo = 0, q_hi = 0;
+    size_t s_lo = 0, s_hi = 0;
+
+    for (int i = 1; sb; i++) {
+        if (sb <= target) {
+            q_lo = qb;
+            s_lo = sb;
+        } else {
+            q_hi = qb;
+            s_hi = sb;
+        }
+        if (i == JPEG_BUDGET_ESTIMATES || (sb <= target && sb >= target * 7 / 8)) {
+            break;
+        }
+        int q;
+        if (q_lo && q_hi) {
+            // Interpolate between the two, at least a quarter of the way in
+            // from either end, as the slope flattens towards quality 100
+            int m = (q_hi - q_lo) / 4;
+            q = jpeg_budget_secant(q_lo, s_lo, q_hi, s_hi, aim);
+            q = q < q_lo + m ? q_lo + m : q > q_hi - m ? q_hi - m : q;
+            q = q <= q_lo ? q_lo + 1 : q >= q_hi ? q_hi - 1 : q;
+            if (q >= q_hi) {
+                break;
+            }
+        } else {
+            // One side known: extrapolate from the last two, at first a
+            // fixed step
+            q = sa && sa != sb ? jpeg_budget_secant(qa, sa, qb, sb, aim) : sb > target ? qb - 20 : qb + 10;
+            q = sb > target && q >= qb ? qb - 1 : sb < target && q <= qb ? qb + 1 : q;
+            q = q < 1 ? 1 : q > JPEG_QUALITY_MAX ? JPEG_QUALITY_MAX : q;
+            if (q == qb) {
+                break;
+            }
+        }
+        qa = qb;
+        sa = sb;
+        qb = q;
+        sb = jpeg_budget_estimate(ctx, mode, img, w, h, qb);
+    }
+    if (sb == 0) {
+        return 0;
+    }
+    qb = q_lo ? q_lo : q_hi;
+
+    // One encode, a second one a step lower if the estimate was off
+    for (int tries = 0; tries < 2; tries++) {
+        if (jpeg_encode_ctx_set_quality(ctx, qb) != ESP_OK) {
+            return 0;
+        }
+        size_t size = jpeg_encode_ctx(ctx, mode, img, w, h, jpeg, max_size);
+        if (size != 0 || qb == 1) {
+            return size;
+        }
+        // A scale factor sqrt(2) times coarser, typically a fifth smaller
+        int q = jpeg_budget_quality(jpeg_budget_scale(qb) + (1 << 15));
+        qb = q < qb ? q : qb - 1;
+    }
+    return 0;
+}
+
+esp_err_t jpeg_encode_ctx_multi(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, uint8_t *img, int w, int h, jpeg_encode_output_t *out, int n)
+{
+    if (n < 1 || n > JPEG_ENCODE_OUTPUTS_MAX) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    for (int i = 0; i < n; i++) {
+        if (out[i].quality < JPEG_QUALITY_DEFAULT || out[i].quality > JPEG_QUALITY_MAX) {
+            return ESP_ERR_INVALID_ARG;
+        }
+    }
+    if (!jpeg_encode_check_size(&ctx->enc, mode, w, h)) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    //Output 0 is the context's own encoder, the others are chained to it
+    jpeg_enc_t *enc[JPEG_ENCODE_OUTPUTS_MAX];
+    enc[0] = &ctx->enc;
+    for (int i = 1; i < n; i++) {
+        if (ctx->output[i - 1] == NULL) {
+            // Scratch blocks are touched for every pixel, keep them in internal RAM
+            ctx->output[i - 1] = (jpeg_enc_t *)heap_caps_calloc(1, sizeof(jpeg_enc_t), MALLOC_CAP_INTERNAL | MALLOC_CAP_8BIT);
+            if (ctx->output[i - 1] == NULL) {
+                ESP_LOGE(TAG, "Image encoder: no memory for output %d", i);
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        enc[i] = ctx->output[i - 1];
+    }
+    for (int i = 0; i < n; i++) {
+        if (huffman_quality(enc[i], out[i].quality) != 0) {
+            ESP_LOGE(TAG, "Image encoder: no memory for quality %d tables", out[i].quality);
+            huffman_quality(&ctx->enc, ctx->quality);
+            return ESP_ERR_NO_MEM;
+        }
+    }
+
+    int mcu_h = 0;
+    for (int i = 0; i < n; i++) {
+        if (out[i].cb) {
+            huffman_sink_callback(enc[i], out[i].cb, out[i].arg);
+        } else {
+            huffman_sink_buffer(enc[i], out[i].jpeg, out[i].max_size);
+        }
+        enc[i]->subsampling = ctx->enc.subsampling;
+        enc[i]->trellis = ctx->enc.trellis;
+        enc[i]->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+        enc[i]->stride = w * jpeg_encode_bytes_per_pixel(mode);
+        enc[i]->next = i + 1 < n ? enc[i + 1] : NULL;
+        mcu_h = JPEG_MCU_HEIGHT(enc[i]);
+        huffman_start(enc[i], h & -mcu_h, w & -JPEG_MCU_WIDTH(enc[i]));
+        huffman_resetdc(enc[i]);
+    }
+
+    //Colour conversion and DCT run once per block for all outputs
+    for (int x = 0; x < h / mcu_h; x++) {
+        int alive = 0;
+        for (int i = 0; i < n; i++) {
+            alive += !huffman_sink_failed(enc[i]);
+        }
+        if (alive == 0) {
+            break;
+        }
+        jpeg_encode_line(enc[0], mode, &img[enc[0]->stride * mcu_h * x], x);
+    }
+
+    for (int i = 0; i < n; i++) {
+        enc[i]->next = NULL;
+        out[i].size = jpeg_encode_finish(enc[i]);
+    }
+    huffman_quality(&ctx->enc, ctx->quality);
+    return ESP_OK;
+}
+
+esp_err_t jpeg_encode_ctx_set_thumbnail(jpeg_encode_ctx_t *ctx, bool enable)
+{
+    jpeg_thumb_t *t = ctx->enc.thumb;
+
+    if (enable && t == NULL) {
+        ctx->enc.thumb = (jpeg_thumb_t *)heap_caps_calloc(1, sizeof(jpeg_thumb_t), MALLOC_CAP_8BIT);
+        if (ctx->enc.thumb == NULL) {
+            ESP_LOGE(TAG, "Image encoder: no memory for thumbnail");
+            return ESP_ERR_NO_MEM;
+        }
+    } else if (!enable && t != NULL) {
+        free(t->y);
+        free(t);
+        ctx->enc.thumb = NULL;
+    }
+    return ESP_OK;
+}
+
+//Thumbnail of a complete encode, chroma rows per block row (4:2:0: 2) in rows
+static bool jpeg_thumb_ready(const jpeg_encode_ctx_t *ctx, unsigned *rows)
+{
+    const jpeg_thumb_t *t = ctx->enc.thumb;
+
+    if (t == NULL || t->width == 0 || t->n[0] != t->width * t->height) {
+        return false;
+    }
+    if (ctx->enc.grayscale) {
+        *rows = 0;
+        return true;
+    }
+    *rows = t->n[1] / (t->width / 2);
+    return t->n[1] == t->n[2] && (*rows == t->height || *rows == t->height / 2);
+}
+
+esp_err_t jpeg_encode_ctx_thumbnail(jpeg_encode_ctx_t *ctx, uint8_t *rgb, size_t size, int *w, int *h)
+{
+    const jpeg_thumb_t *t = ctx->enc.thumb;
+    unsigned rows;
+
+    if (!jpeg_thumb_ready(ctx, &rows)) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    *w = t->width;
+    *h = t->height;
+    if (size < t->width * t->height * 2) {
+        return ESP_ERR_INVALID_SIZE;
+    }
+    for (unsigned r = 0; r < t->height; r++) {
+        for (unsigned c = 0; c < t->width; c++) {
+            int y = t->y[r * t->width + c];
+            int cb = 0, cr = 0;
+            if (rows) {
+                unsigned k = (rows == t->height ? r : r / 2) * (t->width / 2) + c / 2;
+                cb = t->cb[k] - 128;
+                cr = t->cr[k] - 128;
+            }
+            //JFIF YCbCr to RGB, 16-bit fixed point
+            int red = y + ((91881 * cr + 32768) >> 16);
+            int green = y - ((22554 * cb + 46802 * cr - 32768) >> 16);
+            int blue = y + ((116130 * cb + 32768) >> 16);
+            red = red < 0 ? 0 : red > 255 ? 255 : red;
+            green = green < 0 ? 0 : green > 255 ? 255 : green;
+            blue = blue < 0 ? 0 : blue > 255 ? 255 : blue;
+            //Same byte order as ENCODE_RGB16_MODE input and jpeg_decode() output
+            uint16_t v = ((red >> 3) << 11) | ((green >> 2) << 5) | (blue >> 3);
+            rgb[2 * (r * t->width + c)] = v >> 8;
+            rgb[2 * (r * t->width + c) + 1] = v & 0xFF;
+        }
+    }
+    return ESP_OK;
+}
+
+size_t jpeg_encode_ctx_thumbnail_jpeg(jpeg_encode_ctx_t *ctx, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+    jpeg_thumb_t *t = enc->thumb;
+    unsigned rows;
+
+    if (!jpeg_thumb_ready(ctx, &rows)) {
+        return 0;
+    }
+    int w = t->width, h = t->height;
+    jpeg_encode_mode_t mode = rows ? ENCODE_YUV_MODE : ENCODE_GRAY_MODE;
+    jpeg_subsampling_t subsampling = enc->subsampling;
+    enc->subsampling = JPEG_SUBSAMPLING_422;
+    bool fits = jpeg_encode_check_size(enc, mode, w, h);
+    enc->subsampling = subsampling;
+    if (!fits) {
+        return 0;
+    }
+    uint8_t *img = t->y;
+    if (rows) {
+        //Interleave the planes to YUYV, 4:2:0 chroma is repeated for both rows
+        img = (uint8_t *)heap_caps_malloc(w * h * 2, MALLOC_CAP_8BIT);
+        if (img == NULL) {
+            ESP_LOGE(TAG, "Image encoder: no memory for thumbnail");
+            return 0;
+        }
+        for (int r = 0; r < h; r++) {
+            for (int c = 0; c < w; c++) {
+                int k = (rows == t->height ? r : r / 2) * (w / 2) + c / 2;
+                img[2 * (r * w + c)] = t->y[r * w + c];
+                img[2 * (r * w + c) + 1] = (c & 1) ? t->cr[k] : t->cb[k];
+            }
+        }
+    }
+
+    //Encoded like any frame, just not recorded as the thumbnail or indexed
+    jpeg_index_t *index = enc->index;
+    enc->thumb = NULL;
+    enc->index = NULL;
+    enc->subsampling = JPEG_SUBSAMPLING_422;
+    enc->stride = w * jpeg_encode_bytes_per_pixel(mode);
+    huffman_sink_buffer(enc, jpeg, max_size);
+    size_t size = jpeg_encode_run(ctx, mode, img, w, h);
+    enc->subsampling = subsampling;
+    enc->thumb = t;
+    enc->index = index;
+    if (img != t->y) {
+        free(img);
+    }
+    return size;
+}
+
+//Reverse buf[0, len)
+static void jpeg_reverse(uint8_t *buf, size_t len)
+{
+    for (size_t i = 0, j = len - 1; i < j && j < len; i++, j--) {
+        uint8_t b = buf[i];
+        buf[i] = buf[j];
+        buf[j] = b;
+    }
+}
+
+//EXIF APP1 in front of the thumbnail: marker, length, identifier, TIFF header,
+//an empty IFD0 and IFD1 with compression, offset and length of the thumbnail
+#define JPEG_EXIF_SIZE (2 + 2 + 6 + 56)
+
+size_t jpeg_encode_ctx_thumbnail_exif(jpeg_encode_ctx_t *ctx, uint8_t *jpeg, size_t size, size_t max_size)
+{
+    if (size < 4 || jpeg[0] != 0xFF || jpeg[1] != 0xD8 || max_size < size + JPEG_EXIF_SIZE) {
+        return 0;
+    }
+    //Behind SOI and the JFIF APP0
+    size_t at = 2;
+    if (jpeg[2] == 0xFF && jpeg[3] == 0xE0) {
+        at += 2 + (jpeg[4] << 8 | jpeg[5]);
+    }
+    //The thumbnail goes behind the image first, then both swap places
+    size_t room = max_size - size - JPEG_EXIF_SIZE;
+    if (room > 0xFFFF - (JPEG_EXIF_SIZE - 2)) {
+        room = 0xFFFF - (JPEG_EXIF_SIZE - 2);
+    }
+    size_t len = jpeg_encode_ctx_thumbnail_jpeg(ctx, &jpeg[size + JPEG_EXIF_SIZE], room);
+    if (len == 0) {
+        return 0;
+    }
+    jpeg_reverse(&jpeg[at], size - at);
+    jpeg_reverse(&jpeg[size], JPEG_EXIF_SIZE + len);
+    jpeg_reverse(&jpeg[at], size - at + JPEG_EXIF_SIZE + len);
+
+    size_t seg = JPEG_EXIF_SIZE - 2 + len;
+    const uint8_t exif[JPEG_EXIF_SIZE] = {
+        0xFF, 0xE1, seg >> 8, seg & 0xFF, 'E', 'x', 'i', 'f', 0, 0,
+        'I', 'I', 0x2A, 0, 8, 0, 0, 0,                  //Little endian, IFD0 at 8
+        0, 0, 14, 0, 0, 0,                              //IFD0: no entries, IFD1 at 14
+        3, 0,                                           //IFD1: 3 entries
+        0x03, 0x01, 3, 0, 1, 0, 0, 0, 6, 0, 0, 0,       //Compression: JPEG
+        0x01, 0x02, 4, 0, 1, 0, 0, 0, 56, 0, 0, 0,      //JPEGInterchangeFormat
+        0x02, 0x02, 4, 0, 1, 0, 0, 0, len & 0xFF, len >> 8, 0, 0,  //JPEGInterchangeFormatLength
+        0, 0, 0, 0                                      //No IFD2
+    };
+    memcpy(&jpeg[at], exif, JPEG_EXIF_SIZE);
+
+    //Everything behind the JFIF header moved, the row offsets too
+    jpeg_index_t *index = ctx->enc.index;
+    if (index) {
+        for (unsigned i = 0; i < index->count && i < index->max; i++) {
+            index->offset[i] += JPEG_EXIF_SIZE + len;
+        }
+        if (index->at) {
+            index->at += JPEG_EXIF_SIZE + len;
+            huffman_index_write(index, jpeg);
+        }
+    }
+    return size + JPEG_EXIF_SIZE + len;
+}
+
+esp_err_t jpeg_encode_ctx_set_index(jpeg_encode_ctx_t *ctx, uint32_t *offsets, int max, bool app)
+{
+    if (offsets == NULL) {
+        ctx->enc.index = NULL;
+        ctx->index = (jpeg_index_t){0};
+        return ESP_OK;
+    }
+    if (max < 1) {
+        return ESP_ERR_INVALID_ARG;
+    }
+    ctx->index = (jpeg_index_t){offsets, max, 0, app, 0};
+    ctx->enc.index = &ctx->index;
+    return ESP_OK;
+}
+
+int jpeg_encode_ctx_index(const jpeg_encode_ctx_t *ctx)
+{
+    return ctx->enc.index ? ctx->index.count : 0;
+}
+
+//Quantized coefficients of a whole baseline JPEG, see jpeg_coef_load()
+typedef struct {
+    int mcu_w;                 //MCU size in luminance blocks: 1x1, 2x1 or 2x2
+    int mcu_h;
+    int mcus_x;                //Whole MCUs per row
+    int mcus_y;                //Whole MCU rows
+    int bw[3];                 //Blocks per row of each component
+    int bh[3];                 //Block rows of each component
+    int16_t *block[3];         //Zig-zag blocks of each component, row by row
+    jpeg_qtables_t qtables;    //Quantizers of the image (qtable only)
+} jpeg_coef_t;
+
+typedef struct {
+    jpeg_decode_obj_t in;      //First, for jpeg_decode_in_callback()
+    jpeg_coef_t *coef;
+    jpeg_enc_t *enc;           //Requantization: codes the MCUs as they come
+    uint8_t from[2][64];       //Quantizers of the input, zig-zag order
+    uint8_t to[2][64];         //Quantizers of the output, 0: coefficient dropped
+} jpeg_coef_load_t;
+
+//Natural-order index of every zig-zag position
+static const uint8_t jpeg_zigzag_natural[64] = {
+     0,  1,  8, 16,  9,  2,  3, 10, 17, 24, 32, 25, 18, 11,  4,  5,
+    12, 19, 26, 33, 40, 48, 41, 34, 27, 20, 13,  6,  7, 14, 21, 28,
+    35, 42, 49, 56, 57, 50, 43, 36, 29, 22, 15, 23, 30, 37, 44, 51,
+    58, 59, 52, 45, 38, 31, 39, 46, 53, 60, 61, 54, 47, 55, 62, 63
+};
+
+//Decoder pool of a transcode: the tjpgd work buffer and the blocks of one MCU
+#define JPEG_COEF_POOL_SIZE (JPEG_WORK_BUF_SIZE + 6 * 64 * sizeof(int16_t))
+
+//Store the blocks of one MCU, partial MCUs at the right and bottom are dropped
+static UINT jpeg_coef_out_callback(JDEC *decoder, SHORT *blocks, JRECT *rect)
+{
+    jpeg_coef_t *coef = ((jpeg_coef_load_t *)decoder->device)->coef;
+    int mx = rect->left / (8 * coef->mcu_w);
+    int my = rect->top / (8 * coef->mcu_h);
+
+    if (mx >= coef->mcus_x || my >= coef->mcus_y) {
+        return 1;
+    }
+    for (int k = 0; k < coef->mcu_w * coef->mcu_h; k++) {
+        int bx = mx * coef->mcu_w + k % coef->mcu_w;
+        int by = my * coef->mcu_h + k / coef->mcu_w;
+        memcpy(&coef->block[0][(by * coef->bw[0] + bx) * 64], blocks, 64 * sizeof(int16_t));
+        blocks += 64;
+    }
+    for (int c = 1; c < 3; c++) {
+        memcpy(&coef->block[c][(my * coef->bw[c] + mx) * 64], blocks, 64 * sizeof(int16_t));
+        blocks += 64;
+    }
+    return 1;
+}
+
+static void jpeg_coef_free(jpeg_coef_t *coef)
+{
+    if (coef) {
+        free(coef->block[0]);
+        free(coef);
+    }
+}
+
+//Read the headers of load->in into decoder, and the MCU geometry and the
+//quantizers of the image into load->coef; false if it is not a baseline
+//Y/Cb/Cr JPEG that tjpgd can read
+static bool jpeg_coef_prepare(JDEC *decoder, char *pool, jpeg_coef_load_t *load)
+{
+    jpeg_coef_t *coef = load->coef;
+    BYTE qtable[64];
+
+    load->in.in_pos = 0;
+    int ret = jd_prepare(decoder, jpeg_decode_in_callback, pool, JPEG_COEF_POOL_SIZE, load);
+    if (ret != JDR_OK) {
+        ESP_LOGE(TAG, "Image transcoder: jd_prepare failed (%d)", ret);
+        return false;
+    }
+    coef->mcu_w = decoder->msx;
+    coef->mcu_h = decoder->msy;
+    coef->mcus_x = decoder->width / (8 * decoder->msx);
+    coef->mcus_y = decoder->height / (8 * decoder->msy);
+    //Cb and Cr share one quantizer table in the output
+    jd_qtable(decoder, 0, coef->qtables.qtable[0]);
+    jd_qtable(decoder, 1, coef->qtables.qtable[1]);
+    jd_qtable(decoder, 2, qtable);
+    if (coef->mcus_x == 0 || coef->mcus_y == 0 || memcmp(qtable, coef->qtables.qtable[1], 64)) {
+        ESP_LOGE(TAG, "Image transcoder: unsupported image");
+        return false;
+    }
+    coef->bw[0] = coef->mcus_x * coef->mcu_w;
+    coef->bh[0] = coef->mcus_y * coef->mcu_h;
+    coef->bw[1] = coef->bw[2] = coef->mcus_x;
+    coef->bh[1] = coef->bh[2] = coef->mcus_y;
+    return true;
+}
+
+//Huffman-decode src[size] into coefficients, NULL if it is not a baseline
+//Y/Cb/Cr JPEG that tjpgd can read
+static jpeg_coef_t *jpeg_coef_load(const uint8_t *src, size_t size)
+{
+    jpeg_coef_t *coef = (jpeg_coef_t *)heap_caps_calloc(1, sizeof(jpeg_coef_t), MALLOC_CAP_8BIT);
+    char *pool = (char *)heap_caps_malloc(JPEG_COEF_POOL_SIZE, MALLOC_CAP_8BIT);
+    jpeg_coef_load_t load = {.in = {.in = (uint8_t *)src, .in_size = (int)size}, .coef = coef};
+    JDEC decoder = {0};
+    int ret;
+
+    if (coef == NULL || pool == NULL) {
+        ESP_LOGE(TAG, "Image transcoder: no memory");
+        goto fail;
+    }
+    if (!jpeg_coef_prepare(&decoder, pool, &load)) {
+        goto fail;
+    }
+    size_t blocks = coef->bw[0] * coef->bh[0] + 2 * coef->mcus_x * coef->mcus_y;
+    coef->block[0] = (int16_t *)heap_caps_malloc(blocks * 64 * sizeof(int16_t), MALLOC_CAP_SPIRAM);
+    if (coef->block[0] == NULL) {
+        coef->block[0] = (int16_t *)heap_caps_malloc(blocks * 64 * sizeof(int16_t), MALLOC_CAP_8BIT);
+    }
+    if (coef->block[0] == NULL) {
+        ESP_LOGE(TAG, "Image transcoder: no memory for %u blocks", (unsigned)blocks);
+        goto fail;
+    }
+    coef->block[1] = coef->block[0] + coef->bw[0] * coef->bh[0] * 64;
+    coef->block[2] = coef->block[1] + coef->mcus_x * coef->mcus_y * 64;
+    ret = jd_decomp_coef(&decoder, jpeg_coef_out_callback);
+    if (ret != JDR_OK) {
+        ESP_LOGE(TAG, "Image transcoder: jd_decomp_coef failed (%d)", ret);
+        goto fail;
+    }
+    free(pool);
+    return coef;
+
+fail:
+    free(pool);
+    jpeg_coef_free(coef);
+    return NULL;
+}
+
+//Output subsampling of an MCU of mcu_w x mcu_h luminance blocks
+static jpeg_subsampling_t jpeg_coef_subsampling(int mcu_w, int mcu_h)
+{
+    if (mcu_w == 1) {
+        return mcu_h == 1 ? JPEG_SUBSAMPLING_444 : JPEG_SUBSAMPLING_440;
+    }
+    return mcu_h == 1 ? JPEG_SUBSAMPLING_422 : JPEG_SUBSAMPLING_420;
+}
+
+//Entropy-code all blocks of coef turned by transform, as MCU rows with a
+//restart marker each, like the line encoders
+static void jpeg_coef_write(jpeg_enc_t *enc, const jpeg_coef_t *coef, jpeg_transform_t transform)
+{
+    bool transpose = transform & JPEG_TRANSFORM_TRANSPOSE;
+    bool flip_h = transform & JPEG_TRANSFORM_FLIP_H;
+    bool flip_v = transform & JPEG_TRANSFORM_FLIP_V;
+    int mcu_w = transpose ? coef->mcu_h : coef->mcu_w;
+    int mcu_h = transpose ? coef->mcu_w : coef->mcu_h;
+    int mcus_x = transpose ? coef->mcus_y : coef->mcus_x;
+    int mcus_y = transpose ? coef->mcus_x : coef->mcus_y;
+    uint8_t src[64];
+    bool negate[64];
+    int16_t data[64];
+
+    //Coefficient (r, c) of an output block: transposed, then odd horizontal
+    //(vertical) frequencies negated for a horizontal (vertical) mirror
+    for (int k = 0; k < 64; k++) {
+        int r = jpeg_zigzag_natural[k] / 8, c = jpeg_zigzag_natural[k] % 8;
+        int n = transpose ? c * 8 + r : r * 8 + c;
+        for (src[k] = 0; jpeg_zigzag_natural[src[k]] != n; src[k]++);
+        negate[k] = (flip_h && (c & 1)) != (flip_v && (r & 1));
+    }
+
+    for (int my = 0; my < mcus_y; my++) {
+        for (int mx = 0; mx < mcus_x; mx++) {
+            for (int k = 0; k < mcu_w * mcu_h + 2; k++) {
+                int comp = k < mcu_w * mcu_h ? 0 : k - mcu_w * mcu_h + 1;
+                int ox = comp ? mx : mx * mcu_w + k % mcu_w;
+                int oy = comp ? my : my * mcu_h + k / mcu_w;
+                int obw = transpose ? coef->bh[comp] : coef->bw[comp];
+                int obh = transpose ? coef->bw[comp] : coef->bh[comp];
+                //Block of the input that lands at (ox, oy)
+                int tx = flip_h ? obw - 1 - ox : ox;
+                int ty = flip_v ? obh - 1 - oy : oy;
+                int sx = transpose ? ty : tx;
+                int sy = transpose ? tx : ty;
+                const int16_t *in = &coef->block[comp][(sy * coef->bw[comp] + sx) * 64];
+                for (int i = 0; i < 64; i++) {
+                    data[i] = negate[i] ? -in[src[i]] : in[src[i]];
+                }
+                if (enc->block_cb != NULL) {
+                    enc->block_cb(enc->block_arg, comp, data);
+                } else {
+                    huffman_encode(enc, &enc->huffman[comp], data);
+                }
+            }
+        }
+        write_RSI(enc, my % 8);
+    }
+}
+
+size_t jpeg_encode_ctx_transform(jpeg_encode_ctx_t *ctx, const uint8_t *src, size_t size, jpeg_transform_t transform, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    if ((unsigned)transform > JPEG_TRANSFORM_TRANSVERSE) {
+        return 0;
+    }
+    jpeg_coef_t *coef = jpeg_coef_load(src, size);
+    if (coef == NULL) {
+        return 0;
+    }
+    bool transpose = transform & JPEG_TRANSFORM_TRANSPOSE;
+    int mcu_w = transpose ? coef->mcu_h : coef->mcu_w;
+    int mcu_h = transpose ? coef->mcu_w : coef->mcu_h;
+    int w = 8 * mcu_w * (transpose ? coef->mcus_y : coef->mcus_x);
+    int h = 8 * mcu_h * (transpose ? coef->mcus_x : coef->mcus_y);
+
+    //A transposed coefficient keeps its quantizer, so transpose the tables
+    if (transpose) {
+        for (int t = 0; t < 2; t++) {
+            uint8_t *q = coef->qtables.qtable[t];
+            for (int r = 0; r < 8; r++) {
+                for (int c = r + 1; c < 8; c++) {
+                    uint8_t v = q[r * 8 + c];
+                    q[r * 8 + c] = q[c * 8 + r];
+                    q[c * 8 + r] = v;
+                }
+            }
+        }
+    }
+
+    //Headers with the quantizers and sampling of the input, turned
+    jpeg_subsampling_t subsampling = enc->subsampling;
+    jpeg_thumb_t *thumb = enc->thumb;
+    enc->thumb = NULL;
+    enc->subsampling = jpeg_coef_subsampling(mcu_w, mcu_h);
+    enc->grayscale = false;
+    enc->qtables = &coef->qtables;
+    //The coefficients are at hand, optimized tables only cost a Huffman pass
+    if (ctx->optimize) {
+        huffman_setup(enc, h, w);
+        if (huffman_gather_start(enc) == 0) {
+            enc->block_cb = huffman_gather;
+            enc->block_arg = enc;
+            jpeg_coef_write(enc, coef, transform);
+            enc->block_cb = NULL;
+            huffman_optimize(enc);
+        }
+    }
+    huffman_sink_buffer(enc, jpeg, max_size);
+    huffman_start(enc, h, w);
+    huffman_resetdc(enc);
+    jpeg_coef_write(enc, coef, transform);
+    size_t out = jpeg_encode_finish(enc);
+
+    //The headers refer to the quantizers of coef, which go away now
+    huffman_standard(enc);
+    enc->header.len = 0;
+    huffman_quality(enc, ctx->quality);
+    enc->subsampling = subsampling;
+    enc->thumb = thumb;
+    jpeg_coef_free(coef);
+    return out;
+}
+
+//Requantize the blocks of one MCU and code them right away, partial MCUs at
+//the right and bottom are dropped
+static UINT jpeg_requant_out_callback(JDEC *decoder, SHORT *blocks, JRECT *rect)
+{
+    jpeg_coef_load_t *load = (jpeg_coef_load_t *)decoder->device;
+    jpeg_coef_t *coef = load->coef;
+    jpeg_enc_t *enc = load->enc;
+    int mx = rect->left / (8 * coef->mcu_w);
+    int my = rect->top / (8 * coef->mcu_h);
+    int y_blocks = coef->mcu_w * coef->mcu_h;
+    int16_t data[64];
+
+    if (mx >= coef->mcus_x || my >= coef->mcus_y) {
+        return 1;
+    }
+    for (int k = 0; k < y_blocks + 2; k++) {
+        int comp = k < y_blocks ? 0 : k - y_blocks + 1;
+        const uint8_t *from = load->from[comp != 0];
+        const uint8_t *to = load->to[comp != 0];
+        for (int i = 0; i < 64; i++) {
+            int v = blocks[i];
+            if (v != 0 && to[i] != from[i]) {
+                //Round v * from / to half away from zero
+                int a = to[i] ? (2 * abs(v) * from[i] + to[i]) / (2 * to[i]) : 0;
+                v = v < 0 ? -a : a;
+            }
+            data[i] = v;
+        }
+        if (enc->block_cb != NULL) {
+            enc->block_cb(enc->block_arg, comp, data);
+        } else {
+            huffman_encode(enc, &enc->huffman[comp], data);
+        }
+        blocks += 64;
+    }
+    if (mx == coef->mcus_x - 1) {
+        write_RSI(enc, my % 8);
+    }
+    //Stop decoding once the output is full
+    return enc->block_cb != NULL || !huffman_sink_failed(enc);
+}
+
+//Quantizers of the output: those of target, but never finer than those of the
+//input (in load->coef after jpeg_coef_prepare()), which would only cost bits
+static void jpeg_requant_tables(jpeg_coef_load_t *load, const jpeg_qtables_t *target, int coefs)
+{
+    jpeg_qtables_t *qtables = &load->coef->qtables;
+
+    for (int t = 0; t < 2; t++) {
+        for (int k = 0; k < 64; k++) {
+            int n = jpeg_zigzag_natural[k];
+            uint8_t q = qtables->qtable[t][n];
+            if (target->qtable[t][n] > q) {
+                q = target->qtable[t][n];
+            }
+            load->from[t][k] = qtables->qtable[t][n];
+            load->to[t][k] = k < coefs ? q : 0;
+            qtables->qtable[t][n] = q;
+        }
+    }
+}
+
+size_t jpeg_encode_ctx_requantize(jpeg_encode_ctx_t *ctx, const uint8_t *src, size_t size, int coefs, uint8_t *jpeg, size_t max_size)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+    const jpeg_qtables_t *target = enc->qtables;
+    size_t out = 0;
+    int ret;
+
+    if (coefs < 1 || coefs > 64) {
+        return 0;
+    }
+    jpeg_coef_t *coef = (jpeg_coef_t *)heap_caps_calloc(1, sizeof(jpeg_coef_t), MALLOC_CAP_8BIT);
+    char *pool = (char *)heap_caps_malloc(JPEG_COEF_POOL_SIZE, MALLOC_CAP_8BIT);
+    jpeg_coef_load_t load = {.in = {.in = (uint8_t *)src, .in_size = (int)size}, .coef = coef, .enc = enc};
+    JDEC decoder = {0};
+
+    if (coef == NULL || pool == NULL) {
+        ESP_LOGE(TAG, "Image transcoder: no memory");
+        goto done;
+    }
+    if (!jpeg_coef_prepare(&decoder, pool, &load)) {
+        goto done;
+    }
+    jpeg_requant_tables(&load, target, coefs);
+    int w = 8 * coef->mcu_w * coef->mcus_x;
+    int h = 8 * coef->mcu_h * coef->mcus_y;
+
+    jpeg_subsampling_t subsampling = enc->subsampling;
+    jpeg_thumb_t *thumb = enc->thumb;
+    enc->thumb = NULL;
+    enc->subsampling = jpeg_coef_subsampling(coef->mcu_w, coef->mcu_h);
+    enc->grayscale = false;
+    enc->qtables = &coef->qtables;
+    //Optimized tables cost one more Huffman decode of the input
+    if (ctx->optimize) {
+        huffman_setup(enc, h, w);
+        if (huffman_gather_start(enc) == 0) {
+            enc->block_cb = huffman_gather;
+            enc->block_arg = enc;
+            ret = jd_decomp_coef(&decoder, jpeg_requant_out_callback);
+            enc->block_cb = NULL;
+            if (ret == JDR_OK) {
+                huffman_optimize(enc);
+            }
+        }
+        if (!jpeg_coef_prepare(&decoder, pool, &load)) {
+            goto restore;
+        }
+        jpeg_requant_tables(&load, target, coefs);
+    }
+    huffman_sink_buffer(enc, jpeg, max_size);
+    huffman_start(enc, h, w);
+    huffman_resetdc(enc);
+    ret = jd_decomp_coef(&decoder, jpeg_requant_out_callback);
+    if (ret == JDR_OK) {
+        out = jpeg_encode_finish(enc);
+    } else if (ret != JDR_INTR) {
+        ESP_LOGE(TAG, "Image transcoder: jd_decomp_coef failed (%d)", ret);
+    }
+
+restore:
+    //The headers refer to the quantizers of coef, which go away now
+    huffman_standard(enc);
+    enc->header.len = 0;
+    huffman_quality(enc, ctx->quality);
+    enc->subsampling = subsampling;
+    enc->thumb = thumb;
+done:
+    free(pool);
+    jpeg_coef_free(coef);
+    return out;
+}
+
+static void jpeg_encode_stream_start(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, int w, int h)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    free(ctx->carry);
+    ctx->carry = NULL;
+    ctx->carry_rows = 0;
+    enc->grayscale = (mode == ENCODE_GRAY_MODE || mode == ENCODE_YUV_GRAY_MODE);
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    huffman_start(enc, h & -mcu_h, w & -JPEG_MCU_WIDTH(enc));
+    huffman_resetdc(enc);
+    ctx->mode = mode;
+    ctx->line = 0;
+    ctx->lines = h / mcu_h;
+    ctx->row_size = w * jpeg_encode_bytes_per_pixel(mode);
+    enc->stride = ctx->row_size;
+    ctx->streaming = true;
+}
+
+esp_err_t jpeg_encode_ctx_begin(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    if (!jpeg_encode_check_size(&ctx->enc, mode, w, h)) {
+        ctx->streaming = false;
+        return ESP_ERR_INVALID_ARG;
+    }
+    huffman_sink_buffer(&ctx->enc, jpeg, max_size);
+    jpeg_encode_stream_start(ctx, mode, w, h);
+    return huffman_sink_failed(&ctx->enc) ? ESP_ERR_INVALID_SIZE : ESP_OK;
+}
+
+esp_err_t jpeg_encode_ctx_begin_cb(jpeg_encode_ctx_t *ctx, jpeg_encode_mode_t mode, int w, int h, jpeg_sink_cb_t cb, void *arg)
+{
+    if (!jpeg_encode_check_size(&ctx->enc, mode, w, h)) {
+        ctx->streaming = false;
+        return ESP_ERR_INVALID_ARG;
+    }
+    huffman_sink_callback(&ctx->enc, cb, arg);
+    jpeg_encode_stream_start(ctx, mode, w, h);
+    return huffman_sink_failed(&ctx->enc) ? ESP_FAIL : ESP_OK;
+}
+
+esp_err_t jpeg_encode_ctx_push_rows(jpeg_encode_ctx_t *ctx, uint8_t *rows, int n)
+{
+    jpeg_enc_t *enc = &ctx->enc;
+
+    if (!ctx->streaming) {
+        return ESP_ERR_INVALID_STATE;
+    }
+    int mcu_h = JPEG_MCU_HEIGHT(enc);
+    while (n > 0 && ctx->line < ctx->lines && !huffman_sink_failed(enc)) {
+        // Whole MCU rows are encoded in place
+        if (ctx->carry_rows == 0 && n >= mcu_h) {
+            jpeg_encode_line(enc, ctx->mode, rows, ctx->line++);
+            rows += ctx->row_size * mcu_h;
+            n -= mcu_h;
+            continue;
+        }
+        // Bands that do not line up with MCU rows are gathered
+        if (ctx->carry == NULL) {
+            ctx->carry = (uint8_t *)heap_caps_malloc(ctx->row_size * mcu_h, MALLOC_CAP_8BIT);
+            if (ctx->carry == NULL) {
+                ESP_LOGE(TAG, "Image encoder: no memory for band carry");
+                return ESP_ERR_NO_MEM;
+            }
+        }
+        int k = mcu_h - ctx->carry_rows < n ? mcu_h - ctx->carry_rows : n;
+        memcpy(&ctx->carry[ctx->row_size * ctx->carry_rows], rows, ctx->row_size * k);
+        ctx->carry_rows += k;
+        rows += ctx->row_size * k;
+        n -= k;
+        if (ctx->carry_rows == mcu_h) {
+            jpeg_encode_line(enc, ctx->mode, ctx->carry, ctx->line++);
+            ctx->carry_rows = 0;
+        }
+    }
+    return huffman_sink_failed(enc) ? ESP_FAIL : ESP_OK;
+}
+
+size_t jpeg_encode_ctx_end(jpeg_encode_ctx_t *ctx)
+{
+    if (!ctx->streaming) {
+        return 0;
+    }
+    ctx->streaming = false;
+    free(ctx->carry);
+    ctx->carry = NULL;
+    if (ctx->line < ctx->lines && !huffman_sink_failed(&ctx->enc)) {
+        ESP_LOGE(TAG, "Image encoder: frame ended after %d of %d MCU rows", ctx->line, ctx->lines);
+        return 0;
+    }
+    return jpeg_encode_finish(&ctx->enc);
+}
+
+size_t jpeg_encode(jpeg_encode_mode_t mode, uint8_t *img, int w, int h, uint8_t *jpeg, size_t max_size)
+{
+    if (jpeg_encode_default == NULL) {
+        jpeg_encode_default = jpeg_encode_ctx_create();
+        if (jpeg_encode_default == NULL) {
+            return 0;
+        }
+    }
+    return jpeg_encode_ctx(jpeg_encode_default, mode, img, w, h, jpeg, max_size);
+}
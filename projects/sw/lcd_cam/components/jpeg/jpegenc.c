@@ -1,10 +1,9 @@
+#include <stdlib.h>
+#include <string.h>
 #include "dct.h"
 #include "jpegenc.h"
+#include "simd.h"
 
-#define QTAB_SCALE 10	
-
-static int16_t img_high = 640;
-static int16_t img_width = 320;
 
 // as you can see I use Paint tables
 static const unsigned char qtable_0_lum[8][8] =
@@ -31,32 +30,34 @@ static const unsigned char qtable_0_chrom[8][8] =
 	{50, 50, 50, 50, 50, 50, 50, 50}
 };
 
-// (1 << QTAB_SCALE)/qtable_0_lum[][]
-static const unsigned char qtable_lum[8][8] =
-{
-	{128,171,205,128, 85, 51, 39, 33},
-	{171,171,146,102, 79, 35, 34, 37},
-	{146,146,128, 85, 51, 35, 29, 37},
-	{146,114, 93, 68, 39, 23, 26, 33},
-	{114, 93, 54, 37, 30, 19, 20, 26},
-	{ 85, 57, 37, 32, 25, 20, 18, 22},
-	{ 41, 32, 26, 23, 20, 17, 17, 20},
-	{ 28, 22, 21, 21, 18, 20, 20, 20}
+// JPEG Annex K tables, base of the IJG quality scaling
+static const unsigned char qtable_k1_lum[8][8] =
+{
+	{16, 11, 10, 16, 24, 40, 51, 61},
+	{12, 12, 14, 19, 26, 58, 60, 55},
+	{14, 13, 16, 24, 40, 57, 69, 56},
+	{14, 17, 22, 29, 51, 87, 80, 62},
+	{18, 22, 37, 56, 68,109,103, 77},
+	{24, 35, 55, 64, 81,104,113, 92},
+	{49, 64, 78, 87,103,121,120,101},
+	{72, 92, 95, 98,112,100,103, 99}
 };
 
-// (1 << QTAB_SCALE)/qtable_0_chrom[][]
-static const unsigned char qtable_chrom[8][8] =
-{
-	{114,114, 85, 43, 20, 20, 20, 20},
-	{114, 93, 79, 31, 20, 20, 20, 20},
-	{ 85, 79, 37, 20, 20, 20, 20, 20},
-	{ 43, 31, 20, 20, 20, 20, 20, 20},
-	{ 20, 20, 20, 20, 20, 20, 20, 20},
-	{ 20, 20, 20, 20, 20, 20, 20, 20},
-	{ 20, 20, 20, 20, 20, 20, 20, 20},
-	{ 20, 20, 20, 20, 20, 20, 20, 20}
+static const unsigned char qtable_k2_chrom[8][8] =
+{
+	{17, 18, 24, 47, 99, 99, 99, 99},
+	{18, 21, 26, 66, 99, 99, 99, 99},
+	{24, 26, 56, 99, 99, 99, 99, 99},
+	{47, 66, 99, 99, 99, 99, 99, 99},
+	{99, 99, 99, 99, 99, 99, 99, 99},
+	{99, 99, 99, 99, 99, 99, 99, 99},
+	{99, 99, 99, 99, 99, 99, 99, 99},
+	{99, 99, 99, 99, 99, 99, 99, 99}
 };
 
+// built quantization tables, one entry per quality level
+static jpeg_qtables_t *qtables_cache[JPEG_QUALITY_MAX + 1];
+
 // zig-zag table
 static const unsigned char zig[64] =
 {
@@ -155,283 +156,351 @@ static const unsigned char std_ac_chrominance_values[162] =
 	0xf9, 0xfa
 };
 
-static const unsigned char HYDClen[12] =
+static const huffman_dht_t std_dht =
 {
-	0x02, 0x03, 0x03, 0x03, 0x03, 0x03, 0x04, 0x05,
-	0x06, 0x07, 0x08, 0x09
+	{std_dc_luminance_nrcodes, std_ac_luminance_nrcodes, std_dc_chrominance_nrcodes, std_ac_chrominance_nrcodes},
+	{std_dc_luminance_values, std_ac_luminance_values, std_dc_chrominance_values, std_ac_chrominance_values}
 };
 
-static const unsigned char HCDClen[12] =
+// optimized tables of one image and the statistics they are built from
+struct huffman_opt_s
 {
-	0x02, 0x02, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
-	0x08, 0x09, 0x0a, 0x0b
+	huffman_dht_t dht;             // points into nrcodes/values
+	unsigned char nrcodes[4][16];
+	unsigned char values[4][256];
+	uint32_t      freq[4][257];    // symbol counts, [256] is reserved
 };
 
-static const uint16_t HYDCbits[12] =
+/******************************************************************************
+**  sink_flush
+**  --------------------------------------------------------------------------
+**  Called when the sink buffer is full.
+**  Callback mode hands the chunk out and starts over in enc->jpgbuff;
+**  buffer mode switches to enc->jpgbuff as a scratch area, so that bytes
+**  past the end of the caller buffer are only counted, never stored.
+**  
+**  ARGUMENTS:
+**      enc     - pointer to encoder context;
+**
+**  RETURN: -
+******************************************************************************/
+static void sink_flush(jpeg_enc_t *enc)
 {
-	0x0000, 0x0002, 0x0003, 0x0004, 0x0005, 0x0006, 0x000e, 0x001e,
-	0x003e, 0x007e, 0x00fe, 0x01fe
-};
+	jpeg_sink_t *const sink = &enc->sink;
 
-static const uint16_t HCDCbits[12] =
-{
-	0x0000, 0x0001, 0x0002, 0x0006, 0x000e, 0x001e, 0x003e, 0x007e,
-	0x00fe, 0x01fe, 0x03fe, 0x07fe
-};
+	if (sink->cb != NULL) {
+		if (!sink->failed && sink->pos && !sink->cb(sink->arg, sink->buf, sink->pos))
+			sink->failed = true;
+	} else if (sink->full) {
+		sink->failed = true; // a whole scratch area did not fit
+	}
 
+	sink->total += sink->pos;
+	sink->pos = 0;
+	sink->buf = enc->jpgbuff;
+	sink->size = JPEG_BUFFSIZE;
+	if (sink->cb == NULL)
+		sink->full = true;
+}
 
-static const unsigned char HYAClen[16][12] =
-{
-	{0x04, 0x02, 0x02, 0x03, 0x04, 0x05, 0x07, 0x08, 0x0a, 0x10, 0x10, 0x00},	// 00 - 0f
-	{0x00, 0x04, 0x05, 0x07, 0x09, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 10 - 1f
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 20 - 2f
-	{0x00, 0x06, 0x09, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 30 - 3f
-	{0x00, 0x06, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 40 - 4f
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 50 - 5f
-	{0x00, 0x07, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 60 - 6f
-	{0x00, 0x08, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 70 - 7f
-	{0x00, 0x09, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 80 - 8f
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 90 - 9f
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// a0 - af
-	{0x00, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// b0 - bf
-	{0x00, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// c0 - cf
-	{0x00, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// d0 - df
-	{0x00, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// e0 - ef
-	{0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00}
-};
+void huffman_sink_buffer(jpeg_enc_t *enc, uint8_t *buf, size_t size)
+{
+	enc->sink = (jpeg_sink_t){buf, size, 0, 0, NULL, NULL, false, false, buf};
+	if (buf == NULL || size == 0)
+		sink_flush(enc);
+}
 
-static const uint16_t HYACbits[16][12] =
-{
-	{0xFFFA, 0xFFF0, 0xFFF1, 0xFFF4, 0xFFFB, 0xFFFA, 0xFFF8, 0xFFF8, 0xFFF6, 0xFF82, 0xFF83, 0x0000},	// 00 - 0f
-	{0x0000, 0xFFFC, 0xFFFB, 0xFFF9, 0xFFF6, 0xFFF6, 0xFF84, 0xFF85, 0xFF86, 0xFF87, 0xFF88, 0x0000},	// 10 - 1f
-	{0x0000, 0xFFFC, 0xFFF9, 0xFFF7, 0xFFF4, 0xFF89, 0xFF8A, 0xFF8B, 0xFF8C, 0xFF8D, 0xFF8E, 0x0000},	// 20 - 2f
-	{0x0000, 0xFFFA, 0xFFF7, 0xFFF5, 0xFF8F, 0xFF90, 0xFF91, 0xFF92, 0xFF93, 0xFF94, 0xFF95, 0x0000},	// 30 - 3f
-	{0x0000, 0xFFFB, 0xFFF8, 0xFF96, 0xFF97, 0xFF98, 0xFF99, 0xFF9A, 0xFF9B, 0xFF9C, 0xFF9D, 0x0000},	// 40 - 4f
-	{0x0000, 0xFFFA, 0xFFF7, 0xFF9E, 0xFF9F, 0xFFA0, 0xFFA1, 0xFFA2, 0xFFA3, 0xFFA4, 0xFFA5, 0x0000},	// 50 - 5f
-	{0x0000, 0xFFFB, 0xFFF6, 0xFFA6, 0xFFA7, 0xFFA8, 0xFFA9, 0xFFAA, 0xFFAB, 0xFFAC, 0xFFAD, 0x0000},	// 60 - 6f
-	{0x0000, 0xFFFA, 0xFFF7, 0xFFAE, 0xFFAF, 0xFFB0, 0xFFB1, 0xFFB2, 0xFFB3, 0xFFB4, 0xFFB5, 0x0000},	// 70 - 7f
-	{0x0000, 0xFFF8, 0xFFC0, 0xFFB6, 0xFFB7, 0xFFB8, 0xFFB9, 0xFFBA, 0xFFBB, 0xFFBC, 0xFFBD, 0x0000},	// 80 - 8f
-	{0x0000, 0xFFF9, 0xFFBE, 0xFFBF, 0xFFC0, 0xFFC1, 0xFFC2, 0xFFC3, 0xFFC4, 0xFFC5, 0xFFC6, 0x0000},	// 90 - 9f
-	{0x0000, 0xFFFA, 0xFFC7, 0xFFC8, 0xFFC9, 0xFFCA, 0xFFCB, 0xFFCC, 0xFFCD, 0xFFCE, 0xFFCF, 0x0000},	// a0 - af
-	{0x0000, 0xFFF9, 0xFFD0, 0xFFD1, 0xFFD2, 0xFFD3, 0xFFD4, 0xFFD5, 0xFFD6, 0xFFD7, 0xFFD8, 0x0000},	// b0 - bf
-	{0x0000, 0xFFFA, 0xFFD9, 0xFFDA, 0xFFDB, 0xFFDC, 0xFFDD, 0xFFDE, 0xFFDF, 0xFFE0, 0xFFE1, 0x0000},	// c0 - cf
-	{0x0000, 0xFFF8, 0xFFE2, 0xFFE3, 0xFFE4, 0xFFE5, 0xFFE6, 0xFFE7, 0xFFE8, 0xFFE9, 0xFFEA, 0x0000},	// d0 - df
-	{0x0000, 0xFFEB, 0xFFEC, 0xFFED, 0xFFEE, 0xFFEF, 0xFFF0, 0xFFF1, 0xFFF2, 0xFFF3, 0xFFF4, 0x0000},	// e0 - ef
-	{0xFFF9, 0xFFF5, 0xFFF6, 0xFFF7, 0xFFF8, 0xFFF9, 0xFFFA, 0xFFFB, 0xFFFC, 0xFFFD, 0xFFFE, 0x0000}
-};
+void huffman_sink_callback(jpeg_enc_t *enc, jpeg_sink_cb_t cb, void *arg)
+{
+	enc->sink = (jpeg_sink_t){enc->jpgbuff, JPEG_BUFFSIZE, 0, 0, cb, arg, false, false, NULL};
+}
 
-static const unsigned char HCAClen[16][12] =
-{
-	{0x02, 0x02, 0x03, 0x04, 0x05, 0x05, 0x06, 0x07, 0x09, 0x0a, 0x0c, 0x00},	// 00 - 0f
-	{0x00, 0x04, 0x06, 0x08, 0x09, 0x0b, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x00},	// 10 - 1f
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 20 - 2f
-	{0x00, 0x05, 0x08, 0x0a, 0x0c, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 30 - 3f
-	{0x00, 0x06, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 40 - 4f
-	{0x00, 0x06, 0x0a, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 50 - 5f
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 60 - 6f
-	{0x00, 0x07, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 70 - 7f
-	{0x00, 0x08, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 80 - 8f
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// 90 - 9f
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// a0 - af
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// b0 - bf
-	{0x00, 0x09, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// c0 - cf
-	{0x00, 0x0b, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// d0 - df
-	{0x00, 0x0e, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00},	// e0 - ef
-	{0x0a, 0x0f, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x00}
-};
+static bool sink_discard(void *arg, const uint8_t *data, size_t len)
+{
+	(void)arg;
+	(void)data;
+	(void)len;
+	return true;
+}
 
-static const uint16_t HCACbits[16][12] =
-{
-	{0x0000, 0x0001, 0x0004, 0x000a, 0x0018, 0x0019, 0x0038, 0x0078, 0x01f4, 0x03f6, 0x0ff4, 0x0000},	// 00 - 0f
-	{0x0000, 0x000b, 0x0039, 0x00f6, 0x01f5, 0x07f6, 0x0ff5, 0xff88, 0xff89, 0xff8a, 0xff8b, 0x0000},	// 10 - 1f
-	{0x0000, 0x001a, 0x00f7, 0x03f7, 0x0ff6, 0x7fc2, 0xff8c, 0xff8d, 0xff8e, 0xff8f, 0xff90, 0x0000},	// 20 - 2f
-	{0x0000, 0x001b, 0x00f8, 0x03f8, 0x0ff7, 0xff91, 0xff92, 0xff93, 0xff94, 0xff95, 0xff96, 0x0000},	// 30 - 3f
-	{0x0000, 0x003a, 0x01f6, 0xff97, 0xff98, 0xff99, 0xff9a, 0xff9b, 0xff9c, 0xff9d, 0xff9e, 0x0000},	// 40 - 4f
-	{0x0000, 0x003b, 0x03f9, 0xff9f, 0xffa0, 0xffa1, 0xFFA2, 0xFFA3, 0xFFA4, 0xFFA5, 0xFFA6, 0x0000},	// 50 - 5f
-	{0x0000, 0x0079, 0x07f7, 0xffa7, 0xffa8, 0xffa9, 0xffaa, 0xffab, 0xFFAc, 0xFFAf, 0xFFAe, 0x0000},	// 60 - 6f
-	{0x0000, 0x007a, 0x07f8, 0xffaf, 0xffb0, 0xFFB1, 0xFFB2, 0xFFB3, 0xFFB4, 0xFFB5, 0xFFB6, 0x0000},	// 70 - 7f
-	{0x0000, 0x00f9, 0xffb7, 0xFFB8, 0xFFB9, 0xFFBa, 0xFFBb, 0xFFBc, 0xFFBd, 0xFFBe, 0xFFBf, 0x0000},	// 80 - 8f
-	{0x0000, 0x01f7, 0xffc0, 0xffc1, 0xFFC2, 0xFFC3, 0xFFC4, 0xFFC5, 0xFFC6, 0xFFC7, 0xFFC8, 0x0000},	// 90 - 9f
-	{0x0000, 0x01f8, 0xffc9, 0xFFCa, 0xFFCb, 0xFFCc, 0xFFCd, 0xFFCe, 0xFFCf, 0xFFd0, 0xFFd1, 0x0000},	// a0 - af
-	{0x0000, 0x01f9, 0xFFD2, 0xFFD3, 0xFFD4, 0xFFD5, 0xFFD6, 0xFFD7, 0xFFD8, 0xFFD9, 0xFFDa, 0x0000},	// b0 - bf
-	{0x0000, 0x01fa, 0xFFDb, 0xFFDc, 0xFFDd, 0xFFDe, 0xFFDf, 0xFFe0, 0xFFe1, 0xFFe2, 0xFFe3, 0x0000},	// c0 - cf
-	{0x0000, 0x07f9, 0xFFE4, 0xFFE5, 0xFFE6, 0xFFE7, 0xFFE8, 0xFFE9, 0xFFEa, 0xFFEb, 0xFFEc, 0x0000},	// d0 - df
-	{0x0000, 0x3fe0, 0xffed, 0xFFEe, 0xFFEf, 0xFFf0, 0xFFF1, 0xFFF2, 0xFFF3, 0xFFF4, 0xFFF5, 0x0000},	// e0 - ef
-	{0x03fa, 0x7fc3, 0xFFF6, 0xFFF7, 0xFFF8, 0xFFF9, 0xFFFA, 0xFFFB, 0xFFFC, 0xFFFD, 0xFFFE, 0x0000}
-};
+void huffman_sink_count(jpeg_enc_t *enc)
+{
+	huffman_sink_callback(enc, sink_discard, NULL);
+}
 
-huffman_t huffman_ctx[3] =
+void huffman_sink_abort(jpeg_enc_t *enc)
 {
-	{HYAClen, HYACbits, HYDClen, HYDCbits, *qtable_lum,   0}, // Y
-	{HCAClen, HCACbits, HCDClen, HCDCbits, *qtable_chrom, 0}, // Cb
-	{HCAClen, HCACbits, HCDClen, HCDCbits, *qtable_chrom, 0}, // Cr
-};
+	enc->sink.failed = true;
+}
 
-typedef struct bitbuffer_s
+size_t huffman_sink_length(const jpeg_enc_t *enc)
 {
-	unsigned buf;
-	unsigned n;
+	return enc->sink.total + enc->sink.pos;
 }
-bitbuffer_t;
 
-static bitbuffer_t bitbuf;
+bool huffman_sink_failed(const jpeg_enc_t *enc)
+{
+	// in buffer mode anything in the scratch area is past the caller buffer
+	return enc->sink.failed || (enc->sink.full && enc->sink.pos);
+}
 
 /******************************************************************************
-**  quantize
+**  writebyte
 **  --------------------------------------------------------------------------
-**  DCT coeficient quantization.
-**  To avoid division function uses quantization coefs amplified by 2^QTAB_SCALE
-**  and then shifts the product by QTAB_SCALE bits to the right.
-**  To make this operation a bit faster some tricks are used but it is just
-**  returns round(data[i]/qt0[i]).
+**  This function writes byte into the sink buffer
+**  and flushes the buffer if it is full.
 **  
 **  ARGUMENTS:
-**      data    - DCT freq value;
-**      qt      - quantization value ( (1 << QTAB_SCALE)/qt0 );
+**      enc     - pointer to encoder context;
+**      b       - byte;
 **
-**  RETURN: quantized value.
+**  RETURN: -
 ******************************************************************************/
-static int16_t quantize(const int16_t data, const uint16_t qt)
+static void writebyte(jpeg_enc_t *enc, const unsigned char b)
 {
-	return (data*qt - (data>>15) + ((1<<(QTAB_SCALE-1))-1)) >> QTAB_SCALE;
+	jpeg_sink_t *const sink = &enc->sink;
+
+	sink->buf[sink->pos++] = b;
+
+	if (sink->pos == sink->size)
+		sink_flush(enc);
 }
 
 /******************************************************************************
-**  writebyte
+**  writestuffed
 **  --------------------------------------------------------------------------
-**  This function writes byte into output buffer
-**  and flushes the buffer if it is full.
+**  Writes a 32-bit word of entropy-coded data (MSB first) into output buffer,
+**  adding 0x00 after every 0xFF byte.
+**  Most words contain no 0xFF at all, those are copied in one go.
 **  
-**  unsigned char jpgbuff - global output buffer;
-**  unsigned      jpgn    - the buffer index;
-**  
-**  ARGUMENTS: b - byte;
+**  ARGUMENTS:
+**      enc     - pointer to encoder context;
+**      w       - 4 bytes of code-stream;
 **
 **  RETURN: -
 ******************************************************************************/
+static void writestuffed(jpeg_enc_t *enc, const uint32_t w)
+{
+	jpeg_sink_t *const sink = &enc->sink;
+	unsigned i;
 
-// code-stream output counter
-static unsigned jpgn = 0;
-#define BUFFSIZE (1024)
-unsigned char jpgbuff[BUFFSIZE];
+	// (~w - 0x01010101) & w & 0x80808080 is non-zero if any byte of w is 0xFF
+	if (!((~w - 0x01010101) & w & 0x80808080) && sink->pos + 4 <= sink->size) {
+		unsigned char *p = &sink->buf[sink->pos];
+
+		p[0] = w >> 24;
+		p[1] = w >> 16;
+		p[2] = w >> 8;
+		p[3] = w;
+		sink->pos += 4;
+
+		if (sink->pos == sink->size)
+			sink_flush(enc);
+		return;
+	}
+
+	for (i = 0; i < 4; i++) {
+		const unsigned char b = w >> (24 - 8*i);
+
+		writebyte(enc, b);
+
+		if (b == 0xFF)
+			writebyte(enc, 0); // add 0x00 after 0xFF
+	}
+}
 
-static void writebyte(const unsigned char b)
+/******************************************************************************
+**  write_bytes
+**  --------------------------------------------------------------------------
+**  Copies finished code-stream (e.g. an MCU row encoded earlier, with its
+**  restart marker) into the sink. The bit-buffer has to be empty, as it is
+**  after write_RSI().
+**  
+**  ARGUMENTS:
+**      enc     - pointer to encoder context;
+**      data    - code-stream bytes;
+**      len     - number of bytes;
+**
+**  RETURN: -
+******************************************************************************/
+void write_bytes(jpeg_enc_t *enc, const uint8_t *data, size_t len)
 {
-	jpgbuff[jpgn++] = b;
+	jpeg_sink_t *const sink = &enc->sink;
 
-	if (jpgn == BUFFSIZE) {
-		jpgn = 0;
-		write_jpeg(jpgbuff, BUFFSIZE);
+	while (len) {
+		size_t n = sink->size - sink->pos;
+
+		if (n > len)
+			n = len;
+		memcpy(&sink->buf[sink->pos], data, n);
+		sink->pos += n;
+		data += n;
+		len -= n;
+
+		if (sink->pos == sink->size)
+			sink_flush(enc);
 	}
 }
 
-static void writeword(const uint16_t w)
+static void writeword(jpeg_enc_t *enc, const uint16_t w)
 {
-	writebyte(w >> 8); writebyte(w);
+	writebyte(enc, w >> 8); writebyte(enc, w);
 }
 
-static void write_APP0info(void)
+// number of codes in a DHT table
+static unsigned huffman_count(const unsigned char nrcodes[16])
 {
-	writeword(0xFFE0); //marker
-	writeword(16);     //length
-	writebyte('J');
-	writebyte('F');
-	writebyte('I');
-	writebyte('F');
-	writebyte(0);
-	writebyte(1);//versionhi
-	writebyte(1);//versionlo
-	writebyte(0);//xyunits
-	writeword(1);//xdensity
-	writeword(1);//ydensity
-	writebyte(0);//thumbnwidth
-	writebyte(0);//thumbnheight
+	unsigned i, n = 0;
+
+	for (i = 0; i < 16; i++)
+		n += nrcodes[i];
+	return n;
 }
 
-// should set width and height before writing
-static void write_SOF0info(const int16_t height, const int16_t width)
-{
-	writeword(0xFFC0);	//marker
-	writeword(17);		//length
-	writebyte(8);		//precision
-	writeword(height);	//height
-	writeword(width);	//width
-	writebyte(3);		//nrofcomponents
-	writebyte(1);		//IdY
-	writebyte(0x21);	//HVY, 4:4:4 subsampling (0x22 for 4:2:0)
-	writebyte(0);		//QTY
-	writebyte(2);		//IdCb
-	writebyte(0x11);	//HVCb
-	writebyte(1);		//QTCb
-	writebyte(3);		//IdCr
-	writebyte(0x11);	//HVCr
-	writebyte(1);		//QTCr
-}
-
-static void write_SOSinfo(void)
-{
-	writeword(0xFFDA);	//marker
-	writeword(12);		//length
-	writebyte(3);		//nrofcomponents
-	writebyte(1);		//IdY
-	writebyte(0);		//HTY
-	writebyte(2);		//IdCb
-	writebyte(0x11);	//HTCb
-	writebyte(3);		//IdCr
-	writebyte(0x11);	//HTCr
-	writebyte(0);		//Ss
-	writebyte(0x3F);	//Se
-	writebyte(0);		//Bf
-}
-
-static void write_DQTinfo(void)
+static void write_APP0info(jpeg_enc_t *enc)
+{
+	writeword(enc, 0xFFE0); //marker
+	writeword(enc, 16);     //length
+	writebyte(enc, 'J');
+	writebyte(enc, 'F');
+	writebyte(enc, 'I');
+	writebyte(enc, 'F');
+	writebyte(enc, 0);
+	writebyte(enc, 1);//versionhi
+	writebyte(enc, 1);//versionlo
+	writebyte(enc, 0);//xyunits
+	writeword(enc, 1);//xdensity
+	writeword(enc, 1);//ydensity
+	writebyte(enc, 0);//thumbnwidth
+	writebyte(enc, 0);//thumbnheight
+}
+
+// room for the row offsets, filled in by huffman_index_write(); only for
+// buffer output (and counting), callback output is gone by then
+static void write_INDEXinfo(jpeg_enc_t *enc, unsigned entries)
 {
+	const char *id = JPEG_INDEX_ID;
 	unsigned i;
 
-	writeword(0xFFDB);
-	writeword(132);
-	writebyte(0);
+	if (entries > enc->index->max || JPEG_INDEX_SIZE(entries) - 2 > 0xFFFF ||
+	    (enc->sink.cb != NULL && enc->sink.cb != sink_discard))
+		return;
+
+	writeword(enc, JPEG_INDEX_MARKER);
+	writeword(enc, JPEG_INDEX_SIZE(entries) - 2); //length
+	for (i = 0; i < sizeof(JPEG_INDEX_ID); i++)
+		writebyte(enc, id[i]); // with the terminating 0
+	writeword(enc, entries);
+	if (enc->sink.cb == NULL && !enc->sink.full)
+		enc->index->at = huffman_sink_length(enc);
+	for (i = 0; i < 4 * entries; i++)
+		writebyte(enc, 0);
+}
 
-	for (i = 0; i < 64; i++) 
-		writebyte(((unsigned char*)qtable_0_lum)[zig[i]]); // zig-zag order
+// should set width and height before writing
+static void write_SOF0info(jpeg_enc_t *enc, const int16_t height, const int16_t width)
+{
+	if (enc->grayscale) {
+		writeword(enc, 0xFFC0);	//marker
+		writeword(enc, 11);		//length
+		writebyte(enc, 8);		//precision
+		writeword(enc, height);	//height
+		writeword(enc, width);	//width
+		writebyte(enc, 1);		//nrofcomponents
+		writebyte(enc, 1);		//IdY
+		writebyte(enc, 0x11);	//HVY, no subsampling
+		writebyte(enc, 0);		//QTY
+		return;
+	}
 
-	writebyte(1);
+	writeword(enc, 0xFFC0);	//marker
+	writeword(enc, 17);		//length
+	writebyte(enc, 8);		//precision
+	writeword(enc, height);	//height
+	writeword(enc, width);	//width
+	writebyte(enc, 3);		//nrofcomponents
+	writebyte(enc, 1);		//IdY
+	writebyte(enc, (JPEG_MCU_WIDTH(enc) / 8) << 4 | JPEG_MCU_HEIGHT(enc) / 8);	//HVY, 0x21 for 4:2:2 subsampling (0x22 for 4:2:0)
+	writebyte(enc, 0);		//QTY
+	writebyte(enc, 2);		//IdCb
+	writebyte(enc, 0x11);	//HVCb
+	writebyte(enc, 1);		//QTCb
+	writebyte(enc, 3);		//IdCr
+	writebyte(enc, 0x11);	//HVCr
+	writebyte(enc, 1);		//QTCr
+}
 
-	for (i = 0; i < 64; i++) 
-		writebyte(((unsigned char*)qtable_0_chrom)[zig[i]]); // zig-zag order
+static void write_SOSinfo(jpeg_enc_t *enc)
+{
+	if (enc->grayscale) {
+		writeword(enc, 0xFFDA);	//marker
+		writeword(enc, 8);		//length
+		writebyte(enc, 1);		//nrofcomponents
+		writebyte(enc, 1);		//IdY
+		writebyte(enc, 0);		//HTY
+		writebyte(enc, 0);		//Ss
+		writebyte(enc, 0x3F);	//Se
+		writebyte(enc, 0);		//Bf
+		return;
+	}
+
+	writeword(enc, 0xFFDA);	//marker
+	writeword(enc, 12);		//length
+	writebyte(enc, 3);		//nrofcomponents
+	writebyte(enc, 1);		//IdY
+	writebyte(enc, 0);		//HTY
+	writebyte(enc, 2);		//IdCb
+	writebyte(enc, 0x11);	//HTCb
+	writebyte(enc, 3);		//IdCr
+	writebyte(enc, 0x11);	//HTCr
+	writebyte(enc, 0);		//Ss
+	writebyte(enc, 0x3F);	//Se
+	writebyte(enc, 0);		//Bf
 }
 
-static void write_DHTinfo(void)
+static void write_DQTinfo(jpeg_enc_t *enc)
 {
 	unsigned i;
 
-	writeword(0xFFC4); // marker
-	writeword(0x01A2); // length
+	writeword(enc, 0xFFDB);
+	writeword(enc, enc->grayscale ? 67 : 132);
+	writebyte(enc, 0);
 
-	writebyte(0); // HTYDCinfo
-	for (i = 0; i < 16; i++) 
-		writebyte(std_dc_luminance_nrcodes[i]);
-	for (i = 0; i < 12; i++) 
-		writebyte(std_dc_luminance_values[i]);
+	for (i = 0; i < 64; i++) 
+		writebyte(enc, enc->qtables->qtable[0][zig[i]]); // zig-zag order
 
-	writebyte(0x10); // HTYACinfo
-	for (i = 0; i < 16; i++)
-		writebyte(std_ac_luminance_nrcodes[i]);
-	for (i = 0; i < 162; i++)
-		writebyte(std_ac_luminance_values[i]);
+	if (enc->grayscale)
+		return;
 
+	writebyte(enc, 1);
 
-	writebyte(1); // HTCbDCinfo
-	for (i = 0; i < 16; i++)
-		writebyte(std_dc_chrominance_nrcodes[i]);
-	for (i = 0; i < 12; i++)
-		writebyte(std_dc_chrominance_values[i]);
+	for (i = 0; i < 64; i++) 
+		writebyte(enc, enc->qtables->qtable[1][zig[i]]); // zig-zag order
+}
 
-	writebyte(0x11); // HTCbACinfo = 0x11;
-	for (i = 0; i < 16; i++)
-		writebyte(std_ac_chrominance_nrcodes[i]);
-	for (i = 0; i < 162; i++)
-		writebyte(std_ac_chrominance_values[i]);
+static void write_DHTinfo(jpeg_enc_t *enc)
+{
+	const huffman_dht_t *const dht = enc->dht ? enc->dht : &std_dht;
+	// grayscale only has the luminance tables
+	const unsigned ntables = enc->grayscale ? 2 : 4;
+	// table class and destination: Y DC, Y AC, CbCr DC, CbCr AC
+	static const unsigned char tcth[4] = {0x00, 0x10, 0x01, 0x11};
+	unsigned t, i, n, length = 2;
+
+	for (t = 0; t < ntables; t++)
+		length += 17 + huffman_count(dht->nrcodes[t]);
+
+	writeword(enc, 0xFFC4); // marker
+	writeword(enc, length); // length
+
+	for (t = 0; t < ntables; t++) {
+		n = huffman_count(dht->nrcodes[t]);
+		writebyte(enc, tcth[t]);
+		for (i = 0; i < 16; i++)
+			writebyte(enc, dht->nrcodes[t][i]);
+		for (i = 0; i < n; i++)
+			writebyte(enc, dht->values[t][i]);
+	}
 }
 
 
@@ -439,15 +508,19 @@ static void write_DHTinfo(void)
 //
 //  Writes "Define Restart Interval" spacing and defines the interval
 //  between RSTn markers in macroblocks
-static void write_DRIinfo(void)
+static void write_DRIinfo(jpeg_enc_t *enc)
 {
     int frame_adjust=0;
-	writeword(0xFFDD);  // write DRI (define restart interval) marker
-    writeword(4);       // DRI Lr segment length (4 bytes total)
-    if(img_width%8==0 && img_width%16!=0) {
+	writeword(enc, 0xFFDD);  // write DRI (define restart interval) marker
+    writeword(enc, 4);       // DRI Lr segment length (4 bytes total)
+    if (JPEG_MCU_WIDTH(enc) == 8) {
+        writeword(enc, enc->img_width/8);  // grayscale (and 4:4:4, 4:4:0) MCU is a single block wide
+        return;
+    }
+    if(enc->img_width%8==0 && enc->img_width%16!=0) {
         frame_adjust=1;
     }
-	writeword(img_width/16 + frame_adjust);      // restart interval is 40 MCUs (each MCU is 16 pixels wide, which for an image 640 pixels wide is 640/16 = 40 MCUs
+	writeword(enc, enc->img_width/16 + frame_adjust);      // restart interval is 40 MCUs (each MCU is 16 pixels wide, which for an image 640 pixels wide is 640/16 = 40 MCUs
     /* IMG_WIDTH%16?0:1 is needed because if width is not a multiple of 16 but a multiple of 8(eg.360) then the restart interval needs to be 1 more than what integer division gives
       */       
 }
@@ -456,38 +529,32 @@ static void write_DRIinfo(void)
  **  writebits
  **  --------------------------------------------------------------------------
  **  Write bits into bit-buffer.
- **  If the number of bits exceeds 16 the result is unpredictable.
+ **  The 64-bit buffer always holds less than 32 pending bits, so up to 32 bits
+ **  (Huffman code and VLI together) can be added at once; the output is
+ **  flushed a whole 32-bit word at a time.
  **  
  **  ARGUMENTS:
- **      pbb     - pointer to bit-buffer context;
+ **      enc     - pointer to encoder context;
  **      bits    - bits to write;
- **      nbits   - number of bits to write, 0-16;
+ **      nbits   - number of bits to write, 0-32;
  **
  **  RETURN: -
  ******************************************************************************/
-static void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
+static inline void writebits(jpeg_enc_t *enc, uint32_t bits, unsigned nbits)
 {
+	bitbuffer_t *const pbb = &enc->bitbuf;
+
 	// shift old bits to the left, add new to the right
-	pbb->buf = (pbb->buf << nbits) | (bits & ((1 << nbits)-1));
+	pbb->buf = (pbb->buf << nbits) | (bits & (uint32_t)((1ULL << nbits)-1));
 
 	// new number of bits
-	nbits += pbb->n;
-
-	// flush whole bytes
-	while (nbits >= 8) {
-		unsigned char b;
-
-		nbits -= 8;
-		b = pbb->buf >> nbits;
-
-		writebyte(b);
+	pbb->n += nbits;
 
-		if (b == 0xFF)
-			writebyte(0); // add 0x00 after 0xFF
+	// flush a whole word
+	if (pbb->n >= 32) {
+		pbb->n -= 32;
+		writestuffed(enc, (uint32_t)(pbb->buf >> pbb->n));
 	}
-
-	// remember how many bits is remained
-	pbb->n = nbits;
 }
 
 /******************************************************************************
@@ -498,14 +565,30 @@ static void writebits(bitbuffer_t *const pbb, unsigned bits, unsigned nbits)
  **  and write these bytes.
  **  
  **  ARGUMENTS:
- **      pbb     - pointer to bit-buffer context;
+ **      enc     - pointer to encoder context;
  **
  **  RETURN: -
  ******************************************************************************/
-static void flushbits(bitbuffer_t *pbb)
+static void flushbits(jpeg_enc_t *enc)
 {
-	if (pbb->n)
-		writebits(pbb, 0xFF, 8 - pbb->n);
+	bitbuffer_t *const pbb = &enc->bitbuf;
+
+	// pad to a byte boundary
+	if (pbb->n & 7)
+		writebits(enc, 0xFF, 8 - (pbb->n & 7));
+
+	// flush remaining whole bytes
+	while (pbb->n) {
+		unsigned char b;
+
+		pbb->n -= 8;
+		b = pbb->buf >> pbb->n;
+
+		writebyte(enc, b);
+
+		if (b == 0xFF)
+			writebyte(enc, 0); // add 0x00 after 0xFF
+	}
 }
 
 /******************************************************************************
@@ -530,20 +613,261 @@ static unsigned huffman_bits(const int16_t value)
  **  --------------------------------------------------------------------------
  **  Calculates magnitude of an VLI integer - the number of bits that are enough
  **  to represent given value.
+ **  Uses count-leading-zeros (a single NSAU instruction on Xtensa).
  **  
  **  ARGUMENTS:
  **      value    - DCT amplitude;
  **
  **  RETURN: magnitude
  ******************************************************************************/
-static unsigned huffman_magnitude(const int16_t value)
+static inline unsigned huffman_magnitude(const int16_t value)
 {
 	unsigned x = (value < 0)? -value: value;
-	unsigned m = 0;
 
-	while (x >> m) ++m;
+	return x ? 32 - __builtin_clz(x) : 0;
+}
 
-	return m;
+/******************************************************************************
+ **  huffman_write
+ **  --------------------------------------------------------------------------
+ **  Writes a Huffman code followed by the VLI of the amplitude with a single
+ **  bit-buffer write.
+ **  
+ **  ARGUMENTS:
+ **      enc     - pointer to encoder context;
+ **      code    - packed Huffman code, (code << 8) | length;
+ **      value   - DCT amplitude;
+ **      magn    - VLI length of the amplitude;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+static inline void huffman_write(jpeg_enc_t *enc, const uint32_t code, const int16_t value, const unsigned magn)
+{
+	writebits(enc, (code >> 8) << magn | (huffman_bits(value) & ((1 << magn) - 1)),
+	          (code & 0xFF) + magn);
+}
+
+/******************************************************************************
+ **  huffman_build
+ **  --------------------------------------------------------------------------
+ **  Builds a packed code table from a DHT specification (JPEG Annex C.2):
+ **  entry [symbol] = (code << 8) | code length.
+ **  
+ **  ARGUMENTS:
+ **      table   - packed code table to fill;
+ **      nrcodes - number of codes of each length 1-16;
+ **      values  - symbols in code order;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+static void huffman_build(uint32_t *table, const unsigned char nrcodes[16], const unsigned char *values)
+{
+	unsigned code = 0, len, i, k = 0;
+
+	for (len = 1; len <= 16; len++) {
+		for (i = 0; i < nrcodes[len-1]; i++)
+			table[values[k++]] = (code++ << 8) | len;
+		code <<= 1;
+	}
+}
+
+// code length of every symbol of a DHT specification, 0 for the ones it has
+// no code for
+static void huffman_lengths(unsigned char *table, const unsigned char nrcodes[16], const unsigned char *values)
+{
+	unsigned len, i, k = 0;
+
+	for (len = 1; len <= 16; len++)
+		for (i = 0; i < nrcodes[len-1]; i++)
+			table[values[k++]] = len;
+}
+
+// dct_quantize_rd() weight of one bit for a quantization table: 0.1 q (q + 12)
+// of its finest AC step q at strength 100. The slope of D(R) measured over
+// qualities 30..95 grows about linearly with the steps at fine ones and
+// like q^2 at coarse ones; the high-rate slope 2 ln 2 * q^2 / 12 alone
+// leaves fine steps with a lambda far too small. Chrominance gets twice
+// the strength. Scaled by 2^(2*DCT_RD_BITS) like the errors it is weighed
+// against
+static uint32_t huffman_lambda(const unsigned char qtable[64], unsigned strength)
+{
+	unsigned q = 255, i;
+
+	for (i = 1; i < 64; i++)
+		if (qtable[i] < q)
+			q = qtable[i];
+	return (uint32_t)(((uint64_t)strength * q * (q + 12) * (1u << (2 * DCT_RD_BITS)) + 500) / 1000);
+}
+
+/******************************************************************************
+ **  qtables_scale
+ **  --------------------------------------------------------------------------
+ **  Scales a base quantization table to the given quality like the IJG
+ **  library does (50 keeps the base table, 100 gives all ones).
+ **  
+ **  ARGUMENTS:
+ **      base    - base table, natural order;
+ **      quality - 1..100;
+ **      qtable  - scaled table;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+static void qtables_scale(const unsigned char base[64], int quality, unsigned char qtable[64])
+{
+	const int scale = (quality < 50) ? 5000 / quality : 200 - 2*quality;
+	unsigned i;
+
+	for (i = 0; i < 64; i++) {
+		int q = (base[i]*scale + 50) / 100;
+
+		// baseline JPEG allows 8-bit tables only
+		qtable[i] = (q < 1) ? 1 : (q > 255) ? 255 : q;
+	}
+}
+
+/******************************************************************************
+ **  huffman_quality
+ **  --------------------------------------------------------------------------
+ **  Selects the quantization tables of the following encodes.
+ **  Tables (DQT and the matching dct_quantize() quantizers) are built on
+ **  first use of a quality level and shared by all contexts afterwards, so
+ **  switching quality between frames costs nothing.
+ **  
+ **  ARGUMENTS:
+ **      enc     - pointer to encoder context;
+ **      quality - JPEG_QUALITY_DEFAULT for the built-in tables,
+ **                or 1..100 for IJG-scaled Annex K tables;
+ **
+ **  RETURN: 0 on success, -1 on bad quality or no memory.
+ ******************************************************************************/
+int huffman_quality(jpeg_enc_t *enc, int quality)
+{
+	jpeg_qtables_t *qt;
+
+	if (quality < 0 || quality > JPEG_QUALITY_MAX)
+		return -1;
+
+	qt = __atomic_load_n(&qtables_cache[quality], __ATOMIC_ACQUIRE);
+
+	if (qt == NULL) {
+		jpeg_qtables_t *expected = NULL;
+
+		qt = (jpeg_qtables_t *)malloc(sizeof(jpeg_qtables_t));
+		if (qt == NULL)
+			return -1;
+
+		if (quality == JPEG_QUALITY_DEFAULT) {
+			memcpy(qt->qtable[0], qtable_0_lum, 64);
+			memcpy(qt->qtable[1], qtable_0_chrom, 64);
+		} else {
+			qtables_scale(*qtable_k1_lum, quality, qt->qtable[0]);
+			qtables_scale(*qtable_k2_chrom, quality, qt->qtable[1]);
+		}
+		dct_fdtbl(qt->qtable[0], qt->fdtbl[0]);
+		dct_fdtbl(qt->qtable[1], qt->fdtbl[1]);
+
+		// another task may have built the same level meanwhile, keep theirs
+		if (!__atomic_compare_exchange_n(&qtables_cache[quality], &expected, qt,
+		                                 false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+			free(qt);
+			qt = expected;
+		}
+	}
+
+	enc->qtables = qt;
+	return 0;
+}
+
+// size the thumbnail planes for the image, planes are malloc()ed (again)
+// when they grow; none are recorded (width 0) if that fails
+static void thumb_setup(jpeg_enc_t *enc)
+{
+	jpeg_thumb_t *const t = enc->thumb;
+	unsigned w = enc->grayscale ? enc->img_width / 8 : enc->img_width / 16 * 2;
+	unsigned h = enc->img_high / 8;
+
+	if ((size_t)w * h > t->size) {
+		free(t->y);
+		t->y = (uint8_t *)malloc((size_t)w * h * 2);
+		t->size = t->y != NULL ? (size_t)w * h : 0;
+		if (t->y == NULL)
+			w = h = 0;
+	}
+	t->cb = t->y + t->size;
+	t->cr = t->cb + t->size / 2;
+	t->width = w;
+	t->height = h;
+	t->n[0] = t->n[1] = t->n[2] = 0;
+}
+
+/******************************************************************************
+ **  huffman_setup
+ **  --------------------------------------------------------------------------
+ **  Prepares the Huffman and quantization tables and the image size without
+ **  writing anything, so that MCU rows can be encoded into this context's
+ **  sink. Used for the rows of a stripe that goes behind another context's
+ **  headers. Restarts the thumbnail, if one is recorded (enc->thumb).
+ **  
+ **  ARGUMENTS:
+ **      enc     - pointer to encoder context;
+ **      height  - image height (pixels);
+ **      width   - image width (pixels);
+ **
+ **  RETURN: -
+ ******************************************************************************/
+void huffman_setup(jpeg_enc_t *enc, int16_t height, int16_t width)
+{
+	const huffman_dht_t *const dht = enc->dht ? enc->dht : &std_dht;
+
+#if JPEG_SIMD
+	// vector kernels of this CPU, chosen by the first encode
+	jpeg_simd_init();
+#endif
+
+	// build the code tables only when they change: on first use, or when
+	// huffman_optimize() / huffman_standard() switched tables
+	if (enc->hbuilt != dht) {
+		memset(enc->hdccode, 0, sizeof(enc->hdccode));
+		memset(enc->haccode, 0, sizeof(enc->haccode));
+		huffman_build(enc->hdccode[0], dht->nrcodes[0], dht->values[0]);
+		huffman_build(enc->haccode[0], dht->nrcodes[1], dht->values[1]);
+		huffman_build(enc->hdccode[1], dht->nrcodes[2], dht->values[2]);
+		huffman_build(enc->haccode[1], dht->nrcodes[3], dht->values[3]);
+		// rate-distortion quantization costs bits with the lengths of the
+		// tables it codes with, so it only picks symbols they have a code
+		// for. Optimized tables without an EOB (no block of the gathering
+		// pass ended early) keep the Annex K lengths that pass picked with
+		memset(enc->haclen, 0, sizeof(enc->haclen));
+		huffman_lengths(enc->haclen[0], dht->nrcodes[1], dht->values[1]);
+		huffman_lengths(enc->haclen[1], dht->nrcodes[3], dht->values[3]);
+		if (enc->haclen[0][0x00] == 0 || enc->haclen[1][0x00] == 0) {
+			memset(enc->haclen, 0, sizeof(enc->haclen));
+			huffman_lengths(enc->haclen[0], std_dht.nrcodes[1], std_dht.values[1]);
+			huffman_lengths(enc->haclen[1], std_dht.nrcodes[3], std_dht.values[3]);
+		}
+		enc->hbuilt = dht;
+	}
+
+	if (enc->qtables == NULL)
+		huffman_quality(enc, JPEG_QUALITY_DEFAULT);
+
+	enc->huffman[0] = (huffman_t){enc->hdccode[0], enc->haccode[0], enc->qtables->fdtbl[0], enc->qtables->qtable[0], 0, 0}; // Y
+	enc->huffman[1] = (huffman_t){enc->hdccode[1], enc->haccode[1], enc->qtables->fdtbl[1], enc->qtables->qtable[1], 0, 0}; // Cb
+	enc->huffman[2] = (huffman_t){enc->hdccode[1], enc->haccode[1], enc->qtables->fdtbl[1], enc->qtables->qtable[1], 0, 0}; // Cr
+
+	if (enc->trellis) {
+		enc->huffman[0].lambda = huffman_lambda(enc->qtables->qtable[0], enc->trellis);
+		enc->huffman[1].lambda = huffman_lambda(enc->qtables->qtable[1], 2 * enc->trellis);
+		enc->huffman[2].lambda = enc->huffman[1].lambda;
+	}
+	enc->bitbuf.buf = 0;
+	enc->bitbuf.n = 0;
+	if (enc->sink.buf == NULL)
+		huffman_sink_buffer(enc, NULL, 0); // no sink set, fail instead of crashing
+    enc->img_high = height;
+    enc->img_width = width;
+	if (enc->thumb != NULL)
+		thumb_setup(enc);
 }
 
 /******************************************************************************
@@ -551,38 +875,119 @@ static unsigned huffman_magnitude(const int16_t value)
  **  --------------------------------------------------------------------------
  **  Starts Huffman encoding by writing Start of Image (SOI) and all headers.
  **  Sets image size in Start of File (SOF) header before writing it.
+ **  The sink has to be set up (again) for every image, see huffman_sink_buffer().
+ **  The headers are serialized once into enc->header and copied from there
+ **  as long as size, quality and subsampling stay the same, as for MJPEG.
  **  
  **  ARGUMENTS:
+ **      enc     - pointer to encoder context;
  **      height  - image height (pixels);
  **      width   - image width (pixels);
  **
  **  RETURN: -
  ******************************************************************************/
-void huffman_start(int16_t height, int16_t width)
-{
-    img_high = height;
-    img_width = width;
-	writeword(0xFFD8); // SOI
-	write_APP0info();
-	write_DQTinfo();
-	write_SOF0info(height, width);
-	write_DHTinfo();
-	write_DRIinfo();    // set restart interval length
-	write_SOSinfo();
-	huffman_ctx[2].dc = 
-		huffman_ctx[1].dc = 
-		huffman_ctx[0].dc = 0;
+void huffman_start(jpeg_enc_t *enc, int16_t height, int16_t width)
+{
+	jpeg_header_t *const hdr = &enc->header;
+
+	huffman_setup(enc, height, width);
+
+	if (hdr->len == 0 || hdr->qtables != enc->qtables ||
+	    hdr->width != width || hdr->height != height ||
+	    hdr->subsampling != enc->subsampling || hdr->grayscale != enc->grayscale) {
+		const jpeg_sink_t sink = enc->sink;
+
+		huffman_sink_buffer(enc, hdr->data, sizeof(hdr->data));
+		writeword(enc, 0xFFD8); // SOI
+		write_APP0info(enc);
+		hdr->app = huffman_sink_length(enc);
+		write_DQTinfo(enc);
+		write_SOF0info(enc, height, width);
+		write_DHTinfo(enc);
+		write_DRIinfo(enc);    // set restart interval length
+		write_SOSinfo(enc);
+		hdr->len = huffman_sink_failed(enc) ? 0 : huffman_sink_length(enc);
+		if (hdr->len == 0)
+			hdr->app = 0;
+		enc->sink = sink;
+
+		hdr->qtables = enc->qtables;
+		hdr->width = width;
+		hdr->height = height;
+		hdr->subsampling = enc->subsampling;
+		hdr->grayscale = enc->grayscale;
+	}
+
+	if (enc->index == NULL) {
+		write_bytes(enc, hdr->data, hdr->len);
+		return;
+	}
+	enc->index->count = 0;
+	enc->index->at = 0;
+	write_bytes(enc, hdr->data, hdr->app);
+	if (enc->index->app)
+		write_INDEXinfo(enc, height / JPEG_MCU_HEIGHT(enc) + 1);
+	write_bytes(enc, &hdr->data[hdr->app], hdr->len - hdr->app);
+	huffman_index_row(enc);
+}
+
+/******************************************************************************
+ **  huffman_index_row
+ **  --------------------------------------------------------------------------
+ **  Records the current sink position as the next entry of enc->index:
+ **  the start of an MCU row, or of EOI after the last one. Entries past
+ **  the caller array are only counted.
+ **  
+ **  ARGUMENTS:
+ **      enc     - pointer to encoder context, enc->index set;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+void huffman_index_row(jpeg_enc_t *enc)
+{
+	jpeg_index_t *const index = enc->index;
+
+	if (index->count < index->max)
+		index->offset[index->count] = huffman_sink_length(enc);
+	index->count++;
+}
+
+/******************************************************************************
+ **  huffman_index_write
+ **  --------------------------------------------------------------------------
+ **  Fills the offsets of the index segment reserved by huffman_start(), once
+ **  they are all known. Nothing to do if the last encode reserved none.
+ **  
+ **  ARGUMENTS:
+ **      index   - row offsets of the last encode;
+ **      jpeg    - its output;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+void huffman_index_write(const jpeg_index_t *index, uint8_t *jpeg)
+{
+	uint8_t *p = &jpeg[index->at];
+	unsigned i;
+
+	if (index->at == 0)
+		return;
+	for (i = 0; i < index->count && i < index->max; i++, p += 4) {
+		p[0] = index->offset[i] >> 24;
+		p[1] = index->offset[i] >> 16;
+		p[2] = index->offset[i] >> 8;
+		p[3] = index->offset[i];
+	}
 }
 
 //
 // huffman_resetdc()
 //
 // reset DC predictors for Huffman encoding (needed every restart interval)
-void huffman_resetdc(void)
+void huffman_resetdc(jpeg_enc_t *enc)
 {
-	huffman_ctx[2].dc = 
-		huffman_ctx[1].dc = 
-		huffman_ctx[0].dc = 0;
+	enc->huffman[2].dc = 
+		enc->huffman[1].dc = 
+		enc->huffman[0].dc = 0;
 }
 
 
@@ -592,93 +997,418 @@ void huffman_resetdc(void)
  **  Finalize Huffman encoding by flushing bit-buffer, writing End of Image (EOI)
  **  into output buffer and flusing this buffer.
  **  
- **  ARGUMENTS: -
+ **  ARGUMENTS:
+ **      enc     - pointer to encoder context;
  **
  **  RETURN: -
  ******************************************************************************/
-void huffman_stop(void)
+void huffman_stop(jpeg_enc_t *enc)
 {
-	flushbits(&bitbuf);
-	writeword(0xFFD9); // EOI - End of Image
-	write_jpeg(jpgbuff, jpgn);
-	jpgn = 0;
+	flushbits(enc);
+	writeword(enc, 0xFFD9); // EOI - End of Image
+	// hand out the last, partial chunk
+	if (enc->sink.cb != NULL)
+		sink_flush(enc);
+	// in buffer mode the whole image is still at hand, also when it ended
+	// exactly at the end of the buffer (and buf went to the scratch area)
+	else if (enc->index != NULL && !huffman_sink_failed(enc))
+		huffman_index_write(enc->index, enc->sink.out);
 }
 
 /******************************************************************************
  **  huffman_encode
  **  --------------------------------------------------------------------------
- **  Quantize and Encode a 8x8 DCT block by JPEG Huffman lossless coding.
+ **  Encode a quantized 8x8 DCT block by JPEG Huffman lossless coding.
  **  This function writes encoded bit-stream into bit-buffer.
  **  
  **  ARGUMENTS:
- **      ctx     - pointer to encoder context;
- **      data    - pointer to 8x8 DCT block;
+ **      enc     - pointer to encoder context;
+ **      ctx     - pointer to component Huffman context;
+ **      data    - quantized coefficients in zig-zag order;
  **
  **  RETURN: -
  ******************************************************************************/
-void huffman_encode(huffman_t *const ctx, const int16_t data[])
+// DC coefficient of a block, as the difference to the one before
+static inline void huffman_write_dc(jpeg_enc_t *enc, huffman_t *const ctx, const int16_t dc)
 {
-	unsigned magn, bits;
-	unsigned zerorun, i;
-	int16_t    diff;
+	const int16_t diff = dc - ctx->dc;
+	const unsigned magn = huffman_magnitude(diff); // VLI length
 
-	int16_t    dc = quantize(data[0], ctx->qtable[0]);
-	// difference between old and new DC
-	diff = dc - ctx->dc;
 	ctx->dc = dc;
+	// encode VLI length and VLI itself
+	huffman_write(enc, ctx->hdccode[magn], diff, magn);
+}
+
+void huffman_encode(jpeg_enc_t *enc, huffman_t *const ctx, const int16_t data[])
+{
+	unsigned magn;
+	unsigned zerorun, i, last;
 
-	bits = huffman_bits(diff); // VLI
-	magn = huffman_magnitude(diff); // VLI length
+	huffman_write_dc(enc, ctx, data[0]);
 
-	// encode VLI length
-	writebits(&bitbuf, ctx->hdcbit[magn], ctx->hdclen[magn]);
-	// encode VLI itself
-	writebits(&bitbuf, bits, magn);
+	// the trailing zeros are all covered by the EOB, so the AC loop stops at
+	// the last non-zero coefficient (right away for DC-only blocks)
+	for (last = 63; last > 0 && !data[last]; last--)
+		;
 
-	for (zerorun = 0, i = 1; i < 64; i++)
+	for (zerorun = 0, i = 1; i <= last; i++)
 	{
-		const int16_t ac = quantize(data[zig[i]], ctx->qtable[zig[i]]);
+		const int16_t ac = data[i];
 
 		if (ac) {
 			while (zerorun >= 16) {
 				zerorun -= 16;
 				// ZRL
-				writebits(&bitbuf, ctx->hacbit[15][0], ctx->haclen[15][0]);
+				writebits(enc, ctx->haccode[0xF0] >> 8, ctx->haccode[0xF0] & 0xFF);
 			}
 
-			bits = huffman_bits(ac);
 			magn = huffman_magnitude(ac);
 
-			writebits(&bitbuf, ctx->hacbit[zerorun][magn], ctx->haclen[zerorun][magn]);
-			writebits(&bitbuf, bits, magn);
+			huffman_write(enc, ctx->haccode[(zerorun << 4) | magn], ac, magn);
+
+			zerorun = 0;
+		}
+		else zerorun++;
+	}
+
+	if (last < 63) { // EOB - End Of Block
+		writebits(enc, ctx->haccode[0x00] >> 8, ctx->haccode[0x00] & 0xFF);
+	}
+}
+
+// huffman_encode() of a block with only a DC coefficient: DC and EOB
+static void huffman_encode_dc(jpeg_enc_t *enc, huffman_t *const ctx, const int16_t dc)
+{
+	huffman_write_dc(enc, ctx, dc);
+	writebits(enc, ctx->haccode[0x00] >> 8, ctx->haccode[0x00] & 0xFF);
+}
+
+/******************************************************************************
+ **  huffman_gather
+ **  --------------------------------------------------------------------------
+ **  First pass of optimized Huffman coding: counts the symbols that
+ **  huffman_encode() would write for a block, in enc->opt. Used as block_cb
+ **  with block_arg = enc, after huffman_gather_start().
+ **  
+ **  ARGUMENTS:
+ **      arg     - pointer to encoder context;
+ **      comp    - component (index into huffman[]) or JPEG_BLOCK_RST + n;
+ **      data    - quantized coefficients in zig-zag order;
+ **
+ **  RETURN: -
+ ******************************************************************************/
+void huffman_gather(void *arg, unsigned comp, const int16_t *data)
+{
+	jpeg_enc_t *const enc = (jpeg_enc_t *)arg;
+	huffman_t *ctx;
+	uint32_t *dc, *ac;
+	unsigned zerorun, i;
+	int16_t diff;
+
+	// restart: the DC predictors start over, as in write_RSI()
+	if (comp >= JPEG_BLOCK_RST) {
+		huffman_resetdc(enc);
+		return;
+	}
 
+	ctx = &enc->huffman[comp];
+	dc = enc->opt->freq[comp ? 2 : 0];
+	ac = enc->opt->freq[comp ? 3 : 1];
+
+	diff = data[0] - ctx->dc;
+	ctx->dc = data[0];
+	dc[huffman_magnitude(diff)]++;
+
+	for (zerorun = 0, i = 1; i < 64; i++) {
+		if (data[i]) {
+			for (; zerorun >= 16; zerorun -= 16)
+				ac[0xF0]++; // ZRL
+			ac[(zerorun << 4) | huffman_magnitude(data[i])]++;
 			zerorun = 0;
 		}
 		else zerorun++;
 	}
 
-	if (zerorun) { // EOB - End Of Block
-		writebits(&bitbuf, ctx->hacbit[0][0], ctx->haclen[0][0]);
+	if (zerorun)
+		ac[0x00]++; // EOB
+}
+
+int huffman_gather_start(jpeg_enc_t *enc)
+{
+	if (enc->opt == NULL) {
+		enc->opt = (struct huffman_opt_s *)calloc(1, sizeof(struct huffman_opt_s));
+		if (enc->opt == NULL)
+			return -1;
+	}
+	memset(enc->opt->freq, 0, sizeof(enc->opt->freq));
+	huffman_resetdc(enc);
+	return 0;
+}
+
+/******************************************************************************
+ **  huffman_optimal
+ **  --------------------------------------------------------------------------
+ **  Builds an optimal Huffman table with codes of at most 16 bits for the
+ **  given symbol counts, as in Annex K.2 of the standard: the reserved
+ **  symbol 256 keeps any real code from being all 1 bits.
+ **  
+ **  ARGUMENTS:
+ **      freq    - symbol counts, destroyed;
+ **      nrcodes - number of codes of each length 1..16 (BITS);
+ **      values  - symbols by increasing code length (HUFFVAL);
+ **
+ **  RETURN: -
+ ******************************************************************************/
+static void huffman_optimal(uint32_t freq[257], unsigned char nrcodes[16], unsigned char values[256])
+{
+	unsigned char codesize[257];
+	short others[257];
+	unsigned char bits[33];
+	int c1, c2, i, j, k;
+
+	memset(codesize, 0, sizeof(codesize));
+	memset(bits, 0, sizeof(bits));
+	for (i = 0; i < 257; i++)
+		others[i] = -1;
+	freq[256] = 1;
+
+	for (;;) {
+		// the two least frequent remaining symbols, ties go to the larger one
+		uint32_t v = UINT32_MAX;
+		c1 = -1;
+		for (i = 0; i < 257; i++)
+			if (freq[i] && freq[i] <= v) {
+				v = freq[i];
+				c1 = i;
+			}
+		v = UINT32_MAX;
+		c2 = -1;
+		for (i = 0; i < 257; i++)
+			if (freq[i] && freq[i] <= v && i != c1) {
+				v = freq[i];
+				c2 = i;
+			}
+		if (c2 < 0)
+			break;
+
+		// merge them, everything in either branch gets one bit longer
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		codesize[c1]++;
+		while (others[c1] >= 0) {
+			c1 = others[c1];
+			codesize[c1]++;
+		}
+		others[c1] = c2;
+		codesize[c2]++;
+		while (others[c2] >= 0) {
+			c2 = others[c2];
+			codesize[c2]++;
+		}
+	}
+
+	for (i = 0; i < 257; i++)
+		if (codesize[i])
+			bits[codesize[i]]++;
+
+	// limit to 16 bits: move pairs of long codes up the tree
+	for (i = 32; i > 16; i--)
+		while (bits[i] > 0) {
+			j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+
+	// drop the reserved symbol, it has one of the longest codes
+	for (i = 16; i > 0 && bits[i] == 0; i--)
+		;
+	if (i > 0)
+		bits[i]--;
+
+	memcpy(nrcodes, &bits[1], 16);
+	for (k = 0, i = 1; i <= 32; i++)
+		for (j = 0; j < 256; j++)
+			if (codesize[j] == i)
+				values[k++] = j;
+}
+
+void huffman_optimize(jpeg_enc_t *enc)
+{
+	struct huffman_opt_s *const opt = enc->opt;
+	unsigned t, i;
+
+	for (t = 0; t < 4; t++) {
+		// no symbols (chrominance of a grayscale image): keep Annex K
+		for (i = 0; i < 256 && opt->freq[t][i] == 0; i++)
+			;
+		if (i == 256) {
+			opt->dht.nrcodes[t] = std_dht.nrcodes[t];
+			opt->dht.values[t] = std_dht.values[t];
+			continue;
+		}
+		huffman_optimal(opt->freq[t], opt->nrcodes[t], opt->values[t]);
+		opt->dht.nrcodes[t] = opt->nrcodes[t];
+		opt->dht.values[t] = opt->values[t];
+	}
+	enc->dht = &opt->dht;
+	enc->hbuilt = NULL;     // same pointer, new tables
+	enc->header.len = 0;
+}
+
+// back to the Annex K tables, enc->opt is kept for the next image
+void huffman_standard(jpeg_enc_t *enc)
+{
+	if (enc->dht != NULL) {
+		enc->dht = NULL;
+		enc->header.len = 0;
+	}
+}
+
+// bytes from one pixel row of a line buffer to the next
+static inline unsigned int line_stride(const jpeg_enc_t *enc, unsigned int bpp)
+{
+	return enc->stride ? enc->stride : bpp * enc->img_width;
+}
+
+// store the average of a block, from its quantized DC coefficient, at its
+// place in the thumbnail; blocks come in code-stream order
+static void thumb_put(jpeg_enc_t *enc, unsigned comp, int16_t dc)
+{
+	jpeg_thumb_t *const t = enc->thumb;
+	const unsigned n = t->n[comp]++;
+	int v = 128 + ((dc * enc->qtables->qtable[comp != 0][0] + 4) >> 3);
+
+	v = v < 0 ? 0 : v > 255 ? 255 : v;
+	if (comp != 0) {
+		const unsigned rows = JPEG_MCU_HEIGHT(enc) == 16 ? t->height / 2 : t->height;
+
+		if (n < t->width / 2 * rows)
+			(comp == 1 ? t->cb : t->cr)[n] = v;
+	} else if (n < t->width * t->height) {
+		unsigned r = n / t->width;
+		unsigned c = n % t->width;
+
+		// 4:2:0 MCUs hold 2x2 blocks: top left/right, bottom left/right
+		if (JPEG_MCU_HEIGHT(enc) == 16) {
+			const unsigned m = n / 4;
+
+			r = m / (t->width / 2) * 2 + (n & 2) / 2;
+			c = m % (t->width / 2) * 2 + (n & 1);
+		}
+		t->y[r * t->width + c] = v;
+	}
+}
+
+// true if all pixels of the block are the same; any other block mostly
+// differs within the first few pixels, so this costs little next to the DCT
+static inline bool block_flat(int16_t block[8][8])
+{
+	const int16_t *p = &block[0][0];
+	unsigned i;
+
+	for (i = 1; i < 64; i++)
+		if (p[i] != p[0])
+			return false;
+	return true;
+}
+
+// one transform, quantized and encoded by every encoder of the chain
+static void encode_block_chain(jpeg_enc_t *enc, unsigned comp, int16_t block[8][8])
+{
+	const bool flat = block_flat(block);
+	int32_t coef[64];
+	int16_t data[64];
+
+	if (!flat)
+		dct_aan(block, coef);
+	for (; enc != NULL; enc = enc->next) {
+		if (huffman_sink_failed(enc))
+			continue;
+		if (flat) {
+			memset(data, 0, sizeof(data));
+			data[0] = dct_quantize_flat(block[0][0], enc->huffman[comp].fdtbl);
+		} else if (enc->huffman[comp].lambda > 0)
+			dct_quantize_rd(coef, enc->huffman[comp].fdtbl, enc->huffman[comp].qtable,
+			                enc->haclen[comp != 0], enc->huffman[comp].lambda, data);
+		else
+			dct_requantize(coef, enc->huffman[comp].fdtbl, data);
+		if (enc->thumb != NULL)
+			thumb_put(enc, comp, data[0]);
+		if (enc->block_cb != NULL)
+			enc->block_cb(enc->block_arg, comp, data);
+		else
+			huffman_encode(enc, &enc->huffman[comp], data);
+	}
+}
+
+// transform, quantize and encode one 8x8 pixel block
+static void encode_block(jpeg_enc_t *enc, huffman_t *const ctx, int16_t block[8][8])
+{
+	const unsigned comp = ctx - enc->huffman;
+	int16_t data[64];
+
+	if (enc->next != NULL) {
+		encode_block_chain(enc, comp, block);
+		return;
+	}
+	if (block_flat(block)) {
+		// uniform, e.g. a flat area of a screen capture: no transform, and
+		// just DC and EOB when coding here
+		data[0] = dct_quantize_flat(block[0][0], ctx->fdtbl);
+		if (enc->thumb != NULL)
+			thumb_put(enc, comp, data[0]);
+		if (enc->block_cb == NULL) {
+			huffman_encode_dc(enc, ctx, data[0]);
+			return;
+		}
+		memset(&data[1], 0, 63 * sizeof(data[0]));
+	} else if (ctx->lambda > 0) {
+		int32_t coef[64];
+
+		dct_aan(block, coef);
+		dct_quantize_rd(coef, ctx->fdtbl, ctx->qtable, enc->haclen[comp != 0], ctx->lambda, data);
+		if (enc->thumb != NULL)
+			thumb_put(enc, comp, data[0]);
+	} else {
+		dct_quantize(block, ctx->fdtbl, data);
+		if (enc->thumb != NULL)
+			thumb_put(enc, comp, data[0]);
 	}
+	if (enc->block_cb != NULL)
+		enc->block_cb(enc->block_arg, comp, data);
+	else
+		huffman_encode(enc, ctx, data);
 }
 
 // write re-start interval termination character
 //  _rsi    :   3-bit restart interval character [0..7]
-void write_RSI(unsigned int _rsi)
+void write_RSI(jpeg_enc_t *enc, unsigned int _rsi)
 {
 	// ensure re-start interval is valid
 	_rsi &= 0x07;   // mask with '111' (keep only last 3 bits)
 
-	// flush buffer
-	flushbits(&bitbuf);
+	// entropy coding happens elsewhere, pass the marker on with the blocks
+	if (enc->block_cb != NULL) {
+		enc->block_cb(enc->block_arg, JPEG_BLOCK_RST + _rsi, NULL);
+	} else {
+		// flush buffer
+		flushbits(enc);
+
+		// write marker with 3-bit restart interval counter
+		writeword(enc, 0xFFD0 | _rsi);
+		if (enc->index != NULL)
+			huffman_index_row(enc);
 
-	// write marker with 3-bit restart interval counter
-	writeword(0xFFD0 | _rsi);
+		// reset block-to-block predictors (DC values, etc.)
+		huffman_resetdc(enc);
+	}
 
-	write_jpeg(jpgbuff, jpgn);
-	jpgn = 0; 
-	// reset block-to-block predictors (DC values, etc.)
-	huffman_resetdc();
+	if (enc->next != NULL)
+		write_RSI(enc->next, _rsi);
 }
 
 #ifdef ENABLE_RGB
@@ -695,7 +1425,7 @@ inline color RGB2Cr(const color r, const color g, const color b)
 	return (8421376 + 32767*r - 27438*g - 5329*b) >> 16;
 }
 
-// chroma subsampling, i.e. converting a 16x16 RGB block into 8x8 Cb and Cr
+// chroma subsampling, i.e. converting a 16x8 RGB block into 8x8 Cb and Cr
 void subsample(RGB rgb[8][16], int16_t cb[8][8], int16_t cr[8][8])
 {
 	RGB pixel;
@@ -711,199 +1441,434 @@ void subsample(RGB rgb[8][16], int16_t cb[8][8], int16_t cr[8][8])
 			cr[r][c] = (int16_t)RGB2Cr( pixel.Red, pixel.Green, pixel.Blue )-128;
 		}
 }
-#endif // ENABLE_RGB
-
-#ifdef ENABLE_RGB
-// static arrays for processing
-RGB     RGB8x16[8][16]; // two 8x8 red/green/blue blocks
-#endif // ENABLE_RGB
 
-int16_t   Y8x8[2][8][8];  // luminance
-int16_t   Cb8x8[8][8];    // chrominance
-int16_t   Cr8x8[8][8];    // chrominance
+// 4:2:0 chroma subsampling, i.e. converting a 16x16 RGB block into 8x8 Cb and Cr
+void subsample420(RGB rgb[16][16], int16_t cb[8][8], int16_t cr[8][8])
+{
+	RGB pixel;
+	unsigned int r;     // row index
+	unsigned int c;     // col index
+	for (r = 0; r < 8; r++)
+		for (c = 0; c < 8; c++)
+		{
+			const RGB *p0 = &rgb[2*r][2*c];
+			const RGB *p1 = &rgb[2*r+1][2*c];
+			pixel.Red = (p0[0].Red+p0[1].Red+p1[0].Red+p1[1].Red+2)/4;
+			pixel.Green = (p0[0].Green+p0[1].Green+p1[0].Green+p1[1].Green+2)/4;
+			pixel.Blue = (p0[0].Blue+p0[1].Blue+p1[0].Blue+p1[1].Blue+2)/4;
+			cb[r][c] = (int16_t)RGB2Cb( pixel.Red, pixel.Green, pixel.Blue )-128;
+			cr[r][c] = (int16_t)RGB2Cr( pixel.Red, pixel.Green, pixel.Blue )-128;
+		}
+}
 
-#ifdef ENABLE_RGB
-// encode RGB 24 line [size: img_width * 3 * 8  bytes]
-void encode_line_rgb24(uint8_t *    _line_buffer,
-		unsigned int _line_number)
+// convert 16x8 (4:2:2) or 16x16 (4:2:0) RGB pixels to level shifted YCbCr
+// blocks: Y left/right, then bottom left/right for 4:2:0, subsampled Cb, Cr
+void rgb_ycbcr(RGB rgb[16][16], bool s420, int16_t y[4][8][8], int16_t cb[8][8], int16_t cr[8][8])
 {
-	// number of blocks in row: 40 = 640 pixels / 16 pixels per block
-	unsigned int num_blocks = img_width / 16;
+	const unsigned int num_y = s420 ? 4 : 2;
 
 	unsigned int b;
 	unsigned int r;
 	unsigned int c;
-	for (b=0; b<num_blocks; b++) {
-		// get 8x16 pixel RGB block
-		for (r=0; r<8; r++)
-			for (c=0; c<16; c++)
-			{
-				// get pixel index and extract RGB values
-				unsigned int n = 3*(img_width*r + 16*b + c);
-				RGB8x16[r][c].Red   = _line_buffer[n+0];
-				RGB8x16[r][c].Green = _line_buffer[n+1];
-				RGB8x16[r][c].Blue  = _line_buffer[n+2];
-			}
 
-		// convert to YCbCr
-		color R, G, B;
+	// convert to YCbCr
+	for (b=0; b<num_y; b++)
 		for (r=0; r<8; r++)
 			for (c=0; c<8; c++)
 			{
-				R = RGB8x16[r][c].Red;
-				G = RGB8x16[r][c].Green;
-				B = RGB8x16[r][c].Blue;
-				Y8x8[0][r][c] = RGB2Y(R,G,B)-128;
-
-				R = RGB8x16[r][c+8].Red;
-				G = RGB8x16[r][c+8].Green;
-				B = RGB8x16[r][c+8].Blue;
-				Y8x8[1][r][c] = RGB2Y(R,G,B)-128;
+				const RGB *pixel = &rgb[8*(b >> 1) + r][8*(b & 1) + c];
+				y[b][r][c] = RGB2Y(pixel->Red, pixel->Green, pixel->Blue)-128;
 			}
 
-		// subsample
-		subsample(RGB8x16, Cb8x8, Cr8x8);
-
-		// 1 Y-compression
-		dct(Y8x8[0], Y8x8[0]);
-		huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[0]);
+	// subsample
+	if (s420)
+		subsample420(rgb, cb, cr);
+	else
+		subsample(rgb, cb, cr);
+}
 
-		// 2 Y-compression
-		dct(Y8x8[1], Y8x8[1]);
-		huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[1]);
+// encode the YCbCr blocks of an RGB MCU
+static void encode_mcu_ycbcr(jpeg_enc_t *enc)
+{
+	const unsigned int num_y = JPEG_MCU_HEIGHT(enc) / 4;
+	unsigned int y;
 
-		// 1 Cb-compression
-		dct(Cb8x8, Cb8x8);
-		huffman_encode(HUFFMAN_CTX_Cb, (int16_t*)Cb8x8);
+	// Y-compression
+	for (y=0; y<num_y; y++)
+		encode_block(enc, HUFFMAN_CTX_Y(enc), enc->Y8x8[y]);
 
-		// 1 Cr-compression
-		dct(Cr8x8, Cr8x8);
-		huffman_encode(HUFFMAN_CTX_Cr, (int16_t*)Cr8x8);
-	}
+	// 1 Cb-compression
+	encode_block(enc, HUFFMAN_CTX_Cb(enc), enc->Cb8x8);
 
-	// write restart interval termination character
-	write_RSI(_line_number % 8);
+	// 1 Cr-compression
+	encode_block(enc, HUFFMAN_CTX_Cr(enc), enc->Cr8x8);
 }
-#endif // ENABLE_RGB
 
-#ifdef ENABLE_RGB
-// encode RGB 16 line [size: img_width * 2 * 8 bytes]
-void encode_line_rgb16(uint8_t *    _line_buffer,
-		unsigned int _line_number)
+// encode RGB 24 line [size: stride * JPEG_MCU_HEIGHT bytes]
+void encode_line_rgb24(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
 {
+	RGB (*const RGB16x16)[16] = enc->RGB16x16;
+
 	// number of blocks in row: 40 = 640 pixels / 16 pixels per block
-	unsigned int num_blocks = img_width / 16;
+	unsigned int num_blocks = enc->img_width / 16;
+	unsigned int num_rows = JPEG_MCU_HEIGHT(enc);
+	unsigned int stride = line_stride(enc, 3);
 
 	unsigned int b;
 	unsigned int r;
 	unsigned int c;
 	for (b=0; b<num_blocks; b++) {
-		// get 8x16 pixel RGB block
-		for (r=0; r<8; r++)
+#if JPEG_SIMD
+		// converted straight from the line
+		if (jpeg_simd.rgb24_ycbcr != NULL) {
+			jpeg_simd.rgb24_ycbcr(&_line_buffer[48*b], stride, enc->subsampling == JPEG_SUBSAMPLING_420,
+			                 enc->Y8x8, enc->Cb8x8, enc->Cr8x8);
+			encode_mcu_ycbcr(enc);
+			continue;
+		}
+#endif
+		// get 16x8 or 16x16 pixel RGB block
+		for (r=0; r<num_rows; r++)
 			for (c=0; c<16; c++)
 			{
 				// get pixel index and extract RGB values
-				unsigned int n = 2*(img_width*r + 16*b + c);
-
-				// read in two bytes from buffer
-				uint8_t v0 = _line_buffer[n+0];
-				uint8_t v1 = _line_buffer[n+1];
-
-				// de-compress RGB values from compact two-byte
-				// to three-byte representation
-				// [v0 v0 v0 v0 v0 v0 v0 v0|v1 v1 v1 v1 v1 v1 v1 v1]
-				// [r7 r6 r5 r4 r3 g7 g6 g5|g4 g3 g2 b7 b6 b5 b4 b3]
-				RGB8x16[r][c].Red   = v0 & 0xf8;
-				RGB8x16[r][c].Green = ((v0 << 5) & 0xe0) | ((v1 >> 2) & 0x1c);
-				RGB8x16[r][c].Blue  = (v1 << 3) & 0xf8;
+				unsigned int n = stride*r + 3*(16*b + c);
+				RGB16x16[r][c].Red   = _line_buffer[n+0];
+				RGB16x16[r][c].Green = _line_buffer[n+1];
+				RGB16x16[r][c].Blue  = _line_buffer[n+2];
 			}
 
-		// convert to YCbCr
-		color R, G, B;
-		for (r=0; r<8; r++)
-			for (c=0; c<8; c++)
-			{
-				R = RGB8x16[r][c].Red;
-				G = RGB8x16[r][c].Green;
-				B = RGB8x16[r][c].Blue;
-				Y8x8[0][r][c] = RGB2Y(R,G,B)-128;
-
-				R = RGB8x16[r][c+8].Red;
-				G = RGB8x16[r][c+8].Green;
-				B = RGB8x16[r][c+8].Blue;
-				Y8x8[1][r][c] = RGB2Y(R,G,B)-128;
-			}
+		rgb_ycbcr(RGB16x16, enc->subsampling == JPEG_SUBSAMPLING_420, enc->Y8x8, enc->Cb8x8, enc->Cr8x8);
+		encode_mcu_ycbcr(enc);
+	}
 
-		// subsample
-		subsample(RGB8x16, Cb8x8, Cr8x8);
+	// write restart interval termination character
+	write_RSI(enc, _line_number % 8);
+}
 
-		// 1 Y-compression
-		dct(Y8x8[0], Y8x8[0]);
-		huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[0]);
+// RGB565 conversion tables: the RGB2Y/Cb/Cr() products of each 5/6-bit field.
+// Chrominance goes by the sum of a field over the 2 (4:2:2, index doubled)
+// or 4 (4:2:0) pixels that subsample() / subsample420() average: their
+// 8-bit averages are exactly 2 * sum (red, blue) and sum (green), so the
+// tables give the same result. The rounding constants are in the red tables.
+#define LUT4(f, i)   f(i), f((i) + 1), f((i) + 2), f((i) + 3)
+#define LUT16(f, i)  LUT4(f, i), LUT4(f, (i) + 4), LUT4(f, (i) + 8), LUT4(f, (i) + 12)
+#define LUT64(f, i)  LUT16(f, i), LUT16(f, (i) + 16), LUT16(f, (i) + 32), LUT16(f, (i) + 48)
+#define LUT128(f)    LUT64(f, 0), LUT64(f, 64)
+#define LUT256(f)    LUT128(f), LUT64(f, 128), LUT64(f, 192)
+
+#define Y_R(i)   (32768 + 19595 * ((i) << 3))
+#define Y_G(i)   (38470 * ((i) << 2))
+#define Y_B(i)   (7471 * ((i) << 3))
+#define CB_R(i)  (8421376 - 11058 * 2 * (i))
+#define CB_G(i)  (-21709 * (i))
+#define CR_R(i)  (8421376 + 32767 * 2 * (i))
+#define CR_G(i)  (-27438 * (i))
+#define CR_B(i)  (-5329 * 2 * (i))
+#define CB_B(i)  (32767 * 2 * (i))
+
+static const int32_t rgb565_y_r[32]   = { LUT16(Y_R, 0), LUT16(Y_R, 16) };
+static const int32_t rgb565_y_g[64]   = { LUT64(Y_G, 0) };
+static const int32_t rgb565_y_b[32]   = { LUT16(Y_B, 0), LUT16(Y_B, 16) };
+static const int32_t rgb565_cb_r[128] = { LUT128(CB_R) };
+static const int32_t rgb565_cb_g[256] = { LUT256(CB_G) };
+static const int32_t rgb565_cb_b[128] = { LUT128(CB_B) };
+static const int32_t rgb565_cr_r[128] = { LUT128(CR_R) };
+static const int32_t rgb565_cr_g[256] = { LUT256(CR_G) };
+static const int32_t rgb565_cr_b[128] = { LUT128(CR_B) };
+
+// Y of one RGB565 pixel, level shifted
+static inline int16_t rgb565_y(uint32_t px)
+{
+	return ((rgb565_y_r[px >> 11] + rgb565_y_g[(px >> 5) & 0x3f] + rgb565_y_b[px & 0x1f]) >> 16) - 128;
+}
+
+// encode RGB 16 line [size: stride * JPEG_MCU_HEIGHT bytes]
+// without staging the pixels as RGB: two big-endian pixels are read as one
+// 32-bit word, go through the tables into the Y blocks, and the field sums
+// of the pair (added in the word) into Cb/Cr
+void encode_line_rgb16(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	int16_t (*const Y8x8)[8][8] = enc->Y8x8;
+	int16_t (*const Cb8x8)[8] = enc->Cb8x8;
+	int16_t (*const Cr8x8)[8] = enc->Cr8x8;
+
+	// number of blocks in row: 40 = 640 pixels / 16 pixels per block
+	unsigned int num_blocks = enc->img_width / 16;
+	unsigned int num_rows = JPEG_MCU_HEIGHT(enc);
+	unsigned int num_y = num_rows / 4;
+	unsigned int stride = line_stride(enc, 2);
+	// 4:2:2 has no second row to add, its sums count double
+	unsigned int scale = num_rows == 16 ? 1 : 2;
+
+	// field sums of the pixel pairs of the row above (4:2:0)
+	unsigned int rb_above[8];
+	unsigned int g_above[8];
+
+	unsigned int b;
+	unsigned int r;
+	unsigned int c;
+	unsigned int y;
+	for (b=0; b<num_blocks; b++) {
+		for (r=0; r<num_rows; r++) {
+			const uint8_t *p = _line_buffer + stride*r + 32*b;
+			// left four pairs go into the left Y block, right four into the
+			// right one (Y8x8[2] and Y8x8[3] for the bottom half of 4:2:0)
+			int16_t *yrow[2] = { Y8x8[(r >> 3)*2][r%8], Y8x8[(r >> 3)*2 + 1][r%8] };
+			// 4:2:0 takes the chrominance of two rows, at the second one
+			const bool top = scale == 1 && !(r & 1);
+			int16_t *cbrow = Cb8x8[scale == 1 ? r/2 : r];
+			int16_t *crrow = Cr8x8[scale == 1 ? r/2 : r];
+
+			for (c=0; c<8; c++, p += 4)
+			{
+				// [r g b of pixel 2c | r g b of pixel 2c+1], 5:6:5 bits each
+				const uint32_t w = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+				// red and blue, and green, of both pixels added in one go:
+				// red sum at bits 11..16, blue sum at 0..5, green sum at 5..11
+				unsigned int rb = ((w >> 16) & 0xf81f) + (w & 0xf81f);
+				unsigned int g = ((w >> 16) & 0x07e0) + (w & 0x07e0);
+
+				yrow[c >> 2][(2*c)%8 + 0] = rgb565_y(w >> 16);
+				yrow[c >> 2][(2*c)%8 + 1] = rgb565_y(w & 0xffff);
+
+				if (top) {
+					rb_above[c] = rb;
+					g_above[c] = g;
+					continue;
+				}
+				if (scale == 1) {
+					rb += rb_above[c];
+					g += g_above[c];
+				}
+				const unsigned int sr = (rb >> 11) * scale;
+				const unsigned int sg = (g >> 5) * scale;
+				const unsigned int sb = (rb & 0x7f) * scale;
+				cbrow[c] = ((rgb565_cb_r[sr] + rgb565_cb_g[sg] + rgb565_cb_b[sb]) >> 16) - 128;
+				crrow[c] = ((rgb565_cr_r[sr] + rgb565_cr_g[sg] + rgb565_cr_b[sb]) >> 16) - 128;
+			}
+		}
 
-		// 2 Y-compression
-		dct(Y8x8[1], Y8x8[1]);
-		huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[1]);
+		// Y-compression
+		for (y=0; y<num_y; y++)
+			encode_block(enc, HUFFMAN_CTX_Y(enc), Y8x8[y]);
 
 		// 1 Cb-compression
-		dct(Cb8x8, Cb8x8);
-		huffman_encode(HUFFMAN_CTX_Cb, (int16_t*)Cb8x8);
+		encode_block(enc, HUFFMAN_CTX_Cb(enc), Cb8x8);
 
 		// 1 Cr-compression
-		dct(Cr8x8, Cr8x8);
-		huffman_encode(HUFFMAN_CTX_Cr, (int16_t*)Cr8x8);
+		encode_block(enc, HUFFMAN_CTX_Cr(enc), Cr8x8);
 	}
 
 	// write restart interval termination character
-	write_RSI(_line_number % 8);
+	write_RSI(enc, _line_number % 8);
 }
 #endif // ENABLE_RGB
 
-// encode YUV line [size: img_width * 2 * 8 bytes]
-void encode_line_yuv(uint8_t *    _line_buffer,
-		unsigned int _line_number)
+// encode packed 4:2:2 YUV line [size: stride * JPEG_MCU_HEIGHT bytes],
+// every 4 bytes hold two pixels: _y is the offset of the first Y (the
+// second one follows 2 bytes later), _cb and _cr those of Cb and Cr
+static void encode_line_packed(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number,
+		unsigned int  _y,
+		unsigned int  _cb,
+		unsigned int  _cr)
 {
+	int16_t (*const Y8x8)[8][8] = enc->Y8x8;
+	int16_t (*const Cb8x8)[8] = enc->Cb8x8;
+	int16_t (*const Cr8x8)[8] = enc->Cr8x8;
+
 	// number of blocks in row: 40 = 640 pixels / 16 pixels per block
-	unsigned int num_blocks = img_width / 16;
+	unsigned int num_blocks = enc->img_width / 16;
+	unsigned int num_rows = JPEG_MCU_HEIGHT(enc);
+	unsigned int num_y = num_rows / 4;
+	unsigned int stride = line_stride(enc, 2);
 
 	unsigned int b;
 	unsigned int r;
 	unsigned int c;
+	unsigned int y;
 	for (b=0; b<num_blocks; b++) {
-		// get 8x16 pixel YUV block
-		for (r=0; r<8; r++)
+		// get 16x8 or 16x16 pixel YUV block
+		for (r=0; r<num_rows; r++)
 			for (c=0; c<8; c++)
 			{
 				// get pixel index and extract YUV values
-				unsigned int n = 2*(img_width*r + 16*b + 2*c);
+				unsigned int n = stride*r + 2*(16*b + 2*c);
 
 				// first four pairs of pixels get put into Y8x8[0],
 				// and last four pairs get pu into Y8x8[1]
-				unsigned int yindex = c < 4 ? 0 : 1;
-
-				Y8x8[yindex][r][(2*c)%8+0] = _line_buffer[n+0] - 128;
-				Cb8x8[r][c]                = _line_buffer[n+1] - 128;
-				Y8x8[yindex][r][(2*c)%8+1] = _line_buffer[n+2] - 128;
-				Cr8x8[r][c]                = _line_buffer[n+3] - 128;
+				// (Y8x8[2] and Y8x8[3] for the bottom half of 4:2:0)
+				unsigned int yindex = (r >> 3)*2 + (c < 4 ? 0 : 1);
+
+				Y8x8[yindex][r%8][(2*c)%8+0] = _line_buffer[n+_y] - 128;
+				Y8x8[yindex][r%8][(2*c)%8+1] = _line_buffer[n+_y+2] - 128;
+
+				if (enc->subsampling != JPEG_SUBSAMPLING_420) {
+					Cb8x8[r][c]          = _line_buffer[n+_cb] - 128;
+					Cr8x8[r][c]          = _line_buffer[n+_cr] - 128;
+				} else if (r & 1) {
+					// average with the chroma of the row above
+					unsigned int m = n - stride;
+					Cb8x8[r/2][c]        = ((_line_buffer[n+_cb] + _line_buffer[m+_cb] + 1) >> 1) - 128;
+					Cr8x8[r/2][c]        = ((_line_buffer[n+_cr] + _line_buffer[m+_cr] + 1) >> 1) - 128;
+				}
 			}
 
-        // 1 Y-compression
-        dct(Y8x8[0], Y8x8[0]);
-        huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[0]);
-
-        // 2 Y-compression
-        dct(Y8x8[1], Y8x8[1]);
-        huffman_encode(HUFFMAN_CTX_Y, (int16_t*)Y8x8[1]);
+        // Y-compression
+        for (y=0; y<num_y; y++)
+            encode_block(enc, HUFFMAN_CTX_Y(enc), Y8x8[y]);
 
         // 1 Cb-compression
-        dct(Cb8x8, Cb8x8);
-        huffman_encode(HUFFMAN_CTX_Cb, (int16_t*)Cb8x8);
+        encode_block(enc, HUFFMAN_CTX_Cb(enc), Cb8x8);
 
         // 1 Cr-compression
-        dct(Cr8x8, Cr8x8);
-        huffman_encode(HUFFMAN_CTX_Cr, (int16_t*)Cr8x8);
+        encode_block(enc, HUFFMAN_CTX_Cr(enc), Cr8x8);
     }
 
     // write restart interval termination character
-    write_RSI(_line_number % 8);
-}
\ No newline at end of file
+    write_RSI(enc, _line_number % 8);
+}
+
+// encode YUV line (Y0 Cb Y1 Cr) [size: stride * JPEG_MCU_HEIGHT bytes]
+void encode_line_yuv(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	encode_line_packed(enc, _line_buffer, _line_number, 0, 1, 3);
+}
+
+// encode UYVY line (Cb Y0 Cr Y1) [size: stride * JPEG_MCU_HEIGHT bytes]
+void encode_line_uyvy(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	encode_line_packed(enc, _line_buffer, _line_number, 1, 0, 2);
+}
+
+// encode YVYU line (Y0 Cr Y1 Cb) [size: stride * JPEG_MCU_HEIGHT bytes]
+void encode_line_yvyu(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	encode_line_packed(enc, _line_buffer, _line_number, 0, 3, 1);
+}
+
+// encode planar or semi-planar line: Y rows from _line_buffer [size:
+// stride * JPEG_MCU_HEIGHT bytes], Cb and Cr from enc->planes. Source and
+// output subsampling may differ: 4:2:0 chroma rows are repeated for 4:2:2
+// output, two 4:2:2 chroma rows averaged for 4:2:0 output
+void encode_line_planar(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	const jpeg_planes_t *const planes = &enc->planes;
+	int16_t (*const Y8x8)[8][8] = enc->Y8x8;
+	int16_t (*const Cb8x8)[8] = enc->Cb8x8;
+	int16_t (*const Cr8x8)[8] = enc->Cr8x8;
+
+	// number of blocks in row: 40 = 640 pixels / 16 pixels per block
+	unsigned int num_blocks = enc->img_width / 16;
+	unsigned int num_rows = JPEG_MCU_HEIGHT(enc);
+	unsigned int num_y = num_rows / 4;
+	unsigned int stride = line_stride(enc, 1);
+	// output rows per chroma block row, 1 (4:2:2) or 2 (4:2:0)
+	unsigned int rows_per_c = num_rows / 8;
+
+	unsigned int b;
+	unsigned int r;
+	unsigned int c;
+	unsigned int y;
+	for (b=0; b<num_blocks; b++) {
+		// get 16x8 or 16x16 pixel Y block
+		for (r=0; r<num_rows; r++) {
+			const uint8_t *p = _line_buffer + stride*r + 16*b;
+
+			for (c=0; c<16; c++)
+				Y8x8[(r >> 3)*2 + (c >> 3)][r%8][c%8] = p[c] - 128;
+		}
+
+		// 8x8 chroma from the source rows of the first and the last
+		// image row it covers (the same one unless averaged)
+		for (r=0; r<8; r++) {
+			unsigned int row = _line_number * num_rows + r * rows_per_c;
+			unsigned int s0 = planes->half ? row / 2 : row;
+			unsigned int s1 = planes->half ? (row + rows_per_c - 1) / 2 : row + rows_per_c - 1;
+			const uint8_t *cb0 = planes->cb + planes->cb_stride*s0 + planes->step*8*b;
+			const uint8_t *cb1 = planes->cb + planes->cb_stride*s1 + planes->step*8*b;
+			const uint8_t *cr0 = planes->cr + planes->cr_stride*s0 + planes->step*8*b;
+			const uint8_t *cr1 = planes->cr + planes->cr_stride*s1 + planes->step*8*b;
+
+			for (c=0; c<8; c++) {
+				unsigned int n = planes->step*c;
+
+				Cb8x8[r][c] = ((cb0[n] + cb1[n] + 1) >> 1) - 128;
+				Cr8x8[r][c] = ((cr0[n] + cr1[n] + 1) >> 1) - 128;
+			}
+		}
+
+		// Y-compression
+		for (y=0; y<num_y; y++)
+			encode_block(enc, HUFFMAN_CTX_Y(enc), Y8x8[y]);
+
+		// 1 Cb-compression
+		encode_block(enc, HUFFMAN_CTX_Cb(enc), Cb8x8);
+
+		// 1 Cr-compression
+		encode_block(enc, HUFFMAN_CTX_Cr(enc), Cr8x8);
+	}
+
+	// write restart interval termination character
+	write_RSI(enc, _line_number % 8);
+}
+
+// encode luma-only line, one 8x8 block per MCU
+//  _step   :   distance between two Y bytes (1 for grayscale, 2 for YUYV)
+static void encode_line_luma(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number,
+		unsigned int  _step)
+{
+	int16_t (*const Y8x8)[8][8] = enc->Y8x8;
+
+	// number of blocks in row: 80 = 640 pixels / 8 pixels per block
+	unsigned int num_blocks = enc->img_width / 8;
+	unsigned int stride = line_stride(enc, _step);
+
+	unsigned int b;
+	unsigned int r;
+	unsigned int c;
+	for (b=0; b<num_blocks; b++) {
+		// get 8x8 pixel Y block
+		for (r=0; r<8; r++)
+			for (c=0; c<8; c++)
+				Y8x8[0][r][c] = _line_buffer[stride*r + _step*(8*b + c)] - 128;
+
+		// Y-compression
+		encode_block(enc, HUFFMAN_CTX_Y(enc), Y8x8[0]);
+	}
+
+	// write restart interval termination character
+	write_RSI(enc, _line_number % 8);
+}
+
+// encode grayscale line [size: stride * 8 bytes]
+void encode_line_gray(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	encode_line_luma(enc, _line_buffer, _line_number, 1);
+}
+
+// encode Y of a YUV line as grayscale [size: stride * 8 bytes]
+void encode_line_yuv_gray(jpeg_enc_t *  enc,
+		uint8_t *     _line_buffer,
+		unsigned int  _line_number)
+{
+	encode_line_luma(enc, _line_buffer, _line_number, 2);
+}
@@ -0,0 +1,386 @@
+#include <stdlib.h>
+#include <string.h>
+#include "dct.h"
+#include "jpegenc.h"
+#include "simd.h"
+
+#if JPEG_SIMD
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#else
+#include <arm_neon.h>
+#endif
+
+jpeg_simd_kernels_t jpeg_simd = { .name = "scalar" };
+
+typedef int32_t  v8si __attribute__((vector_size(32)));
+typedef int16_t  v8hi __attribute__((vector_size(16)));
+typedef uint8_t  v16qu __attribute__((vector_size(16)));
+
+// the kernels are written once and compiled for each instruction set by
+// the SIMD_VARIANT() wrappers at the end of the file
+#define SIMD_INLINE static inline __attribute__((always_inline))
+
+// the dct.c constants, C1_306562965 as 1 + C0_306562965 to keep c * 8 in 16 bits
+#define C0_306562965 1256
+#define C0_382683433 1567
+#define C0_541196100 2217
+#define C0_707106781 2896
+
+// AAN_MUL() of dct.c on 16-bit lanes: (v * c + 2048) >> 12 for |v| < 16384
+// and c < 4096, the one step the vector extensions do not map to a single
+// instruction; one for each instruction set
+typedef v8hi (*simd_mulr_t)(v8hi v, int16_t c);
+
+#if defined(__x86_64__) || defined(__i386__)
+// high and low halves of 2v * 8c, the high one rounded by bit 15 of the low
+__attribute__((target("sse2"))) SIMD_INLINE v8hi simd_mulr_sse2(v8hi v, int16_t c)
+{
+	const __m128i v2 = (__m128i)(v + v), k = _mm_set1_epi16(c * 8);
+
+	return (v8hi)_mm_sub_epi16(_mm_mulhi_epi16(v2, k), _mm_srai_epi16(_mm_mullo_epi16(v2, k), 15));
+}
+
+// (v * 8c + (1 << 14)) >> 15
+__attribute__((target("avx2"))) SIMD_INLINE v8hi simd_mulr_avx2(v8hi v, int16_t c)
+{
+	return (v8hi)_mm_mulhrs_epi16((__m128i)v, _mm_set1_epi16(c * 8));
+}
+#else
+// (2 * v * 8c + (1 << 15)) >> 16
+SIMD_INLINE v8hi simd_mulr_neon(v8hi v, int16_t c)
+{
+	return (v8hi)vqrdmulhq_n_s16((int16x8_t)v, c * 8);
+}
+#endif
+
+// AAN 1-D pass of dct_aan_rows() / dct_aan_column(), on 8 of them at once:
+// lane j of x[n] is element n of transform j. The values of both passes
+// over -128..127 pixels stay below 13000, so 16-bit lanes give the exact
+// 32-bit results of dct.c.
+SIMD_INLINE void simd_aan(const v8hi x[8], v8hi out[8], simd_mulr_t mulr)
+{
+	v8hi tmp0, tmp1, tmp2, tmp3, tmp4, tmp5, tmp6, tmp7;
+	v8hi tmp10, tmp11, tmp12, tmp13;
+	v8hi z1, z2, z3, z4, z5, z11, z13;
+
+	tmp0 = x[0] + x[7];
+	tmp7 = x[0] - x[7];
+	tmp1 = x[1] + x[6];
+	tmp6 = x[1] - x[6];
+	tmp2 = x[2] + x[5];
+	tmp5 = x[2] - x[5];
+	tmp3 = x[3] + x[4];
+	tmp4 = x[3] - x[4];
+
+	// even part
+	tmp10 = tmp0 + tmp3;
+	tmp13 = tmp0 - tmp3;
+	tmp11 = tmp1 + tmp2;
+	tmp12 = tmp1 - tmp2;
+
+	out[0] = tmp10 + tmp11;
+	out[4] = tmp10 - tmp11;
+
+	z1 = mulr(tmp12 + tmp13, C0_707106781);
+	out[2] = tmp13 + z1;
+	out[6] = tmp13 - z1;
+
+	// odd part
+	tmp10 = tmp4 + tmp5;
+	tmp11 = tmp5 + tmp6;
+	tmp12 = tmp6 + tmp7;
+
+	z5 = mulr(tmp10 - tmp12, C0_382683433);
+	z2 = mulr(tmp10, C0_541196100) + z5;
+	z4 = tmp12 + mulr(tmp12, C0_306562965) + z5;
+	z3 = mulr(tmp11, C0_707106781);
+
+	z11 = tmp7 + z3;
+	z13 = tmp7 - z3;
+
+	out[5] = z13 + z2;
+	out[3] = z13 - z2;
+	out[1] = z11 + z4;
+	out[7] = z11 - z4;
+}
+
+// 8x8 transpose of 8-lane vectors by interleaving pieces of 1, then 2, then
+// 4 elements (unpack instructions on x86, zip on NEON)
+#define LO1(a, b) __builtin_shufflevector(a, b, 0, 8, 1, 9, 2, 10, 3, 11)
+#define HI1(a, b) __builtin_shufflevector(a, b, 4, 12, 5, 13, 6, 14, 7, 15)
+#define LO2(a, b) __builtin_shufflevector(a, b, 0, 1, 8, 9, 2, 3, 10, 11)
+#define HI2(a, b) __builtin_shufflevector(a, b, 4, 5, 12, 13, 6, 7, 14, 15)
+#define LO4(a, b) __builtin_shufflevector(a, b, 0, 1, 2, 3, 8, 9, 10, 11)
+#define HI4(a, b) __builtin_shufflevector(a, b, 4, 5, 6, 7, 12, 13, 14, 15)
+SIMD_INLINE void simd_transpose(const v8hi in[8], v8hi out[8])
+{
+	const v8hi s0 = LO1(in[0], in[1]), s1 = HI1(in[0], in[1]);
+	const v8hi s2 = LO1(in[2], in[3]), s3 = HI1(in[2], in[3]);
+	const v8hi s4 = LO1(in[4], in[5]), s5 = HI1(in[4], in[5]);
+	const v8hi s6 = LO1(in[6], in[7]), s7 = HI1(in[6], in[7]);
+	const v8hi t0 = LO2(s0, s2), t1 = HI2(s0, s2);
+	const v8hi t2 = LO2(s1, s3), t3 = HI2(s1, s3);
+	const v8hi t4 = LO2(s4, s6), t5 = HI2(s4, s6);
+	const v8hi t6 = LO2(s5, s7), t7 = HI2(s5, s7);
+
+	out[0] = LO4(t0, t4); out[1] = HI4(t0, t4);
+	out[2] = LO4(t1, t5); out[3] = HI4(t1, t5);
+	out[4] = LO4(t2, t6); out[5] = HI4(t2, t6);
+	out[6] = LO4(t3, t7); out[7] = HI4(t3, t7);
+}
+
+// both passes of the AAN DCT, out[k] lane i is coefficient (k, i)
+SIMD_INLINE void simd_aan2(int16_t pixels[8][8], v8hi out[8], simd_mulr_t mulr)
+{
+	v8hi x[8], y[8];
+
+	memcpy(y, pixels, sizeof(y));
+	// rows: y[k] lane i is element k of row i, back to rows for the columns
+	simd_transpose(y, x);
+	simd_aan(x, y, mulr);
+	simd_transpose(y, x);
+	simd_aan(x, out, mulr);
+}
+
+SIMD_INLINE void simd_dct_quantize_body(int16_t pixels[8][8], const int32_t fdtbl[64], int16_t data[64],
+                                        simd_mulr_t mulr)
+{
+	v8hi coef[8];
+	unsigned k;
+
+	simd_aan2(pixels, coef, mulr);
+	for (k = 0; k < 8; k++) {
+		v8si q;
+
+		// dct_quant()
+		memcpy(&q, &fdtbl[k*8], sizeof(q));
+		q = (__builtin_convertvector(coef[k], v8si) * q + (1 << (DCT_FDTBL_SCALE-1))) >> DCT_FDTBL_SCALE;
+		coef[k] = __builtin_convertvector(q, v8hi);
+	}
+	memcpy(data, coef, sizeof(coef));
+}
+
+SIMD_INLINE void simd_quantize_body(const int32_t coef[64], const int32_t fdtbl[64], int16_t data[64])
+{
+	unsigned k;
+
+	for (k = 0; k < 8; k++) {
+		v8si c, q;
+		v8hi v;
+
+		memcpy(&c, &coef[k*8], sizeof(c));
+		memcpy(&q, &fdtbl[k*8], sizeof(q));
+		v = __builtin_convertvector((c * q + (1 << (DCT_FDTBL_SCALE-1))) >> DCT_FDTBL_SCALE, v8hi);
+		memcpy(&data[k*8], &v, sizeof(v));
+	}
+}
+
+SIMD_INLINE void simd_dct_aan_body(int16_t pixels[8][8], int32_t coef[64], simd_mulr_t mulr)
+{
+	v8hi out[8];
+	unsigned k;
+
+	simd_aan2(pixels, out, mulr);
+	for (k = 0; k < 8; k++) {
+		const v8si c = __builtin_convertvector(out[k], v8si);
+
+		memcpy(&coef[k*8], &c, sizeof(c));
+	}
+}
+
+#ifdef ENABLE_RGB
+// the RGB2Y/Cb/Cr() of jpegenc.c, level shifted
+#define SIMD_Y(r, g, b)  (((32768 + 19595*(r) + 38470*(g) + 7471*(b)) >> 16) - 128)
+#define SIMD_CB(r, g, b) (((8421376 - 11058*(r) - 21709*(g) + 32767*(b)) >> 16) - 128)
+#define SIMD_CR(r, g, b) (((8421376 + 32767*(r) - 27438*(g) - 5329*(b)) >> 16) - 128)
+
+// store 8 values as int16_t (a macro: 32-byte vector arguments need AVX in
+// the x86 ABI)
+#define SIMD_STORE(dst, v) do { \
+	const v8hi h_ = __builtin_convertvector(v, v8hi); \
+	memcpy(dst, &h_, sizeof(h_)); \
+} while (0)
+
+// interleaved bytes of the low halves of a and b (punpcklbw, zip1), and
+// the high half of a vector in the low one
+#define ZIPLO(a, b) __builtin_shufflevector(a, b, 0, 16, 1, 17, 2, 18, 3, 19, 4, 20, 5, 21, 6, 22, 7, 23)
+#define HIGH(a) __builtin_shufflevector(a, a, 8, 9, 10, 11, 12, 13, 14, 15, 8, 9, 10, 11, 12, 13, 14, 15)
+// low 8 bytes of a as int32_t, through 16 bits (unpack with 0, then to 32)
+#define WIDEN(a) __builtin_convertvector((v8hi)ZIPLO(a, (v16qu){0}), v8si)
+
+// rgb_ycbcr() of 16 pixel wide rows read straight from an RGB24 line
+SIMD_INLINE void simd_rgb24_ycbcr_body(const uint8_t *px, unsigned stride, bool s420,
+                                       int16_t y[4][8][8], int16_t cb[8][8], int16_t cr[8][8])
+{
+	const unsigned rows = s420 ? 16 : 8;
+	v8si sr = {0}, sg = {0}, sb = {0};  // chroma pixel sums
+	unsigned r, n;
+
+	for (r = 0; r < rows; r++, px += stride) {
+		int16_t (*const yb)[8][8] = &y[r & 8 ? 2 : 0];
+		v16qu a, b, c;
+		v8si re, ge, be, ro, go, bo, ye, yo;
+
+		// 16 pixels; three rounds of interleaving leave the red, green and
+		// blue of the even pixels in a, b.lo, and of the odd ones in b.hi, c
+		memcpy(&a, px, 16);
+		memcpy(&b, px + 16, 16);
+		memcpy(&c, px + 32, 16);
+		for (n = 0; n < 3; n++) {
+			const v16qu t0 = ZIPLO(a, HIGH(b)), t1 = ZIPLO(HIGH(a), c);
+
+			c = ZIPLO(b, HIGH(c));
+			a = t0;
+			b = t1;
+		}
+		re = WIDEN(a);
+		ge = WIDEN(HIGH(a));
+		be = WIDEN(b);
+		ro = WIDEN(HIGH(b));
+		go = WIDEN(c);
+		bo = WIDEN(HIGH(c));
+
+		ye = SIMD_Y(re, ge, be);
+		yo = SIMD_Y(ro, go, bo);
+		SIMD_STORE(yb[0][r & 7], __builtin_shufflevector(ye, yo, 0, 8, 1, 9, 2, 10, 3, 11));
+		SIMD_STORE(yb[1][r & 7], __builtin_shufflevector(ye, yo, 4, 12, 5, 13, 6, 14, 7, 15));
+
+		// subsample() / subsample420() of the pixel pairs
+		if (!s420) {
+			sr = (re + ro) >> 1;
+			sg = (ge + go) >> 1;
+			sb = (be + bo) >> 1;
+			SIMD_STORE(cb[r], SIMD_CB(sr, sg, sb));
+			SIMD_STORE(cr[r], SIMD_CR(sr, sg, sb));
+		} else if (!(r & 1)) {
+			sr = re + ro;
+			sg = ge + go;
+			sb = be + bo;
+		} else {
+			sr = (sr + re + ro + 2) >> 2;
+			sg = (sg + ge + go + 2) >> 2;
+			sb = (sb + be + bo + 2) >> 2;
+			SIMD_STORE(cb[r >> 1], SIMD_CB(sr, sg, sb));
+			SIMD_STORE(cr[r >> 1], SIMD_CR(sr, sg, sb));
+		}
+	}
+}
+#endif // ENABLE_RGB
+
+// the kernels compiled for one instruction set
+#define SIMD_VARIANT(isa, attr) \
+	attr static void dct_quantize_##isa(int16_t pixels[8][8], const int32_t fdtbl[64], int16_t data[64]) \
+	{ simd_dct_quantize_body(pixels, fdtbl, data, simd_mulr_##isa); } \
+	attr static void dct_aan_##isa(int16_t pixels[8][8], int32_t coef[64]) \
+	{ simd_dct_aan_body(pixels, coef, simd_mulr_##isa); } \
+	attr static void quantize_##isa(const int32_t coef[64], const int32_t fdtbl[64], int16_t data[64]) \
+	{ simd_quantize_body(coef, fdtbl, data); } \
+	SIMD_VARIANT_RGB(isa, attr) \
+	static const jpeg_simd_kernels_t simd_##isa = { #isa, dct_quantize_##isa, dct_aan_##isa, quantize_##isa, SIMD_RGB(isa) };
+
+#ifdef ENABLE_RGB
+#define SIMD_VARIANT_RGB(isa, attr) \
+	attr static void rgb24_ycbcr_##isa(const uint8_t *px, unsigned stride, bool s420, \
+	                                   int16_t y[4][8][8], int16_t cb[8][8], int16_t cr[8][8]) \
+	{ simd_rgb24_ycbcr_body(px, stride, s420, y, cb, cr); }
+#define SIMD_RGB(isa) rgb24_ycbcr_##isa
+#else
+#define SIMD_VARIANT_RGB(isa, attr)
+#define SIMD_RGB(isa) NULL
+#endif // ENABLE_RGB
+
+#if defined(__x86_64__) || defined(__i386__)
+SIMD_VARIANT(sse2, __attribute__((target("sse2"))))
+SIMD_VARIANT(avx2, __attribute__((target("avx2"))))
+#else
+SIMD_VARIANT(neon, )
+#endif
+
+// every set of this build, best first
+const jpeg_simd_kernels_t *const jpeg_simd_sets[] = {
+#if defined(__x86_64__) || defined(__i386__)
+	&simd_avx2, &simd_sse2,
+#else
+	&simd_neon,
+#endif
+	NULL
+};
+
+/******************************************************************************
+**  jpeg_simd_supported
+**  --------------------------------------------------------------------------
+**  Whether the running CPU has the instruction set of a kernel set.
+**
+**  ARGUMENTS:
+**      set     - one of jpeg_simd_sets;
+**
+**  RETURN: true if its kernels can run
+******************************************************************************/
+bool jpeg_simd_supported(const jpeg_simd_kernels_t *set)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if (set == &simd_avx2)
+		return __builtin_cpu_supports("avx2");
+	if (set == &simd_sse2)
+		return __builtin_cpu_supports("sse2");
+	return false;
+#else
+	return set == &simd_neon;
+#endif
+}
+
+// 0: not chosen yet, 1: being chosen, 2: jpeg_simd is set
+static int simd_state;
+
+/******************************************************************************
+**  jpeg_simd_select
+**  --------------------------------------------------------------------------
+**  Use the kernels of a set from now on, or the scalar code, instead of the
+**  choice of jpeg_simd_init(), e.g. to compare them. Not while encoding.
+**
+**  ARGUMENTS:
+**      set     - one of jpeg_simd_sets the CPU supports, NULL: scalar code;
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_simd_select(const jpeg_simd_kernels_t *set)
+{
+	static const jpeg_simd_kernels_t scalar = { .name = "scalar" };
+
+	jpeg_simd = set != NULL ? *set : scalar;
+	__atomic_store_n(&simd_state, 2, __ATOMIC_RELEASE);
+}
+
+/******************************************************************************
+**  jpeg_simd_init
+**  --------------------------------------------------------------------------
+**  Picks the kernels of the best instruction set the CPU has, once: the
+**  encoder calls it before its first block, later calls return at once.
+**  Until then jpeg_simd is empty and the scalar code runs. The kernels are
+**  bit-exact to the scalar code, checked by host_test/test_simd.
+**
+**  ARGUMENTS: -
+**
+**  RETURN: -
+******************************************************************************/
+void jpeg_simd_init(void)
+{
+	const jpeg_simd_kernels_t *const *set;
+	int state = 0;
+
+	if (__atomic_load_n(&simd_state, __ATOMIC_ACQUIRE) == 2)
+		return;
+	if (!__atomic_compare_exchange_n(&simd_state, &state, 1, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+		// another encoder is choosing, it takes a few cpuid
+		while (__atomic_load_n(&simd_state, __ATOMIC_ACQUIRE) != 2)
+			;
+		return;
+	}
+	for (set = jpeg_simd_sets; *set != NULL && !jpeg_simd_supported(*set); set++)
+		;
+	jpeg_simd_select(*set);
+}
+
+#endif // JPEG_SIMD
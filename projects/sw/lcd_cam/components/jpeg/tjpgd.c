@@ -200,9 +200,9 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 	UINT ndata				/* Size of input data */
 )
 {
-	UINT i, j, b, np, cls, num;
+	UINT i, j, b, np, cls, num, hc;
 	BYTE d, *pb, *pd;
-	WORD hc, *ph;
+	WORD *ph;
 
 
 	while (ndata) {	/* Process all tables in the segment */
@@ -225,7 +225,8 @@ UINT create_huffman_tbl (	/* 0:OK, !0:Failed */
 		hc = 0;
 		for (j = i = 0; i < 16; i++) {		/* Re-build huffman code word table */
 			b = pb[i];
-			while (b--) ph[j++] = hc++;
+			while (b--) ph[j++] = (WORD)hc++;
+			if (hc > 1u << (i + 1)) return JDR_FMT1;	/* Err: more code words than the bit length has */
 			hc <<= 1;
 		}
 
@@ -556,6 +557,77 @@ JRESULT mcu_load (
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Load all blocks in the MCU as quantized coefficients (no IDCT)        */
+/*-----------------------------------------------------------------------*/
+
+static
+JRESULT mcu_load_coef (
+	JDEC* jd,		/* Pointer to the decompressor object */
+	SHORT* coef		/* Blocks of the MCU, 64 coefficients each in zigzag-order */
+)
+{
+	UINT blk, nby, nbc, i, z, id, cmp;
+	INT b, d, e;
+	const BYTE *hb, *hd;
+	const WORD *hc;
+
+
+	nby = jd->msx * jd->msy;	/* Number of Y blocks (1, 2 or 4) */
+	nbc = 2;					/* Number of C blocks (2) */
+
+	for (blk = 0; blk < nby + nbc; blk++, coef += 64) {
+		cmp = (blk < nby) ? 0 : blk - nby + 1;	/* Component number 0:Y, 1:Cb, 2:Cr */
+		id = cmp ? 1 : 0;						/* Huffman table ID of the component */
+
+		/* Extract a DC element from input stream */
+		hb = jd->huffbits[id][0];				/* Huffman table for the DC element */
+		hc = jd->huffcode[id][0];
+		hd = jd->huffdata[id][0];
+		b = huffext(jd, hb, hc, hd);			/* Extract a huffman coded data (bit length) */
+		if (b < 0) return 0 - b;				/* Err: invalid code or input */
+		d = jd->dcv[cmp];						/* DC value of previous block */
+		if (b) {								/* If there is any difference from previous block */
+			e = bitext(jd, b);					/* Extract data bits */
+			if (e < 0) return 0 - e;			/* Err: input */
+			b = 1 << (b - 1);					/* MSB position */
+			if (!(e & b)) e -= (b << 1) - 1;	/* Restore sign if needed */
+			d += e;								/* Get current value */
+			jd->dcv[cmp] = (SHORT)d;			/* Save current DC value for next block */
+		}
+		coef[0] = (SHORT)d;
+
+		/* Extract following 63 AC elements from input stream */
+		for (i = 1; i < 64; i++) coef[i] = 0;	/* Clear rest of elements */
+		hb = jd->huffbits[id][1];				/* Huffman table for the AC elements */
+		hc = jd->huffcode[id][1];
+		hd = jd->huffdata[id][1];
+		i = 1;					/* Top of the AC elements */
+		do {
+			b = huffext(jd, hb, hc, hd);		/* Extract a huffman coded value (zero runs and bit length) */
+			if (b == 0) break;					/* EOB? */
+			if (b < 0) return 0 - b;			/* Err: invalid code or input error */
+			z = (UINT)b >> 4;					/* Number of leading zero elements */
+			if (z) {
+				i += z;							/* Skip zero elements */
+				if (i >= 64) return JDR_FMT1;	/* Too long zero run */
+			}
+			if (b &= 0x0F) {					/* Bit length */
+				d = bitext(jd, b);				/* Extract data bits */
+				if (d < 0) return 0 - d;		/* Err: input device */
+				b = 1 << (b - 1);				/* MSB position */
+				if (!(d & b)) d -= (b << 1) - 1;/* Restore negative value if needed */
+				coef[i] = (SHORT)d;				/* Keep zigzag-order, no de-quantization */
+			}
+		} while (++i < 64);		/* Next AC element */
+	}
+
+	return JDR_OK;	/* All blocks have been loaded successfully */
+}
+
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Output an MCU: Convert YCrCb to RGB and output it in RGB form         */
 /*-----------------------------------------------------------------------*/
@@ -595,8 +667,8 @@ JRESULT mcu_output (
 			pc = jd->mcubuf;
 			py = pc + iy * 8;
 			if (my == 16) {		/* Double block height? */
-				pc += 64 * 4 + (iy >> 1) * 8;
-				if (iy >= 8) py += 64;
+				pc += mx * 16 + (iy >> 1) * 8;
+				if (iy >= 8) py += 64 * (jd->msx - 1);	/* Lower block(s), 4:2:0 or 4:4:0 */
 			} else {			/* Single block height */
 				pc += mx * 8 + iy * 8;
 			}
@@ -656,7 +728,7 @@ JRESULT mcu_output (
 		cr = pc[64] - 128;
 		for (iy = 0; iy < my; iy += 8) {
 			py = jd->mcubuf;
-			if (iy == 8) py += 64 * 2;
+			if (iy == 8) py += 64 * jd->msx;
 			for (ix = 0; ix < mx; ix += 8) {
 				yy = *py;	/* Get Y component */
 				py += 64;
@@ -820,8 +892,8 @@ JRESULT jd_prepare (
 			for (i = 0; i < 3; i++) {	
 				b = seg[7 + 3 * i];							/* Get sampling factor */
 				if (!i) {	/* Y component */
-					if (b != 0x11 && b != 0x22 && b != 0x21)/* Check sampling factor */
-						return JDR_FMT3;					/* Err: Supports only 4:4:4, 4:2:0 or 4:2:2 */
+					if (b != 0x11 && b != 0x22 && b != 0x21 && b != 0x12)/* Check sampling factor */
+						return JDR_FMT3;					/* Err: Supports only 4:4:4, 4:2:0, 4:2:2 or 4:4:0 */
 					jd->msx = b >> 4; jd->msy = b & 15;		/* Size of MCU [blocks] */
 				} else {	/* Cb/Cr component */
 					if (b != 0x11) return JDR_FMT3;			/* Err: Sampling factor of Cr/Cb must be 1 */
@@ -965,6 +1037,75 @@ JRESULT jd_decomp (
 
 	return rc;
 }
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Pass the quantized coefficients of every MCU (lossless transcoding)   */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_decomp_coef (
+	JDEC* jd,								/* Initialized decompression object */
+	UINT (*outfunc)(JDEC*, SHORT*, JRECT*)	/* Coefficient output function */
+)
+{
+	UINT x, y, mx, my;
+	WORD rst, rsc;
+	SHORT *coef;
+	JRECT rect;
+	JRESULT rc;
+
+
+	coef = alloc_pool(jd, (jd->msx * jd->msy + 2) * 64 * sizeof (SHORT));	/* Blocks of one MCU */
+	if (!coef) return JDR_MEM1;				/* Err: not enough memory */
+
+	mx = jd->msx * 8; my = jd->msy * 8;			/* Size of the MCU (pixel) */
+
+	jd->dcv[2] = jd->dcv[1] = jd->dcv[0] = 0;	/* Initialize DC values */
+	rst = rsc = 0;
+
+	rc = JDR_OK;
+	for (y = 0; y < jd->height; y += my) {		/* Vertical loop of MCUs */
+		for (x = 0; x < jd->width; x += mx) {	/* Horizontal loop of MCUs */
+			if (jd->nrst && rst++ == jd->nrst) {	/* Process restart interval if enabled */
+				rc = restart(jd, rsc++);
+				if (rc != JDR_OK) return rc;
+				rst = 1;
+			}
+			rc = mcu_load_coef(jd, coef);		/* Load an MCU (decompress huffman coded stream only) */
+			if (rc != JDR_OK) return rc;
+			rect.left = x; rect.right = x + mx - 1;	/* Location of the MCU */
+			rect.top = y; rect.bottom = y + my - 1;
+			if (!outfunc(jd, coef, &rect)) return JDR_INTR;	/* Output the MCU */
+		}
+	}
+
+	return rc;
+}
+
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Get the quantizer table of a component (raster-order)                 */
+/*-----------------------------------------------------------------------*/
+
+JRESULT jd_qtable (
+	JDEC* jd,		/* Initialized decompression object */
+	UINT cmp,		/* Component number 0:Y, 1:Cb, 2:Cr */
+	BYTE* qt		/* 64 quantizers */
+)
+{
+	UINT i;
+	const LONG *pb;
+
+
+	if (cmp > 2) return JDR_PAR;
+	pb = jd->qttbl[jd->qtid[cmp]];
+	for (i = 0; i < 64; i++) qt[i] = (BYTE)(pb[i] / IPSF(i));	/* Remove scale factor of Arai algorithm */
+
+	return JDR_OK;
+}
 #endif//SUPPORT_JPEG
 
 